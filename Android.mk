@@ -26,6 +26,10 @@ LOCAL_C_INCLUDES += hardware/stc/libstc-rpc/include
 LOCAL_CFLAGS += \
     -fno-short-enums -DDEBUG -DVERBOSE 
 
+ifeq ($(BOARD_GPS_PROXY_USE_SHM),true)
+LOCAL_CFLAGS += -DGPS_PROXY_USE_SHM
+endif
+
 LOCAL_PRELINK_MODULE := false
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
@@ -51,9 +55,35 @@ endif # arm
 
 LOCAL_SRC_FILES += gps_proxy.c
 
+ifeq ($(BOARD_GPS_PROXY_USE_SHM),true)
+LOCAL_CFLAGS += -DGPS_PROXY_USE_SHM
+endif
+
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
 LOCAL_C_INCLUDES += hardware/stc/libstc-rpc/include
 
 include $(BUILD_EXECUTABLE)
 
+#==============================================================================
+# synthetic receiver to run the daemon without vendor hardware
+#==============================================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := gps.sim
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SHARED_LIBRARIES := \
+	liblog \
+	libcutils
+
+LOCAL_SRC_FILES += gps_sim.c
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
+LOCAL_C_INCLUDES += hardware/stc/libstc-rpc/include
+
+LOCAL_PRELINK_MODULE := false
+LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
+
+include $(BUILD_SHARED_LIBRARY)
+
 endif # BOARD_USES_GPS_PROXY
@@ -0,0 +1,130 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* host stand-ins for the cutils socket and ashmem helpers */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/sockets.h>
+
+static socklen_t socket_local_addr(const char *name, int namespaceId,
+	struct sockaddr_un *addr)
+{
+	size_t len = strlen(name);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_LOCAL;
+
+	if (namespaceId == ANDROID_SOCKET_NAMESPACE_ABSTRACT) {
+		if (len + 1 > sizeof(addr->sun_path)) {
+			return 0;
+		}
+		memcpy(addr->sun_path + 1, name, len);
+		return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+	}
+
+	if (len + 1 > sizeof(addr->sun_path)) {
+		return 0;
+	}
+	memcpy(addr->sun_path, name, len);
+	return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+int socket_local_server(const char *name, int namespaceId, int type) {
+	struct sockaddr_un addr;
+	socklen_t alen = socket_local_addr(name, namespaceId, &addr);
+	int one = 1;
+	int fd;
+
+	if (!alen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_LOCAL, type, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (namespaceId != ANDROID_SOCKET_NAMESPACE_ABSTRACT) {
+		unlink(addr.sun_path);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr*)&addr, alen) ||
+		(type == SOCK_STREAM && listen(fd, 4)))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int socket_local_client(const char *name, int namespaceId, int type) {
+	struct sockaddr_un addr;
+	socklen_t alen = socket_local_addr(name, namespaceId, &addr);
+	int fd;
+
+	if (!alen) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_LOCAL, type, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr*)&addr, alen)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ashmem_create_region(const char *name, size_t size) {
+	int fd = syscall(SYS_memfd_create, name ? name : "ashmem", 0);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int ashmem_set_prot_region(int fd, int prot) {
+	return 0;
+}
@@ -0,0 +1,597 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Host benchmark for the proxy. It starts the daemon on top of the
+ * synthetic receiver, loads the HAL library the way the framework does
+ * and measures
+ *
+ *   - the latency of every HAL call, as seen by the framework
+ *   - the callbacks per second that reach the framework at a fixed fix
+ *     rate, against the number the receiver produced
+ *   - the CPU time the daemon and the library spend per fix
+ *   - the memory high-water mark of both processes
+ *
+ * Each result is printed as one JSON object per line on stdout, so runs
+ * can be compared by a script. Logs go to stderr.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <hardware/gps.h>
+
+#define BENCH_CONNECT_TIMEOUT_MS 5000
+#define BENCH_WARMUP_CALLS 16
+#define BENCH_WARMUP_MS 1000
+
+struct bench_opts {
+	const char *daemon;
+	const char *hal;
+	const char *blob;
+	unsigned seconds;
+	unsigned calls;
+};
+
+static const GpsInterface *gps = NULL;
+static const GpsXtraInterface *xtra = NULL;
+static const AGpsInterface *agps = NULL;
+static const GpsNiInterface *ni = NULL;
+static const AGpsRilInterface *ril = NULL;
+
+static uint64_t n_loc = 0;
+static uint64_t n_sv = 0;
+static uint64_t n_nmea = 0;
+static uint64_t n_status = 0;
+static uint64_t n_other = 0;
+static int have_capabilities = 0;
+
+static uint64_t bench_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void bench_sleep_ms(unsigned ms) {
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR) {
+	}
+}
+
+/******************************************************************************
+ * Framework callbacks
+ *****************************************************************************/
+static void bench_count(uint64_t *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t bench_read(uint64_t *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void bench_location_cb(GpsLocation *location) {
+	bench_count(&n_loc);
+}
+
+static void bench_status_cb(GpsStatus *status) {
+	bench_count(&n_status);
+}
+
+static void bench_sv_status_cb(GpsSvStatus *sv_info) {
+	bench_count(&n_sv);
+}
+
+static void bench_nmea_cb(GpsUtcTime timestamp, const char *nmea, int length) {
+	bench_count(&n_nmea);
+}
+
+static void bench_set_capabilities_cb(uint32_t capabilities) {
+	__atomic_store_n(&have_capabilities, 1, __ATOMIC_RELEASE);
+}
+
+static void bench_other_cb(void) {
+	bench_count(&n_other);
+}
+
+static void bench_agps_status_cb(AGpsStatus *status) {
+	bench_count(&n_other);
+}
+
+static void bench_ni_notify_cb(GpsNiNotification *notification) {
+	bench_count(&n_other);
+}
+
+static void bench_ril_request_cb(uint32_t flags) {
+	bench_count(&n_other);
+}
+
+struct bench_thread {
+	void (*start)(void *);
+	void *arg;
+};
+
+static void *bench_thread_func(void *arg) {
+	struct bench_thread t = *(struct bench_thread*)arg;
+
+	free(arg);
+	t.start(t.arg);
+	return NULL;
+}
+
+static pthread_t bench_create_thread_cb(const char *name,
+	void (*start)(void *), void *arg)
+{
+	struct bench_thread *t = malloc(sizeof(*t));
+	pthread_t thread;
+
+	if (!t) {
+		return 0;
+	}
+
+	t->start = start;
+	t->arg = arg;
+	if (pthread_create(&thread, NULL, bench_thread_func, t)) {
+		free(t);
+		return 0;
+	}
+	return thread;
+}
+
+static GpsCallbacks gpsCallbacks = {
+	.size = sizeof(GpsCallbacks),
+	.location_cb = bench_location_cb,
+	.status_cb = bench_status_cb,
+	.sv_status_cb = bench_sv_status_cb,
+	.nmea_cb = bench_nmea_cb,
+	.set_capabilities_cb = bench_set_capabilities_cb,
+	.acquire_wakelock_cb = bench_other_cb,
+	.release_wakelock_cb = bench_other_cb,
+	.create_thread_cb = bench_create_thread_cb,
+	.request_utc_time_cb = bench_other_cb,
+};
+
+static GpsXtraCallbacks xtraCallbacks = {
+	.download_request_cb = bench_other_cb,
+	.create_thread_cb = bench_create_thread_cb,
+};
+
+static AGpsCallbacks aGpsCallbacks = {
+	.status_cb = bench_agps_status_cb,
+	.create_thread_cb = bench_create_thread_cb,
+};
+
+static GpsNiCallbacks niCallbacks = {
+	.notify_cb = bench_ni_notify_cb,
+	.create_thread_cb = bench_create_thread_cb,
+};
+
+static AGpsRilCallbacks rilCallbacks = {
+	.request_setid = bench_ril_request_cb,
+	.request_refloc = bench_ril_request_cb,
+	.create_thread_cb = bench_create_thread_cb,
+};
+
+/******************************************************************************
+ * Process statistics
+ *****************************************************************************/
+
+/* CPU time of a process in microseconds, all of its threads included */
+static uint64_t bench_cpu_us(pid_t pid) {
+	char path[64];
+	char buf[1024];
+	unsigned long utime, stime;
+	long ticks = sysconf(_SC_CLK_TCK);
+	char *p;
+	FILE *f;
+	size_t n;
+
+	if (!pid) {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+			ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	/* the command may contain spaces, fields are counted after it */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		"%lu %lu", &utime, &stime) != 2)
+	{
+		return 0;
+	}
+
+	return (uint64_t)(utime + stime) * 1000000 / ticks;
+}
+
+/* peak resident set size of a process in kilobytes */
+static unsigned long bench_hwm_kb(pid_t pid) {
+	char path[64];
+	char line[256];
+	unsigned long kb = 0;
+	FILE *f;
+
+	if (pid) {
+		snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	}
+	else {
+		snprintf(path, sizeof(path), "/proc/self/status");
+	}
+
+	f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmHWM: %lu kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+/******************************************************************************
+ * Call latency
+ *****************************************************************************/
+static char xtra_data[1024];
+
+static void call_set_position_mode(void) {
+	gps->set_position_mode(GPS_POSITION_MODE_MS_BASED,
+		GPS_POSITION_RECURRENCE_PERIODIC, 10, 0, 0);
+}
+
+static void call_inject_time(void) {
+	gps->inject_time(1350000000000LL, bench_now_us() / 1000, 10);
+}
+
+static void call_inject_location(void) {
+	gps->inject_location(59.9343, 30.3351, 100);
+}
+
+static void call_delete_aiding_data(void) {
+	gps->delete_aiding_data(GPS_DELETE_EPHEMERIS);
+}
+
+static void call_xtra_inject_data(void) {
+	xtra->inject_xtra_data(xtra_data, sizeof(xtra_data));
+}
+
+static void call_agps_set_server(void) {
+	agps->set_server(AGPS_TYPE_SUPL, "supl.example.com", 7275);
+}
+
+static void call_agps_data_conn_open(void) {
+	agps->data_conn_open("internet");
+}
+
+static void call_ni_respond(void) {
+	ni->respond(1, 1);
+}
+
+static void call_ril_update_network_state(void) {
+	ril->update_network_state(1, 1, 0, "bench");
+}
+
+static void call_ril_set_set_id(void) {
+	ril->set_set_id(AGPS_SETID_TYPE_IMSI, "001010123456789");
+}
+
+struct bench_call {
+	const char *name;
+	void (*call)(void);
+	const void **iface;
+};
+
+static const struct bench_call bench_calls[] = {
+	{ "set_position_mode", call_set_position_mode, (const void**)&gps },
+	{ "inject_time", call_inject_time, (const void**)&gps },
+	{ "inject_location", call_inject_location, (const void**)&gps },
+	{ "delete_aiding_data", call_delete_aiding_data, (const void**)&gps },
+	{ "xtra_inject_data", call_xtra_inject_data, (const void**)&xtra },
+	{ "agps_set_server", call_agps_set_server, (const void**)&agps },
+	{ "agps_data_conn_open", call_agps_data_conn_open, (const void**)&agps },
+	{ "ni_respond", call_ni_respond, (const void**)&ni },
+	{ "ril_update_network_state", call_ril_update_network_state,
+		(const void**)&ril },
+	{ "ril_set_set_id", call_ril_set_set_id, (const void**)&ril },
+};
+
+static int bench_cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_call_latency(const struct bench_call *bc, unsigned calls) {
+	uint64_t *samples;
+	uint64_t sum = 0;
+	unsigned i;
+
+	if (!*bc->iface) {
+		fprintf(stderr, "%s: interface not available\n", bc->name);
+		return;
+	}
+
+	samples = malloc(sizeof(*samples) * calls);
+	if (!samples) {
+		return;
+	}
+
+	for (i = 0; i < BENCH_WARMUP_CALLS; i++) {
+		bc->call();
+	}
+
+	for (i = 0; i < calls; i++) {
+		uint64_t start = bench_now_us();
+		bc->call();
+		samples[i] = bench_now_us() - start;
+		sum += samples[i];
+	}
+
+	qsort(samples, calls, sizeof(*samples), bench_cmp_u64);
+	printf("{\"bench\":\"call_latency\",\"call\":\"%s\",\"calls\":%u,"
+		"\"mean_us\":%.1f,\"p50_us\":%llu,\"p99_us\":%llu,\"max_us\":%llu}\n",
+		bc->name, calls, (double)sum / calls,
+		(unsigned long long)samples[calls / 2],
+		(unsigned long long)samples[calls * 99 / 100],
+		(unsigned long long)samples[calls - 1]);
+	fflush(stdout);
+
+	free(samples);
+}
+
+/******************************************************************************
+ * Callback throughput, CPU and memory
+ *****************************************************************************/
+static void bench_fixes(pid_t daemon, unsigned seconds) {
+	uint64_t loc0, sv0, nmea0, other0, t0, cpu_d0, cpu_c0;
+	uint64_t loc, sv, nmea, other, elapsed_us, cpu_d, cpu_c;
+	double secs;
+
+	call_set_position_mode();
+	gps->start();
+	bench_sleep_ms(BENCH_WARMUP_MS);
+
+	loc0 = bench_read(&n_loc);
+	sv0 = bench_read(&n_sv);
+	nmea0 = bench_read(&n_nmea);
+	other0 = bench_read(&n_other) + bench_read(&n_status);
+	cpu_d0 = bench_cpu_us(daemon);
+	cpu_c0 = bench_cpu_us(0);
+	t0 = bench_now_us();
+
+	bench_sleep_ms(seconds * 1000);
+
+	loc = bench_read(&n_loc) - loc0;
+	sv = bench_read(&n_sv) - sv0;
+	nmea = bench_read(&n_nmea) - nmea0;
+	other = bench_read(&n_other) + bench_read(&n_status) - other0;
+	cpu_d = bench_cpu_us(daemon) - cpu_d0;
+	cpu_c = bench_cpu_us(0) - cpu_c0;
+	elapsed_us = bench_now_us() - t0;
+
+	gps->stop();
+
+	secs = elapsed_us / 1e6;
+	printf("{\"bench\":\"callbacks\",\"seconds\":%.3f,\"locations\":%llu,"
+		"\"sv_status\":%llu,\"nmea\":%llu,\"other\":%llu,"
+		"\"per_second\":%.1f,\"fixes_per_second\":%.1f}\n",
+		secs, (unsigned long long)loc, (unsigned long long)sv,
+		(unsigned long long)nmea, (unsigned long long)other,
+		(loc + sv + nmea + other) / secs, loc / secs);
+
+	printf("{\"bench\":\"cpu_per_fix\",\"fixes\":%llu,"
+		"\"daemon_us\":%.1f,\"library_us\":%.1f}\n",
+		(unsigned long long)loc,
+		loc ? (double)cpu_d / loc : 0, loc ? (double)cpu_c / loc : 0);
+	fflush(stdout);
+}
+
+static void bench_memory(pid_t daemon) {
+	printf("{\"bench\":\"memory\",\"daemon_hwm_kb\":%lu,"
+		"\"library_hwm_kb\":%lu}\n",
+		bench_hwm_kb(daemon), bench_hwm_kb(0));
+	fflush(stdout);
+}
+
+/******************************************************************************
+ * Setup
+ *****************************************************************************/
+static pid_t bench_start_daemon(const struct bench_opts *opts) {
+	pid_t pid = fork();
+
+	if (pid) {
+		return pid;
+	}
+
+	execl(opts->daemon, opts->daemon, "-p", "-l", opts->blob, (char*)NULL);
+	fprintf(stderr, "failed to run %s: %s\n", opts->daemon, strerror(errno));
+	_exit(127);
+}
+
+static int bench_open_hal(const char *path) {
+	struct hw_module_t *module;
+	struct gps_device_t *device = NULL;
+	void *handle;
+
+	handle = dlopen(path, RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "failed to load %s: %s\n", path, dlerror());
+		return -1;
+	}
+
+	module = dlsym(handle, HAL_MODULE_INFO_SYM_AS_STR);
+	if (!module || !module->methods || !module->methods->open ||
+		module->methods->open(module, GPS_HARDWARE_MODULE_ID,
+			(struct hw_device_t**)&device) || !device)
+	{
+		fprintf(stderr, "failed to open the GPS module in %s\n", path);
+		return -1;
+	}
+
+	gps = device->get_gps_interface(device);
+	if (!gps) {
+		fprintf(stderr, "no GPS interface in %s\n", path);
+		return -1;
+	}
+
+	xtra = gps->get_extension(GPS_XTRA_INTERFACE);
+	agps = gps->get_extension(AGPS_INTERFACE);
+	ni = gps->get_extension(GPS_NI_INTERFACE);
+	ril = gps->get_extension(AGPS_RIL_INTERFACE);
+	return 0;
+}
+
+static int bench_init(void) {
+	uint64_t deadline = bench_now_us() + BENCH_CONNECT_TIMEOUT_MS * 1000ULL;
+
+	if (gps->init(&gpsCallbacks)) {
+		fprintf(stderr, "failed to init GPS\n");
+		return -1;
+	}
+
+	if (xtra) {
+		xtra->init(&xtraCallbacks);
+	}
+	if (agps) {
+		agps->init(&aGpsCallbacks);
+	}
+	if (ni) {
+		ni->init(&niCallbacks);
+	}
+	if (ril) {
+		ril->init(&rilCallbacks);
+	}
+
+	/* the capabilities come once the daemon has initialized the receiver */
+	while (!__atomic_load_n(&have_capabilities, __ATOMIC_ACQUIRE)) {
+		if (bench_now_us() > deadline) {
+			fprintf(stderr, "the daemon did not come up\n");
+			return -1;
+		}
+		bench_sleep_ms(10);
+	}
+
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-d daemon] [-l library] [-b blob] "
+		"[-t seconds] [-n calls]\n"
+		"  -d  daemon executable, ./gps_proxy by default\n"
+		"  -l  HAL library, ./gps.proxy.so by default\n"
+		"  -b  receiver the daemon loads, ./gps.sim.so by default\n"
+		"  -t  seconds to measure the fix stream for\n"
+		"  -n  calls to time for every HAL call\n", name);
+}
+
+int main(int argc, char **argv) {
+	struct bench_opts opts = {
+		.daemon = "./gps_proxy",
+		.hal = "./gps.proxy.so",
+		.blob = "./gps.sim.so",
+		.seconds = 5,
+		.calls = 1000,
+	};
+	pid_t daemon;
+	unsigned i;
+	int rc = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:l:b:t:n:")) != -1) {
+		switch (opt) {
+			case 'd':
+				opts.daemon = optarg;
+				break;
+			case 'l':
+				opts.hal = optarg;
+				break;
+			case 'b':
+				opts.blob = optarg;
+				break;
+			case 't':
+				opts.seconds = strtoul(optarg, NULL, 10);
+				break;
+			case 'n':
+				opts.calls = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (!opts.calls || !opts.seconds) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	/* the receiver runs flat out unless told otherwise */
+	setenv("GPS_SIM_RATE_HZ", "100", 0);
+	setenv("GPS_SIM_SVS", "32", 0);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	daemon = bench_start_daemon(&opts);
+	if (daemon < 0) {
+		fprintf(stderr, "failed to fork the daemon\n");
+		return -1;
+	}
+
+	if (bench_open_hal(opts.hal) || bench_init()) {
+		goto done;
+	}
+
+	for (i = 0; i < sizeof(bench_calls) / sizeof(bench_calls[0]); i++) {
+		bench_call_latency(bench_calls + i, opts.calls);
+	}
+
+	bench_fixes(daemon, opts.seconds);
+	bench_memory(daemon);
+	rc = 0;
+
+done:
+	kill(daemon, SIGTERM);
+	waitpid(daemon, NULL, 0);
+	return rc;
+}
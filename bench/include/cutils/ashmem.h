@@ -0,0 +1,31 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* host stand-in for cutils/ashmem.h, backed by memfd */
+
+#ifndef __BENCH_CUTILS_ASHMEM_H__
+#define __BENCH_CUTILS_ASHMEM_H__
+
+#include <stddef.h>
+
+int ashmem_create_region(const char *name, size_t size);
+int ashmem_set_prot_region(int fd, int prot);
+
+#endif //__BENCH_CUTILS_ASHMEM_H__
@@ -0,0 +1,33 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* host stand-in for the part of cutils/sockets.h the proxy uses */
+
+#ifndef __BENCH_CUTILS_SOCKETS_H__
+#define __BENCH_CUTILS_SOCKETS_H__
+
+#define ANDROID_SOCKET_NAMESPACE_ABSTRACT 0
+#define ANDROID_SOCKET_NAMESPACE_RESERVED 1
+#define ANDROID_SOCKET_NAMESPACE_FILESYSTEM 2
+
+int socket_local_server(const char *name, int namespaceId, int type);
+int socket_local_client(const char *name, int namespaceId, int type);
+
+#endif //__BENCH_CUTILS_SOCKETS_H__
@@ -0,0 +1,258 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* host stand-in for the ICS hardware/gps.h */
+
+#ifndef __BENCH_HARDWARE_GPS_H__
+#define __BENCH_HARDWARE_GPS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <hardware/hardware.h>
+#define GPS_HARDWARE_MODULE_ID "gps"
+typedef int64_t GpsUtcTime;
+#define GPS_MAX_SVS 32
+typedef uint32_t GpsPositionMode;
+#define GPS_POSITION_MODE_STANDALONE 0
+#define GPS_POSITION_MODE_MS_BASED 1
+#define GPS_POSITION_MODE_MS_ASSISTED 2
+typedef uint32_t GpsPositionRecurrence;
+#define GPS_POSITION_RECURRENCE_PERIODIC 0
+#define GPS_POSITION_RECURRENCE_SINGLE 1
+typedef uint16_t GpsStatusValue;
+#define GPS_STATUS_NONE 0
+#define GPS_STATUS_SESSION_BEGIN 1
+#define GPS_STATUS_SESSION_END 2
+#define GPS_STATUS_ENGINE_ON 3
+#define GPS_STATUS_ENGINE_OFF 4
+typedef uint16_t GpsLocationFlags;
+#define GPS_LOCATION_HAS_LAT_LONG 0x0001
+#define GPS_LOCATION_HAS_ALTITUDE 0x0002
+#define GPS_LOCATION_HAS_SPEED 0x0004
+#define GPS_LOCATION_HAS_BEARING 0x0008
+#define GPS_LOCATION_HAS_ACCURACY 0x0010
+#define GPS_CAPABILITY_SCHEDULING 0x0000001
+#define GPS_CAPABILITY_MSB 0x0000002
+#define GPS_CAPABILITY_MSA 0x0000004
+#define GPS_CAPABILITY_SINGLE_SHOT 0x0000008
+#define GPS_CAPABILITY_ON_DEMAND_TIME 0x0000010
+typedef uint16_t GpsAidingData;
+#define GPS_DELETE_EPHEMERIS 0x0001
+#define GPS_DELETE_ALMANAC 0x0002
+#define GPS_DELETE_POSITION 0x0004
+#define GPS_DELETE_TIME 0x0008
+#define GPS_DELETE_IONO 0x0010
+#define GPS_DELETE_UTC 0x0020
+#define GPS_DELETE_HEALTH 0x0040
+#define GPS_DELETE_SVDIR 0x0080
+#define GPS_DELETE_SVSTEER 0x0100
+#define GPS_DELETE_SADATA 0x0200
+#define GPS_DELETE_RTI 0x0400
+#define GPS_DELETE_CELLDB_INFO 0x8000
+#define GPS_DELETE_ALL 0xFFFF
+typedef uint16_t AGpsType;
+#define AGPS_TYPE_SUPL 1
+#define AGPS_TYPE_C2K 2
+typedef uint16_t AGpsSetIDType;
+#define AGPS_SETID_TYPE_NONE 0
+#define AGPS_SETID_TYPE_IMSI 1
+#define AGPS_SETID_TYPE_MSISDN 2
+typedef uint32_t GpsNiType;
+#define GPS_NI_TYPE_VOICE 1
+#define GPS_NI_TYPE_UMTS_SUPL 2
+#define GPS_NI_TYPE_UMTS_CTRL_PLANE 3
+typedef uint32_t GpsNiNotifyFlags;
+typedef int GpsUserResponseType;
+#define GPS_NI_RESPONSE_ACCEPT 1
+#define GPS_NI_RESPONSE_DENY 2
+#define GPS_NI_RESPONSE_NORESP 3
+typedef int GpsNiEncodingType;
+typedef uint16_t AGpsStatusValue;
+#define GPS_REQUEST_AGPS_DATA_CONN 1
+#define GPS_RELEASE_AGPS_DATA_CONN 2
+#define GPS_AGPS_DATA_CONNECTED 3
+#define GPS_AGPS_DATA_CONN_DONE 4
+#define GPS_AGPS_DATA_CONN_FAILED 5
+#define AGPS_REF_LOCATION_TYPE_GSM_CELLID 1
+#define AGPS_REF_LOCATION_TYPE_UMTS_CELLID 2
+#define AGPS_REG_LOCATION_TYPE_MAC 3
+#define GPS_XTRA_INTERFACE "gps-xtra"
+#define GPS_DEBUG_INTERFACE "gps-debug"
+#define AGPS_INTERFACE "agps"
+#define GPS_NI_INTERFACE "gps-ni"
+#define AGPS_RIL_INTERFACE "agps_ril"
+typedef struct {
+	size_t size;
+	uint16_t flags;
+	double latitude;
+	double longitude;
+	double altitude;
+	float speed;
+	float bearing;
+	float accuracy;
+	GpsUtcTime timestamp;
+} GpsLocation;
+typedef struct {
+	size_t size;
+	GpsStatusValue status;
+} GpsStatus;
+typedef struct {
+	size_t size;
+	int prn;
+	float snr;
+	float elevation;
+	float azimuth;
+} GpsSvInfo;
+typedef struct {
+	size_t size;
+	int num_svs;
+	GpsSvInfo sv_list[GPS_MAX_SVS];
+	uint32_t ephemeris_mask;
+	uint32_t almanac_mask;
+	uint32_t used_in_fix_mask;
+} GpsSvStatus;
+typedef void (* gps_location_callback)(GpsLocation* location);
+typedef void (* gps_status_callback)(GpsStatus* status);
+typedef void (* gps_sv_status_callback)(GpsSvStatus* sv_info);
+typedef void (* gps_nmea_callback)(GpsUtcTime timestamp, const char* nmea, int length);
+typedef void (* gps_set_capabilities)(uint32_t capabilities);
+typedef void (* gps_acquire_wakelock)();
+typedef void (* gps_release_wakelock)();
+typedef void (* gps_request_utc_time)();
+typedef pthread_t (* gps_create_thread)(const char* name, void (*start)(void *), void* arg);
+typedef struct {
+	size_t size;
+	gps_location_callback location_cb;
+	gps_status_callback status_cb;
+	gps_sv_status_callback sv_status_cb;
+	gps_nmea_callback nmea_cb;
+	gps_set_capabilities set_capabilities_cb;
+	gps_acquire_wakelock acquire_wakelock_cb;
+	gps_release_wakelock release_wakelock_cb;
+	gps_create_thread create_thread_cb;
+	gps_request_utc_time request_utc_time_cb;
+} GpsCallbacks;
+typedef struct {
+	size_t size;
+	int (*init)(GpsCallbacks* callbacks);
+	int (*start)(void);
+	int (*stop)(void);
+	void (*cleanup)(void);
+	int (*inject_time)(GpsUtcTime time, int64_t timeReference, int uncertainty);
+	int (*inject_location)(double latitude, double longitude, float accuracy);
+	void (*delete_aiding_data)(GpsAidingData flags);
+	int (*set_position_mode)(GpsPositionMode mode, GpsPositionRecurrence recurrence,
+		uint32_t min_interval, uint32_t preferred_accuracy, uint32_t preferred_time);
+	const void* (*get_extension)(const char* name);
+} GpsInterface;
+typedef void (* gps_xtra_download_request)();
+typedef struct {
+	gps_xtra_download_request download_request_cb;
+	gps_create_thread create_thread_cb;
+} GpsXtraCallbacks;
+typedef struct {
+	size_t size;
+	int (*init)(GpsXtraCallbacks* callbacks);
+	int (*inject_xtra_data)(char* data, int length);
+} GpsXtraInterface;
+typedef struct {
+	size_t size;
+	AGpsType type;
+	AGpsStatusValue status;
+	uint32_t ipaddr;
+} AGpsStatus;
+typedef void (* agps_status_callback)(AGpsStatus* status);
+typedef struct {
+	agps_status_callback status_cb;
+	gps_create_thread create_thread_cb;
+} AGpsCallbacks;
+typedef struct {
+	size_t size;
+	void (*init)(AGpsCallbacks* callbacks);
+	int (*data_conn_open)(const char* apn);
+	int (*data_conn_closed)();
+	int (*data_conn_failed)();
+	int (*set_server)(AGpsType type, const char* hostname, int port);
+} AGpsInterface;
+#define GPS_NI_SHORT_STRING_MAXLEN 256
+#define GPS_NI_LONG_STRING_MAXLEN 2048
+typedef struct {
+	size_t size;
+	int notification_id;
+	GpsNiType ni_type;
+	GpsNiNotifyFlags notify_flags;
+	int timeout;
+	GpsUserResponseType default_response;
+	char requestor_id[GPS_NI_SHORT_STRING_MAXLEN];
+	char text[GPS_NI_LONG_STRING_MAXLEN];
+	GpsNiEncodingType requestor_id_encoding;
+	GpsNiEncodingType text_encoding;
+	char extras[GPS_NI_LONG_STRING_MAXLEN];
+} GpsNiNotification;
+typedef void (*gps_ni_notify_callback)(GpsNiNotification *notification);
+typedef struct {
+	gps_ni_notify_callback notify_cb;
+	gps_create_thread create_thread_cb;
+} GpsNiCallbacks;
+typedef struct {
+	size_t size;
+	void (*init) (GpsNiCallbacks *callbacks);
+	void (*respond) (int notif_id, GpsUserResponseType user_response);
+} GpsNiInterface;
+typedef struct {
+	uint16_t type;
+	uint16_t mcc;
+	uint16_t mnc;
+	uint16_t lac;
+	uint32_t cid;
+} AGpsRefLocationCellID;
+typedef struct {
+	uint8_t mac[6];
+} AGpsRefLocationMac;
+typedef struct {
+	uint16_t type;
+	union {
+		AGpsRefLocationCellID cellID;
+		AGpsRefLocationMac mac;
+	} u;
+} AGpsRefLocation;
+typedef void (*agps_ril_request_set_id)(uint32_t flags);
+typedef void (*agps_ril_request_ref_loc)(uint32_t flags);
+typedef struct {
+	agps_ril_request_set_id request_setid;
+	agps_ril_request_ref_loc request_refloc;
+	gps_create_thread create_thread_cb;
+} AGpsRilCallbacks;
+typedef struct {
+	size_t size;
+	void (*init)(AGpsRilCallbacks* callbacks);
+	void (*set_ref_location) (const AGpsRefLocation *agps_reflocation, size_t sz_struct);
+	void (*set_set_id) (AGpsSetIDType type, const char* setid);
+	void (*ni_message) (uint8_t *msg, size_t len);
+	void (*update_network_state) (int connected, int type, int roaming, const char* extra_info);
+	void (*update_network_availability) (int avaiable, const char* apn);
+} AGpsRilInterface;
+struct gps_device_t {
+	struct hw_device_t common;
+	const GpsInterface* (*get_gps_interface)(struct gps_device_t* dev);
+};
+
+#endif //__BENCH_HARDWARE_GPS_H__
@@ -0,0 +1,66 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* host stand-in for the ICS hardware/hardware.h */
+
+#ifndef __BENCH_HARDWARE_HARDWARE_H__
+#define __BENCH_HARDWARE_HARDWARE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAKE_TAG_CONSTANT(A,B,C,D) (((A) << 24) | ((B) << 16) | ((C) << 8) | (D))
+
+#define HARDWARE_MODULE_TAG MAKE_TAG_CONSTANT('H', 'W', 'M', 'T')
+#define HARDWARE_DEVICE_TAG MAKE_TAG_CONSTANT('H', 'W', 'D', 'T')
+
+struct hw_module_t;
+struct hw_module_methods_t;
+struct hw_device_t;
+
+typedef struct hw_module_t {
+	uint32_t tag;
+	uint16_t version_major;
+	uint16_t version_minor;
+	const char *id;
+	const char *name;
+	const char *author;
+	struct hw_module_methods_t* methods;
+	void* dso;
+	uint32_t reserved[32-7];
+} hw_module_t;
+
+typedef struct hw_module_methods_t {
+	int (*open)(const struct hw_module_t* module, const char* id,
+		struct hw_device_t** device);
+} hw_module_methods_t;
+
+typedef struct hw_device_t {
+	uint32_t tag;
+	uint32_t version;
+	struct hw_module_t* module;
+	uint32_t reserved[12];
+	int (*close)(struct hw_device_t* device);
+} hw_device_t;
+
+#define HAL_MODULE_INFO_SYM HMI
+#define HAL_MODULE_INFO_SYM_AS_STR "HMI"
+
+#endif //__BENCH_HARDWARE_HARDWARE_H__
@@ -0,0 +1,44 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Host stand-in for the libstc-rpc logging macros. Errors and info go to
+ * stderr, debug output and the entry and exit traces are compiled out.
+ */
+
+#ifndef __BENCH_STC_LOG_H__
+#define __BENCH_STC_LOG_H__
+
+#include <stdio.h>
+
+#ifndef LOG_TAG
+#define LOG_TAG "[GPS-BENCH]"
+#endif
+
+#define RPC_ERROR(fmt, ...) \
+	fprintf(stderr, LOG_TAG " E " fmt "\n", ##__VA_ARGS__)
+#define RPC_INFO(fmt, ...) \
+	fprintf(stderr, LOG_TAG " I " fmt "\n", ##__VA_ARGS__)
+#define RPC_DEBUG(fmt, ...) do {} while (0)
+
+#define LOG_ENTRY do {} while (0)
+#define LOG_EXIT do {} while (0)
+
+#endif //__BENCH_STC_LOG_H__
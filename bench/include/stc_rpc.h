@@ -0,0 +1,90 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Host stand-in for the libstc-rpc API, implemented in bench/stc_rpc.c.
+ * Requests and replies travel as fixed-size messages over the socket the
+ * connection was initialized with.
+ */
+
+#ifndef __BENCH_STC_RPC_H__
+#define __BENCH_STC_RPC_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define RPC_PAYLOAD_MAX 4096
+
+typedef struct rpc_request_hdr_t {
+	uint32_t code;
+	char buffer[RPC_PAYLOAD_MAX];
+} rpc_request_hdr_t;
+
+typedef struct rpc_reply_t {
+	uint32_t code;
+	char buffer[RPC_PAYLOAD_MAX];
+} rpc_reply_t;
+
+typedef struct rpc_request_t {
+	rpc_request_hdr_t header;
+	rpc_reply_t reply;
+} rpc_request_t;
+
+typedef struct rpc rpc_t;
+typedef int (*rpc_handler_t)(rpc_request_hdr_t *hdr, rpc_reply_t *reply);
+
+rpc_t *rpc_alloc(void);
+void rpc_free(rpc_t *rpc);
+int rpc_init(int fd, rpc_handler_t handler, rpc_t *rpc);
+int rpc_start(rpc_t *rpc);
+int rpc_join(rpc_t *rpc);
+int rpc_call(rpc_t *rpc, rpc_request_t *req);
+int rpc_call_noreply(rpc_t *rpc, rpc_request_t *req);
+
+#define RPC_PACK_RAW(buf, idx, ptr, len) do { \
+	if ((idx) + (len) > RPC_PAYLOAD_MAX) { \
+		RPC_ERROR("%s: pack overflow", __func__); \
+		goto fail; \
+	} \
+	memcpy((buf) + (idx), (ptr), (len)); \
+	(idx) += (len); \
+} while (0)
+
+#define RPC_UNPACK_RAW(buf, idx, ptr, len) do { \
+	if ((idx) + (len) > RPC_PAYLOAD_MAX) { \
+		RPC_ERROR("%s: unpack overflow", __func__); \
+		goto fail; \
+	} \
+	memcpy((ptr), (buf) + (idx), (len)); \
+	(idx) += (len); \
+} while (0)
+
+#define RPC_PACK(buf, idx, val) RPC_PACK_RAW(buf, idx, &(val), sizeof(val))
+#define RPC_UNPACK(buf, idx, val) RPC_UNPACK_RAW(buf, idx, &(val), sizeof(val))
+
+#define RPC_PACK_S(buf, idx, str) \
+	RPC_PACK_RAW(buf, idx, str, strlen(str) + 1)
+#define RPC_UNPACK_S(buf, idx, str) \
+	RPC_UNPACK_RAW(buf, idx, str, \
+		strnlen((buf) + (idx), RPC_PAYLOAD_MAX - (idx)) + 1)
+
+#endif //__BENCH_STC_RPC_H__
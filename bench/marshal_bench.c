@@ -0,0 +1,1712 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Micro-benchmark of the proxy marshalling.
+ *
+ * Every message type is encoded and decoded the way the proxy did it
+ * with the RPC_PACK family on cleared buffers ("legacy") and the way it
+ * does it now with the stubs gps-marshal.h generates from the protocol
+ * description in gps-rpc.h ("marshal"). Both produce the same bytes,
+ * which is checked before anything is timed. The encoders hand their
+ * request and the decoders their arguments to an opaque sink, so that the
+ * compiler keeps the work a real call does.
+ *
+ * The callbacks that also have a compact encoding are measured in it as
+ * well ("compact"), with the size it takes next to the raw struct. Each
+ * message is decoded and compared with its arguments before it is timed.
+ *
+ * Each result is printed as one JSON object per line on stdout.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hardware/gps.h>
+
+#include <stc_rpc.h>
+#include <stc_log.h>
+
+#include "gps-rpc.h"
+#include "gps-marshal.h"
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_ROUNDS 5
+
+/******************************************************************************
+ * Sinks
+ *****************************************************************************/
+static int capturing = 0;
+static char *captured;
+static size_t captured_len;
+
+static void __attribute__((noinline)) bench_send(rpc_request_t *req,
+	size_t len)
+{
+	__asm__ __volatile__("" : : "r"(req), "r"(len) : "memory");
+	if (capturing) {
+		memcpy(captured, req->header.buffer, len);
+		captured_len = len;
+	}
+}
+
+static void __attribute__((noinline)) bench_use(const void *ptr, size_t len) {
+	__asm__ __volatile__("" : : "r"(ptr), "r"(len) : "memory");
+}
+
+/******************************************************************************
+ * Arguments
+ *****************************************************************************/
+static GpsUtcTime arg_time = 1341000000000LL;
+static int64_t arg_time_ref = 123456789;
+static int arg_uncertainty = 10;
+static double arg_lat = 59.9386;
+static double arg_lon = 30.3141;
+static float arg_accuracy = 25.0f;
+static GpsAidingData arg_aiding = GPS_DELETE_ALL;
+static GpsPositionMode arg_mode = GPS_POSITION_MODE_MS_BASED;
+static GpsPositionRecurrence arg_recurrence = GPS_POSITION_RECURRENCE_PERIODIC;
+static uint32_t arg_interval = 1000;
+static uint32_t arg_pref_accuracy = 50;
+static uint32_t arg_pref_time = 0;
+static char arg_xtra[1024];
+static int arg_xtra_len = sizeof(arg_xtra);
+static const char *arg_apn = "internet.provider.net";
+static AGpsType arg_agps_type = AGPS_TYPE_SUPL;
+static const char *arg_host = "supl.google.com";
+static int arg_port = 7276;
+static int arg_notif_id = 3;
+static GpsUserResponseType arg_response = GPS_NI_RESPONSE_ACCEPT;
+static AGpsRefLocation arg_ref_loc;
+static AGpsSetIDType arg_set_id_type = AGPS_SETID_TYPE_IMSI;
+static const char *arg_set_id = "250011234567890";
+static uint8_t arg_ni_msg[256];
+static int arg_connected = 1;
+static int arg_net_type = 1;
+static int arg_roaming = 0;
+static const char *arg_extra = "wifi";
+static int arg_available = 1;
+static struct gps_ttff_report arg_ttff = { 1000000, 4500000 };
+
+static GpsLocation arg_location;
+static GpsStatus arg_status;
+static GpsSvStatus arg_sv;
+static const char *arg_nmea =
+	"$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47\r\n";
+static uint32_t arg_caps = GPS_CAPABILITY_SCHEDULING | GPS_CAPABILITY_MSB;
+static AGpsStatus arg_agps_status;
+static GpsNiNotification arg_ni_notify;
+
+static void bench_args_init(void) {
+	int i;
+
+	for (i = 0; i < (int)sizeof(arg_xtra); i++) {
+		arg_xtra[i] = i * 7;
+	}
+	for (i = 0; i < (int)sizeof(arg_ni_msg); i++) {
+		arg_ni_msg[i] = i * 13;
+	}
+
+	memset(&arg_ref_loc, 0, sizeof(arg_ref_loc));
+	arg_ref_loc.type = AGPS_REF_LOCATION_TYPE_UMTS_CELLID;
+	arg_ref_loc.u.cellID.mcc = 250;
+	arg_ref_loc.u.cellID.mnc = 1;
+	arg_ref_loc.u.cellID.lac = 7801;
+	arg_ref_loc.u.cellID.cid = 40312;
+
+	memset(&arg_location, 0, sizeof(arg_location));
+	arg_location.size = sizeof(arg_location);
+	arg_location.flags = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ACCURACY;
+	arg_location.latitude = arg_lat;
+	arg_location.longitude = arg_lon;
+	arg_location.accuracy = arg_accuracy;
+	arg_location.timestamp = arg_time;
+
+	memset(&arg_status, 0, sizeof(arg_status));
+	arg_status.size = sizeof(arg_status);
+	arg_status.status = GPS_STATUS_SESSION_BEGIN;
+
+	memset(&arg_sv, 0, sizeof(arg_sv));
+	arg_sv.size = sizeof(arg_sv);
+	arg_sv.num_svs = 12;
+	for (i = 0; i < arg_sv.num_svs; i++) {
+		arg_sv.sv_list[i].size = sizeof(GpsSvInfo);
+		arg_sv.sv_list[i].prn = i + 1;
+		arg_sv.sv_list[i].snr = 20 + i;
+		arg_sv.sv_list[i].elevation = 5 * i;
+		arg_sv.sv_list[i].azimuth = 30 * i;
+	}
+	arg_sv.used_in_fix_mask = 0xff;
+
+	memset(&arg_agps_status, 0, sizeof(arg_agps_status));
+	arg_agps_status.size = sizeof(arg_agps_status);
+	arg_agps_status.type = AGPS_TYPE_SUPL;
+	arg_agps_status.status = GPS_REQUEST_AGPS_DATA_CONN;
+
+	memset(&arg_ni_notify, 0, sizeof(arg_ni_notify));
+	arg_ni_notify.size = sizeof(arg_ni_notify);
+	arg_ni_notify.notification_id = arg_notif_id;
+	arg_ni_notify.ni_type = GPS_NI_TYPE_UMTS_SUPL;
+	arg_ni_notify.timeout = 30;
+	arg_ni_notify.default_response = GPS_NI_RESPONSE_NORESP;
+	strcpy(arg_ni_notify.requestor_id, "+79001234567");
+	strcpy(arg_ni_notify.text, "Location request from the network");
+}
+
+/******************************************************************************
+ * Legacy encoders
+ *****************************************************************************/
+static void enc_inject_time_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_GPS_INJECT_TIME,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_time);
+	RPC_PACK(buf, idx, arg_time_ref);
+	RPC_PACK(buf, idx, arg_uncertainty);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_inject_location_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_GPS_INJECT_LOCATION,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_lat);
+	RPC_PACK(buf, idx, arg_lon);
+	RPC_PACK(buf, idx, arg_accuracy);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_delete_aiding_data_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_GPS_DELETE_AIDING_DATA,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_aiding);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_position_mode_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_GPS_SET_POSITION_MODE,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_mode);
+	RPC_PACK(buf, idx, arg_recurrence);
+	RPC_PACK(buf, idx, arg_interval);
+	RPC_PACK(buf, idx, arg_pref_accuracy);
+	RPC_PACK(buf, idx, arg_pref_time);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_xtra_data_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_XTRA_INJECT_XTRA_DATA,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, arg_xtra_len);
+	RPC_PACK_RAW(buf, idx, arg_xtra, arg_xtra_len);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_data_conn_open_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_AGPS_DATA_CONN_OPEN,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK_S(buf, idx, arg_apn);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_server_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_AGPS_AGPS_SET_SERVER,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, arg_agps_type);
+	RPC_PACK(buf, idx, arg_port);
+	RPC_PACK_S(buf, idx, arg_host);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_ni_respond_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_NI_RESPOND,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_notif_id);
+	RPC_PACK(buf, idx, arg_response);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_ref_location_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = RIL_SET_REF_LOC,
+		}
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	/* a size_t on the 32-bit targets the macros were written for */
+	uint32_t sz_struct = sizeof(arg_ref_loc);
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, sz_struct);
+	RPC_PACK_RAW(buf, idx, &arg_ref_loc, sz_struct);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_set_id_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = RIL_SET_SET_ID,
+		}
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, arg_set_id_type);
+	RPC_PACK_S(buf, idx, arg_set_id);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_ni_message_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = RIL_NI_MSG,
+		}
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	/* a size_t on the 32-bit targets the macros were written for */
+	uint32_t len = sizeof(arg_ni_msg);
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, len);
+	RPC_PACK_RAW(buf, idx, arg_ni_msg, len);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_network_state_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = RIL_UPDATE_NET_STATE,
+		}
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, arg_connected);
+	RPC_PACK(buf, idx, arg_net_type);
+	RPC_PACK(buf, idx, arg_roaming);
+	RPC_PACK_S(buf, idx, arg_extra);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_network_availability_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = RIL_UPDATE_NET_AVAILABILITY,
+		}
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
+	RPC_PACK(buf, idx, arg_available);
+	RPC_PACK_S(buf, idx, arg_apn);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_gps_start_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_GPS_START,
+		},
+	};
+
+	bench_send(&req, 0);
+}
+
+static void enc_ttff_report_legacy(void) {
+	struct rpc_request_t req = {
+		.header = {
+			.code = GPS_PROXY_TTFF_REPORT,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_ttff);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_location_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = GPS_LOC_CB,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK_RAW(buf, idx, &arg_location, sizeof(GpsLocation));
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_status_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = GPS_STATUS_CB,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK_RAW(buf, idx, &arg_status, sizeof(GpsStatus));
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+/* a keyframe, which carries every field of every SV */
+static size_t enc_sv_delta_body(char *buf) {
+	struct gps_sv_delta delta;
+	size_t idx = sizeof(delta);
+	int i;
+
+	memset(&delta, 0, sizeof(delta));
+	delta.flags = GPS_SV_DELTA_KEYFRAME;
+	delta.num_svs = arg_sv.num_svs;
+	delta.used_in_fix_mask = arg_sv.used_in_fix_mask;
+
+	for (i = 0; i < arg_sv.num_svs; i++) {
+		GpsSvInfo *sv = arg_sv.sv_list + i;
+		uint8_t fields = GPS_SV_FIELD_ALL;
+
+		delta.changed |= 1ULL << i;
+		RPC_PACK(buf, idx, fields);
+		RPC_PACK(buf, idx, sv->prn);
+		RPC_PACK(buf, idx, sv->snr);
+		RPC_PACK(buf, idx, sv->elevation);
+		RPC_PACK(buf, idx, sv->azimuth);
+	}
+	memcpy(buf, &delta, sizeof(delta));
+	return idx;
+
+fail:
+	return 0;
+}
+
+static void enc_sv_delta_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = GPS_SV_DELTA_CB,
+		},
+	};
+
+	bench_send(&req, enc_sv_delta_body(req.header.buffer));
+}
+
+static void enc_nmea_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = GPS_NMEA_CB,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	int length = strlen(arg_nmea);
+
+	RPC_PACK(buf, idx, arg_time);
+	RPC_PACK(buf, idx, length);
+	RPC_PACK_RAW(buf, idx, arg_nmea, length);
+	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_capabilities_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = GPS_SET_CAPABILITIES_CB,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK(buf, idx, arg_caps);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_agps_status_legacy(void) {
+	rpc_request_t req = {
+		.header = {
+			.code = AGPS_STATUS_CB,
+		},
+	};
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_PACK_RAW(buf, idx, &arg_agps_status, sizeof(AGpsStatus));
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+/******************************************************************************
+ * Marshal encoders
+ *****************************************************************************/
+static void enc_inject_time(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_GPS_INJECT_TIME;
+
+	if (gps_pack_gps_inject_time(buf, &idx, &arg_time, &arg_time_ref,
+		&arg_uncertainty))
+	{
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_inject_location(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_GPS_INJECT_LOCATION;
+
+	if (gps_pack_gps_inject_location(buf, &idx, &arg_lat, &arg_lon,
+		&arg_accuracy))
+	{
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_delete_aiding_data(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_GPS_DELETE_AIDING_DATA;
+
+	if (gps_pack_gps_delete_aiding_data(buf, &idx, &arg_aiding)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_position_mode(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_GPS_SET_POSITION_MODE;
+
+	if (gps_pack_gps_set_position_mode(buf, &idx, &arg_mode,
+		&arg_recurrence, &arg_interval, &arg_pref_accuracy, &arg_pref_time))
+	{
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_xtra_data(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_XTRA_INJECT_XTRA_DATA;
+
+	if (gps_pack_xtra_inject_data(buf, &idx, &arg_xtra_len)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, arg_xtra, arg_xtra_len);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_data_conn_open(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_AGPS_DATA_CONN_OPEN;
+
+	GPS_MARSHAL_S(buf, idx, arg_apn);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_server(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_AGPS_AGPS_SET_SERVER;
+
+	if (gps_pack_agps_set_server(buf, &idx, &arg_agps_type, &arg_port)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, arg_host);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_ni_respond(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_NI_RESPOND;
+
+	if (gps_pack_ni_respond(buf, &idx, &arg_notif_id, &arg_response)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_ref_location(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	uint32_t sz_struct = sizeof(arg_ref_loc);
+
+	req.header.code = RIL_SET_REF_LOC;
+
+	if (gps_pack_ril_set_ref_location(buf, &idx, &sz_struct)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, &arg_ref_loc, sz_struct);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_set_set_id(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = RIL_SET_SET_ID;
+
+	if (gps_pack_ril_set_set_id(buf, &idx, &arg_set_id_type)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, arg_set_id);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_ni_message(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	uint32_t len = sizeof(arg_ni_msg);
+
+	req.header.code = RIL_NI_MSG;
+
+	if (gps_pack_ril_ni_message(buf, &idx, &len)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, arg_ni_msg, len);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_network_state(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = RIL_UPDATE_NET_STATE;
+
+	if (gps_pack_ril_update_network_state(buf, &idx, &arg_connected,
+		&arg_net_type, &arg_roaming))
+	{
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, arg_extra);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_network_availability(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = RIL_UPDATE_NET_AVAILABILITY;
+
+	if (gps_pack_ril_update_network_availability(buf, &idx, &arg_available)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, arg_apn);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_gps_start(void) {
+	struct rpc_request_t req;
+
+	req.header.code = GPS_PROXY_GPS_START;
+	bench_send(&req, 0);
+}
+
+static void enc_ttff_report(void) {
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_TTFF_REPORT;
+
+	if (gps_pack_ttff_report(buf, &idx, &arg_ttff)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_location(void) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_LOC_CB;
+
+	if (gps_pack_location(buf, &idx, &arg_location)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_status(void) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_STATUS_CB;
+
+	if (gps_pack_status(buf, &idx, &arg_status)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_sv_delta(void) {
+	rpc_request_t req;
+
+	req.header.code = GPS_SV_DELTA_CB;
+	bench_send(&req, enc_sv_delta_body(req.header.buffer));
+}
+
+static void enc_nmea(void) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	int length = strlen(arg_nmea);
+
+	req.header.code = GPS_NMEA_CB;
+
+	if (gps_pack_nmea(buf, &idx, &arg_time, &length)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, arg_nmea, length);
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_capabilities(void) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = GPS_SET_CAPABILITIES_CB;
+
+	if (gps_pack_set_capabilities(buf, &idx, &arg_caps)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+static void enc_agps_status(void) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	req.header.code = AGPS_STATUS_CB;
+
+	if (gps_pack_agps_status(buf, &idx, &arg_agps_status)) {
+		goto fail;
+	}
+	bench_send(&req, idx);
+fail:
+	return;
+}
+
+/******************************************************************************
+ * Legacy decoders
+ *****************************************************************************/
+static void dec_inject_time_legacy(char *buf) {
+	GpsUtcTime time;
+	int64_t timeReference;
+	int uncertainty;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, time);
+	RPC_UNPACK(buf, idx, timeReference);
+	RPC_UNPACK(buf, idx, uncertainty);
+	bench_use(&time, timeReference + uncertainty);
+fail:
+	return;
+}
+
+static void dec_inject_location_legacy(char *buf) {
+	double latitude;
+	double longitude;
+	float accuracy;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, latitude);
+	RPC_UNPACK(buf, idx, longitude);
+	RPC_UNPACK(buf, idx, accuracy);
+	bench_use(&latitude, longitude + accuracy);
+fail:
+	return;
+}
+
+static void dec_delete_aiding_data_legacy(char *buf) {
+	GpsAidingData flags;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, flags);
+	bench_use(&flags, flags);
+fail:
+	return;
+}
+
+static void dec_set_position_mode_legacy(char *buf) {
+	GpsPositionMode mode;
+	GpsPositionRecurrence recurrence;
+	uint32_t min_interval;
+	uint32_t preferred_accuracy;
+	uint32_t preferred_time;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, mode);
+	RPC_UNPACK(buf, idx, recurrence);
+	RPC_UNPACK(buf, idx, min_interval);
+	RPC_UNPACK(buf, idx, preferred_accuracy);
+	RPC_UNPACK(buf, idx, preferred_time);
+	bench_use(&mode, recurrence + min_interval + preferred_accuracy +
+		preferred_time);
+fail:
+	return;
+}
+
+static void dec_xtra_data_legacy(char *buf) {
+	int length;
+	char data[RPC_PAYLOAD_MAX - 4];
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, length);
+	if (length < 0 || length > (int)sizeof(data)) {
+		return;
+	}
+	RPC_UNPACK_RAW(buf, idx, data, length);
+	bench_use(data, length);
+fail:
+	return;
+}
+
+static void dec_data_conn_open_legacy(char *buf) {
+	char str[RPC_PAYLOAD_MAX] = {};
+	size_t idx = 0;
+
+	RPC_UNPACK_S(buf, idx, str);
+	bench_use(str, 0);
+fail:
+	return;
+}
+
+static void dec_set_server_legacy(char *buf) {
+	char hostname[RPC_PAYLOAD_MAX] = {};
+	AGpsType type;
+	int port;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, type);
+	RPC_UNPACK(buf, idx, port);
+	RPC_UNPACK_S(buf, idx, hostname);
+	bench_use(hostname, type + port);
+fail:
+	return;
+}
+
+static void dec_ni_respond_legacy(char *buf) {
+	int notif_id;
+	GpsUserResponseType user_response;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, notif_id);
+	RPC_UNPACK(buf, idx, user_response);
+	bench_use(&notif_id, user_response);
+fail:
+	return;
+}
+
+static void dec_set_ref_location_legacy(char *buf) {
+	AGpsRefLocation loc;
+	uint32_t sz_struct;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, sz_struct);
+	RPC_UNPACK_RAW(buf, idx, &loc, sz_struct);
+	bench_use(&loc, sz_struct);
+fail:
+	return;
+}
+
+static void dec_set_set_id_legacy(char *buf) {
+	AGpsSetIDType type;
+	char setid[RPC_PAYLOAD_MAX] = {};
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, type);
+	RPC_UNPACK_S(buf, idx, setid);
+	bench_use(setid, type);
+fail:
+	return;
+}
+
+static void dec_ni_message_legacy(char *buf) {
+	uint8_t msg[RPC_PAYLOAD_MAX] = {};
+	uint32_t len;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, len);
+	RPC_UNPACK_RAW(buf, idx, msg, len);
+	bench_use(msg, len);
+fail:
+	return;
+}
+
+static void dec_network_state_legacy(char *buf) {
+	int connected, type, roaming;
+	char extra[RPC_PAYLOAD_MAX] = {};
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, connected);
+	RPC_UNPACK(buf, idx, type);
+	RPC_UNPACK(buf, idx, roaming);
+	RPC_UNPACK_S(buf, idx, extra);
+	bench_use(extra, connected + type + roaming);
+fail:
+	return;
+}
+
+static void dec_network_availability_legacy(char *buf) {
+	char apn[RPC_PAYLOAD_MAX] = {};
+	int available;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, available);
+	RPC_UNPACK_S(buf, idx, apn);
+	bench_use(apn, available);
+fail:
+	return;
+}
+
+static void dec_gps_start_legacy(char *buf) {
+	bench_use(buf, 0);
+}
+
+static void dec_ttff_report_legacy(char *buf) {
+	struct gps_ttff_report report;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, report);
+	bench_use(&report, sizeof(report));
+fail:
+	return;
+}
+
+static void dec_location_legacy(char *buf) {
+	GpsLocation location;
+	size_t idx = 0;
+
+	memset(&location, 0, sizeof(location));
+	RPC_UNPACK(buf, idx, location);
+	bench_use(&location, sizeof(location));
+fail:
+	return;
+}
+
+static void dec_status_legacy(char *buf) {
+	GpsStatus status;
+	size_t idx = 0;
+
+	memset(&status, 0, sizeof(status));
+	RPC_UNPACK(buf, idx, status);
+	bench_use(&status, sizeof(status));
+fail:
+	return;
+}
+
+static GpsSvStatus sv_table;
+
+static void dec_sv_delta_legacy(char *buf) {
+	struct gps_sv_delta delta;
+	size_t idx = 0;
+	int i;
+
+	RPC_UNPACK(buf, idx, delta);
+	memset(&sv_table, 0, sizeof(sv_table));
+
+	for (i = 0; i < GPS_MAX_SVS; i++) {
+		GpsSvInfo *sv = sv_table.sv_list + i;
+		uint8_t fields;
+
+		if (!(delta.changed & (1ULL << i))) {
+			continue;
+		}
+
+		RPC_UNPACK(buf, idx, fields);
+		if (fields & GPS_SV_FIELD_PRN) {
+			RPC_UNPACK(buf, idx, sv->prn);
+		}
+		if (fields & GPS_SV_FIELD_SNR) {
+			RPC_UNPACK(buf, idx, sv->snr);
+		}
+		if (fields & GPS_SV_FIELD_ELEVATION) {
+			RPC_UNPACK(buf, idx, sv->elevation);
+		}
+		if (fields & GPS_SV_FIELD_AZIMUTH) {
+			RPC_UNPACK(buf, idx, sv->azimuth);
+		}
+		sv->size = sizeof(GpsSvInfo);
+	}
+	sv_table.num_svs = delta.num_svs;
+	bench_use(&sv_table, sizeof(sv_table));
+fail:
+	return;
+}
+
+static void dec_nmea_legacy(char *buf) {
+	char nmea[RPC_PAYLOAD_MAX] = {};
+	GpsUtcTime timestamp;
+	int length;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, timestamp);
+	RPC_UNPACK(buf, idx, length);
+	RPC_UNPACK_RAW(buf, idx, nmea, length);
+	bench_use(nmea, length + timestamp);
+fail:
+	return;
+}
+
+static void dec_capabilities_legacy(char *buf) {
+	uint32_t caps = 0;
+	size_t idx = 0;
+
+	RPC_UNPACK(buf, idx, caps);
+	bench_use(&caps, caps);
+fail:
+	return;
+}
+
+static void dec_agps_status_legacy(char *buf) {
+	AGpsStatus status;
+	size_t idx = 0;
+
+	memset(&status, 0, sizeof(status));
+	RPC_UNPACK(buf, idx, status);
+	bench_use(&status, sizeof(status));
+fail:
+	return;
+}
+
+/******************************************************************************
+ * Marshal decoders
+ *****************************************************************************/
+static void dec_inject_time(char *buf) {
+	GpsUtcTime time;
+	int64_t timeReference;
+	int uncertainty;
+	size_t idx = 0;
+
+	if (gps_unpack_gps_inject_time(buf, &idx, &time, &timeReference,
+		&uncertainty))
+	{
+		goto fail;
+	}
+	bench_use(&time, timeReference + uncertainty);
+fail:
+	return;
+}
+
+static void dec_inject_location(char *buf) {
+	double latitude;
+	double longitude;
+	float accuracy;
+	size_t idx = 0;
+
+	if (gps_unpack_gps_inject_location(buf, &idx, &latitude, &longitude,
+		&accuracy))
+	{
+		goto fail;
+	}
+	bench_use(&latitude, longitude + accuracy);
+fail:
+	return;
+}
+
+static void dec_set_position_mode(char *buf) {
+	GpsPositionMode mode;
+	GpsPositionRecurrence recurrence;
+	uint32_t min_interval;
+	uint32_t preferred_accuracy;
+	uint32_t preferred_time;
+	size_t idx = 0;
+
+	if (gps_unpack_gps_set_position_mode(buf, &idx, &mode, &recurrence,
+		&min_interval, &preferred_accuracy, &preferred_time))
+	{
+		goto fail;
+	}
+	bench_use(&mode, recurrence + min_interval + preferred_accuracy +
+		preferred_time);
+fail:
+	return;
+}
+
+static void dec_xtra_data(char *buf) {
+	int length;
+	char *data;
+	size_t idx = 0;
+
+	if (gps_unpack_xtra_inject_data(buf, &idx, &length)) {
+		goto fail;
+	}
+	if (length < 0 || length > RPC_PAYLOAD_MAX - (int)idx) {
+		return;
+	}
+	GPS_UNMARSHAL_REF(buf, idx, data, length);
+	bench_use(data, length);
+fail:
+	return;
+}
+
+static void dec_data_conn_open(char *buf) {
+	char *str;
+	size_t idx = 0;
+
+	GPS_UNMARSHAL_S(buf, idx, str);
+	bench_use(str, 0);
+fail:
+	return;
+}
+
+static void dec_set_server(char *buf) {
+	char *hostname;
+	AGpsType type;
+	int port;
+	size_t idx = 0;
+
+	if (gps_unpack_agps_set_server(buf, &idx, &type, &port)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, idx, hostname);
+	bench_use(hostname, type + port);
+fail:
+	return;
+}
+
+static void dec_ni_respond(char *buf) {
+	int notif_id;
+	GpsUserResponseType user_response;
+	size_t idx = 0;
+
+	if (gps_unpack_ni_respond(buf, &idx, &notif_id, &user_response)) {
+		goto fail;
+	}
+	bench_use(&notif_id, user_response);
+fail:
+	return;
+}
+
+static void dec_set_set_id(char *buf) {
+	AGpsSetIDType type;
+	char *setid;
+	size_t idx = 0;
+
+	if (gps_unpack_ril_set_set_id(buf, &idx, &type)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, idx, setid);
+	bench_use(setid, type);
+fail:
+	return;
+}
+
+static void dec_ni_message(char *buf) {
+	uint8_t *msg;
+	uint32_t len;
+	size_t idx = 0;
+
+	if (gps_unpack_ril_ni_message(buf, &idx, &len)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_REF(buf, idx, msg, len);
+	bench_use(msg, len);
+fail:
+	return;
+}
+
+static void dec_network_state(char *buf) {
+	int connected, type, roaming;
+	char *extra;
+	size_t idx = 0;
+
+	if (gps_unpack_ril_update_network_state(buf, &idx, &connected, &type,
+		&roaming))
+	{
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, idx, extra);
+	bench_use(extra, connected + type + roaming);
+fail:
+	return;
+}
+
+static void dec_network_availability(char *buf) {
+	char *apn;
+	int available;
+	size_t idx = 0;
+
+	if (gps_unpack_ril_update_network_availability(buf, &idx, &available)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, idx, apn);
+	bench_use(apn, available);
+fail:
+	return;
+}
+
+static void dec_location(char *buf) {
+	GpsLocation location;
+	size_t idx = 0;
+
+	if (gps_unpack_location(buf, &idx, &location)) {
+		goto fail;
+	}
+	bench_use(&location, sizeof(location));
+fail:
+	return;
+}
+
+static void dec_status(char *buf) {
+	GpsStatus status;
+	size_t idx = 0;
+
+	if (gps_unpack_status(buf, &idx, &status)) {
+		goto fail;
+	}
+	bench_use(&status, sizeof(status));
+fail:
+	return;
+}
+
+static void dec_nmea(char *buf) {
+	GpsUtcTime timestamp;
+	int length;
+	char *nmea;
+	size_t idx = 0;
+
+	if (gps_unpack_nmea(buf, &idx, &timestamp, &length)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_REF(buf, idx, nmea, length);
+	bench_use(nmea, length + timestamp);
+fail:
+	return;
+}
+
+static void dec_agps_status(char *buf) {
+	AGpsStatus status;
+	size_t idx = 0;
+
+	if (gps_unpack_agps_status(buf, &idx, &status)) {
+		goto fail;
+	}
+	bench_use(&status, sizeof(status));
+fail:
+	return;
+}
+
+/******************************************************************************
+ * Compact encoders and decoders
+ *****************************************************************************/
+#define BENCH_COMPACT(name, type, msg_code) \
+static void enc_##name##_compact(void) { \
+	rpc_request_t req; \
+	size_t idx = 0; \
+\
+	req.header.code = msg_code; \
+	if (!gps_encode_##name(req.header.buffer, &idx, &arg_##name)) { \
+		bench_send(&req, idx); \
+	} \
+} \
+\
+static void dec_##name##_compact(char *buf) { \
+	type out; \
+	size_t idx = 0; \
+\
+	if (!gps_decode_##name(buf, &idx, &out)) { \
+		bench_use(&out, sizeof(out)); \
+	} \
+} \
+\
+static int check_##name##_compact(char *buf) { \
+	type out; \
+	size_t idx = 0; \
+\
+	return gps_decode_##name(buf, &idx, &out) || \
+		memcmp(&out, &arg_##name, sizeof(out)); \
+}
+
+BENCH_COMPACT(location, GpsLocation, GPS_LOC_COMPACT_CB)
+BENCH_COMPACT(status, GpsStatus, GPS_STATUS_COMPACT_CB)
+BENCH_COMPACT(agps_status, AGpsStatus, AGPS_STATUS_COMPACT_CB)
+BENCH_COMPACT(ni_notify, GpsNiNotification, NI_NOTIFY_COMPACT_CB)
+
+/******************************************************************************
+ * Benchmark
+ *****************************************************************************/
+struct bench_msg {
+	const char *name;
+	void (*enc_legacy)(void);
+	void (*enc)(void);
+	void (*dec_legacy)(char *buf);
+	void (*dec)(char *buf);
+};
+
+/*
+ * Messages whose decoding did not change share the legacy decoder, the
+ * daemon still copies the reference location into an aligned struct.
+ */
+static const struct bench_msg bench_msgs[] = {
+	{ "inject_time", enc_inject_time_legacy, enc_inject_time,
+		dec_inject_time_legacy, dec_inject_time },
+	{ "inject_location", enc_inject_location_legacy, enc_inject_location,
+		dec_inject_location_legacy, dec_inject_location },
+	{ "delete_aiding_data", enc_delete_aiding_data_legacy,
+		enc_delete_aiding_data,
+		dec_delete_aiding_data_legacy, dec_delete_aiding_data_legacy },
+	{ "set_position_mode", enc_set_position_mode_legacy,
+		enc_set_position_mode,
+		dec_set_position_mode_legacy, dec_set_position_mode },
+	{ "xtra_data", enc_xtra_data_legacy, enc_xtra_data,
+		dec_xtra_data_legacy, dec_xtra_data },
+	{ "data_conn_open", enc_data_conn_open_legacy, enc_data_conn_open,
+		dec_data_conn_open_legacy, dec_data_conn_open },
+	{ "set_server", enc_set_server_legacy, enc_set_server,
+		dec_set_server_legacy, dec_set_server },
+	{ "ni_respond", enc_ni_respond_legacy, enc_ni_respond,
+		dec_ni_respond_legacy, dec_ni_respond },
+	{ "set_ref_location", enc_set_ref_location_legacy, enc_set_ref_location,
+		dec_set_ref_location_legacy, dec_set_ref_location_legacy },
+	{ "set_set_id", enc_set_set_id_legacy, enc_set_set_id,
+		dec_set_set_id_legacy, dec_set_set_id },
+	{ "ni_message", enc_ni_message_legacy, enc_ni_message,
+		dec_ni_message_legacy, dec_ni_message },
+	{ "update_network_state", enc_network_state_legacy, enc_network_state,
+		dec_network_state_legacy, dec_network_state },
+	{ "update_network_availability", enc_network_availability_legacy,
+		enc_network_availability,
+		dec_network_availability_legacy, dec_network_availability },
+	{ "gps_start", enc_gps_start_legacy, enc_gps_start,
+		dec_gps_start_legacy, dec_gps_start_legacy },
+	{ "ttff_report", enc_ttff_report_legacy, enc_ttff_report,
+		dec_ttff_report_legacy, dec_ttff_report_legacy },
+	{ "location_cb", enc_location_legacy, enc_location,
+		dec_location_legacy, dec_location },
+	{ "status_cb", enc_status_legacy, enc_status,
+		dec_status_legacy, dec_status },
+	{ "sv_delta_cb", enc_sv_delta_legacy, enc_sv_delta,
+		dec_sv_delta_legacy, dec_sv_delta_legacy },
+	{ "nmea_cb", enc_nmea_legacy, enc_nmea,
+		dec_nmea_legacy, dec_nmea },
+	{ "set_capabilities_cb", enc_capabilities_legacy, enc_capabilities,
+		dec_capabilities_legacy, dec_capabilities_legacy },
+	{ "agps_status_cb", enc_agps_status_legacy, enc_agps_status,
+		dec_agps_status_legacy, dec_agps_status },
+};
+
+#define BENCH_NUM_MSGS (sizeof(bench_msgs) / sizeof(bench_msgs[0]))
+
+struct bench_compact {
+	const char *name;
+	/* size of the struct the raw encoding sends */
+	size_t raw_len;
+	void (*enc)(void);
+	void (*dec)(char *buf);
+	int (*check)(char *buf);
+};
+
+static const struct bench_compact bench_compacts[] = {
+	{ "location_cb", sizeof(GpsLocation), enc_location_compact,
+		dec_location_compact, check_location_compact },
+	{ "status_cb", sizeof(GpsStatus), enc_status_compact,
+		dec_status_compact, check_status_compact },
+	{ "agps_status_cb", sizeof(AGpsStatus), enc_agps_status_compact,
+		dec_agps_status_compact, check_agps_status_compact },
+	{ "ni_notify_cb", sizeof(GpsNiNotification), enc_ni_notify_compact,
+		dec_ni_notify_compact, check_ni_notify_compact },
+};
+#define BENCH_NUM_COMPACTS (sizeof(bench_compacts) / sizeof(bench_compacts[0]))
+
+static uint64_t bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* runs an encoder once and copies what it sends to @out */
+static size_t bench_capture(void (*enc)(void), char *out) {
+	capturing = 1;
+	captured = out;
+	captured_len = 0;
+	enc();
+	capturing = 0;
+	return captured_len;
+}
+
+/* one run of @iterations operations, in nanoseconds per operation */
+static double bench_run_enc(void (*enc)(void), unsigned iterations) {
+	uint64_t start = bench_now_ns();
+	unsigned i;
+
+	for (i = 0; i < iterations; i++) {
+		enc();
+	}
+	return (double)(bench_now_ns() - start) / iterations;
+}
+
+static double bench_run_dec(void (*dec)(char *buf), char *buf,
+	unsigned iterations)
+{
+	uint64_t start = bench_now_ns();
+	unsigned i;
+
+	for (i = 0; i < iterations; i++) {
+		dec(buf);
+	}
+	return (double)(bench_now_ns() - start) / iterations;
+}
+
+static void bench_best(double *best, unsigned round, double ns) {
+	if (!round || ns < *best) {
+		*best = ns;
+	}
+}
+
+/* the best of BENCH_ROUNDS runs, in nanoseconds per operation */
+static double bench_time_enc(void (*enc)(void), unsigned iterations) {
+	double best = 0;
+	unsigned r;
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		bench_best(&best, r, bench_run_enc(enc, iterations));
+	}
+	return best;
+}
+
+static double bench_time_dec(void (*dec)(char *buf), char *buf,
+	unsigned iterations)
+{
+	double best = 0;
+	unsigned r;
+
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		bench_best(&best, r, bench_run_dec(dec, buf, iterations));
+	}
+	return best;
+}
+
+/*
+ * Times the legacy and the marshal variant of a message against each
+ * other. The runs alternate and every other round starts with the other
+ * variant: timed one after the other, the second one came out up to 15%
+ * slower even when both were the same function.
+ */
+static void bench_pair_enc(const struct bench_msg *m, unsigned iterations,
+	double *legacy, double *marshal)
+{
+	unsigned r;
+
+	for (r = 0; r < BENCH_ROUNDS * 2; r++) {
+		if (r & 1) {
+			bench_best(marshal, r / 2, bench_run_enc(m->enc, iterations));
+			bench_best(legacy, r / 2, bench_run_enc(m->enc_legacy, iterations));
+		}
+		else {
+			bench_best(legacy, r / 2, bench_run_enc(m->enc_legacy, iterations));
+			bench_best(marshal, r / 2, bench_run_enc(m->enc, iterations));
+		}
+	}
+}
+
+static void bench_pair_dec(const struct bench_msg *m, char *buf,
+	unsigned iterations, double *legacy, double *marshal)
+{
+	unsigned r;
+
+	for (r = 0; r < BENCH_ROUNDS * 2; r++) {
+		if (r & 1) {
+			bench_best(marshal, r / 2,
+				bench_run_dec(m->dec, buf, iterations));
+			bench_best(legacy, r / 2,
+				bench_run_dec(m->dec_legacy, buf, iterations));
+		}
+		else {
+			bench_best(legacy, r / 2,
+				bench_run_dec(m->dec_legacy, buf, iterations));
+			bench_best(marshal, r / 2,
+				bench_run_dec(m->dec, buf, iterations));
+		}
+	}
+}
+
+static void bench_report(const char *name, const char *op, double legacy,
+	double marshal)
+{
+	printf("{\"bench\":\"marshal\",\"msg\":\"%s\",\"op\":\"%s\","
+		"\"legacy_ns\":%.1f,\"marshal_ns\":%.1f,\"speedup\":%.2f}\n",
+		name, op, legacy, marshal, marshal > 0 ? legacy / marshal : 0);
+	fflush(stdout);
+}
+
+static void bench_report_compact(const char *name, size_t raw_len,
+	size_t len, double enc, double dec)
+{
+	printf("{\"bench\":\"compact\",\"msg\":\"%s\",\"raw_bytes\":%zu,"
+		"\"compact_bytes\":%zu,\"encode_ns\":%.1f,\"decode_ns\":%.1f}\n",
+		name, raw_len, len, enc, dec);
+	fflush(stdout);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-n iterations] [-m message]\n", prog);
+}
+
+int main(int argc, char **argv) {
+	unsigned iterations = BENCH_ITERATIONS;
+	const char *only = NULL;
+	static char buf[RPC_PAYLOAD_MAX];
+	static char check[RPC_PAYLOAD_MAX];
+	unsigned i;
+	int opt;
+	int rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iterations = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				only = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (!iterations) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	bench_args_init();
+
+	for (i = 0; i < BENCH_NUM_MSGS; i++) {
+		const struct bench_msg *m = bench_msgs + i;
+		double legacy = 0, marshal = 0;
+		size_t len, check_len;
+
+		if (only && strcmp(only, m->name)) {
+			continue;
+		}
+
+		/* both encoders have to produce the same message */
+		len = bench_capture(m->enc_legacy, buf);
+		check_len = bench_capture(m->enc, check);
+		if (len != check_len || memcmp(buf, check, len)) {
+			RPC_ERROR("%s: encodings differ", m->name);
+			rc = 1;
+			continue;
+		}
+
+		bench_pair_enc(m, iterations, &legacy, &marshal);
+		bench_report(m->name, "encode", legacy, marshal);
+
+		/* decoders read the message out of a receive buffer */
+		memset(buf + len, 0, RPC_PAYLOAD_MAX - len);
+		bench_pair_dec(m, buf, iterations, &legacy, &marshal);
+		bench_report(m->name, "decode", legacy, marshal);
+	}
+
+	for (i = 0; i < BENCH_NUM_COMPACTS; i++) {
+		const struct bench_compact *m = bench_compacts + i;
+		size_t len;
+
+		if (only && strcmp(only, m->name)) {
+			continue;
+		}
+
+		/* the decoder has to give back what was encoded */
+		len = bench_capture(m->enc, buf);
+		memset(buf + len, 0, RPC_PAYLOAD_MAX - len);
+		if (!len || m->check(buf)) {
+			RPC_ERROR("%s: compact encoding does not round trip", m->name);
+			rc = 1;
+			continue;
+		}
+
+		bench_report_compact(m->name, m->raw_len, len,
+			bench_time_enc(m->enc, iterations),
+			bench_time_dec(m->dec, buf, iterations));
+	}
+
+	return rc;
+}
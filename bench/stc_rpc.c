@@ -0,0 +1,234 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Host stand-in for libstc-rpc. Every message is a fixed-size header and
+ * payload, written with a single send. One receive thread per connection
+ * serves calls through the handler and hands replies to the caller that
+ * is waiting for them. Calls on one connection are serialized.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define LOG_TAG "[STC-RPC]"
+#include <stc_log.h>
+#include <stc_rpc.h>
+
+enum {
+	RPC_MSG_CALL = 1,
+	RPC_MSG_NOREPLY,
+	RPC_MSG_REPLY,
+};
+
+struct rpc_msg {
+	uint32_t type;
+	uint32_t code;
+	char buffer[RPC_PAYLOAD_MAX];
+};
+
+struct rpc {
+	int fd;
+	rpc_handler_t handler;
+	pthread_t thread;
+	int started;
+
+	/* serializes the writers */
+	pthread_mutex_t send_mutex;
+
+	/* one call at a time waits for its reply */
+	pthread_mutex_t call_mutex;
+	pthread_mutex_t reply_mutex;
+	pthread_cond_t reply_cond;
+	rpc_reply_t *reply;
+	int reply_ready;
+	int dead;
+};
+
+static int rpc_read_full(int fd, void *buf, size_t len) {
+	char *p = buf;
+
+	while (len) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int rpc_send(rpc_t *rpc, uint32_t type, uint32_t code,
+	const char *buffer)
+{
+	struct rpc_msg msg;
+	const char *p = (const char*)&msg;
+	size_t len = sizeof(msg);
+	int rc = 0;
+
+	msg.type = type;
+	msg.code = code;
+	memcpy(msg.buffer, buffer, RPC_PAYLOAD_MAX);
+
+	pthread_mutex_lock(&rpc->send_mutex);
+	while (len) {
+		ssize_t n = send(rpc->fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			rc = -1;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&rpc->send_mutex);
+	return rc;
+}
+
+static void *rpc_thread_func(void *arg) {
+	rpc_t *rpc = arg;
+	struct rpc_msg *msg = malloc(sizeof(*msg));
+	rpc_request_hdr_t *hdr = malloc(sizeof(*hdr));
+	rpc_reply_t *reply = malloc(sizeof(*reply));
+
+	while (msg && hdr && reply && !rpc_read_full(rpc->fd, msg, sizeof(*msg))) {
+		if (msg->type == RPC_MSG_REPLY) {
+			pthread_mutex_lock(&rpc->reply_mutex);
+			if (rpc->reply) {
+				rpc->reply->code = msg->code;
+				memcpy(rpc->reply->buffer, msg->buffer, RPC_PAYLOAD_MAX);
+				rpc->reply_ready = 1;
+				pthread_cond_signal(&rpc->reply_cond);
+			}
+			pthread_mutex_unlock(&rpc->reply_mutex);
+			continue;
+		}
+
+		hdr->code = msg->code;
+		memcpy(hdr->buffer, msg->buffer, RPC_PAYLOAD_MAX);
+		memset(reply, 0, sizeof(*reply));
+		rpc->handler(hdr, reply);
+
+		if (msg->type == RPC_MSG_CALL &&
+			rpc_send(rpc, RPC_MSG_REPLY, reply->code, reply->buffer))
+		{
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&rpc->reply_mutex);
+	rpc->dead = 1;
+	pthread_cond_broadcast(&rpc->reply_cond);
+	pthread_mutex_unlock(&rpc->reply_mutex);
+
+	free(reply);
+	free(hdr);
+	free(msg);
+	return NULL;
+}
+
+rpc_t *rpc_alloc(void) {
+	return calloc(1, sizeof(rpc_t));
+}
+
+void rpc_free(rpc_t *rpc) {
+	if (!rpc) {
+		return;
+	}
+
+	pthread_mutex_destroy(&rpc->send_mutex);
+	pthread_mutex_destroy(&rpc->call_mutex);
+	pthread_mutex_destroy(&rpc->reply_mutex);
+	pthread_cond_destroy(&rpc->reply_cond);
+	free(rpc);
+}
+
+int rpc_init(int fd, rpc_handler_t handler, rpc_t *rpc) {
+	if (!rpc || fd < 0 || !handler) {
+		return -1;
+	}
+
+	rpc->fd = fd;
+	rpc->handler = handler;
+	pthread_mutex_init(&rpc->send_mutex, NULL);
+	pthread_mutex_init(&rpc->call_mutex, NULL);
+	pthread_mutex_init(&rpc->reply_mutex, NULL);
+	pthread_cond_init(&rpc->reply_cond, NULL);
+	return 0;
+}
+
+int rpc_start(rpc_t *rpc) {
+	if (pthread_create(&rpc->thread, NULL, rpc_thread_func, rpc)) {
+		return -1;
+	}
+	rpc->started = 1;
+	return 0;
+}
+
+int rpc_join(rpc_t *rpc) {
+	if (!rpc->started) {
+		return -1;
+	}
+	rpc->started = 0;
+	return pthread_join(rpc->thread, NULL) ? -1 : 0;
+}
+
+int rpc_call(rpc_t *rpc, rpc_request_t *req) {
+	int rc = 0;
+
+	pthread_mutex_lock(&rpc->call_mutex);
+
+	pthread_mutex_lock(&rpc->reply_mutex);
+	rpc->reply = &req->reply;
+	rpc->reply_ready = 0;
+	pthread_mutex_unlock(&rpc->reply_mutex);
+
+	if (rpc_send(rpc, RPC_MSG_CALL, req->header.code, req->header.buffer)) {
+		rc = -1;
+	}
+
+	pthread_mutex_lock(&rpc->reply_mutex);
+	while (!rc && !rpc->reply_ready && !rpc->dead) {
+		pthread_cond_wait(&rpc->reply_cond, &rpc->reply_mutex);
+	}
+	if (!rpc->reply_ready) {
+		rc = -1;
+	}
+	rpc->reply = NULL;
+	pthread_mutex_unlock(&rpc->reply_mutex);
+
+	pthread_mutex_unlock(&rpc->call_mutex);
+	return rc;
+}
+
+int rpc_call_noreply(rpc_t *rpc, rpc_request_t *req) {
+	return rpc_send(rpc, RPC_MSG_NOREPLY, req->header.code,
+		req->header.buffer);
+}
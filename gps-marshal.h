@@ -0,0 +1,500 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef __GPS_MARSHAL_H__
+#define __GPS_MARSHAL_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Marshalling of the proxy messages.
+ *
+ * The wire format is the one RPC_PACK and RPC_UNPACK produce: fields back
+ * to back in host byte order, strings with their terminator and raw
+ * blocks after their length. Only the cost is different:
+ *
+ * - The fixed part of a message is checked against the buffer once by
+ *   GPS_MARSHAL_RESERVE. The fields are then stored or loaded through a
+ *   cursor, at offsets the compiler turns into constants.
+ * - Strings and byte arrays are read in place. GPS_UNMARSHAL_S and
+ *   GPS_UNMARSHAL_REF point into the buffer instead of copying out of it.
+ * - Requests are not cleared before they are packed. Only the packed
+ *   bytes are sent, except on the RPC socket fallback, which clears the
+ *   rest of the buffer itself.
+ *
+ * Like the RPC macros, these jump to a fail label if the message does not
+ * fit the buffer.
+ */
+
+/* Reserves @len bytes at @idx and points @p at them */
+#define GPS_MARSHAL_RESERVE(buf, idx, len, p) do { \
+	size_t __len = (len); \
+	if (__len > RPC_PAYLOAD_MAX - (idx)) { \
+		RPC_ERROR("%s: message overflow at %u", __func__, \
+			(unsigned)(idx)); \
+		goto fail; \
+	} \
+	(p) = (buf) + (idx); \
+	(idx) += __len; \
+} while (0)
+
+/* Stores @val at the cursor @p, which must point into reserved space */
+#define GPS_MARSHAL_PUT(p, val) do { \
+	memcpy((p), &(val), sizeof(val)); \
+	(p) += sizeof(val); \
+} while (0)
+
+/* Loads @val from the cursor @p, which must point into reserved space */
+#define GPS_MARSHAL_GET(p, val) do { \
+	memcpy(&(val), (p), sizeof(val)); \
+	(p) += sizeof(val); \
+} while (0)
+
+/* Packs @len bytes of @data */
+#define GPS_MARSHAL_RAW(buf, idx, data, len) do { \
+	char *__p; \
+	GPS_MARSHAL_RESERVE(buf, idx, len, __p); \
+	memcpy(__p, (data), (len)); \
+} while (0)
+
+/* Packs a string with its terminator */
+#define GPS_MARSHAL_S(buf, idx, str) \
+	GPS_MARSHAL_RAW(buf, idx, str, strlen(str) + 1)
+
+/* Points @ptr at @len bytes of the buffer */
+#define GPS_UNMARSHAL_REF(buf, idx, ptr, len) do { \
+	char *__p; \
+	GPS_MARSHAL_RESERVE(buf, idx, len, __p); \
+	(ptr) = (void*)__p; \
+} while (0)
+
+/* Points @str at a string in the buffer, which must be terminated there */
+#define GPS_UNMARSHAL_S(buf, idx, str) do { \
+	size_t __max = RPC_PAYLOAD_MAX - (idx); \
+	size_t __n = strnlen((buf) + (idx), __max); \
+	if (__n == __max) { \
+		RPC_ERROR("%s: unterminated string at %u", __func__, \
+			(unsigned)(idx)); \
+		goto fail; \
+	} \
+	(str) = (buf) + (idx); \
+	(idx) += __n + 1; \
+} while (0)
+
+/******************************************************************************
+ * Generated stubs
+ *****************************************************************************/
+
+/*
+ * For every message in GPS_RPC_CALLS and GPS_RPC_CALLBACKS of gps-rpc.h:
+ *
+ *   gps_pack_<name>(buf, &idx, &arg...)    packs the fixed arguments
+ *   gps_unpack_<name>(buf, &idx, &arg...)  unpacks them
+ *
+ * The arguments are passed by address, in the order of the message
+ * description. Both check the buffer once, advance @idx past the fixed
+ * arguments and return -1 if they do not fit. A tail is left to the
+ * caller. GPS_ARGS_SIZE is the size of the fixed arguments as a constant
+ * expression.
+ *
+ * The types come from hardware/gps.h, which the includer has to include
+ * first.
+ */
+#define GPS_ARG_SIZE(type, name) + sizeof(type)
+#define GPS_ARG_IN(type, name) , const type *name
+#define GPS_ARG_OUT(type, name) , type *name
+#define GPS_ARG_PUT(type, name) \
+	memcpy(p, name, sizeof(type)); \
+	p += sizeof(type);
+#define GPS_ARG_GET(type, name) \
+	memcpy(name, p, sizeof(type)); \
+	p += sizeof(type);
+
+#define GPS_ARGS_SIZE(args) (0 args(GPS_ARG_SIZE))
+
+#define GPS_MARSHAL_STUBS(name, args) \
+static inline int gps_pack_##name(char *buf, size_t *idx \
+	args(GPS_ARG_IN)) \
+{ \
+	char *p; \
+	GPS_MARSHAL_RESERVE(buf, *idx, GPS_ARGS_SIZE(args), p); \
+	args(GPS_ARG_PUT) \
+	(void)p; \
+	return 0; \
+fail: \
+	return -1; \
+} \
+\
+static inline int gps_unpack_##name(char *buf, size_t *idx \
+	args(GPS_ARG_OUT)) \
+{ \
+	char *p; \
+	GPS_MARSHAL_RESERVE(buf, *idx, GPS_ARGS_SIZE(args), p); \
+	args(GPS_ARG_GET) \
+	(void)p; \
+	return 0; \
+fail: \
+	return -1; \
+}
+
+#define GPS_CALL_STUBS(code, name, flags, args) \
+	GPS_MARSHAL_STUBS(name, args)
+#define GPS_CALLBACK_STUBS(code, name, iface, flags, args) \
+	GPS_MARSHAL_STUBS(name, args)
+
+GPS_RPC_CALLS(GPS_CALL_STUBS)
+GPS_RPC_CALLBACKS(GPS_CALLBACK_STUBS)
+
+GPS_MARSHAL_STUBS(proxy_open, GPS_ARGS_OPEN)
+
+#undef GPS_CALL_STUBS
+#undef GPS_CALLBACK_STUBS
+
+/******************************************************************************
+ * Compact encoding
+ *****************************************************************************/
+
+/*
+ * ABI-independent form of the callbacks that otherwise carry raw structs,
+ * used once both sides agreed on GPS_FEATURE_COMPACT. A message is the
+ * 16-bit length of its body, then fixed-width fields in a fixed order:
+ *
+ *   location      flags, [latitude, longitude], [altitude], [speed],
+ *                 [bearing], [accuracy], timestamp; the bracketed fields
+ *                 only if flags marks them valid
+ *   status        status
+ *   agps status   type, status, ipaddr
+ *   ni notify     id, type, notify flags, timeout, default response,
+ *                 requestor id encoding, text encoding, then requestor id,
+ *                 text and extras with their terminators
+ *
+ * The decoders fill in the native struct and clear what was not sent.
+ * They skip anything a newer peer appends to the body.
+ */
+#define GPS_LOCATION_COMPACT_FLAGS (GPS_LOCATION_HAS_LAT_LONG | \
+	GPS_LOCATION_HAS_ALTITUDE | GPS_LOCATION_HAS_SPEED | \
+	GPS_LOCATION_HAS_BEARING | GPS_LOCATION_HAS_ACCURACY)
+
+/* Loads @val from the cursor @p, which must not pass @end */
+#define GPS_COMPACT_GET(p, end, val) do { \
+	if ((size_t)((end) - (p)) < sizeof(val)) { \
+		RPC_ERROR("%s: truncated message", __func__); \
+		goto fail; \
+	} \
+	GPS_MARSHAL_GET(p, val); \
+} while (0)
+
+/* Copies a string at the cursor @p into the array @arr */
+#define GPS_COMPACT_GET_S(p, end, arr) do { \
+	size_t __n = strnlen((p), (end) - (p)); \
+	if (__n == (size_t)((end) - (p)) || __n >= sizeof(arr)) { \
+		RPC_ERROR("%s: bad string", __func__); \
+		goto fail; \
+	} \
+	memcpy((arr), (p), __n + 1); \
+	(p) += __n + 1; \
+} while (0)
+
+/* Stores a string of at most @n bytes and its terminator at the cursor */
+#define GPS_COMPACT_PUT_S(p, str, n) do { \
+	memcpy((p), (str), (n)); \
+	(p)[n] = '\0'; \
+	(p) += (n) + 1; \
+} while (0)
+
+/* Reserves a body of @len bytes after its length */
+#define GPS_COMPACT_BEGIN(buf, idx, len, p) do { \
+	uint16_t __body = (len); \
+	GPS_MARSHAL_RESERVE(buf, idx, sizeof(__body) + __body, p); \
+	GPS_MARSHAL_PUT(p, __body); \
+} while (0)
+
+/* Points @p at the body at @idx and @end past it */
+#define GPS_COMPACT_OPEN(buf, idx, p, end) do { \
+	uint16_t __body; \
+	GPS_MARSHAL_RESERVE(buf, idx, sizeof(__body), p); \
+	GPS_MARSHAL_GET(p, __body); \
+	GPS_MARSHAL_RESERVE(buf, idx, __body, p); \
+	(end) = (p) + __body; \
+} while (0)
+
+static inline int gps_encode_location(char *buf, size_t *idx,
+	const GpsLocation *loc)
+{
+	uint16_t flags = loc->flags & GPS_LOCATION_COMPACT_FLAGS;
+	int64_t timestamp = loc->timestamp;
+	size_t len = sizeof(flags) + sizeof(timestamp);
+	char *p;
+
+	if (flags & GPS_LOCATION_HAS_LAT_LONG) {
+		len += 2 * sizeof(double);
+	}
+	if (flags & GPS_LOCATION_HAS_ALTITUDE) {
+		len += sizeof(double);
+	}
+	if (flags & GPS_LOCATION_HAS_SPEED) {
+		len += sizeof(float);
+	}
+	if (flags & GPS_LOCATION_HAS_BEARING) {
+		len += sizeof(float);
+	}
+	if (flags & GPS_LOCATION_HAS_ACCURACY) {
+		len += sizeof(float);
+	}
+
+	GPS_COMPACT_BEGIN(buf, *idx, len, p);
+	GPS_MARSHAL_PUT(p, flags);
+	if (flags & GPS_LOCATION_HAS_LAT_LONG) {
+		GPS_MARSHAL_PUT(p, loc->latitude);
+		GPS_MARSHAL_PUT(p, loc->longitude);
+	}
+	if (flags & GPS_LOCATION_HAS_ALTITUDE) {
+		GPS_MARSHAL_PUT(p, loc->altitude);
+	}
+	if (flags & GPS_LOCATION_HAS_SPEED) {
+		GPS_MARSHAL_PUT(p, loc->speed);
+	}
+	if (flags & GPS_LOCATION_HAS_BEARING) {
+		GPS_MARSHAL_PUT(p, loc->bearing);
+	}
+	if (flags & GPS_LOCATION_HAS_ACCURACY) {
+		GPS_MARSHAL_PUT(p, loc->accuracy);
+	}
+	GPS_MARSHAL_PUT(p, timestamp);
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_decode_location(char *buf, size_t *idx,
+	GpsLocation *loc)
+{
+	uint16_t flags;
+	int64_t timestamp;
+	char *p;
+	char *end;
+
+	GPS_COMPACT_OPEN(buf, *idx, p, end);
+	memset(loc, 0, sizeof(*loc));
+	loc->size = sizeof(*loc);
+
+	GPS_COMPACT_GET(p, end, flags);
+	if (flags & GPS_LOCATION_HAS_LAT_LONG) {
+		GPS_COMPACT_GET(p, end, loc->latitude);
+		GPS_COMPACT_GET(p, end, loc->longitude);
+	}
+	if (flags & GPS_LOCATION_HAS_ALTITUDE) {
+		GPS_COMPACT_GET(p, end, loc->altitude);
+	}
+	if (flags & GPS_LOCATION_HAS_SPEED) {
+		GPS_COMPACT_GET(p, end, loc->speed);
+	}
+	if (flags & GPS_LOCATION_HAS_BEARING) {
+		GPS_COMPACT_GET(p, end, loc->bearing);
+	}
+	if (flags & GPS_LOCATION_HAS_ACCURACY) {
+		GPS_COMPACT_GET(p, end, loc->accuracy);
+	}
+	GPS_COMPACT_GET(p, end, timestamp);
+
+	loc->flags = flags;
+	loc->timestamp = timestamp;
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_encode_status(char *buf, size_t *idx,
+	const GpsStatus *status)
+{
+	uint16_t value = status->status;
+	char *p;
+
+	GPS_COMPACT_BEGIN(buf, *idx, sizeof(value), p);
+	GPS_MARSHAL_PUT(p, value);
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_decode_status(char *buf, size_t *idx,
+	GpsStatus *status)
+{
+	uint16_t value;
+	char *p;
+	char *end;
+
+	GPS_COMPACT_OPEN(buf, *idx, p, end);
+	GPS_COMPACT_GET(p, end, value);
+
+	memset(status, 0, sizeof(*status));
+	status->size = sizeof(*status);
+	status->status = value;
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_encode_agps_status(char *buf, size_t *idx,
+	const AGpsStatus *status)
+{
+	uint16_t type = status->type;
+	uint16_t value = status->status;
+	uint32_t ipaddr = status->ipaddr;
+	char *p;
+
+	GPS_COMPACT_BEGIN(buf, *idx, sizeof(type) + sizeof(value) +
+		sizeof(ipaddr), p);
+	GPS_MARSHAL_PUT(p, type);
+	GPS_MARSHAL_PUT(p, value);
+	GPS_MARSHAL_PUT(p, ipaddr);
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_decode_agps_status(char *buf, size_t *idx,
+	AGpsStatus *status)
+{
+	uint16_t type;
+	uint16_t value;
+	uint32_t ipaddr;
+	char *p;
+	char *end;
+
+	GPS_COMPACT_OPEN(buf, *idx, p, end);
+	GPS_COMPACT_GET(p, end, type);
+	GPS_COMPACT_GET(p, end, value);
+	GPS_COMPACT_GET(p, end, ipaddr);
+
+	memset(status, 0, sizeof(*status));
+	status->size = sizeof(*status);
+	status->type = type;
+	status->status = value;
+	status->ipaddr = ipaddr;
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_encode_ni_notify(char *buf, size_t *idx,
+	const GpsNiNotification *nfy)
+{
+	int32_t fields[7] = {
+		nfy->notification_id,
+		nfy->ni_type,
+		nfy->notify_flags,
+		nfy->timeout,
+		nfy->default_response,
+		nfy->requestor_id_encoding,
+		nfy->text_encoding,
+	};
+	size_t requestor_id = strnlen(nfy->requestor_id,
+		sizeof(nfy->requestor_id) - 1);
+	size_t text = strnlen(nfy->text, sizeof(nfy->text) - 1);
+	size_t extras = strnlen(nfy->extras, sizeof(nfy->extras) - 1);
+	size_t len = sizeof(fields) + requestor_id + text + extras + 3;
+	char *p;
+
+	GPS_COMPACT_BEGIN(buf, *idx, len, p);
+	GPS_MARSHAL_PUT(p, fields);
+	GPS_COMPACT_PUT_S(p, nfy->requestor_id, requestor_id);
+	GPS_COMPACT_PUT_S(p, nfy->text, text);
+	GPS_COMPACT_PUT_S(p, nfy->extras, extras);
+	return 0;
+
+fail:
+	return -1;
+}
+
+static inline int gps_decode_ni_notify(char *buf, size_t *idx,
+	GpsNiNotification *nfy)
+{
+	int32_t fields[7];
+	char *p;
+	char *end;
+
+	GPS_COMPACT_OPEN(buf, *idx, p, end);
+	GPS_COMPACT_GET(p, end, fields);
+
+	memset(nfy, 0, sizeof(*nfy));
+	nfy->size = sizeof(*nfy);
+	nfy->notification_id = fields[0];
+	nfy->ni_type = fields[1];
+	nfy->notify_flags = fields[2];
+	nfy->timeout = fields[3];
+	nfy->default_response = fields[4];
+	nfy->requestor_id_encoding = fields[5];
+	nfy->text_encoding = fields[6];
+	GPS_COMPACT_GET_S(p, end, nfy->requestor_id);
+	GPS_COMPACT_GET_S(p, end, nfy->text);
+	GPS_COMPACT_GET_S(p, end, nfy->extras);
+	return 0;
+
+fail:
+	return -1;
+}
+
+/******************************************************************************
+ * Protocol negotiation
+ *****************************************************************************/
+
+/**
+ * Fills @open with this side of the handshake: the magic, the version,
+ * @features and the sizes of the raw structs as built here.
+ */
+static inline void gps_proxy_open_init(struct gps_proxy_open *open,
+	uint32_t features, int32_t pid)
+{
+	memset(open, 0, sizeof(*open));
+	open->magic = GPS_PROTOCOL_MAGIC;
+	open->version = GPS_PROTOCOL_VERSION;
+	open->features = features;
+	open->pid = pid;
+
+	#define GPS_ABI_INIT(type, name) open->sz_##name = sizeof(type);
+	GPS_ABI_TYPES(GPS_ABI_INIT)
+	#undef GPS_ABI_INIT
+}
+
+/**
+ * Returns nonzero if the peer lays out the raw structs like this side.
+ */
+static inline int gps_proxy_open_abi_match(const struct gps_proxy_open *peer)
+{
+	int match = 1;
+
+	#define GPS_ABI_CHECK(type, name) \
+		match &= peer->sz_##name == sizeof(type);
+	GPS_ABI_TYPES(GPS_ABI_CHECK)
+	#undef GPS_ABI_CHECK
+
+	return match;
+}
+
+#endif //__GPS_MARSHAL_H__
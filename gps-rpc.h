@@ -21,126 +21,327 @@
 #ifndef __GPS_RPC_H__
 #define __GPS_RPC_H__
 
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #define GPS_RPC_SOCKET_NAME "gps-rpc-socket"
-#define GPS_SOCKET_RETRY_COUNT 5
+#define GPS_CB_SOCKET_NAME "gps-rpc-cb-socket"
+
+/* largest XTRA file the daemon accepts through the chunked fallback */
+#define GPS_XTRA_MAX_SIZE (1024 * 1024)
+
+#define CHECK_CLOSE(fd) \
+do {\
+	if (fd >= 0) {\
+		close(fd); \
+		fd = -1;\
+	}\
+} while (0)
+
+/******************************************************************************
+ * Protocol description
+ *****************************************************************************/
+
+/*
+ * Every message code, in wire order. New codes go at the end, before
+ * GPS_RPC_MAX, so that older peers keep their numbering.
+ */
+#define GPS_RPC_CODES(X) \
+	/* reserved for debugging */ \
+	X(GPS_PROXY_NOP) \
+	X(GPS_PROXY_OPEN) \
+	/* XTRA Interface */ \
+	X(GPS_PROXY_XTRA_INIT) \
+	X(GPS_PROXY_XTRA_INJECT_XTRA_DATA) \
+	/* AGPS Interface */ \
+	X(GPS_PROXY_AGPS_INIT) \
+	X(GPS_PROXY_AGPS_DATA_CONN_OPEN) \
+	X(GPS_PROXY_AGPS_DATA_CONN_CLOSED) \
+	X(GPS_PROXY_AGPS_DATA_CONN_FAILED) \
+	X(GPS_PROXY_AGPS_AGPS_SET_SERVER) \
+	/* NI Interface */ \
+	X(GPS_PROXY_NI_INIT) \
+	X(GPS_PROXY_NI_RESPOND) \
+	/* GPS Interface */ \
+	X(GPS_PROXY_GPS_INIT) \
+	X(GPS_PROXY_GPS_START) \
+	X(GPS_PROXY_GPS_STOP) \
+	X(GPS_PROXY_GPS_CLEANUP) \
+	X(GPS_PROXY_GPS_INJECT_TIME) \
+	X(GPS_PROXY_GPS_INJECT_LOCATION) \
+	X(GPS_PROXY_GPS_DELETE_AIDING_DATA) \
+	X(GPS_PROXY_GPS_SET_POSITION_MODE) \
+	X(GPS_PROXY_GPS_GET_EXTENSION) \
+	/* GPS Callbacks */ \
+	X(GPS_LOC_CB) \
+	X(GPS_STATUS_CB) \
+	X(GPS_SV_STATUS_CB) \
+	X(GPS_NMEA_CB) \
+	X(GPS_SET_CAPABILITIES_CB) \
+	X(GPS_ACQUIRE_LOCK_CB) \
+	X(GPS_RELEASE_LOCK_CB) \
+	X(GPS_CREATE_THREAD_CB) \
+	X(GPS_REQUEST_UTC_TIME_CB) \
+	/* XTRA Callbacks */ \
+	X(XTRA_REQUEST_CB) \
+	X(XTRA_CREATE_THREAD_CB) \
+	/* AGPS Callbacks */ \
+	X(AGPS_STATUS_CB) \
+	X(AGPS_CREATE_THREAD_CB) \
+	/* NI Callbacks */ \
+	X(NI_NOTIFY_CB) \
+	X(NI_CREATE_THREAD_CB) \
+	/* RIL Callbacks */ \
+	X(RIL_SET_ID_CB) \
+	X(RIL_REF_LOC_CB) \
+	X(RIL_CREATE_THREAD_CB) \
+	X(RIL_INIT) \
+	X(RIL_SET_REF_LOC) \
+	X(RIL_SET_SET_ID) \
+	X(RIL_NI_MSG) \
+	X(RIL_UPDATE_NET_STATE) \
+	X(RIL_UPDATE_NET_AVAILABILITY) \
+	/* Callback channel */ \
+	X(GPS_PROXY_CB_ATTACH) \
+	X(GPS_PROXY_XTRA_INJECT_XTRA_FD) \
+	X(GPS_PROXY_XTRA_INJECT_XTRA_CHUNK) \
+	/* Location, SV status and NMEA of one fix epoch */ \
+	X(GPS_EPOCH_CB) \
+	/* SV status encoded against the previously sent table */ \
+	X(GPS_SV_DELTA_CB) \
+	/* Result of a call made over the callback channel */ \
+	X(GPS_PROXY_REPLY) \
+	/* Library side stages of a time to first fix */ \
+	X(GPS_PROXY_TTFF_REPORT) \
+	/* Compact encodings of the callbacks that carry raw structs */ \
+	X(GPS_LOC_COMPACT_CB) \
+	X(GPS_STATUS_COMPACT_CB) \
+	X(AGPS_STATUS_COMPACT_CB) \
+	X(NI_NOTIFY_COMPACT_CB)
+
+/*
+ * Fixed arguments of the messages, in wire order, as F(type, name). They
+ * are packed back to back in host byte order. A string or byte array that
+ * follows them is marked GPS_RPC_TAIL in the message table and is packed
+ * by hand after them.
+ */
+#define GPS_ARGS_NONE(F)
+
+#define GPS_ARGS_XTRA_DATA(F) \
+	F(int, length)
+
+#define GPS_ARGS_XTRA_CHUNK(F) \
+	F(int, total) \
+	F(int, offset) \
+	F(int, length)
+
+#define GPS_ARGS_SET_SERVER(F) \
+	F(AGpsType, type) \
+	F(int, port)
+
+#define GPS_ARGS_NI_RESPOND(F) \
+	F(int, notif_id) \
+	F(GpsUserResponseType, user_response)
+
+#define GPS_ARGS_INJECT_TIME(F) \
+	F(GpsUtcTime, time) \
+	F(int64_t, time_reference) \
+	F(int, uncertainty)
+
+#define GPS_ARGS_INJECT_LOCATION(F) \
+	F(double, latitude) \
+	F(double, longitude) \
+	F(float, accuracy)
+
+#define GPS_ARGS_DELETE_AIDING_DATA(F) \
+	F(GpsAidingData, flags)
+
+#define GPS_ARGS_SET_POSITION_MODE(F) \
+	F(GpsPositionMode, mode) \
+	F(GpsPositionRecurrence, recurrence) \
+	F(uint32_t, min_interval) \
+	F(uint32_t, preferred_accuracy) \
+	F(uint32_t, preferred_time)
+
+#define GPS_ARGS_TTFF_REPORT(F) \
+	F(struct gps_ttff_report, report)
+
+/* sizes go on the wire as 32 bits, size_t differs between the ABIs */
+#define GPS_ARGS_SET_REF_LOC(F) \
+	F(uint32_t, sz_struct)
+
+#define GPS_ARGS_SET_SET_ID(F) \
+	F(AGpsSetIDType, type)
+
+#define GPS_ARGS_NI_MSG(F) \
+	F(uint32_t, len)
+
+#define GPS_ARGS_NET_STATE(F) \
+	F(int, connected) \
+	F(int, type) \
+	F(int, roaming)
+
+#define GPS_ARGS_NET_AVAILABILITY(F) \
+	F(int, available)
+
+#define GPS_ARGS_LOCATION(F) \
+	F(GpsLocation, location)
+
+#define GPS_ARGS_STATUS(F) \
+	F(GpsStatus, status)
+
+#define GPS_ARGS_SV_STATUS(F) \
+	F(GpsSvStatus, sv_status)
+
+#define GPS_ARGS_SV_DELTA(F) \
+	F(struct gps_sv_delta, delta)
+
+#define GPS_ARGS_NMEA(F) \
+	F(GpsUtcTime, timestamp) \
+	F(int, length)
+
+#define GPS_ARGS_FLAGS(F) \
+	F(uint32_t, flags)
+
+#define GPS_ARGS_AGPS_STATUS(F) \
+	F(AGpsStatus, status)
+
+#define GPS_ARGS_NI_NOTIFY(F) \
+	F(GpsNiNotification, notification)
+
+#define GPS_ARGS_OPEN(F) \
+	F(struct gps_proxy_open, open)
+
+#define GPS_ARGS_COMPACT(F) \
+	F(uint16_t, length)
+
+/* message flags */
+/* the daemon returns the result in the reply */
+#define GPS_RPC_RESULT (1 << 0)
+/* a string or byte array follows the fixed arguments */
+#define GPS_RPC_TAIL (1 << 1)
+/* the fixed argument is the length of the compact encoding after it */
+#define GPS_RPC_COMPACT (1 << 2)
+
+/*
+ * Calls from the library to the daemon, as X(code, name, flags, args).
+ * The daemon serves each with gps_srv_<name>, both sides marshal the
+ * fixed arguments with the gps_pack_<name> and gps_unpack_<name> stubs
+ * that gps-marshal.h generates.
+ */
+#define GPS_RPC_CALLS(X) \
+	X(GPS_PROXY_XTRA_INIT, xtra_init, GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_XTRA_INJECT_XTRA_DATA, xtra_inject_data, \
+		GPS_RPC_RESULT | GPS_RPC_TAIL, GPS_ARGS_XTRA_DATA) \
+	X(GPS_PROXY_XTRA_INJECT_XTRA_CHUNK, xtra_inject_chunk, \
+		GPS_RPC_RESULT | GPS_RPC_TAIL, GPS_ARGS_XTRA_CHUNK) \
+	X(GPS_PROXY_AGPS_INIT, agps_init, 0, GPS_ARGS_NONE) \
+	X(GPS_PROXY_AGPS_DATA_CONN_OPEN, agps_data_conn_open, \
+		GPS_RPC_RESULT | GPS_RPC_TAIL, GPS_ARGS_NONE) \
+	X(GPS_PROXY_AGPS_DATA_CONN_CLOSED, agps_data_conn_closed, \
+		GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_AGPS_DATA_CONN_FAILED, agps_data_conn_failed, \
+		GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_AGPS_AGPS_SET_SERVER, agps_set_server, \
+		GPS_RPC_RESULT | GPS_RPC_TAIL, GPS_ARGS_SET_SERVER) \
+	X(GPS_PROXY_NI_INIT, ni_init, 0, GPS_ARGS_NONE) \
+	X(GPS_PROXY_NI_RESPOND, ni_respond, 0, GPS_ARGS_NI_RESPOND) \
+	X(GPS_PROXY_GPS_INIT, gps_init, GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_GPS_START, gps_start, GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_GPS_STOP, gps_stop, GPS_RPC_RESULT, GPS_ARGS_NONE) \
+	X(GPS_PROXY_GPS_CLEANUP, gps_cleanup, 0, GPS_ARGS_NONE) \
+	X(GPS_PROXY_GPS_INJECT_TIME, gps_inject_time, GPS_RPC_RESULT, \
+		GPS_ARGS_INJECT_TIME) \
+	X(GPS_PROXY_GPS_INJECT_LOCATION, gps_inject_location, GPS_RPC_RESULT, \
+		GPS_ARGS_INJECT_LOCATION) \
+	X(GPS_PROXY_GPS_DELETE_AIDING_DATA, gps_delete_aiding_data, 0, \
+		GPS_ARGS_DELETE_AIDING_DATA) \
+	X(GPS_PROXY_GPS_SET_POSITION_MODE, gps_set_position_mode, \
+		GPS_RPC_RESULT, GPS_ARGS_SET_POSITION_MODE) \
+	X(GPS_PROXY_TTFF_REPORT, ttff_report, 0, GPS_ARGS_TTFF_REPORT) \
+	X(RIL_INIT, ril_init, 0, GPS_ARGS_NONE) \
+	X(RIL_SET_REF_LOC, ril_set_ref_location, GPS_RPC_TAIL, \
+		GPS_ARGS_SET_REF_LOC) \
+	X(RIL_SET_SET_ID, ril_set_set_id, GPS_RPC_TAIL, GPS_ARGS_SET_SET_ID) \
+	X(RIL_NI_MSG, ril_ni_message, GPS_RPC_TAIL, GPS_ARGS_NI_MSG) \
+	X(RIL_UPDATE_NET_STATE, ril_update_network_state, GPS_RPC_TAIL, \
+		GPS_ARGS_NET_STATE) \
+	X(RIL_UPDATE_NET_AVAILABILITY, ril_update_network_availability, \
+		GPS_RPC_TAIL, GPS_ARGS_NET_AVAILABILITY)
+
+/* interfaces of the library that callbacks are delivered to */
+enum gps_rpc_iface {
+	GPS_IFACE_GPS,
+	GPS_IFACE_XTRA,
+	GPS_IFACE_AGPS,
+	GPS_IFACE_NI,
+	GPS_IFACE_RIL,
+
+	GPS_IFACE_MAX,
+};
+
+/*
+ * Callbacks from the daemon to the library, as
+ * X(code, name, iface, flags, args). The library runs each on the thread
+ * of its interface with gps_cb_<name>.
+ */
+#define GPS_RPC_CALLBACKS(X) \
+	X(GPS_LOC_CB, location, GPS_IFACE_GPS, 0, GPS_ARGS_LOCATION) \
+	X(GPS_STATUS_CB, status, GPS_IFACE_GPS, 0, GPS_ARGS_STATUS) \
+	X(GPS_SV_STATUS_CB, sv_status, GPS_IFACE_GPS, 0, GPS_ARGS_SV_STATUS) \
+	X(GPS_SV_DELTA_CB, sv_delta, GPS_IFACE_GPS, GPS_RPC_TAIL, \
+		GPS_ARGS_SV_DELTA) \
+	X(GPS_NMEA_CB, nmea, GPS_IFACE_GPS, GPS_RPC_TAIL, GPS_ARGS_NMEA) \
+	X(GPS_SET_CAPABILITIES_CB, set_capabilities, GPS_IFACE_GPS, 0, \
+		GPS_ARGS_FLAGS) \
+	X(GPS_ACQUIRE_LOCK_CB, acquire_wakelock, GPS_IFACE_GPS, 0, \
+		GPS_ARGS_NONE) \
+	X(GPS_RELEASE_LOCK_CB, release_wakelock, GPS_IFACE_GPS, 0, \
+		GPS_ARGS_NONE) \
+	X(GPS_REQUEST_UTC_TIME_CB, request_utc_time, GPS_IFACE_GPS, 0, \
+		GPS_ARGS_NONE) \
+	X(XTRA_REQUEST_CB, xtra_download_request, GPS_IFACE_XTRA, 0, \
+		GPS_ARGS_NONE) \
+	X(AGPS_STATUS_CB, agps_status, GPS_IFACE_AGPS, 0, GPS_ARGS_AGPS_STATUS) \
+	X(NI_NOTIFY_CB, ni_notify, GPS_IFACE_NI, 0, GPS_ARGS_NI_NOTIFY) \
+	X(RIL_SET_ID_CB, ril_request_set_id, GPS_IFACE_RIL, 0, GPS_ARGS_FLAGS) \
+	X(RIL_REF_LOC_CB, ril_request_ref_loc, GPS_IFACE_RIL, 0, GPS_ARGS_FLAGS) \
+	X(GPS_LOC_COMPACT_CB, location_compact, GPS_IFACE_GPS, \
+		GPS_RPC_COMPACT, GPS_ARGS_COMPACT) \
+	X(GPS_STATUS_COMPACT_CB, status_compact, GPS_IFACE_GPS, \
+		GPS_RPC_COMPACT, GPS_ARGS_COMPACT) \
+	X(AGPS_STATUS_COMPACT_CB, agps_status_compact, GPS_IFACE_AGPS, \
+		GPS_RPC_COMPACT, GPS_ARGS_COMPACT) \
+	X(NI_NOTIFY_COMPACT_CB, ni_notify_compact, GPS_IFACE_NI, \
+		GPS_RPC_COMPACT, GPS_ARGS_COMPACT)
+
+/*
+ * Callbacks that ask the library to start the thread of an interface, as
+ * X(code, iface).
+ */
+#define GPS_RPC_THREAD_CALLBACKS(X) \
+	X(GPS_CREATE_THREAD_CB, GPS_IFACE_GPS) \
+	X(XTRA_CREATE_THREAD_CB, GPS_IFACE_XTRA) \
+	X(AGPS_CREATE_THREAD_CB, GPS_IFACE_AGPS) \
+	X(NI_CREATE_THREAD_CB, GPS_IFACE_NI) \
+	X(RIL_CREATE_THREAD_CB, GPS_IFACE_RIL)
 
 enum gps_rpc_code {
-	/* reserved for debugging */
-	GPS_PROXY_NOP,
-
-	GPS_PROXY_OPEN,
-
-	/* XTRA Interface */
-	GPS_PROXY_XTRA_INIT,
-	GPS_PROXY_XTRA_INJECT_XTRA_DATA,
-
-	/* AGPS Interface */
-	GPS_PROXY_AGPS_INIT,
-	GPS_PROXY_AGPS_DATA_CONN_OPEN,
-	GPS_PROXY_AGPS_DATA_CONN_CLOSED,
-	GPS_PROXY_AGPS_DATA_CONN_FAILED,
-	GPS_PROXY_AGPS_AGPS_SET_SERVER,
-
-	/* NI Interface */
-	GPS_PROXY_NI_INIT,
-	GPS_PROXY_NI_RESPOND,
-
-	/* GPS Interface */
-	GPS_PROXY_GPS_INIT,
-	GPS_PROXY_GPS_START,
-	GPS_PROXY_GPS_STOP,
-	GPS_PROXY_GPS_CLEANUP,
-	GPS_PROXY_GPS_INJECT_TIME,
-	GPS_PROXY_GPS_INJECT_LOCATION,
-	GPS_PROXY_GPS_DELETE_AIDING_DATA,
-	GPS_PROXY_GPS_SET_POSITION_MODE,
-	GPS_PROXY_GPS_GET_EXTENSION,
-
-	/* GPS Callbacks */
-	GPS_LOC_CB,
-	GPS_STATUS_CB,
-	GPS_SV_STATUS_CB,
-	GPS_NMEA_CB,
-	GPS_SET_CAPABILITIES_CB,
-	GPS_ACQUIRE_LOCK_CB,
-	GPS_RELEASE_LOCK_CB,
-	GPS_CREATE_THREAD_CB,
-	GPS_REQUEST_UTC_TIME_CB,
-
-	/* XTRA Callbacks */
-	XTRA_REQUEST_CB,
-	XTRA_CREATE_THREAD_CB,
-
-	/* AGPS Callbacks */
-	AGPS_STATUS_CB,
-	AGPS_CREATE_THREAD_CB,
-
-	/* NI Callbacks */
-	NI_NOTIFY_CB,
-	NI_CREATE_THREAD_CB,
-
-	/* RIL Callbacks */
-	RIL_SET_ID_CB,
-	RIL_REF_LOC_CB,
-	RIL_CREATE_THREAD_CB,
-	RIL_INIT,
-	RIL_SET_REF_LOC,
-	RIL_SET_SET_ID,
-	RIL_NI_MSG,
-	RIL_UPDATE_NET_STATE,
-	RIL_UPDATE_NET_AVAILABILITY,
-	
+	#define GPS_RPC_ENUM(code) code,
+	GPS_RPC_CODES(GPS_RPC_ENUM)
+	#undef GPS_RPC_ENUM
+
 	GPS_RPC_MAX,
 };
 
-
 static inline char* gps_rpc_to_s(enum gps_rpc_code code) {
-	#define TT_ENTRY(x) [x] = #x
-	char *ttbl[GPS_RPC_MAX] = {
-		TT_ENTRY(GPS_PROXY_NOP),
-		TT_ENTRY(GPS_PROXY_OPEN),
-		TT_ENTRY(GPS_PROXY_XTRA_INIT),
-		TT_ENTRY(GPS_PROXY_XTRA_INJECT_XTRA_DATA),
-		TT_ENTRY(GPS_PROXY_AGPS_INIT),
-		TT_ENTRY(GPS_PROXY_AGPS_DATA_CONN_OPEN),
-		TT_ENTRY(GPS_PROXY_AGPS_DATA_CONN_CLOSED),
-		TT_ENTRY(GPS_PROXY_AGPS_DATA_CONN_FAILED),
-		TT_ENTRY(GPS_PROXY_AGPS_AGPS_SET_SERVER),
-		TT_ENTRY(GPS_PROXY_NI_INIT),
-		TT_ENTRY(GPS_PROXY_NI_RESPOND),
-		TT_ENTRY(GPS_PROXY_GPS_INIT),
-		TT_ENTRY(GPS_PROXY_GPS_START),
-		TT_ENTRY(GPS_PROXY_GPS_STOP),
-		TT_ENTRY(GPS_PROXY_GPS_CLEANUP),
-		TT_ENTRY(GPS_PROXY_GPS_INJECT_TIME),
-		TT_ENTRY(GPS_PROXY_GPS_INJECT_LOCATION),
-		TT_ENTRY(GPS_PROXY_GPS_DELETE_AIDING_DATA),
-		TT_ENTRY(GPS_PROXY_GPS_SET_POSITION_MODE),
-		TT_ENTRY(GPS_PROXY_GPS_GET_EXTENSION),
-		TT_ENTRY(GPS_LOC_CB),
-		TT_ENTRY(GPS_STATUS_CB),
-		TT_ENTRY(GPS_SV_STATUS_CB),
-		TT_ENTRY(GPS_NMEA_CB),
-		TT_ENTRY(GPS_SET_CAPABILITIES_CB),
-		TT_ENTRY(GPS_ACQUIRE_LOCK_CB),
-		TT_ENTRY(GPS_RELEASE_LOCK_CB),
-		TT_ENTRY(GPS_CREATE_THREAD_CB),
-		TT_ENTRY(GPS_REQUEST_UTC_TIME_CB),
-		TT_ENTRY(XTRA_REQUEST_CB),
-		TT_ENTRY(XTRA_CREATE_THREAD_CB),
-		TT_ENTRY(AGPS_STATUS_CB),
-		TT_ENTRY(AGPS_CREATE_THREAD_CB),
-		TT_ENTRY(NI_NOTIFY_CB),
-		TT_ENTRY(NI_CREATE_THREAD_CB),
-		TT_ENTRY(RIL_SET_ID_CB),
-		TT_ENTRY(RIL_REF_LOC_CB),
-		TT_ENTRY(RIL_CREATE_THREAD_CB),
-		TT_ENTRY(RIL_INIT),
-		TT_ENTRY(RIL_SET_REF_LOC),
-		TT_ENTRY(RIL_SET_SET_ID),
-		TT_ENTRY(RIL_NI_MSG),
-		TT_ENTRY(RIL_UPDATE_NET_STATE),
-		TT_ENTRY(RIL_UPDATE_NET_AVAILABILITY),
+	#define TT_ENTRY(x) [x] = #x,
+	static char *const ttbl[GPS_RPC_MAX] = {
+		GPS_RPC_CODES(TT_ENTRY)
 	};
 	#undef TT_ENTRY
 
@@ -150,4 +351,306 @@ static inline char* gps_rpc_to_s(enum gps_rpc_code code) {
 	return ttbl[code];
 }
 
+/******************************************************************************
+ * Protocol negotiation
+ *****************************************************************************/
+
+/*
+ * The library sends a struct gps_proxy_open with GPS_PROXY_OPEN on the RPC
+ * socket before any other call, with the features it supports and the
+ * sizes of the structs it sends raw. The daemon replies with rc 0 followed
+ * by its own struct gps_proxy_open that carries the features both sides
+ * support. A peer that predates the handshake, or a reply without the
+ * magic, means GPS_FEATURES_LEGACY.
+ */
+#define GPS_PROTOCOL_MAGIC 0x4750504f
+#define GPS_PROTOCOL_VERSION 1
+
+/* calls and callbacks over a callback channel */
+#define GPS_FEATURE_CB_CHANNEL (1 << 0)
+/* callbacks through a shared memory ring instead of channel frames */
+#define GPS_FEATURE_SHM (1 << 1)
+/* location, SV status and NMEA of a fix bundled into GPS_EPOCH_CB */
+#define GPS_FEATURE_EPOCH (1 << 2)
+/* SV status sent as GPS_SV_DELTA_CB */
+#define GPS_FEATURE_SV_DELTA (1 << 3)
+/* XTRA data passed as a file descriptor */
+#define GPS_FEATURE_XTRA_FD (1 << 4)
+/* locations, status and NI notifications in their compact encoding */
+#define GPS_FEATURE_COMPACT (1 << 5)
+
+/*
+ * A peer without the handshake speaks the original protocol: every call
+ * and callback on the RPC socket, one plain code per callback.
+ */
+#define GPS_FEATURES_LEGACY 0
+
+#define GPS_FEATURES_ALL (GPS_FEATURE_CB_CHANNEL | GPS_FEATURE_SHM | \
+	GPS_FEATURE_EPOCH | GPS_FEATURE_SV_DELTA | GPS_FEATURE_XTRA_FD | \
+	GPS_FEATURE_COMPACT)
+
+/* structs that cross the wire as they are laid out in memory */
+#define GPS_ABI_TYPES(X) \
+	X(GpsLocation, location) \
+	X(GpsStatus, status) \
+	X(GpsSvStatus, sv_status) \
+	X(AGpsStatus, agps_status) \
+	X(GpsNiNotification, ni_notification) \
+	X(AGpsRefLocation, ref_location)
+
+struct gps_proxy_open {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t features;
+	int32_t pid;
+
+	#define GPS_ABI_FIELD(type, name) uint32_t sz_##name;
+	GPS_ABI_TYPES(GPS_ABI_FIELD)
+	#undef GPS_ABI_FIELD
+};
+
+/******************************************************************************
+ * Calls over the callback channel
+ *****************************************************************************/
+
+/*
+ * A call frame carries the arguments followed by a 32-bit call id. Calls
+ * with GPS_CALL_ONEWAY set in the id get no reply of their own. The daemon
+ * acknowledges them lazily: every GPS_PROXY_REPLY carries the number of
+ * one-way calls processed so far, and a reply with id 0 is sent after
+ * every GPS_ONEWAY_ACK_BATCH of them.
+ */
+#define GPS_CALL_ONEWAY 0x80000000
+#define GPS_ONEWAY_ACK_BATCH 8
+#define GPS_ONEWAY_WINDOW 64
+
+struct gps_call_reply {
+	uint32_t id;
+	int32_t rc;
+	uint32_t oneway_done;
+};
+
+/******************************************************************************
+ * Callback tracing
+ *****************************************************************************/
+
+/*
+ * Appended by the daemon after the payload of every callback it sends,
+ * when there is room. CLOCK_MONOTONIC in microseconds: when the blob
+ * made the callback and when it was written to the client. The records
+ * inside a GPS_EPOCH_CB only carry their origin, the epoch itself only
+ * the time it was sent.
+ */
+struct gps_cb_trace {
+	uint64_t origin_us;
+	uint64_t sent_us;
+};
+
+/******************************************************************************
+ * Time to first fix
+ *****************************************************************************/
+
+/*
+ * Sent by the library after the first location following gps_start has
+ * been handed to location_cb. Both stamps are CLOCK_BOOTTIME in
+ * microseconds, the daemon adds its own stages in between.
+ */
+struct gps_ttff_report {
+	uint64_t start_us;
+	uint64_t fix_us;
+};
+
+/******************************************************************************
+ * SV status delta encoding
+ *****************************************************************************/
+
+/*
+ * GPS_SV_DELTA_CB carries this header followed by one record per slot set
+ * in @changed: a byte of GPS_SV_FIELD_* bits and then the changed fields
+ * (int prn, float snr, float elevation, float azimuth) in that order.
+ * A keyframe has every slot below num_svs marked with all fields, and
+ * resets the table of the receiver. A delta is applied only if its @seq
+ * directly follows the last one applied, otherwise the receiver waits for
+ * the next keyframe.
+ */
+#define GPS_SV_KEYFRAME_INTERVAL 10
+
+#define GPS_SV_FIELD_PRN (1 << 0)
+#define GPS_SV_FIELD_SNR (1 << 1)
+#define GPS_SV_FIELD_ELEVATION (1 << 2)
+#define GPS_SV_FIELD_AZIMUTH (1 << 3)
+#define GPS_SV_FIELD_ALL 0xf
+
+#define GPS_SV_DELTA_KEYFRAME (1 << 0)
+
+struct gps_sv_delta {
+	uint32_t seq;
+	uint32_t flags;
+	int32_t num_svs;
+	uint32_t ephemeris_mask;
+	uint32_t almanac_mask;
+	uint32_t used_in_fix_mask;
+	uint64_t changed;
+};
+
+/**
+ * Returns the encoded size of a delta, or 0 if it does not fit in @len.
+ */
+static inline size_t gps_sv_delta_size(const char *buf, size_t len) {
+	struct gps_sv_delta delta;
+	size_t idx = sizeof(delta);
+	int i;
+
+	if (len < sizeof(delta)) {
+		return 0;
+	}
+	memcpy(&delta, buf, sizeof(delta));
+
+	for (i = 0; i < 64; i++) {
+		uint8_t fields;
+
+		if (!(delta.changed & (1ULL << i))) {
+			continue;
+		}
+
+		if (idx + 1 > len) {
+			return 0;
+		}
+		fields = buf[idx];
+		idx += 1 + 4 * __builtin_popcount(fields & GPS_SV_FIELD_ALL);
+	}
+
+	return idx <= len ? idx : 0;
+}
+
+/******************************************************************************
+ * Length-prefixed framing
+ *****************************************************************************/
+
+/*
+ * Frame header used on the callback channel socket. Only the used part of
+ * the payload follows the header, instead of the whole RPC_PAYLOAD_MAX
+ * buffer of rpc_request_hdr_t.
+ */
+struct gps_rpc_frame {
+	uint32_t code;
+	uint32_t len;
+};
+
+/**
+ * Writes the whole iovec to a socket. A peer that has gone away yields an
+ * error instead of SIGPIPE, so the other side can reconnect.
+ */
+static inline int gps_rpc_write_full(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt) {
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = iovcnt,
+		};
+		ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		while (iovcnt && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+static inline int gps_rpc_read_full(int fd, void *data, size_t len) {
+	char *ptr = data;
+
+	while (len) {
+		ssize_t rc = read(fd, ptr, len);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (rc <= 0) {
+			return -1;
+		}
+		ptr += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static inline int gps_rpc_frame_write(int fd, uint32_t code,
+	const void *data, uint32_t len)
+{
+	struct gps_rpc_frame frame = {
+		.code = code,
+		.len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &frame, .iov_len = sizeof(frame) },
+		{ .iov_base = (void*)data, .iov_len = len },
+	};
+
+	return gps_rpc_write_full(fd, iov, len ? 2 : 1);
+}
+
+/**
+ * Writes a frame without blocking. Returns 0 if it was written, 1 if the
+ * socket is full and nothing was written, and -1 if the socket failed or
+ * took only part of the frame, which leaves the stream out of sync.
+ */
+static inline int gps_rpc_frame_try_write(int fd, uint32_t code,
+	const void *data, uint32_t len)
+{
+	struct gps_rpc_frame frame = {
+		.code = code,
+		.len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &frame, .iov_len = sizeof(frame) },
+		{ .iov_base = (void*)data, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = len ? 2 : 1,
+	};
+	ssize_t rc;
+
+	do {
+		rc = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 1;
+	}
+
+	return (size_t)rc == sizeof(frame) + len ? 0 : -1;
+}
+
+/**
+ * Reads one frame into @data. Frames longer than @max are an error since
+ * the stream cannot be resynchronized after them.
+ */
+static inline int gps_rpc_frame_read(int fd, struct gps_rpc_frame *frame,
+	void *data, uint32_t max)
+{
+	if (gps_rpc_read_full(fd, frame, sizeof(*frame))) {
+		return -1;
+	}
+
+	if (frame->len > max) {
+		return -1;
+	}
+
+	return gps_rpc_read_full(fd, data, frame->len);
+}
+
 #endif //__GPS_RPC_H__
@@ -0,0 +1,373 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GPS_SHM_H__
+#define __GPS_SHM_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * Shared memory callback transport.
+ *
+ * The daemon allocates a ring in an anonymous shared memory region and
+ * hands it to the library together with an eventfd over the callback
+ * channel socket. Callbacks are then written into the ring as
+ * variable-length records and the library is only woken up when it has
+ * gone to sleep on an empty ring. The RPC socket still carries all the
+ * calls that need a reply.
+ *
+ * The ring is single-producer single-consumer. The daemon serializes the
+ * blob threads with a local mutex before pushing. The library uses the
+ * same ring in private memory to feed its interface threads.
+ */
+
+#define GPS_SHM_MAGIC 0x47505352
+#define GPS_SHM_RING_SIZE (64 * 1024)
+#define GPS_SHM_ALIGN 8
+#define GPS_SHM_CACHELINE 64
+
+/* record code used to skip the tail of the ring when a record wraps */
+#define GPS_SHM_PAD 0xffffffff
+
+struct gps_shm_record {
+	uint32_t code;
+	uint32_t len;
+	char data[];
+};
+
+struct gps_shm_ring {
+	uint32_t magic;
+	uint32_t size;
+	char pad0[GPS_SHM_CACHELINE - 2 * sizeof(uint32_t)];
+
+	/* producer position, free-running */
+	uint32_t head;
+	char pad1[GPS_SHM_CACHELINE - sizeof(uint32_t)];
+
+	/* consumer position, free-running */
+	uint32_t tail;
+	/* set by the consumer before it sleeps on the eventfd */
+	uint32_t waiting;
+	char pad2[GPS_SHM_CACHELINE - 2 * sizeof(uint32_t)];
+
+	char data[];
+};
+
+static inline size_t gps_shm_map_size(uint32_t ring_size) {
+	return sizeof(struct gps_shm_ring) + ring_size;
+}
+
+static inline uint32_t gps_shm_record_size(uint32_t len) {
+	uint32_t sz = sizeof(struct gps_shm_record) + len;
+	return (sz + GPS_SHM_ALIGN - 1) & ~(GPS_SHM_ALIGN - 1);
+}
+
+static inline void gps_shm_ring_init(struct gps_shm_ring *ring,
+	uint32_t size)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->size = size;
+	ring->magic = GPS_SHM_MAGIC;
+}
+
+static inline int gps_shm_ring_valid(struct gps_shm_ring *ring,
+	size_t map_size)
+{
+	if (ring->magic != GPS_SHM_MAGIC) {
+		return 0;
+	}
+
+	/* size must be a power of two and fit into the mapping */
+	if (!ring->size || (ring->size & (ring->size - 1))) {
+		return 0;
+	}
+
+	return gps_shm_map_size(ring->size) <= map_size;
+}
+
+static inline int gps_shm_ring_empty(struct gps_shm_ring *ring) {
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+/**
+ * Reserves room for a record of @len bytes and returns a pointer to its
+ * payload, or NULL if the ring is full. The record becomes visible to the
+ * consumer only after gps_shm_ring_commit.
+ */
+static inline char *gps_shm_ring_reserve(struct gps_shm_ring *ring,
+	uint32_t code, uint32_t len)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t rsize = gps_shm_record_size(len);
+	uint32_t off = head & (ring->size - 1);
+	uint32_t pad = 0;
+	struct gps_shm_record *rec;
+
+	if (rsize > ring->size / 2) {
+		return NULL;
+	}
+
+	/* records are never split, skip the tail of the ring instead */
+	if (off + rsize > ring->size) {
+		pad = ring->size - off;
+	}
+
+	if (head + pad + rsize - tail > ring->size) {
+		return NULL;
+	}
+
+	if (pad) {
+		rec = (struct gps_shm_record*)(ring->data + off);
+		rec->code = GPS_SHM_PAD;
+		rec->len = pad - sizeof(*rec);
+		off = 0;
+	}
+
+	rec = (struct gps_shm_record*)(ring->data + off);
+	rec->code = code;
+	rec->len = len;
+
+	return rec->data;
+}
+
+static inline void gps_shm_ring_commit(struct gps_shm_ring *ring,
+	uint32_t len)
+{
+	uint32_t head = ring->head;
+	uint32_t off = head & (ring->size - 1);
+	uint32_t rsize = gps_shm_record_size(len);
+
+	if (off + rsize > ring->size) {
+		head += ring->size - off;
+	}
+
+	__atomic_store_n(&ring->head, head + rsize, __ATOMIC_RELEASE);
+}
+
+static inline int gps_shm_ring_push(struct gps_shm_ring *ring,
+	uint32_t code, const void *data, uint32_t len)
+{
+	char *dst = gps_shm_ring_reserve(ring, code, len);
+	if (!dst) {
+		return -1;
+	}
+
+	if (len) {
+		memcpy(dst, data, len);
+	}
+	gps_shm_ring_commit(ring, len);
+	return 0;
+}
+
+/**
+ * Returns the oldest record without consuming it, or NULL if the ring is
+ * empty. The record stays valid until gps_shm_ring_consume.
+ */
+static inline struct gps_shm_record *gps_shm_ring_peek(
+	struct gps_shm_ring *ring)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	struct gps_shm_record *rec;
+
+	while (head != tail) {
+		rec = (struct gps_shm_record*)
+			(ring->data + (tail & (ring->size - 1)));
+
+		if (rec->code != GPS_SHM_PAD) {
+			return rec;
+		}
+
+		tail += sizeof(*rec) + rec->len;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static inline void gps_shm_ring_consume(struct gps_shm_ring *ring,
+	struct gps_shm_record *rec)
+{
+	__atomic_store_n(&ring->tail,
+		ring->tail + gps_shm_record_size(rec->len), __ATOMIC_RELEASE);
+}
+
+/**
+ * Called by the consumer before it blocks. Returns nonzero if the ring is
+ * still empty and the consumer may sleep on the eventfd.
+ */
+static inline int gps_shm_ring_prepare_wait(struct gps_shm_ring *ring) {
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) !=
+		__atomic_load_n(&ring->tail, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Called by the producer after a commit. Returns nonzero if the consumer
+ * is asleep and the eventfd has to be signalled.
+ */
+static inline int gps_shm_ring_need_wakeup(struct gps_shm_ring *ring) {
+	return __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * Shared memory allocation and fd passing
+ *****************************************************************************/
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+#define GPS_SHM_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+static inline int gps_shm_create(const char *name, size_t size,
+	unsigned flags)
+{
+	int fd = -1;
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC | flags);
+#endif
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Sends @nfds file descriptors, possibly none, together with @len bytes of
+ * @data.
+ */
+static inline int gps_shm_send_fds(int sock, const void *data, size_t len,
+	const int *fds, int nfds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * 4)];
+	struct iovec iov = {
+		.iov_base = (void*)data,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+
+	if (nfds > 4) {
+		return -1;
+	}
+
+	if (nfds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	if (sendmsg(sock, &msg, 0) != (ssize_t)len) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Receives up to @nfds file descriptors and exactly @len bytes of @data.
+ * Returns the number of descriptors received or -1 on error.
+ */
+static inline int gps_shm_recv_fds(int sock, void *data, size_t len,
+	int *fds, int nfds)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * 4)];
+	struct iovec iov = {
+		.iov_base = data,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int count = 0;
+
+	if (nfds > 4) {
+		return -1;
+	}
+
+	if (recvmsg(sock, &msg, MSG_WAITALL) != (ssize_t)len) {
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (count > nfds) {
+			int i;
+			int *extra = (int*)CMSG_DATA(cmsg);
+			for (i = nfds; i < count; i++) {
+				close(extra[i]);
+			}
+			count = nfds;
+		}
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+	}
+
+	return count;
+}
+
+#endif //__GPS_SHM_H__
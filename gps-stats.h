@@ -0,0 +1,270 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GPS_STATS_H__
+#define __GPS_STATS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME 7
+#endif
+
+/*
+ * Stage timestamps that are compared between the daemon and the library
+ * use CLOCK_BOOTTIME, which is shared by all processes and keeps running
+ * while the device sleeps through a cold start.
+ */
+static inline uint64_t gps_boottime_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t gps_monotonic_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Latency histogram with logarithmic buckets. Values below
+ * GPS_HIST_LINEAR get a bucket each, above that every power of two is
+ * split into GPS_HIST_SUB buckets, so percentiles are within 12.5% of the
+ * real value. A histogram is not thread safe and is owned by one thread.
+ */
+#define GPS_HIST_SUB_BITS 3
+#define GPS_HIST_SUB (1 << GPS_HIST_SUB_BITS)
+#define GPS_HIST_LINEAR (2 * GPS_HIST_SUB)
+#define GPS_HIST_BUCKETS (GPS_HIST_LINEAR + (64 - 4) * GPS_HIST_SUB)
+
+struct gps_latency_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[GPS_HIST_BUCKETS];
+};
+
+static inline unsigned gps_hist_bucket(uint64_t v) {
+	unsigned e;
+
+	if (v < GPS_HIST_LINEAR) {
+		return v;
+	}
+
+	e = 63 - __builtin_clzll(v);
+	return GPS_HIST_LINEAR + (e - 4) * GPS_HIST_SUB +
+		((v >> (e - GPS_HIST_SUB_BITS)) & (GPS_HIST_SUB - 1));
+}
+
+/* largest value that falls into bucket @b */
+static inline uint64_t gps_hist_bucket_max(unsigned b) {
+	unsigned e, sub;
+
+	if (b < GPS_HIST_LINEAR) {
+		return b;
+	}
+
+	e = (b - GPS_HIST_LINEAR) / GPS_HIST_SUB + 4;
+	sub = (b - GPS_HIST_LINEAR) % GPS_HIST_SUB;
+	return ((uint64_t)(GPS_HIST_SUB + sub + 1) << (e - GPS_HIST_SUB_BITS)) - 1;
+}
+
+static inline void gps_latency_hist_reset(struct gps_latency_hist *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+static inline void gps_latency_hist_add(struct gps_latency_hist *h,
+	uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+	h->buckets[gps_hist_bucket(v)]++;
+}
+
+/**
+ * Returns an upper bound of the @pct percentile, or 0 if the histogram
+ * is empty.
+ */
+static inline uint64_t gps_latency_hist_percentile(
+	const struct gps_latency_hist *h, unsigned pct)
+{
+	uint64_t want = (h->count * pct + 99) / 100;
+	uint64_t seen = 0;
+	unsigned b;
+
+	for (b = 0; b < GPS_HIST_BUCKETS && want; b++) {
+		seen += h->buckets[b];
+		if (seen >= want) {
+			uint64_t v = gps_hist_bucket_max(b);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return 0;
+}
+
+static inline void gps_latency_hist_merge(struct gps_latency_hist *dst,
+	const struct gps_latency_hist *src)
+{
+	unsigned b;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	for (b = 0; b < GPS_HIST_BUCKETS; b++) {
+		dst->buckets[b] += src->buckets[b];
+	}
+}
+
+/******************************************************************************
+ * Per-call statistics
+ *****************************************************************************/
+
+/*
+ * Counters and a latency histogram in microseconds for every call code.
+ * Each thread records into its own slots, found through thread-specific
+ * data, so recording takes no lock and touches no shared cache line. The
+ * slots of a code are allocated on its first call in that thread, and a
+ * thread's recorder is linked into the registry once and kept after the
+ * thread exits. A report walks all recorders without stopping them, so
+ * it may miss the calls that complete while it runs.
+ */
+struct gps_call_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	struct gps_latency_hist latency;
+};
+
+struct gps_stats_recorder {
+	struct gps_stats_recorder *next;
+	struct gps_call_stats *codes[];
+};
+
+struct gps_stats_registry {
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	int key_valid;
+	unsigned ncodes;
+	struct gps_stats_recorder *head;
+};
+
+#define GPS_STATS_REGISTRY_INIT(ncodes) \
+	{ PTHREAD_MUTEX_INITIALIZER, 0, 0, (ncodes), NULL }
+
+static inline struct gps_stats_recorder *gps_stats_recorder_get(
+	struct gps_stats_registry *reg)
+{
+	struct gps_stats_recorder *rec;
+
+	if (!__atomic_load_n(&reg->key_valid, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&reg->lock);
+		if (!reg->key_valid && !pthread_key_create(&reg->key, NULL)) {
+			__atomic_store_n(&reg->key_valid, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&reg->lock);
+
+		if (!reg->key_valid) {
+			return NULL;
+		}
+	}
+
+	rec = pthread_getspecific(reg->key);
+	if (rec) {
+		return rec;
+	}
+
+	rec = calloc(1, sizeof(*rec) + reg->ncodes * sizeof(rec->codes[0]));
+	if (!rec) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&reg->lock);
+	rec->next = reg->head;
+	__atomic_store_n(&reg->head, rec, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&reg->lock);
+
+	pthread_setspecific(reg->key, rec);
+	return rec;
+}
+
+static inline void gps_stats_record(struct gps_stats_registry *reg,
+	unsigned code, size_t bytes, int error, uint64_t latency_us)
+{
+	struct gps_stats_recorder *rec;
+	struct gps_call_stats *st;
+
+	if (code >= reg->ncodes || !(rec = gps_stats_recorder_get(reg))) {
+		return;
+	}
+
+	st = rec->codes[code];
+	if (!st) {
+		st = calloc(1, sizeof(*st));
+		if (!st) {
+			return;
+		}
+		__atomic_store_n(&rec->codes[code], st, __ATOMIC_RELEASE);
+	}
+
+	st->calls++;
+	st->errors += !!error;
+	st->bytes += bytes;
+	gps_latency_hist_add(&st->latency, latency_us);
+}
+
+/**
+ * Sums up the statistics of @code over all threads into @out.
+ */
+static inline void gps_stats_merge(struct gps_stats_registry *reg,
+	unsigned code, struct gps_call_stats *out)
+{
+	struct gps_stats_recorder *rec;
+	struct gps_call_stats *st;
+
+	memset(out, 0, sizeof(*out));
+	if (code >= reg->ncodes) {
+		return;
+	}
+
+	rec = __atomic_load_n(&reg->head, __ATOMIC_ACQUIRE);
+	for (; rec; rec = rec->next) {
+		st = __atomic_load_n(&rec->codes[code], __ATOMIC_ACQUIRE);
+		if (!st) {
+			continue;
+		}
+		out->calls += st->calls;
+		out->errors += st->errors;
+		out->bytes += st->bytes;
+		gps_latency_hist_merge(&out->latency, &st->latency);
+	}
+}
+
+#endif //__GPS_STATS_H__
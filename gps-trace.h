@@ -0,0 +1,231 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __GPS_TRACE_H__
+#define __GPS_TRACE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ * Proxy traffic trace file.
+ *
+ * A trace is a header followed by variable-length records, each aligned
+ * to GPS_TRACE_ALIGN so that a reader can walk a mapping of the file
+ * without copying. Records are only ever appended. A record cut short by
+ * a crash is ignored by the reader, together with anything after it.
+ *
+ * Times are CLOCK_MONOTONIC microseconds since the trace was created.
+ * The header also keeps the wall clock time of creation to match a trace
+ * against the logs.
+ */
+
+#define GPS_TRACE_MAGIC 0x47505454
+#define GPS_TRACE_VERSION 1
+#define GPS_TRACE_ALIGN 8
+
+/* record types */
+enum {
+	/* a call served by the daemon, with its arguments and result */
+	GPS_TRACE_CALL = 1,
+	/* a callback sent on its own */
+	GPS_TRACE_CB,
+	/* a callback that goes into a fix epoch bundle */
+	GPS_TRACE_EPOCH_CB,
+};
+
+struct gps_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint64_t realtime_us;
+};
+
+struct gps_trace_record {
+	uint64_t time_us;
+	uint32_t code;
+	uint16_t type;
+	uint16_t reserved;
+	int32_t rc;
+	uint32_t len;
+	char data[];
+};
+
+static inline uint32_t gps_trace_record_size(uint32_t len) {
+	uint32_t sz = sizeof(struct gps_trace_record) + len;
+	return (sz + GPS_TRACE_ALIGN - 1) & ~(GPS_TRACE_ALIGN - 1);
+}
+
+/**
+ * Creates a trace file at @path, replacing an existing one, and writes
+ * its header. Returns the file descriptor or -1 on error.
+ */
+static inline int gps_trace_create(const char *path, uint64_t realtime_us) {
+	struct gps_trace_header hdr = {
+		.magic = GPS_TRACE_MAGIC,
+		.version = GPS_TRACE_VERSION,
+		.header_size = sizeof(struct gps_trace_header),
+		.record_size = sizeof(struct gps_trace_record),
+		.realtime_us = realtime_us,
+	};
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		0640);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Appends one record with @len bytes of @data. The record is written
+ * with a single call, so concurrent writers never interleave.
+ */
+static inline int gps_trace_append(int fd, const struct gps_trace_record *rec,
+	const void *data)
+{
+	static const char pad[GPS_TRACE_ALIGN];
+	uint32_t len = rec->len;
+	size_t total = gps_trace_record_size(len);
+	struct iovec iov[3] = {
+		{ .iov_base = (void*)rec, .iov_len = sizeof(*rec) },
+		{ .iov_base = (void*)data, .iov_len = len },
+		{
+			.iov_base = (void*)pad,
+			.iov_len = total - sizeof(*rec) - len,
+		},
+	};
+
+	if (writev(fd, iov, 3) != (ssize_t)total) {
+		return -1;
+	}
+	return 0;
+}
+
+struct gps_trace_map {
+	char *base;
+	size_t size;
+};
+
+/**
+ * Maps the trace at @path read-only and checks its header.
+ */
+static inline int gps_trace_map_open(const char *path,
+	struct gps_trace_map *map)
+{
+	const struct gps_trace_header *hdr;
+	struct stat st;
+	int fd;
+
+	map->base = NULL;
+	map->size = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		goto fail;
+	}
+
+	map->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map->base == MAP_FAILED) {
+		map->base = NULL;
+		goto fail;
+	}
+	map->size = st.st_size;
+	close(fd);
+
+	hdr = (const struct gps_trace_header*)map->base;
+	if (hdr->magic != GPS_TRACE_MAGIC ||
+		hdr->version != GPS_TRACE_VERSION ||
+		hdr->header_size < sizeof(*hdr) ||
+		hdr->header_size > map->size ||
+		hdr->record_size != sizeof(struct gps_trace_record))
+	{
+		munmap(map->base, map->size);
+		map->base = NULL;
+		map->size = 0;
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+static inline void gps_trace_map_close(struct gps_trace_map *map) {
+	if (map->base) {
+		munmap(map->base, map->size);
+	}
+	map->base = NULL;
+	map->size = 0;
+}
+
+/**
+ * Returns the record at *@off and moves *@off past it, or NULL at the end
+ * of the trace. Start with *@off at zero.
+ */
+static inline const struct gps_trace_record *gps_trace_next(
+	const struct gps_trace_map *map, size_t *off)
+{
+	const struct gps_trace_header *hdr =
+		(const struct gps_trace_header*)map->base;
+	const struct gps_trace_record *rec;
+	size_t pos = *off;
+
+	if (!map->base) {
+		return NULL;
+	}
+
+	if (pos < hdr->header_size) {
+		pos = hdr->header_size;
+	}
+
+	if (pos + sizeof(*rec) > map->size) {
+		return NULL;
+	}
+
+	rec = (const struct gps_trace_record*)(map->base + pos);
+	if (rec->len > map->size - pos - sizeof(*rec)) {
+		return NULL;
+	}
+
+	*off = pos + gps_trace_record_size(rec->len);
+	return rec;
+}
+
+#endif //__GPS_TRACE_H__
@@ -22,14 +22,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 
 #include <cutils/sockets.h>
+#include <cutils/ashmem.h>
 
 /* ANDROID-specific headers */
 #define LOG_TAG "[GPS-PROXY-LIB] "
@@ -42,6 +47,9 @@
 #include <stc_log.h>
 
 #include "gps-rpc.h"
+#include "gps-marshal.h"
+#include "gps-shm.h"
+#include "gps-stats.h"
 
 /******************************************************************************
  * Global Library State
@@ -49,7 +57,6 @@
 
 static int client_fd = -1;
 static pthread_mutex_t gps_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t gps_cond = PTHREAD_COND_INITIALIZER;
 
 static GpsXtraCallbacks *xtraCallbacks = NULL;
 static AGpsCallbacks *aGpsCallbacks = NULL;
@@ -58,483 +65,1912 @@ static GpsNiCallbacks *niCallbacks = NULL;
 static AGpsRilCallbacks *rilCallbacks = NULL;
 
 static rpc_t *gps_rpc = NULL;
+/* held for reading around every use of gps_rpc, for writing to replace it */
+static pthread_rwlock_t gps_rpc_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 static pthread_t gps_rpc_thread;
 
+/* cleared when the daemon goes away, the client thread then reconnects */
+static pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;
+static int link_up = 0;
+
+#define GPS_RECONNECT_MIN_MS 20
+#define GPS_RECONNECT_MAX_MS 2000
+
+/* everything this library can handle */
+#define GPS_LIB_FEATURES GPS_FEATURES_ALL
+
+/* agreed with the daemon on the current connection */
+static uint32_t link_features = GPS_FEATURES_LEGACY;
+
+/*
+ * Calls made while there is no connection. State setters are covered by
+ * the session replay, the rest are queued here and sent once the daemon
+ * is reachable. Protected by pending_mutex, which the client thread also
+ * holds while it restores the session so that nothing overtakes it.
+ */
+#define GPS_PENDING_MAX 16
+
+struct gps_pending_call {
+	uint32_t code;
+	size_t len;
+	char *data;
+};
+
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gps_pending_call pending_calls[GPS_PENDING_MAX];
+static int pending_count = 0;
+static uint64_t pending_dropped = 0;
+/* set once the session has been restored on the current connection */
+static int link_ready = 0;
+
+#define GPS_SESSION_STR_MAX 128
+/* AGPS_TYPE_SUPL and AGPS_TYPE_C2K */
+#define GPS_SESSION_AGPS_TYPES 3
+
+/*
+ * Everything the framework told the daemon that outlives a single call,
+ * replayed after a reconnect. Protected by gps_mutex.
+ */
+struct gps_session_state {
+	int mode_set;
+	GpsPositionMode mode;
+	GpsPositionRecurrence recurrence;
+	uint32_t min_interval;
+	uint32_t preferred_accuracy;
+	uint32_t preferred_time;
+
+	int started;
+
+	struct {
+		int set;
+		int port;
+		char hostname[GPS_SESSION_STR_MAX];
+	} server[GPS_SESSION_AGPS_TYPES];
+
+	int set_id_set;
+	AGpsSetIDType set_id_type;
+	char set_id[GPS_SESSION_STR_MAX];
+
+	int ref_loc_set;
+	size_t ref_loc_size;
+	AGpsRefLocation ref_loc;
+
+	int net_state_set;
+	int connected;
+	int net_type;
+	int roaming;
+	char extra_info[GPS_SESSION_STR_MAX];
+
+	int net_avail_set;
+	int available;
+	char apn[GPS_SESSION_STR_MAX];
+};
+
+static struct gps_session_state session;
+
+static int gps_session_replay(void);
+
+static void gps_session_copy(char *dst, const char *src) {
+	strncpy(dst, src, GPS_SESSION_STR_MAX - 1);
+	dst[GPS_SESSION_STR_MAX - 1] = '\0';
+}
+
 static pthread_t gps_cb_thread;
 static pthread_t ni_cb_thread;
 static pthread_t agps_cb_thread;
 static pthread_t xtra_cb_thread;
 static pthread_t ril_cb_thread;
 
-enum {
-	READ_END = 0,
-	WRITE_END = 1,
+struct gps_cb_queue {
+	struct gps_shm_ring *ring;
+	int event_fd;
+	/* set by the consumer before it sleeps on the eventfd */
+	uint32_t waiting;
+};
+
+static struct gps_cb_queue queue_gps = { NULL, -1, 0 };
+static struct gps_cb_queue queue_ni = { NULL, -1, 0 };
+static struct gps_cb_queue queue_agps = { NULL, -1, 0 };
+static struct gps_cb_queue queue_xtra = { NULL, -1, 0 };
+static struct gps_cb_queue queue_ril = { NULL, -1, 0 };
+
+/* serializes the producers: the RPC thread and the callback channel */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t queue_count = 0;
+static uint64_t queue_bytes = 0;
+static uint64_t queue_stalls = 0;
+
+static struct gps_shm_ring *cb_ring = NULL;
+static int cb_event_fd = -1;
+static uint32_t cb_map_size = 0;
+static int cb_sock = -1;
+static pthread_t cb_channel_thread;
+
+static size_t gps_cb_payload_len(uint32_t code, const char *buf);
+
+/* SV table rebuilt from GPS_SV_DELTA_CB, protected by queue_mutex */
+static GpsSvStatus sv_table;
+static uint32_t sv_table_seq = 0;
+static int sv_table_valid = 0;
+
+/******************************************************************************
+ * Callback Queues
+ *****************************************************************************/
+
+/*
+ * Each interface thread consumes its callbacks from an in-process ring of
+ * the same layout as the shared memory transport. The consumer handles a
+ * record in place and only sleeps on the eventfd once it has nothing to
+ * do, so a busy thread costs no syscalls. A full ring stalls the producer
+ * the same way a full pipe used to.
+ *
+ * The GPS thread has more sources, drained in priority order so that a
+ * location never waits behind a burst of NMEA sentences:
+ *  - the newest location, in a latest-value mailbox
+ *  - status, capabilities, wakelock and time requests, in the ring
+ *  - the newest SV status, in a latest-value mailbox
+ *  - NMEA sentences, in a bounded buffer that drops the oldest ones
+ * A stalled framework thread therefore only ever stalls the producer for
+ * callbacks that must not be lost. Order is only kept within a source.
+ * Every record carries the time it was queued, next to the origin and
+ * send times the daemon stamped it with.
+ */
+#define GPS_CB_QUEUE_SIZE (16 * 1024)
+#define GPS_CB_QUEUE_STALL_US 1000
+
+/* a slot takes any sentence the daemon can send, only lapping drops one */
+#define GPS_NMEA_SLOTS 64
+#define GPS_NMEA_SLOT_SIZE RPC_PAYLOAD_MAX
+
+/* callback delivery latency is logged every so many fixes */
+#define GPS_LATENCY_REPORT_INTERVAL 60
+
+struct gps_cb_stamp {
+	uint64_t origin_us;
+	uint64_t sent_us;
+	uint64_t queued_us;
+};
+
+/*
+ * Single-value mailbox guarded by a sequence lock. The producer overwrites
+ * the value at will, the consumer takes it if seq moved past taken.
+ */
+struct gps_cb_mailbox {
+	uint32_t seq;
+	uint32_t taken;
+	uint32_t code;
+	uint32_t len;
+	struct gps_cb_stamp stamp;
+	char data[sizeof(GpsSvStatus)];
+};
+
+struct gps_nmea_slot {
+	uint32_t seq;
+	uint32_t len;
+	struct gps_cb_stamp stamp;
+	char data[GPS_NMEA_SLOT_SIZE];
+};
+
+/*
+ * Overwriting ring of NMEA sentences. Slot h % GPS_NMEA_SLOTS holds
+ * sentence h once its seq is 2 * h + 2, so the consumer can tell when the
+ * producer lapped it.
+ */
+struct gps_nmea_ring {
+	uint32_t head;
+	char pad[GPS_SHM_CACHELINE - sizeof(uint32_t)];
+	/* consumer position, private to the GPS thread */
+	uint32_t tail;
+	struct gps_nmea_slot slots[GPS_NMEA_SLOTS];
+};
+
+static struct gps_cb_mailbox loc_box;
+static struct gps_cb_mailbox sv_box;
+static struct gps_nmea_ring nmea_ring;
+
+static uint64_t loc_conflated = 0;
+static uint64_t sv_conflated = 0;
+static uint64_t nmea_dropped = 0;
+
+/*
+ * Where the time between the blob callback in the daemon and the return
+ * of the framework callback goes, per kind of GPS callback:
+ *   daemon     until the daemon wrote it out, including epoch bundling
+ *   socket     until the library queued it for the GPS thread
+ *   queue      until the GPS thread picked it up
+ *   framework  time spent in the framework callback
+ * Owned by the GPS thread.
+ */
+enum {
+	GPS_TRACE_LOC,
+	GPS_TRACE_SV,
+	GPS_TRACE_NMEA,
+	GPS_TRACE_OTHER,
+	GPS_TRACE_KINDS,
+};
+
+enum {
+	GPS_TRACE_DAEMON,
+	GPS_TRACE_SOCKET,
+	GPS_TRACE_QUEUE,
+	GPS_TRACE_FRAMEWORK,
+	GPS_TRACE_TOTAL,
+	GPS_TRACE_STAGES,
+};
+
+static const char *trace_kind_names[GPS_TRACE_KINDS] = {
+	"location", "sv status", "nmea", "other",
+};
+
+static struct gps_latency_hist trace_hist[GPS_TRACE_KINDS][GPS_TRACE_STAGES];
+
+/* when gps_start was called, cleared once the first fix is delivered */
+static uint64_t ttff_start_us = 0;
+
+static void gps_ttff_fix_delivered(void);
+
+/* the same clock the daemon stamps callback traces with */
+static uint64_t gps_now_us(void) {
+	return gps_monotonic_us();
+}
+
+static void gps_cb_queue_free(struct gps_cb_queue *q) {
+	CHECK_CLOSE(q->event_fd);
+	free(q->ring);
+	q->ring = NULL;
+}
+
+static int gps_cb_queue_init(struct gps_cb_queue *q) {
+	q->ring = malloc(gps_shm_map_size(GPS_CB_QUEUE_SIZE));
+	if (!q->ring) {
+		return -1;
+	}
+	gps_shm_ring_init(q->ring, GPS_CB_QUEUE_SIZE);
+
+	q->event_fd = eventfd(0, EFD_CLOEXEC);
+	if (q->event_fd < 0) {
+		gps_cb_queue_free(q);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* called by a producer with queue_mutex held */
+static void gps_cb_queue_wake(struct gps_cb_queue *q) {
+	if (__atomic_exchange_n(&q->waiting, 0, __ATOMIC_SEQ_CST)) {
+		eventfd_write(q->event_fd, 1);
+	}
+}
+
+static void gps_cb_queue_push(struct gps_cb_queue *q, uint32_t code,
+	const char *buf, size_t len, const struct gps_cb_stamp *origin)
+{
+	struct gps_cb_stamp stamp = *origin;
+	char *dst;
+
+	stamp.queued_us = gps_now_us();
+
+	if (len > RPC_PAYLOAD_MAX) {
+		len = RPC_PAYLOAD_MAX;
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	while (!(dst = gps_shm_ring_reserve(q->ring, code, len + sizeof(stamp)))) {
+		queue_stalls++;
+		pthread_mutex_unlock(&queue_mutex);
+		usleep(GPS_CB_QUEUE_STALL_US);
+		pthread_mutex_lock(&queue_mutex);
+	}
+
+	memcpy(dst, buf, len);
+	memcpy(dst + len, &stamp, sizeof(stamp));
+	gps_shm_ring_commit(q->ring, len + sizeof(stamp));
+
+	gps_cb_queue_wake(q);
+	queue_count++;
+	queue_bytes += gps_shm_record_size(len + sizeof(stamp));
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+static void gps_cb_record_stamp(struct gps_shm_record *rec,
+	struct gps_cb_stamp *stamp)
+{
+	memcpy(stamp, rec->data + rec->len - sizeof(*stamp), sizeof(*stamp));
+}
+
+/* called with queue_mutex held */
+static void gps_cb_mailbox_put(struct gps_cb_mailbox *box, uint32_t code,
+	const void *buf, size_t len, const struct gps_cb_stamp *origin,
+	uint64_t *conflated)
+{
+	uint32_t seq = box->seq;
+
+	if (len > sizeof(box->data)) {
+		len = sizeof(box->data);
+	}
+
+	if (seq != __atomic_load_n(&box->taken, __ATOMIC_ACQUIRE)) {
+		__atomic_fetch_add(conflated, 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&box->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	box->code = code;
+	box->len = len;
+	box->stamp = *origin;
+	box->stamp.queued_us = gps_now_us();
+	memcpy(box->data, buf, len);
+	__atomic_store_n(&box->seq, seq + 2, __ATOMIC_RELEASE);
+
+	gps_cb_queue_wake(&queue_gps);
+	queue_count++;
+	queue_bytes += len;
+}
+
+static int gps_cb_mailbox_pending(struct gps_cb_mailbox *box) {
+	return __atomic_load_n(&box->seq, __ATOMIC_SEQ_CST) != box->taken;
+}
+
+/**
+ * Copies out the newest unread value. Returns nonzero if there was none.
+ */
+static int gps_cb_mailbox_take(struct gps_cb_mailbox *box, char *buf,
+	uint32_t *code, struct gps_cb_stamp *stamp)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&box->seq, __ATOMIC_ACQUIRE);
+		if (seq == box->taken) {
+			return -1;
+		}
+		if (seq & 1) {
+			continue;
+		}
+
+		*code = box->code;
+		*stamp = box->stamp;
+		memcpy(buf, box->data, box->len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&box->seq, __ATOMIC_RELAXED) || (seq & 1));
+
+	__atomic_store_n(&box->taken, seq, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* called with queue_mutex held */
+static void gps_nmea_put(const char *buf, size_t len,
+	const struct gps_cb_stamp *origin)
+{
+	uint32_t head = nmea_ring.head;
+	struct gps_nmea_slot *slot = nmea_ring.slots + head % GPS_NMEA_SLOTS;
+
+	if (len > GPS_NMEA_SLOT_SIZE ||
+		len < gps_cb_payload_len(GPS_NMEA_CB, buf))
+	{
+		RPC_ERROR("%s: malformed sentence of %zu bytes", __func__, len);
+		return;
+	}
+
+	__atomic_store_n(&slot->seq, 2 * head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->len = len;
+	slot->stamp = *origin;
+	slot->stamp.queued_us = gps_now_us();
+	memcpy(slot->data, buf, len);
+	__atomic_store_n(&slot->seq, 2 * head + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&nmea_ring.head, head + 1, __ATOMIC_RELEASE);
+
+	gps_cb_queue_wake(&queue_gps);
+	queue_count++;
+	queue_bytes += len;
+}
+
+static int gps_nmea_pending(void) {
+	return __atomic_load_n(&nmea_ring.head, __ATOMIC_SEQ_CST) !=
+		nmea_ring.tail;
+}
+
+/**
+ * Copies out the oldest sentence that has not been overwritten yet.
+ * Returns nonzero if there is none.
+ */
+static int gps_nmea_take(char *buf, struct gps_cb_stamp *stamp) {
+	uint32_t head, tail, seq;
+	struct gps_nmea_slot *slot;
+
+	while (1) {
+		head = __atomic_load_n(&nmea_ring.head, __ATOMIC_ACQUIRE);
+		tail = nmea_ring.tail;
+		if (head == tail) {
+			return -1;
+		}
+
+		if (head - tail > GPS_NMEA_SLOTS) {
+			__atomic_fetch_add(&nmea_dropped, head - tail - GPS_NMEA_SLOTS,
+				__ATOMIC_RELAXED);
+			tail = head - GPS_NMEA_SLOTS;
+		}
+		nmea_ring.tail = tail + 1;
+
+		slot = nmea_ring.slots + tail % GPS_NMEA_SLOTS;
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == 2 * tail + 2) {
+			uint32_t len = slot->len;
+			*stamp = slot->stamp;
+			memcpy(buf, slot->data, len <= GPS_NMEA_SLOT_SIZE ? len : 0);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (seq == __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)) {
+				return 0;
+			}
+		}
+
+		/* lapped while reading */
+		__atomic_fetch_add(&nmea_dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int gps_cb_gps_pending(void) {
+	return gps_cb_mailbox_pending(&loc_box) ||
+		gps_cb_mailbox_pending(&sv_box) ||
+		gps_nmea_pending();
+}
+
+/**
+ * Blocks until a producer signals the queue. Returns nonzero if the queue
+ * is not usable any more. @pending checks extra sources besides the ring.
+ */
+static int gps_cb_queue_wait(struct gps_cb_queue *q, int (*pending)(void)) {
+	eventfd_t val;
+
+	__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->ring->head, __ATOMIC_SEQ_CST) != q->ring->tail ||
+		(pending && pending()))
+	{
+		__atomic_store_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	if (eventfd_read(q->event_fd, &val) < 0 && errno != EINTR) {
+		RPC_ERROR("%s: eventfd_read failed %s", __func__, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns the next callback, blocking while the queue is empty. The record
+ * stays valid until gps_cb_queue_consume.
+ */
+static struct gps_shm_record *gps_cb_queue_next(struct gps_cb_queue *q) {
+	struct gps_shm_record *rec;
+
+	while (q->ring) {
+		rec = gps_shm_ring_peek(q->ring);
+		if (rec) {
+			return rec;
+		}
+
+		if (gps_cb_queue_wait(q, NULL)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void gps_cb_queue_consume(struct gps_cb_queue *q,
+	struct gps_shm_record *rec)
+{
+	gps_shm_ring_consume(q->ring, rec);
+}
+
+/**
+ * Records how long a callback took through each stage. Stamps the daemon
+ * did not provide, or that are out of order, are skipped.
+ */
+static void gps_trace_record(int kind, const struct gps_cb_stamp *stamp,
+	uint64_t dispatch_us)
+{
+	struct gps_latency_hist *h = trace_hist[kind];
+	uint64_t done_us = gps_now_us();
+
+	if (stamp->origin_us && stamp->origin_us <= stamp->sent_us &&
+		stamp->sent_us <= stamp->queued_us)
+	{
+		gps_latency_hist_add(&h[GPS_TRACE_DAEMON],
+			stamp->sent_us - stamp->origin_us);
+		gps_latency_hist_add(&h[GPS_TRACE_SOCKET],
+			stamp->queued_us - stamp->sent_us);
+		gps_latency_hist_add(&h[GPS_TRACE_TOTAL],
+			done_us - stamp->origin_us);
+	}
+	gps_latency_hist_add(&h[GPS_TRACE_QUEUE], dispatch_us - stamp->queued_us);
+	gps_latency_hist_add(&h[GPS_TRACE_FRAMEWORK], done_us - dispatch_us);
+}
+
+static void gps_latency_report(void) {
+	struct gps_latency_hist *h;
+	int kind;
+
+	for (kind = 0; kind < GPS_TRACE_KINDS; kind++) {
+		h = trace_hist[kind];
+		if (!h[GPS_TRACE_QUEUE].count) {
+			continue;
+		}
+
+		RPC_INFO("%s latency p50/p99: %llu callbacks, daemon %llu/%lluus, "
+			"socket %llu/%lluus, queue %llu/%lluus, framework %llu/%lluus, "
+			"total %llu/%lluus", trace_kind_names[kind],
+			(unsigned long long)h[GPS_TRACE_QUEUE].count,
+#define P(stage) \
+			(unsigned long long)gps_latency_hist_percentile(&h[stage], 50), \
+			(unsigned long long)gps_latency_hist_percentile(&h[stage], 99)
+			P(GPS_TRACE_DAEMON), P(GPS_TRACE_SOCKET), P(GPS_TRACE_QUEUE),
+			P(GPS_TRACE_FRAMEWORK), P(GPS_TRACE_TOTAL));
+#undef P
+	}
+
+	RPC_INFO("conflated %llu locations, %llu sv status; dropped %llu nmea",
+		(unsigned long long)__atomic_load_n(&loc_conflated, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&sv_conflated, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&nmea_dropped, __ATOMIC_RELAXED));
+}
+
+/******************************************************************************
+ * RPC Socket Interface
+ *****************************************************************************/
+/**
+ * Applies a GPS_SV_DELTA_CB to the SV table. Returns nonzero if the table
+ * is not usable until the next keyframe.
+ */
+static int gps_sv_delta_apply(char *buf) {
+	struct gps_sv_delta delta;
+	size_t idx = 0;
+	int i;
+
+	RPC_UNPACK(buf, idx, delta);
+
+	if (delta.flags & GPS_SV_DELTA_KEYFRAME) {
+		memset(&sv_table, 0, sizeof(sv_table));
+		sv_table_valid = 1;
+	}
+	else if (!sv_table_valid || delta.seq != sv_table_seq + 1) {
+		RPC_DEBUG("%s: dropping delta %u", __func__, delta.seq);
+		sv_table_valid = 0;
+		return -1;
+	}
+	sv_table_seq = delta.seq;
+
+	if (delta.num_svs < 0 || delta.num_svs > GPS_MAX_SVS) {
+		goto fail;
+	}
+
+	for (i = 0; i < GPS_MAX_SVS; i++) {
+		GpsSvInfo *sv = sv_table.sv_list + i;
+		uint8_t fields;
+
+		if (!(delta.changed & (1ULL << i))) {
+			continue;
+		}
+
+		RPC_UNPACK(buf, idx, fields);
+		if (fields & GPS_SV_FIELD_PRN) {
+			RPC_UNPACK(buf, idx, sv->prn);
+		}
+		if (fields & GPS_SV_FIELD_SNR) {
+			RPC_UNPACK(buf, idx, sv->snr);
+		}
+		if (fields & GPS_SV_FIELD_ELEVATION) {
+			RPC_UNPACK(buf, idx, sv->elevation);
+		}
+		if (fields & GPS_SV_FIELD_AZIMUTH) {
+			RPC_UNPACK(buf, idx, sv->azimuth);
+		}
+		sv->size = sizeof(GpsSvInfo);
+	}
+
+	sv_table.size = sizeof(GpsSvStatus);
+	sv_table.num_svs = delta.num_svs;
+	sv_table.ephemeris_mask = delta.ephemeris_mask;
+	sv_table.almanac_mask = delta.almanac_mask;
+	sv_table.used_in_fix_mask = delta.used_in_fix_mask;
+	return 0;
+
+fail:
+	sv_table_valid = 0;
+	return -1;
+}
+
+/*
+ * One handler per callback of GPS_RPC_CALLBACKS. A handler unpacks the
+ * arguments and passes them to the framework, on the thread of the
+ * interface.
+ */
+static void gps_cb_location(char *buf) {
+	GpsLocation location;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->location_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_location(buf, &idx, &location)) {
+		gpsCallbacks->location_cb(&location);
+	}
+}
+
+static void gps_cb_status(char *buf) {
+	GpsStatus status;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->status_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_status(buf, &idx, &status)) {
+		gpsCallbacks->status_cb(&status);
+	}
+}
+
+static void gps_cb_sv_status(char *buf) {
+	GpsSvStatus status;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->sv_status_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_sv_status(buf, &idx, &status)) {
+		gpsCallbacks->sv_status_cb(&status);
+	}
+}
+
+/* deltas are applied as they arrive and reach the thread as SV status */
+static void gps_cb_sv_delta(char *buf) {
+	RPC_ERROR("%s: unexpected SV delta", __func__);
+}
+
+static void gps_cb_nmea(char *buf) {
+	GpsUtcTime timestamp;
+	int length;
+	char *nmea;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->nmea_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (gps_unpack_nmea(buf, &idx, &timestamp, &length)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_REF(buf, idx, nmea, length);
+
+	gpsCallbacks->nmea_cb(timestamp, nmea, length);
+
+fail:
+	return;
+}
+
+static void gps_cb_set_capabilities(char *buf) {
+	uint32_t caps;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->set_capabilities_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_set_capabilities(buf, &idx, &caps)) {
+		RPC_DEBUG("SET_CAPABILITIES %x", caps);
+		gpsCallbacks->set_capabilities_cb(caps);
+	}
+}
+
+static void gps_cb_acquire_wakelock(char *buf) {
+	if (gpsCallbacks && gpsCallbacks->acquire_wakelock_cb) {
+		gpsCallbacks->acquire_wakelock_cb();
+	}
+	else {
+		RPC_ERROR("gpsCallbacks == NULL");
+	}
+}
+
+static void gps_cb_release_wakelock(char *buf) {
+	if (gpsCallbacks && gpsCallbacks->release_wakelock_cb) {
+		gpsCallbacks->release_wakelock_cb();
+	}
+	else {
+		RPC_ERROR("gpsCallbacks == NULL");
+	}
+}
+
+static void gps_cb_request_utc_time(char *buf) {
+	if (gpsCallbacks && gpsCallbacks->request_utc_time_cb) {
+		gpsCallbacks->request_utc_time_cb();
+	}
+	else {
+		RPC_ERROR("gpsCallbacks == NULL");
+	}
+}
+
+static void gps_cb_xtra_download_request(char *buf) {
+	if (xtraCallbacks && xtraCallbacks->download_request_cb) {
+		xtraCallbacks->download_request_cb();
+	}
+	else {
+		RPC_ERROR("xtraCallbacks == NULL");
+	}
+}
+
+static void gps_cb_agps_status(char *buf) {
+	AGpsStatus status;
+	size_t idx = 0;
+
+	if (!aGpsCallbacks || !aGpsCallbacks->status_cb) {
+		RPC_ERROR("aGpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_agps_status(buf, &idx, &status)) {
+		aGpsCallbacks->status_cb(&status);
+	}
+}
+
+static void gps_cb_ni_notify(char *buf) {
+	GpsNiNotification nfy;
+	size_t idx = 0;
+
+	if (!niCallbacks || !niCallbacks->notify_cb) {
+		RPC_ERROR("niCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_ni_notify(buf, &idx, &nfy)) {
+		niCallbacks->notify_cb(&nfy);
+	}
+}
+
+static void gps_cb_ril_request_set_id(char *buf) {
+	uint32_t flags;
+	size_t idx = 0;
+
+	if (!rilCallbacks || !rilCallbacks->request_setid) {
+		RPC_ERROR("rilCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_ril_request_set_id(buf, &idx, &flags)) {
+		rilCallbacks->request_setid(flags);
+	}
+}
+
+static void gps_cb_ril_request_ref_loc(char *buf) {
+	uint32_t flags;
+	size_t idx = 0;
+
+	if (!rilCallbacks || !rilCallbacks->request_refloc) {
+		RPC_ERROR("rilCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_unpack_ril_request_ref_loc(buf, &idx, &flags)) {
+		rilCallbacks->request_refloc(flags);
+	}
+}
+
+static void gps_cb_location_compact(char *buf) {
+	GpsLocation location;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->location_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_decode_location(buf, &idx, &location)) {
+		gpsCallbacks->location_cb(&location);
+	}
+}
+
+static void gps_cb_status_compact(char *buf) {
+	GpsStatus status;
+	size_t idx = 0;
+
+	if (!gpsCallbacks || !gpsCallbacks->status_cb) {
+		RPC_ERROR("gpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_decode_status(buf, &idx, &status)) {
+		gpsCallbacks->status_cb(&status);
+	}
+}
+
+static void gps_cb_agps_status_compact(char *buf) {
+	AGpsStatus status;
+	size_t idx = 0;
+
+	if (!aGpsCallbacks || !aGpsCallbacks->status_cb) {
+		RPC_ERROR("aGpsCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_decode_agps_status(buf, &idx, &status)) {
+		aGpsCallbacks->status_cb(&status);
+	}
+}
+
+static void gps_cb_ni_notify_compact(char *buf) {
+	GpsNiNotification nfy;
+	size_t idx = 0;
+
+	if (!niCallbacks || !niCallbacks->notify_cb) {
+		RPC_ERROR("niCallbacks == NULL");
+		return;
+	}
+
+	if (!gps_decode_ni_notify(buf, &idx, &nfy)) {
+		niCallbacks->notify_cb(&nfy);
+	}
+}
+
+static void (*const gps_cb_handlers[GPS_RPC_MAX])(char *buf) = {
+	#define GPS_CB_HANDLER(code, name, iface, flags, args) \
+		[code] = gps_cb_##name,
+	GPS_RPC_CALLBACKS(GPS_CB_HANDLER)
+	#undef GPS_CB_HANDLER
+};
+
+static void gps_cb_handle(uint32_t code, char *buf) {
+	RPC_DEBUG("%s: request code %d", __func__, code);
+
+	if (code >= GPS_RPC_MAX || !gps_cb_handlers[code]) {
+		RPC_ERROR("%s: unexpected code %x", __func__, code);
+		return;
+	}
+
+	gps_cb_handlers[code](buf);
+}
+
+/**
+ * Runs the callbacks queued for an interface until its queue is torn
+ * down. The GPS interface has its own loop for the mailboxes.
+ */
+static void gps_cb_queue_serve(struct gps_cb_queue *q) {
+	struct gps_shm_record *rec;
+
+	while ((rec = gps_cb_queue_next(q))) {
+		gps_cb_handle(rec->code, rec->data);
+		gps_cb_queue_consume(q, rec);
+	}
+}
+
+static void gps_cb_thread_func(void* unused) {
+	struct gps_shm_record *rec;
+	char buf[sizeof(GpsSvStatus) + GPS_NMEA_SLOT_SIZE];
+	struct gps_cb_stamp stamp;
+	uint64_t dispatch_us;
+	uint32_t code;
+
+	while (queue_gps.ring) {
+		dispatch_us = gps_now_us();
+
+		if (!gps_cb_mailbox_take(&loc_box, buf, &code, &stamp)) {
+			gps_cb_handle(code, buf);
+			gps_trace_record(GPS_TRACE_LOC, &stamp, dispatch_us);
+			gps_ttff_fix_delivered();
+
+			if (!(trace_hist[GPS_TRACE_LOC][GPS_TRACE_QUEUE].count %
+				GPS_LATENCY_REPORT_INTERVAL))
+			{
+				gps_latency_report();
+			}
+			continue;
+		}
+
+		rec = gps_shm_ring_peek(queue_gps.ring);
+		if (rec) {
+			gps_cb_handle(rec->code, rec->data);
+			gps_cb_record_stamp(rec, &stamp);
+			gps_trace_record(GPS_TRACE_OTHER, &stamp, dispatch_us);
+			gps_cb_queue_consume(&queue_gps, rec);
+			continue;
+		}
+
+		if (!gps_cb_mailbox_take(&sv_box, buf, &code, &stamp)) {
+			gps_cb_handle(code, buf);
+			gps_trace_record(GPS_TRACE_SV, &stamp, dispatch_us);
+			continue;
+		}
+
+		if (!gps_nmea_take(buf, &stamp)) {
+			gps_cb_handle(GPS_NMEA_CB, buf);
+			gps_trace_record(GPS_TRACE_NMEA, &stamp, dispatch_us);
+			continue;
+		}
+
+		if (gps_cb_queue_wait(&queue_gps, gps_cb_gps_pending)) {
+			break;
+		}
+	}
+}
+
+static void agps_cb_thread_func(void* unused) {
+	LOG_ENTRY;
+	gps_cb_queue_serve(&queue_agps);
+	LOG_EXIT;
+}
+
+static void ni_cb_thread_func(void* unused) {
+	LOG_ENTRY;
+	gps_cb_queue_serve(&queue_ni);
+	LOG_EXIT;
+}
+
+static void xtra_cb_thread_func(void* unused) {
+	LOG_ENTRY;
+	gps_cb_queue_serve(&queue_xtra);
+	LOG_EXIT;
+}
+
+static void ril_cb_thread_func(void* unused) {
+	LOG_ENTRY;
+	gps_cb_queue_serve(&queue_ril);
+	LOG_EXIT;
+}
+
+/******************************************************************************
+ * Pipelined calls
+ *****************************************************************************/
+
+/*
+ * Once the callback channel is up, calls are written to it as frames with
+ * the call id appended to the arguments, and the daemon answers each with
+ * a GPS_PROXY_REPLY carrying the id and the result. Several calls can be
+ * in flight at a time; the blocking wrappers just wait for their own id.
+ */
+#define GPS_CALLS_MAX 16
+#define GPS_CALL_TIMEOUT_MS 10000
+
+typedef void (*gps_call_done_t)(uint32_t code, int rc);
+
+struct gps_call {
+	uint32_t id;
+	uint32_t code;
+	size_t len;
+	uint64_t start_us;
+	int busy;
+	int done;
+	int rc;
+	gps_call_done_t done_cb;
 };
 
-static int pipe_gps[2] = {-1, -1};
-static int pipe_ni[2] = {-1, -1};
-static int pipe_agps[2] = {-1, -1};
-static int pipe_xtra[2] = {-1, -1};
-static int pipe_ril[2] = {-1, -1};
+static pthread_mutex_t call_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_cond = PTHREAD_COND_INITIALIZER;
+static struct gps_call gps_calls[GPS_CALLS_MAX];
+static uint32_t call_next_id = 1;
+static int call_channel_up = 0;
+static uint32_t oneway_sent = 0;
+static uint32_t oneway_acked = 0;
 
-#define CHECK_CLOSE(fd) \
-do {\
-	if (fd >= 0) {\
-		close(fd); \
-		fd = -1;\
-	}\
-} while (0)
+/* round trip of every call code, see gps-stats.h */
+static struct gps_stats_registry call_stats =
+	GPS_STATS_REGISTRY_INIT(GPS_RPC_MAX);
 
-/******************************************************************************
- * RPC Socket Interface
- *****************************************************************************/
-static void gps_cb_thread_func(void* unused) {
-	while (pipe_gps[0] >= 0) {
-		struct rpc_request_hdr_t hdr;
-		memset(&hdr, 0, sizeof(hdr));
-		if (read(pipe_gps[READ_END], &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			RPC_ERROR("failed to read request header");
+/**
+ * Sends a call over the callback channel. If @done_cb is NULL the caller
+ * must collect the result with gps_call_wait. Returns the slot of the call
+ * or -1 if the channel is not available.
+ */
+static int gps_call_submit(rpc_request_t *req, size_t len,
+	gps_call_done_t done_cb)
+{
+	struct gps_call *call = NULL;
+	uint32_t id;
+	int slot = -1;
+	int i;
+
+	if (len + sizeof(id) > RPC_PAYLOAD_MAX) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&call_mutex);
+	while (call_channel_up) {
+		for (i = 0; i < GPS_CALLS_MAX; i++) {
+			if (!gps_calls[i].busy) {
+				slot = i;
+				break;
+			}
+		}
+
+		if (slot >= 0) {
 			break;
 		}
-		
-		char *buf = hdr.buffer;
-		size_t idx = 0;
+		pthread_cond_wait(&call_cond, &call_mutex);
+	}
 
-		RPC_DEBUG("%s: request code %d", __func__, hdr.code);
+	if (slot < 0) {
+		goto fail;
+	}
 
-		switch (hdr.code) {
-		case GPS_LOC_CB:
-			if (gpsCallbacks && gpsCallbacks->location_cb) {
-				GpsLocation location;
-				memset(&location, 0, sizeof(location));
-				RPC_UNPACK(buf, idx, location);
-				gpsCallbacks->location_cb(&location);
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+	/* ids never carry the one-way flag and 0 is reserved for acks */
+	id = call_next_id;
+	call_next_id = (call_next_id + 1) & ~GPS_CALL_ONEWAY;
+	if (!call_next_id) {
+		call_next_id = 1;
+	}
+
+	call = gps_calls + slot;
+	call->id = id;
+	call->code = req->header.code;
+	call->len = len;
+	call->start_us = gps_now_us();
+	call->busy = 1;
+	call->done = 0;
+	call->rc = -1;
+	call->done_cb = done_cb;
+
+	memcpy(req->header.buffer + len, &id, sizeof(id));
+	if (gps_rpc_frame_write(cb_sock, req->header.code, req->header.buffer,
+		len + sizeof(id)))
+	{
+		RPC_ERROR("%s: failed to send %s", __func__,
+			gps_rpc_to_s(req->header.code));
+		call->busy = 0;
+		slot = -1;
+	}
+
+fail:
+	pthread_mutex_unlock(&call_mutex);
+	return slot;
+}
+
+/**
+ * Queues a one-way call on the channel. The caller only blocks if
+ * GPS_ONEWAY_WINDOW calls are still unacknowledged by the daemon.
+ * Returns nonzero if the channel is not available.
+ */
+static int gps_call_submit_oneway(rpc_request_t *req, size_t len) {
+	uint32_t id = GPS_CALL_ONEWAY;
+	int rc = -1;
+
+	if (len + sizeof(id) > RPC_PAYLOAD_MAX) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&call_mutex);
+	while (call_channel_up &&
+		(uint32_t)(oneway_sent - oneway_acked) >= GPS_ONEWAY_WINDOW)
+	{
+		pthread_cond_wait(&call_cond, &call_mutex);
+	}
+
+	if (!call_channel_up) {
+		goto fail;
+	}
+
+	memcpy(req->header.buffer + len, &id, sizeof(id));
+	if (gps_rpc_frame_write(cb_sock, req->header.code, req->header.buffer,
+		len + sizeof(id)))
+	{
+		RPC_ERROR("%s: failed to send %s", __func__,
+			gps_rpc_to_s(req->header.code));
+		goto fail;
+	}
+	oneway_sent++;
+	rc = 0;
+
+fail:
+	pthread_mutex_unlock(&call_mutex);
+	return rc;
+}
+
+/**
+ * Waits for the reply to a call. A call that gets no reply within
+ * GPS_CALL_TIMEOUT_MS fails, so that a daemon that never answers does not
+ * hang the framework thread that made it.
+ */
+static int gps_call_wait(int slot) {
+	struct gps_call *call = gps_calls + slot;
+	struct timespec deadline;
+	int rc = -1;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += GPS_CALL_TIMEOUT_MS / 1000;
+
+	pthread_mutex_lock(&call_mutex);
+	while (!call->done) {
+		if (pthread_cond_timedwait(&call_cond, &call_mutex,
+			&deadline) == ETIMEDOUT)
+		{
+			RPC_ERROR("%s: no reply to %s", __func__,
+				gps_rpc_to_s(call->code));
 			break;
+		}
+	}
+	if (call->done) {
+		rc = call->rc;
+	}
+	call->busy = 0;
+	pthread_cond_broadcast(&call_cond);
+	pthread_mutex_unlock(&call_mutex);
 
-		case GPS_STATUS_CB:
-			if (gpsCallbacks && gpsCallbacks->status_cb) {
-				GpsStatus status;
-				memset(&status, 0, sizeof(status));
-				RPC_UNPACK(buf, idx, status);
-				gpsCallbacks->status_cb(&status);
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+	return rc;
+}
+
+static void gps_call_finish_locked(struct gps_call *call, int rc) {
+	gps_call_done_t done_cb = call->done_cb;
+
+	call->rc = rc;
+	call->done = 1;
+
+	if (done_cb) {
+		gps_stats_record(&call_stats, call->code, call->len, rc,
+			gps_now_us() - call->start_us);
+		call->busy = 0;
+		pthread_mutex_unlock(&call_mutex);
+		done_cb(call->code, rc);
+		pthread_mutex_lock(&call_mutex);
+	}
+	pthread_cond_broadcast(&call_cond);
+}
+
+static void gps_call_complete(const char *buf, size_t len) {
+	struct gps_call_reply reply;
+	int i;
+
+	if (len < sizeof(reply)) {
+		RPC_ERROR("%s: malformed reply", __func__);
+		return;
+	}
+	memcpy(&reply, buf, sizeof(reply));
+
+	pthread_mutex_lock(&call_mutex);
+	if ((int32_t)(reply.oneway_done - oneway_acked) > 0) {
+		oneway_acked = reply.oneway_done;
+		pthread_cond_broadcast(&call_cond);
+	}
+
+	for (i = 0; reply.id && i < GPS_CALLS_MAX; i++) {
+		struct gps_call *call = gps_calls + i;
+		if (call->busy && !call->done && call->id == reply.id) {
+			gps_call_finish_locked(call, reply.rc);
 			break;
+		}
+	}
+	pthread_mutex_unlock(&call_mutex);
+}
 
-		case GPS_SV_STATUS_CB:
-			if (gpsCallbacks && gpsCallbacks->sv_status_cb) {
-				GpsSvStatus status;
-				memset(&status, 0, sizeof(status));
-				RPC_UNPACK(buf, idx, status);
-				gpsCallbacks->sv_status_cb(&status);
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
+static void gps_call_channel_set(int up) {
+	int i;
+
+	pthread_mutex_lock(&call_mutex);
+	call_channel_up = up;
+	oneway_sent = 0;
+	oneway_acked = 0;
+
+	/* nobody will answer the calls in flight any more */
+	if (!up) {
+		for (i = 0; i < GPS_CALLS_MAX; i++) {
+			struct gps_call *call = gps_calls + i;
+			if (call->busy && !call->done) {
+				gps_call_finish_locked(call, -1);
 			}
-			break;
+		}
+	}
+	pthread_cond_broadcast(&call_cond);
+	pthread_mutex_unlock(&call_mutex);
+}
+
+static void gps_call_log_error(uint32_t code, int rc) {
+	if (rc) {
+		RPC_ERROR("%s failed %d", gps_rpc_to_s(code), rc);
+	}
+}
+
+/******************************************************************************
+ * Callback Dispatch
+ *****************************************************************************/
+struct gps_cb_iface {
+	const char *name;
+	struct gps_cb_queue *queue;
+	pthread_t *thread;
+	void (*thread_func)(void *);
+};
 
+static struct gps_cb_iface gps_cb_ifaces[GPS_IFACE_MAX] = {
+	[GPS_IFACE_GPS] = { "gps", &queue_gps, &gps_cb_thread,
+		gps_cb_thread_func },
+	[GPS_IFACE_XTRA] = { "xtra", &queue_xtra, &xtra_cb_thread,
+		xtra_cb_thread_func },
+	[GPS_IFACE_AGPS] = { "agps", &queue_agps, &agps_cb_thread,
+		agps_cb_thread_func },
+	[GPS_IFACE_NI] = { "ni", &queue_ni, &ni_cb_thread,
+		ni_cb_thread_func },
+	[GPS_IFACE_RIL] = { "ril", &queue_ril, &ril_cb_thread,
+		ril_cb_thread_func },
+};
+
+/* returns the framework callbacks of an interface, NULL before its init */
+static const void *gps_cb_iface_callbacks(int iface) {
+	switch (iface) {
+		case GPS_IFACE_GPS:
+			return gpsCallbacks;
+		case GPS_IFACE_XTRA:
+			return xtraCallbacks;
+		case GPS_IFACE_AGPS:
+			return aGpsCallbacks;
+		case GPS_IFACE_NI:
+			return niCallbacks;
+		case GPS_IFACE_RIL:
+			return rilCallbacks;
+	}
+	return NULL;
+}
+
+static gps_create_thread gps_cb_iface_creator(int iface) {
+	switch (iface) {
+		case GPS_IFACE_GPS:
+			return gpsCallbacks ? gpsCallbacks->create_thread_cb : NULL;
+		case GPS_IFACE_XTRA:
+			return xtraCallbacks ? xtraCallbacks->create_thread_cb : NULL;
+		case GPS_IFACE_AGPS:
+			return aGpsCallbacks ? aGpsCallbacks->create_thread_cb : NULL;
+		case GPS_IFACE_NI:
+			return niCallbacks ? niCallbacks->create_thread_cb : NULL;
+		case GPS_IFACE_RIL:
+			return rilCallbacks ? rilCallbacks->create_thread_cb : NULL;
+	}
+	return NULL;
+}
+
+enum {
+	GPS_CB_ROUTE_NONE,
+	/* to the queue of the interface */
+	GPS_CB_ROUTE_QUEUE,
+	/* starts the thread of the interface */
+	GPS_CB_ROUTE_THREAD,
+	/* split into the records of one fix epoch */
+	GPS_CB_ROUTE_EPOCH,
+	/* completes a call made over the callback channel */
+	GPS_CB_ROUTE_REPLY,
+};
+
+struct gps_cb_route {
+	uint8_t kind;
+	uint8_t iface;
+	/* message flags of the protocol description */
+	uint16_t flags;
+	/* size of the fixed payload */
+	uint32_t len;
+};
+
+static const struct gps_cb_route gps_cb_routes[GPS_RPC_MAX] = {
+	#define GPS_CB_ROUTE(code, name, iface, flags, args) \
+		[code] = { GPS_CB_ROUTE_QUEUE, iface, flags, GPS_ARGS_SIZE(args) },
+	GPS_RPC_CALLBACKS(GPS_CB_ROUTE)
+	#undef GPS_CB_ROUTE
+
+	#define GPS_CB_THREAD_ROUTE(code, iface) \
+		[code] = { GPS_CB_ROUTE_THREAD, iface, 0, 0 },
+	GPS_RPC_THREAD_CALLBACKS(GPS_CB_THREAD_ROUTE)
+	#undef GPS_CB_THREAD_ROUTE
+
+	[GPS_EPOCH_CB] = { GPS_CB_ROUTE_EPOCH, GPS_IFACE_GPS, 0, 0 },
+	[GPS_PROXY_REPLY] = { GPS_CB_ROUTE_REPLY, GPS_IFACE_GPS, 0,
+		sizeof(struct gps_call_reply) },
+};
+
+/**
+ * Returns the number of payload bytes a callback actually uses, so that
+ * only those are copied into the queues.
+ */
+static size_t gps_cb_payload_len(uint32_t code, const char *buf) {
+	if (code >= GPS_RPC_MAX || !gps_cb_routes[code].kind) {
+		return RPC_PAYLOAD_MAX;
+	}
+
+	if (gps_cb_routes[code].flags & GPS_RPC_COMPACT) {
+		uint16_t len;
+		memcpy(&len, buf, sizeof(len));
+		if (len > RPC_PAYLOAD_MAX - sizeof(len)) {
+			return RPC_PAYLOAD_MAX;
+		}
+		return sizeof(len) + len;
+	}
+
+	switch (code) {
 		case GPS_NMEA_CB:
-			if (gpsCallbacks && gpsCallbacks->nmea_cb) {
-				char nmea[RPC_PAYLOAD_MAX] = {};
-				GpsUtcTime timestamp;
+			{
 				int length;
-
-				RPC_UNPACK(buf, idx, timestamp);
-				RPC_UNPACK(buf, idx, length);
-				RPC_UNPACK_RAW(buf, idx, nmea, length);
-			
-				gpsCallbacks->nmea_cb(timestamp,
-					nmea, length);
+				size_t len = GPS_ARGS_SIZE(GPS_ARGS_NMEA);
+				memcpy(&length, buf + sizeof(GpsUtcTime), sizeof(length));
+				if (length < 0 || len + length > RPC_PAYLOAD_MAX) {
+					return RPC_PAYLOAD_MAX;
+				}
+				return len + length;
 			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
+		case GPS_SV_DELTA_CB:
+			{
+				size_t len = gps_sv_delta_size(buf, RPC_PAYLOAD_MAX);
+				return len ? len : RPC_PAYLOAD_MAX;
 			}
+		case GPS_EPOCH_CB:
+			{
+				uint32_t len;
+				memcpy(&len, buf, sizeof(len));
+				if (len > RPC_PAYLOAD_MAX - sizeof(len)) {
+					return RPC_PAYLOAD_MAX;
+				}
+				return sizeof(len) + len;
+			}
+	}
+	return gps_cb_routes[code].len;
+}
+
+/**
+ * Splits the trace the daemon appended to a callback off its payload.
+ * Returns the length of the payload.
+ */
+static size_t gps_cb_trace_strip(uint32_t code, const char *buf, size_t len,
+	struct gps_cb_stamp *stamp)
+{
+	struct gps_cb_trace trace;
+	size_t payload = gps_cb_payload_len(code, buf);
+
+	memset(stamp, 0, sizeof(*stamp));
+	if (payload + sizeof(trace) > len) {
+		return len;
+	}
+
+	memcpy(&trace, buf + payload, sizeof(trace));
+	stamp->origin_us = trace.origin_us;
+	stamp->sent_us = trace.sent_us;
+	return payload;
+}
+
+/**
+ * Queues a callback for the GPS thread. Locations and SV status replace
+ * their unread predecessors, NMEA sentences overwrite the oldest ones,
+ * everything else waits for room in the ring.
+ */
+static void gps_cb_gps_push(uint32_t code, const char *buf, size_t len,
+	const struct gps_cb_stamp *stamp)
+{
+	switch (code) {
+		case GPS_LOC_CB:
+		case GPS_LOC_COMPACT_CB:
+			pthread_mutex_lock(&queue_mutex);
+			gps_cb_mailbox_put(&loc_box, code, buf, len, stamp,
+				&loc_conflated);
+			pthread_mutex_unlock(&queue_mutex);
 			break;
 
-		case GPS_SET_CAPABILITIES_CB:
-			if (gpsCallbacks && gpsCallbacks->set_capabilities_cb) {
-				uint32_t caps = 0;
-				RPC_UNPACK(buf, idx, caps);
-				RPC_DEBUG("SET_CAPABILITIEST %x", caps);
-				gpsCallbacks->set_capabilities_cb(caps);
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+		case GPS_SV_STATUS_CB:
+			pthread_mutex_lock(&queue_mutex);
+			gps_cb_mailbox_put(&sv_box, code, buf, len, stamp,
+				&sv_conflated);
+			pthread_mutex_unlock(&queue_mutex);
 			break;
 
-		case GPS_ACQUIRE_LOCK_CB:
-			if (gpsCallbacks && gpsCallbacks->acquire_wakelock_cb) {
-				gpsCallbacks->acquire_wakelock_cb();
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
+		case GPS_SV_DELTA_CB:
+			/* deltas cannot be conflated, apply them here */
+			pthread_mutex_lock(&queue_mutex);
+			if (!gps_sv_delta_apply((char*)buf)) {
+				gps_cb_mailbox_put(&sv_box, GPS_SV_STATUS_CB, &sv_table,
+					sizeof(sv_table), stamp, &sv_conflated);
 			}
+			pthread_mutex_unlock(&queue_mutex);
 			break;
 
-		case GPS_RELEASE_LOCK_CB:
-			if (gpsCallbacks && gpsCallbacks->release_wakelock_cb) {
-				gpsCallbacks->release_wakelock_cb();
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+		case GPS_NMEA_CB:
+			pthread_mutex_lock(&queue_mutex);
+			gps_nmea_put(buf, len, stamp);
+			pthread_mutex_unlock(&queue_mutex);
 			break;
 
-		case GPS_REQUEST_UTC_TIME_CB:
-			if (gpsCallbacks && gpsCallbacks->request_utc_time_cb) {
-				gpsCallbacks->request_utc_time_cb();
-			}
-			else {
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+		default:
+			gps_cb_queue_push(&queue_gps, code, buf, len, stamp);
 			break;
-		}
-fail:
-		continue;
 	}
 }
 
-static void agps_cb_thread_func(void* unused) {
-	LOG_ENTRY;
-	while (pipe_agps[0] >= 0) {
-		struct rpc_request_hdr_t hdr;
-		memset(&hdr, 0, sizeof(hdr));
-		if (read(pipe_agps[READ_END], &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			RPC_ERROR("failed to read request header");
-			break;
+/**
+ * Queues the callbacks of one fix epoch for the GPS thread. Each record
+ * carries its own origin, the epoch carries the time it was sent.
+ */
+static void gps_cb_split_epoch(const char *buf, size_t len,
+	const struct gps_cb_stamp *epoch)
+{
+	struct gps_cb_stamp stamp;
+	struct gps_rpc_frame frame;
+	size_t payload;
+	uint32_t epoch_len;
+	size_t idx;
+
+	if (len < sizeof(epoch_len)) {
+		return;
+	}
+
+	memcpy(&epoch_len, buf, sizeof(epoch_len));
+	if (epoch_len > len - sizeof(epoch_len)) {
+		RPC_ERROR("%s: truncated epoch", __func__);
+		return;
+	}
+
+	idx = sizeof(epoch_len);
+	len = sizeof(epoch_len) + epoch_len;
+
+	while (idx + sizeof(frame) <= len) {
+		memcpy(&frame, buf + idx, sizeof(frame));
+		idx += sizeof(frame);
+
+		if (frame.len > len - idx ||
+			frame.len < gps_cb_payload_len(frame.code, buf + idx))
+		{
+			RPC_ERROR("%s: malformed record %x", __func__, frame.code);
+			return;
 		}
-		
-		char *buf = hdr.buffer;
-		size_t idx = 0;
-		
-		RPC_DEBUG("%s: request code %d", __func__, hdr.code);
-
-		switch (hdr.code) {
-		case AGPS_STATUS_CB:
-			if (aGpsCallbacks && aGpsCallbacks->status_cb) {
-				AGpsStatus status;
-				memset(&status, 0, sizeof(status));
-				RPC_UNPACK(buf, idx, status);
-				aGpsCallbacks->status_cb(&status);
+
+		payload = gps_cb_trace_strip(frame.code, buf + idx, frame.len,
+			&stamp);
+		stamp.sent_us = epoch->sent_us;
+
+		gps_cb_gps_push(frame.code, buf + idx, payload, &stamp);
+		idx += frame.len;
+	}
+}
+
+/**
+ * Routes a callback from the daemon to the thread of its interface.
+ * Used by both the RPC socket handler and the callback channel.
+ */
+static int gps_cb_dispatch(uint32_t code, const char *buf, size_t len) {
+	const struct gps_cb_route *route;
+	struct gps_cb_iface *iface;
+	struct gps_cb_stamp stamp;
+	gps_create_thread create;
+
+	if (code >= GPS_RPC_MAX || !gps_cb_routes[code].kind) {
+		RPC_ERROR("unknown code %x", code);
+		return 0;
+	}
+
+	len = gps_cb_trace_strip(code, buf, len, &stamp);
+	route = gps_cb_routes + code;
+	iface = gps_cb_ifaces + route->iface;
+
+	if (route->kind == GPS_CB_ROUTE_REPLY) {
+		gps_call_complete(buf, len);
+		return 0;
+	}
+
+	if (!gps_cb_iface_callbacks(route->iface)) {
+		RPC_ERROR("%s: %s callbacks are NULL", __func__, iface->name);
+		return -1;
+	}
+
+	switch (route->kind) {
+		case GPS_CB_ROUTE_QUEUE:
+			if (route->iface == GPS_IFACE_GPS) {
+				gps_cb_gps_push(code, buf, len, &stamp);
 			}
 			else {
-				RPC_ERROR("aGpsCallbacks == NULL");
+				gps_cb_queue_push(iface->queue, code, buf, len, &stamp);
 			}
 			break;
-		}
-fail:
-		continue;
-	}
-	LOG_EXIT;
-}
 
-static void ni_cb_thread_func(void* unused) {
-	LOG_ENTRY;
-	while (pipe_ni[0] >= 0) {
-		struct rpc_request_hdr_t hdr;
-		memset(&hdr, 0, sizeof(hdr));
-		if (read(pipe_ni[READ_END], &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			RPC_ERROR("failed to read request header");
+		case GPS_CB_ROUTE_EPOCH:
+			gps_cb_split_epoch(buf, len, &stamp);
 			break;
-		}
-		
-		char *buf = hdr.buffer;
-		size_t idx = 0;
-		
-		RPC_DEBUG("%s: request code %d", __func__, hdr.code);
-
-		switch (hdr.code) {
-		case NI_NOTIFY_CB:
-			if (niCallbacks && niCallbacks->notify_cb) {
-				GpsNiNotification nfy;
-				memset(&nfy, 0, sizeof(nfy));
-				RPC_UNPACK(buf, idx, nfy);
-				niCallbacks->notify_cb(&nfy);
+
+		case GPS_CB_ROUTE_THREAD:
+			if (*iface->thread) {
+				/* the blob is shared and was set up by another client */
+				break;
 			}
-			else {
-				RPC_ERROR("niCallbacks == NULL");
+
+			create = gps_cb_iface_creator(route->iface);
+			if (!create) {
+				RPC_ERROR("%s: %s create_thread_cb is NULL", __func__,
+					iface->name);
+				return -1;
 			}
+			*iface->thread = create(iface->name, iface->thread_func, NULL);
 			break;
-		}
-fail:
-		continue;
 	}
-	LOG_EXIT;
+
+	return 0;
 }
 
-static void xtra_cb_thread_func(void* unused) {
+static int gps_rpc_handler(rpc_request_hdr_t *hdr, rpc_reply_t *reply) {
 	LOG_ENTRY;
-	while (pipe_xtra[0] >= 0) {
-		struct rpc_request_hdr_t hdr;
-		memset(&hdr, 0, sizeof(hdr));
-		if (read(pipe_xtra[READ_END], &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			RPC_ERROR("failed to read request header");
-			break;
-		}
-		
-		char *buf = hdr.buffer;
-		size_t idx = 0;
-		
-		RPC_DEBUG("%s: request code %d", __func__, hdr.code);
+	
+	if (!hdr) {
+		RPC_ERROR("hdr is NULL");
+		goto fail;
+	}
 
-		switch (hdr.code) {
-		case XTRA_REQUEST_CB:
-			if (xtraCallbacks && xtraCallbacks->download_request_cb) {
-				xtraCallbacks->download_request_cb();
-			}
-			else {
-				RPC_ERROR("xtraCallbacks == NULL");
-			}
-			break;
-		}
-fail:
-		continue;
+	if (!reply) {
+		RPC_ERROR("reply is NULL");
+		goto fail;
 	}
+	
+	RPC_INFO("rpc handler code %x : %s", hdr->code,	gps_rpc_to_s(hdr->code));
+	reply->code = hdr->code;
+
+	/* include the trace that may follow the payload */
+	size_t len = gps_cb_payload_len(hdr->code, hdr->buffer) +
+		sizeof(struct gps_cb_trace);
+	gps_cb_dispatch(hdr->code, hdr->buffer,
+		len < RPC_PAYLOAD_MAX ? len : RPC_PAYLOAD_MAX);
+
+fail:
 	LOG_EXIT;
+	return 0;
 }
 
-static void ril_cb_thread_func(void* unused) {
-	LOG_ENTRY;
-	while (pipe_ril[0] >= 0) {
-		struct rpc_request_hdr_t hdr;
-		memset(&hdr, 0, sizeof(hdr));
-		if (read(pipe_ril[READ_END], &hdr, sizeof(hdr)) != sizeof(hdr)) {
-			RPC_ERROR("failed to read request header");
-			break;
+/**
+ * Marks the connection to the daemon as lost and wakes up the client
+ * thread to reconnect. Safe to call any number of times.
+ */
+static void gps_link_down(const char *why) {
+	pthread_mutex_lock(&link_mutex);
+	if (link_up) {
+		RPC_ERROR("lost the connection to the daemon: %s", why);
+		link_up = 0;
+		pthread_cond_broadcast(&link_cond);
+	}
+	pthread_mutex_unlock(&link_mutex);
+}
+
+/**
+ * Drains the shared memory ring straight into the interface queues.
+ * Returns when the daemon closes the channel socket.
+ */
+static void gps_cb_ring_loop(void) {
+	struct gps_shm_record *rec;
+
+	while (cb_ring) {
+		rec = gps_shm_ring_peek(cb_ring);
+		if (rec) {
+			gps_cb_dispatch(rec->code, rec->data, rec->len);
+			gps_shm_ring_consume(cb_ring, rec);
+			continue;
 		}
-		
-		char *buf = hdr.buffer;
-		size_t idx = 0;
-		
-		RPC_DEBUG("%s: request code %d", __func__, hdr.code);
-
-		switch (hdr.code) {
-		case RIL_SET_ID_CB:
-			if (rilCallbacks && rilCallbacks->request_setid) {
-				uint32_t flags;
-				RPC_UNPACK(buf, idx, flags);
-				rilCallbacks->request_setid(flags);
-			}
-			else {
-				RPC_ERROR("rilCallbacks == NULL");
+
+		if (!gps_shm_ring_prepare_wait(cb_ring)) {
+			continue;
+		}
+
+		struct pollfd pfd[2] = {
+			{ .fd = cb_event_fd, .events = POLLIN },
+			{ .fd = cb_sock, .events = POLLIN },
+		};
+
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			RPC_ERROR("%s: poll failed %s", __func__, strerror(errno));
+			break;
+		}
+
+		if (pfd[1].revents) {
 			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			eventfd_t val;
+			eventfd_read(cb_event_fd, &val);
+		}
+	}
+}
+
+static void gps_cb_frame_loop(void) {
+	struct gps_rpc_frame frame;
+	char buf[RPC_PAYLOAD_MAX];
+
+	while (!gps_rpc_frame_read(cb_sock, &frame, buf, sizeof(buf))) {
+		gps_cb_dispatch(frame.code, buf, frame.len);
+	}
+}
+
+static void* cb_channel_thread_func(void* unused) {
+	LOG_ENTRY;
 
-		case RIL_REF_LOC_CB:
-			if (rilCallbacks && rilCallbacks->request_refloc) {
-				uint32_t flags;
-				RPC_UNPACK(buf, idx, flags);
-				rilCallbacks->request_refloc(flags);
-			}
-			else {
-				RPC_ERROR("rilCallbacks == NULL");
-			}
-			break;
-		}
-fail:
-		continue;
+	gps_call_channel_set(1);
+
+	if (cb_ring) {
+		gps_cb_ring_loop();
 	}
+	else {
+		gps_cb_frame_loop();
+	}
+
+	gps_call_channel_set(0);
+	gps_link_down("callback channel closed");
+
+	RPC_INFO("%s: callback channel closed", __func__);
 	LOG_EXIT;
+	return NULL;
 }
 
-static int gps_rpc_handler(rpc_request_hdr_t *hdr, rpc_reply_t *reply) {
-	LOG_ENTRY;
-	
-	int rc = -1;
-	if (!hdr) {
-		RPC_ERROR("hdr is NULL");
-		goto fail;
+/**
+ * Handles a call made before the session is restored on a connection.
+ * Returns nonzero if the call was taken care of, with its result in @rc:
+ * state the replay restores succeeds right away, other calls are queued,
+ * and XTRA data, which the daemon asks for again anyway, is refused.
+ */
+static int gps_call_deferred(rpc_request_t *req, size_t len, int *rc) {
+	char *data = NULL;
+
+	/* the client thread itself restores the session */
+	if (pthread_equal(pthread_self(), gps_rpc_thread)) {
+		return 0;
 	}
 
-	if (!reply) {
-		RPC_ERROR("reply is NULL");
-		goto fail;
+	pthread_mutex_lock(&pending_mutex);
+	if (link_ready) {
+		pthread_mutex_unlock(&pending_mutex);
+		return 0;
 	}
-	
-	rc = 0;
-	RPC_INFO("rpc handler code %x : %s", hdr->code,	gps_rpc_to_s(hdr->code));
-	reply->code = hdr->code;
-	
-	char *buf = hdr->buffer;
-	size_t idx = 0;
 
-	switch (hdr->code) {
-		case GPS_LOC_CB:
-		case GPS_STATUS_CB:
-		case GPS_SV_STATUS_CB:
-		case GPS_NMEA_CB:
-		case GPS_SET_CAPABILITIES_CB:
-		case GPS_ACQUIRE_LOCK_CB:
-		case GPS_RELEASE_LOCK_CB:
-		case GPS_REQUEST_UTC_TIME_CB:
-			if (gpsCallbacks) {
-				write(pipe_gps[WRITE_END], hdr, sizeof(rpc_request_hdr_t));
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
+	*rc = 0;
+	switch (req->header.code) {
+		case GPS_PROXY_GPS_INIT:
+		case GPS_PROXY_GPS_START:
+		case GPS_PROXY_GPS_STOP:
+		case GPS_PROXY_GPS_CLEANUP:
+		case GPS_PROXY_GPS_SET_POSITION_MODE:
+		case GPS_PROXY_XTRA_INIT:
+		case GPS_PROXY_AGPS_INIT:
+		case GPS_PROXY_AGPS_AGPS_SET_SERVER:
+		case GPS_PROXY_NI_INIT:
+		case RIL_INIT:
+		case RIL_SET_REF_LOC:
+		case RIL_SET_SET_ID:
+		case RIL_UPDATE_NET_STATE:
+		case RIL_UPDATE_NET_AVAILABILITY:
 			break;
 
-		case AGPS_STATUS_CB:
-			if (aGpsCallbacks) {
-				write(pipe_agps[WRITE_END], hdr, sizeof(rpc_request_hdr_t));
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("aGpsCallbacks == NULL");
-			}
+		case GPS_PROXY_XTRA_INJECT_XTRA_DATA:
+		case GPS_PROXY_XTRA_INJECT_XTRA_CHUNK:
+			*rc = -1;
 			break;
 
-		case NI_NOTIFY_CB:
-			if (niCallbacks) {
-				write(pipe_ni[WRITE_END], hdr, sizeof(rpc_request_hdr_t));
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("niCallbacks == NULL");
+		default:
+			if (len) {
+				data = malloc(len);
+				if (!data) {
+					RPC_ERROR("%s: out of memory", __func__);
+					*rc = -1;
+					break;
+				}
+				memcpy(data, req->header.buffer, len);
 			}
-			break;
 
-		case XTRA_REQUEST_CB:
-			if (xtraCallbacks) {
-				write(pipe_xtra[WRITE_END], hdr, sizeof(rpc_request_hdr_t));
+			if (pending_count == GPS_PENDING_MAX) {
+				free(pending_calls[0].data);
+				memmove(pending_calls, pending_calls + 1,
+					sizeof(pending_calls[0]) * (GPS_PENDING_MAX - 1));
+				pending_count--;
+				pending_dropped++;
 			}
-			else {
-				rc = -1;
-				RPC_ERROR("xtraCallbacks == NULL");
-			}
-			break;
 
-		case RIL_SET_ID_CB:
-		case RIL_REF_LOC_CB:
-			if (rilCallbacks) {
-				write(pipe_ril[WRITE_END], hdr, sizeof(rpc_request_hdr_t));
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("rilCallbacks == NULL");
-			}
-			break;
-		
-		case AGPS_CREATE_THREAD_CB:
-			if (aGpsCallbacks && aGpsCallbacks->create_thread_cb) {
-				agps_cb_thread =
-					aGpsCallbacks->create_thread_cb("agps",
-					agps_cb_thread_func, NULL);
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("aGpsCallbacks == NULL");
-			}
-			break;
-		case NI_CREATE_THREAD_CB:
-			if (niCallbacks && niCallbacks->create_thread_cb) {
-				ni_cb_thread = niCallbacks->create_thread_cb("ni",
-					ni_cb_thread_func, NULL);
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("niCallbacks == NULL");
-			}
-			break;
-		case GPS_CREATE_THREAD_CB:
-			if (gpsCallbacks && gpsCallbacks->create_thread_cb) {
-				gps_cb_thread = gpsCallbacks->create_thread_cb("gps",
-					gps_cb_thread_func, NULL);
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("gpsCallbacks == NULL");
-			}
-			break;
-		case XTRA_CREATE_THREAD_CB:
-			if (xtraCallbacks && xtraCallbacks->create_thread_cb) {
-				xtra_cb_thread = xtraCallbacks->create_thread_cb("xtra",
-					xtra_cb_thread_func, NULL);
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("xtraCallbacks == NULL");
-			}
-			break;
-		case RIL_CREATE_THREAD_CB:
-			if (rilCallbacks && rilCallbacks->create_thread_cb) {
-				ril_cb_thread = rilCallbacks->create_thread_cb("ril",
-					ril_cb_thread_func, NULL);
-			}
-			else {
-				rc = -1;
-				RPC_ERROR("rilCallbacks == NULL");
-			}
-			break;
-		
-		default:
-			RPC_ERROR("unknown code %x", hdr->code);
+			pending_calls[pending_count].code = req->header.code;
+			pending_calls[pending_count].len = len;
+			pending_calls[pending_count].data = data;
+			pending_count++;
 			break;
 	}
+	pthread_mutex_unlock(&pending_mutex);
 
-fail:
-	LOG_EXIT;
-	return 0;
+	RPC_DEBUG("%s: %s deferred, rc %d", __func__,
+		gps_rpc_to_s(req->header.code), *rc);
+	return 1;
 }
 
-static int rpc_call_result(rpc_t *rpc, rpc_request_t *req)
+static int rpc_call_result(rpc_request_t *req, size_t len)
 {
 	LOG_ENTRY;
 	int rc = -1;
 
-	if (!rpc) {
-		RPC_ERROR("rpc is NULL");
+	if (!req) {
+		RPC_ERROR("request is NULL");
 		goto fail;
 	}
 
-	if (!req) {
-		RPC_ERROR("request is NULL");
+	if (gps_call_deferred(req, len, &rc)) {
 		goto fail;
 	}
 
-	rc = rpc_call(rpc, req);
+	uint64_t start_us = gps_now_us();
+
+	int slot = gps_call_submit(req, len, NULL);
+	if (slot >= 0) {
+		rc = gps_call_wait(slot);
+		goto done;
+	}
+
+	pthread_rwlock_rdlock(&gps_rpc_lock);
+	if (!gps_rpc) {
+		pthread_rwlock_unlock(&gps_rpc_lock);
+		RPC_ERROR("rpc is NULL");
+		goto done;
+	}
+
+	/* the RPC socket sends the whole buffer, requests are not cleared */
+	memset(req->header.buffer + len, 0, RPC_PAYLOAD_MAX - len);
+	rc = rpc_call(gps_rpc, req);
+	pthread_rwlock_unlock(&gps_rpc_lock);
 	if (rc < 0) {
 		RPC_ERROR("rpc_call failed %d", rc);
-		goto fail;
+		gps_link_down("rpc_call failed");
+		goto done;
 	}
 	RPC_DEBUG("%s: rpc_call done", __func__);
 
 	size_t idx = 0;
 	RPC_UNPACK(req->reply.buffer, idx, rc);
+done:
+	gps_stats_record(&call_stats, req->header.code, len, rc,
+		gps_now_us() - start_us);
 fail:
 	LOG_EXIT;
 	return rc;
 }
 
+/**
+ * Sends a call that has no result. The caller does not wait for the daemon
+ * unless too many one-way calls are unacknowledged.
+ */
+static void rpc_call_oneway(rpc_request_t *req, size_t len) {
+	uint64_t start_us;
+	int rc;
+
+	if (gps_call_deferred(req, len, &rc)) {
+		return;
+	}
+
+	/* only the time to send is known, which includes window stalls */
+	start_us = gps_now_us();
+	rc = gps_call_submit_oneway(req, len);
+	if (!rc) {
+		goto done;
+	}
+
+	pthread_rwlock_rdlock(&gps_rpc_lock);
+	if (!gps_rpc) {
+		pthread_rwlock_unlock(&gps_rpc_lock);
+		RPC_ERROR("rpc is NULL");
+		rc = -1;
+		goto done;
+	}
+
+	memset(req->header.buffer + len, 0, RPC_PAYLOAD_MAX - len);
+	rc = rpc_call_noreply(gps_rpc, req);
+	pthread_rwlock_unlock(&gps_rpc_lock);
+	if (rc < 0) {
+		RPC_ERROR("%s: failed to send %s", __func__,
+			gps_rpc_to_s(req->header.code));
+		gps_link_down("rpc_call_noreply failed");
+	}
+
+done:
+	gps_stats_record(&call_stats, req->header.code, len, rc < 0,
+		gps_now_us() - start_us);
+}
+
+/**
+ * Sends a call without waiting for its result, which is only logged.
+ * Falls back to a blocking call if the channel is unavailable.
+ */
+static int rpc_call_async(rpc_request_t *req, size_t len) {
+	int rc;
+
+	if (gps_call_deferred(req, len, &rc)) {
+		return rc;
+	}
+
+	if (gps_call_submit(req, len, gps_call_log_error) >= 0) {
+		return 0;
+	}
+	return rpc_call_result(req, len);
+}
+
+static void gps_call_stats_report(void) {
+	struct gps_call_stats st;
+	unsigned code;
+
+	for (code = 0; code < GPS_RPC_MAX; code++) {
+		gps_stats_merge(&call_stats, code, &st);
+		if (!st.calls) {
+			continue;
+		}
+
+		RPC_INFO("%s: %llu calls, %llu errors, %llu bytes, p50 %lluus, "
+			"p99 %lluus, max %lluus", gps_rpc_to_s(code),
+			(unsigned long long)st.calls,
+			(unsigned long long)st.errors,
+			(unsigned long long)st.bytes,
+			(unsigned long long)gps_latency_hist_percentile(&st.latency, 50),
+			(unsigned long long)gps_latency_hist_percentile(&st.latency, 99),
+			(unsigned long long)st.latency.max);
+	}
+}
+
+/**
+ * Tells the daemon when the first fix of a session reached the framework,
+ * so that it can split the time to first fix into proxy and receiver time.
+ */
+static void gps_ttff_fix_delivered(void) {
+	struct gps_ttff_report report;
+	struct rpc_request_t req;
+	char *buf = req.header.buffer;
+
+	size_t idx = 0;
+
+	req.header.code = GPS_PROXY_TTFF_REPORT;
+
+	report.start_us = __atomic_exchange_n(&ttff_start_us, 0,
+		__ATOMIC_RELAXED);
+	if (!report.start_us) {
+		return;
+	}
+	report.fix_us = gps_boottime_us();
+
+	RPC_INFO("first fix %llu ms after gps_start",
+		(unsigned long long)((report.fix_us - report.start_us) / 1000));
+
+	if (gps_pack_ttff_report(buf, &idx, &report)) {
+		goto fail;
+	}
+	rpc_call_oneway(&req, idx);
+fail:
+	return;
+}
+
 /******************************************************************************
  * RPC Transport Setup
  *****************************************************************************/
-static void close_pipes(void) {
-	CHECK_CLOSE(pipe_gps[READ_END]);
-	CHECK_CLOSE(pipe_gps[WRITE_END]);
-	CHECK_CLOSE(pipe_agps[READ_END]);
-	CHECK_CLOSE(pipe_agps[WRITE_END]);
-	CHECK_CLOSE(pipe_ni[READ_END]);
-	CHECK_CLOSE(pipe_ni[WRITE_END]);
-	CHECK_CLOSE(pipe_xtra[READ_END]);
-	CHECK_CLOSE(pipe_xtra[WRITE_END]);
-	CHECK_CLOSE(pipe_ril[READ_END]);
-	CHECK_CLOSE(pipe_ril[WRITE_END]);
+static void free_queues(void) {
+	gps_cb_queue_free(&queue_gps);
+	gps_cb_queue_free(&queue_agps);
+	gps_cb_queue_free(&queue_ni);
+	gps_cb_queue_free(&queue_xtra);
+	gps_cb_queue_free(&queue_ril);
 }
 
 static void gps_proxy_cleanup(void) {
 	LOG_ENTRY;
 
+	gps_call_stats_report();
+
+	pthread_mutex_lock(&queue_mutex);
+	if (queue_count) {
+		RPC_INFO("callbacks: %llu queued, %llu bytes, %llu bytes/cb, "
+			"%zu bytes/cb unframed, %llu stalls",
+			(unsigned long long)queue_count,
+			(unsigned long long)queue_bytes,
+			(unsigned long long)(queue_bytes / queue_count),
+			sizeof(rpc_request_hdr_t),
+			(unsigned long long)queue_stalls);
+	}
+	queue_count = 0;
+	queue_bytes = 0;
+	queue_stalls = 0;
+	pthread_mutex_unlock(&queue_mutex);
+
 	pthread_mutex_lock(&gps_mutex);
 
 	xtraCallbacks = NULL;
@@ -542,6 +1978,7 @@ static void gps_proxy_cleanup(void) {
 	gpsCallbacks = NULL;
 	niCallbacks = NULL;
 	rilCallbacks = NULL;
+	memset(&session, 0, sizeof(session));
 
 	pthread_mutex_unlock(&gps_mutex);
 
@@ -568,7 +2005,10 @@ static int start_rpc(int fd) {
 		goto fail;
 	}
 
+	pthread_rwlock_wrlock(&gps_rpc_lock);
 	gps_rpc = rpc;
+	client_fd = fd;
+	pthread_rwlock_unlock(&gps_rpc_lock);
 
 	LOG_EXIT;
 	return 0;
@@ -580,14 +2020,17 @@ fail:
 	return -1;
 }
 
-static int gps_proxy_socket_open(void) {
-	int rc;
-	int retry = GPS_SOCKET_RETRY_COUNT;
+/**
+ * Connects to the daemon, retrying with exponential backoff until it is
+ * up. Returns the socket and the number of attempts it took.
+ */
+static int gps_proxy_socket_open(int *attempts) {
+	unsigned backoff_ms = GPS_RECONNECT_MIN_MS;
 	int fd = -1;
 
 	LOG_ENTRY;
 
-	while (retry--) {
+	for (*attempts = 1; ; (*attempts)++) {
 		fd = socket_local_client(
 			GPS_RPC_SOCKET_NAME,
 			ANDROID_SOCKET_NAMESPACE_ABSTRACT,
@@ -595,12 +2038,17 @@ static int gps_proxy_socket_open(void) {
 		if (fd >= 0) {
 			break;
 		}
-		else {
-			RPC_ERROR("%s: fd %d, errno %d, err %s",
+
+		if (*attempts == 1) {
+			RPC_ERROR("%s: fd %d, errno %d, err %s, retrying",
 				__func__, fd, errno, strerror(errno));
 		}
 
-		usleep(500);
+		usleep(backoff_ms * 1000);
+		backoff_ms *= 2;
+		if (backoff_ms > GPS_RECONNECT_MAX_MS) {
+			backoff_ms = GPS_RECONNECT_MAX_MS;
+		}
 	}
 
 	LOG_EXIT;
@@ -608,33 +2056,311 @@ static int gps_proxy_socket_open(void) {
 	return fd;
 }
 
-static void* gps_client(void* unused) {
-	int client_fd = -1;
+/**
+ * Connects the callback channel. The daemon answers with the size of the
+ * shared memory ring and its descriptors, or with a zero size if it will
+ * send length-prefixed frames over the channel socket instead.
+ */
+static int gps_cb_channel_attach(void) {
+	struct gps_shm_ring *ring = NULL;
+	uint32_t map_size = 0;
+	int fds[2] = {-1, -1};
+	int sock = -1;
+	int nfds;
+
+	LOG_ENTRY;
+
+	sock = socket_local_client(GPS_CB_SOCKET_NAME,
+		ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+	if (sock < 0) {
+		RPC_ERROR("%s: callback channel is unavailable", __func__);
+		goto fail;
+	}
+
+	if (gps_rpc_frame_write(sock, GPS_PROXY_CB_ATTACH, NULL, 0)) {
+		RPC_ERROR("%s: failed to attach the callback channel", __func__);
+		goto fail;
+	}
+
+	nfds = gps_shm_recv_fds(sock, &map_size, sizeof(map_size), fds, 2);
+	if (nfds < 0 || (map_size && nfds != 2)) {
+		RPC_ERROR("%s: failed to set up the callback channel", __func__);
+		goto fail;
+	}
+
+	if (map_size) {
+		ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fds[0], 0);
+		if (ring == MAP_FAILED) {
+			RPC_ERROR("%s: failed to map the ring", __func__);
+			ring = NULL;
+			goto fail;
+		}
+
+		if (!gps_shm_ring_valid(ring, map_size)) {
+			RPC_ERROR("%s: invalid ring", __func__);
+			goto fail;
+		}
+		CHECK_CLOSE(fds[0]);
+	}
+
+	cb_ring = ring;
+	cb_map_size = map_size;
+	cb_event_fd = fds[1];
+	cb_sock = sock;
+
+	if (pthread_create(&cb_channel_thread, NULL, cb_channel_thread_func,
+		NULL))
+	{
+		RPC_ERROR("%s: failed to start the callback thread", __func__);
+		cb_ring = NULL;
+		cb_event_fd = -1;
+		cb_sock = -1;
+		goto fail;
+	}
+
+	LOG_EXIT;
+	return 0;
+
+fail:
+	if (ring) {
+		munmap(ring, map_size);
+	}
+	CHECK_CLOSE(fds[0]);
+	CHECK_CLOSE(fds[1]);
+	CHECK_CLOSE(sock);
+	LOG_EXIT;
+	return -1;
+}
+
+/**
+ * Stops the callback thread and releases the channel, if there is one.
+ */
+static void gps_cb_channel_detach(void) {
+	if (cb_sock < 0) {
+		return;
+	}
+
+	shutdown(cb_sock, SHUT_RDWR);
+	pthread_join(cb_channel_thread, NULL);
+
+	if (cb_ring) {
+		munmap(cb_ring, cb_map_size);
+		cb_ring = NULL;
+	}
+	CHECK_CLOSE(cb_event_fd);
+	CHECK_CLOSE(cb_sock);
+}
+
+/**
+ * Tears down a dead connection. Callers still blocked on the old socket
+ * fail once it is shut down, after which nobody can use the old rpc.
+ */
+static void gps_disconnect(void) {
+	rpc_t *rpc;
+	int fd;
+
+	pthread_mutex_lock(&pending_mutex);
+	link_ready = 0;
+	pthread_mutex_unlock(&pending_mutex);
+
+	gps_cb_channel_detach();
+
+	if (client_fd >= 0) {
+		shutdown(client_fd, SHUT_RDWR);
+	}
+
+	pthread_rwlock_wrlock(&gps_rpc_lock);
+	rpc = gps_rpc;
+	fd = client_fd;
+	gps_rpc = NULL;
+	client_fd = -1;
+	pthread_rwlock_unlock(&gps_rpc_lock);
+
+	if (rpc) {
+		if (rpc_join(rpc)) {
+			RPC_ERROR("failed to wait for RPC completion");
+		}
+		rpc_free(rpc);
+	}
+	CHECK_CLOSE(fd);
+}
+
+/**
+ * Agrees with the daemon on the protocol features to use. A daemon that
+ * predates the handshake does not answer with the magic and gets the
+ * features it has always had.
+ */
+static void gps_proxy_open(void) {
+	struct gps_proxy_open ours;
+	struct gps_proxy_open peer;
+	rpc_request_t req;
+	uint32_t features = GPS_FEATURES_LEGACY;
+	size_t idx = 0;
+	int rc = -1;
+
+	req.header.code = GPS_PROXY_OPEN;
+	gps_proxy_open_init(&ours, GPS_LIB_FEATURES, getpid());
+	if (gps_pack_proxy_open(req.header.buffer, &idx, &ours)) {
+		goto fail;
+	}
+	memset(req.header.buffer + idx, 0, RPC_PAYLOAD_MAX - idx);
+
+	pthread_rwlock_rdlock(&gps_rpc_lock);
+	if (gps_rpc) {
+		rc = rpc_call(gps_rpc, &req);
+	}
+	pthread_rwlock_unlock(&gps_rpc_lock);
+	if (rc < 0) {
+		RPC_ERROR("%s: rpc_call failed %d", __func__, rc);
+		gps_link_down("rpc_call failed");
+		goto fail;
+	}
+
+	idx = 0;
+	RPC_UNPACK(req.reply.buffer, idx, rc);
+	if (rc || gps_unpack_proxy_open(req.reply.buffer, &idx, &peer) ||
+		peer.magic != GPS_PROTOCOL_MAGIC)
+	{
+		RPC_INFO("daemon does not negotiate, using the original protocol");
+		goto fail;
+	}
+
+	features = peer.features & GPS_LIB_FEATURES;
+	RPC_INFO("daemon protocol version %u, features %x", peer.version,
+		features);
+	if (!gps_proxy_open_abi_match(&peer) &&
+		!(features & GPS_FEATURE_COMPACT))
+	{
+		RPC_ERROR("%s: struct sizes differ from the daemon", __func__);
+	}
+
+fail:
+	__atomic_store_n(&link_features, features, __ATOMIC_RELAXED);
+}
+
+/**
+ * Brings up the RPC socket and the callback channel on a connected @fd.
+ */
+static int gps_connect(int fd) {
+	if (start_rpc(fd)) {
+		RPC_ERROR("failed to connect to the RPC server");
+		close(fd);
+		return -1;
+	}
+
+	/* the channel may drop right away, which has to be noticed */
+	pthread_mutex_lock(&link_mutex);
+	link_up = 1;
+	pthread_mutex_unlock(&link_mutex);
+
+	gps_proxy_open();
+
+	if (!(link_features & GPS_FEATURE_CB_CHANNEL) ||
+		gps_cb_channel_attach())
+	{
+		RPC_INFO("using the RPC socket for callbacks");
+	}
+	return 0;
+}
+
+/**
+ * Replays the session and then the calls queued while disconnected.
+ * Framework calls wait until this is done, so they cannot overtake it.
+ * A daemon that cannot take the session back is dropped, the queued calls
+ * wait for the next connection.
+ */
+static void gps_session_restore(void) {
+	struct gps_pending_call call;
+	rpc_request_t req;
+	int i;
+
+	pthread_mutex_lock(&pending_mutex);
+
+	if (gps_session_replay()) {
+		pthread_mutex_unlock(&pending_mutex);
+		gps_link_down("session replay failed");
+		return;
+	}
+
+	for (i = 0; i < pending_count; i++) {
+		call = pending_calls[i];
+
+		req.header.code = call.code;
+		memcpy(req.header.buffer, call.data, call.len);
+		free(call.data);
+
+		rpc_call_async(&req, call.len);
+	}
+
+	if (pending_count || pending_dropped) {
+		RPC_INFO("%s: sent %d queued calls, dropped %llu", __func__,
+			pending_count, (unsigned long long)pending_dropped);
+	}
+	pending_count = 0;
+	pending_dropped = 0;
+	link_ready = 1;
+
+	pthread_mutex_unlock(&pending_mutex);
+}
+
+/**
+ * Connects to the daemon in the background, restores the session and
+ * reconnects whenever the daemon goes away, for as long as the library
+ * is loaded.
+ */
+static void* gps_client(void* unused) {
+	unsigned flap_ms = GPS_RECONNECT_MIN_MS;
+	uint64_t start_us;
+	uint64_t up_us;
+	int connected = 0;
+	int attempts;
+	int fd;
+
+	LOG_ENTRY;
+
+	gps_rpc_thread = pthread_self();
+
+	for (;;) {
+		start_us = gps_now_us();
+		for (;;) {
+			fd = gps_proxy_socket_open(&attempts);
+			if (!gps_connect(fd)) {
+				break;
+			}
+			usleep(GPS_RECONNECT_MAX_MS * 1000);
+		}
+
+		gps_session_restore();
 
-	LOG_ENTRY;
+		RPC_INFO("%s after %d attempts in %llu ms",
+			connected ? "reconnected" : "connected", attempts,
+			(unsigned long long)((gps_now_us() - start_us) / 1000));
+		connected = 1;
+		up_us = gps_now_us();
 
-	client_fd = gps_proxy_socket_open();
-	if (client_fd < 0) {
-		RPC_ERROR("failed to open the socket");
-		goto fail;
-	}
-		
-	if (start_rpc(client_fd)) {
-		RPC_ERROR("failed to connect to the RPC server");
-		goto fail;
-	}
+		pthread_mutex_lock(&link_mutex);
+		while (link_up) {
+			pthread_cond_wait(&link_cond, &link_mutex);
+		}
+		pthread_mutex_unlock(&link_mutex);
 
-	goto done;
+		gps_call_stats_report();
+		gps_disconnect();
 
-fail:
-	if (client_fd >= 0) {
-		close(client_fd);
+		/* a daemon that drops every client must not be hammered */
+		if (gps_now_us() - up_us < GPS_RECONNECT_MAX_MS * 1000ULL) {
+			usleep(flap_ms * 1000);
+			flap_ms *= 2;
+			if (flap_ms > GPS_RECONNECT_MAX_MS) {
+				flap_ms = GPS_RECONNECT_MAX_MS;
+			}
+		}
+		else {
+			flap_ms = GPS_RECONNECT_MIN_MS;
+		}
 	}
 
-done:
-	pthread_mutex_lock(&gps_mutex);
-	pthread_cond_broadcast(&gps_cond);
-	pthread_mutex_unlock(&gps_mutex);
 	LOG_EXIT;
 	return NULL;
 }
@@ -643,37 +2369,34 @@ static int start_gps_client(void) {
 	LOG_ENTRY;
 	int rc = -1;
 
-	if (pipe(pipe_gps) < 0) {
-		RPC_ERROR("failed to create GPS pipe");
+	if (gps_cb_queue_init(&queue_gps)) {
+		RPC_ERROR("failed to create GPS queue");
 		goto fail;
 	}
 
-	if (pipe(pipe_ni) < 0) {
-		RPC_ERROR("fail to create NI pipe");
+	if (gps_cb_queue_init(&queue_ni)) {
+		RPC_ERROR("failed to create NI queue");
 		goto fail;
 	}
 
-	if (pipe(pipe_agps) < 0) {
-		RPC_ERROR("failed to create AGPS pipe");
+	if (gps_cb_queue_init(&queue_agps)) {
+		RPC_ERROR("failed to create AGPS queue");
 		goto fail;
 	}
 
-	if (pipe(pipe_xtra) < 0) {
-		RPC_ERROR("failed to create XTRA pipe");
+	if (gps_cb_queue_init(&queue_xtra)) {
+		RPC_ERROR("failed to create XTRA queue");
 		goto fail;
 	}
-	
-	if (pipe(pipe_ril) < 0) {
-		RPC_ERROR("fail to create RIL pipe");
+
+	if (gps_cb_queue_init(&queue_ril)) {
+		RPC_ERROR("failed to create RIL queue");
 		goto fail;
 	}
-	
-	pthread_create(&gps_rpc_thread, NULL, gps_client, NULL);
-	pthread_mutex_lock(&gps_mutex);
-	pthread_cond_wait(&gps_cond, &gps_mutex);
-	pthread_mutex_unlock(&gps_mutex);
 
-	if (!gps_rpc) {
+	/* the daemon may not be up yet, calls are queued until it is */
+	if (pthread_create(&gps_rpc_thread, NULL, gps_client, NULL)) {
+		RPC_ERROR("failed to start the client thread");
 		goto fail;
 	}
 	
@@ -681,7 +2404,7 @@ static int start_gps_client(void) {
 	goto done;
 	
 fail:
-	close_pipes();
+	free_queues();
 done:
 	LOG_EXIT;
 	return rc;
@@ -703,43 +2426,166 @@ static int gps_xtra_init(GpsXtraCallbacks *callbacks) {
 	xtraCallbacks = callbacks;
 	pthread_mutex_unlock(&gps_mutex);
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_XTRA_INIT,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_XTRA_INIT;
 	
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = rpc_call_result(&req, 0);
 
 fail:
 	LOG_EXIT;
 	return rc;
 }
 
+/**
+ * Passes the XTRA file to the daemon as a sealed shared memory region over
+ * the callback socket, so that it reaches the blob without being copied
+ * through the RPC socket. Returns nonzero if the transport is unavailable,
+ * otherwise the result of the injection is stored in @result.
+ */
+static int inject_xtra_data_fd(char *data, int length, int *result) {
+	struct gps_rpc_frame frame;
+	char msg[sizeof(frame) + sizeof(length)];
+	char *map = NULL;
+	int sealed = 1;
+	int sock = -1;
+	int fd = -1;
+	int rc = -1;
+
+	fd = gps_shm_create("gps-xtra", length, MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		fd = ashmem_create_region("gps-xtra", length);
+		sealed = 0;
+	}
+
+	if (fd < 0) {
+		RPC_ERROR("%s: failed to allocate shared memory", __func__);
+		goto fail;
+	}
+
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		RPC_ERROR("%s: failed to map shared memory", __func__);
+		map = NULL;
+		goto fail;
+	}
+	memcpy(map, data, length);
+	munmap(map, length);
+
+	if (sealed) {
+		fcntl(fd, F_ADD_SEALS, GPS_SHM_SEALS);
+	}
+	else {
+		ashmem_set_prot_region(fd, PROT_READ);
+	}
+
+	sock = socket_local_client(GPS_CB_SOCKET_NAME,
+		ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+	if (sock < 0) {
+		RPC_ERROR("%s: callback socket is unavailable", __func__);
+		goto fail;
+	}
+
+	frame.code = GPS_PROXY_XTRA_INJECT_XTRA_FD;
+	frame.len = sizeof(length);
+	memcpy(msg, &frame, sizeof(frame));
+	memcpy(msg + sizeof(frame), &length, sizeof(length));
+
+	if (gps_shm_send_fds(sock, msg, sizeof(msg), &fd, 1)) {
+		RPC_ERROR("%s: failed to pass the XTRA file", __func__);
+		goto fail;
+	}
+
+	if (gps_rpc_frame_read(sock, &frame, result, sizeof(*result)) ||
+		frame.len != sizeof(*result))
+	{
+		RPC_ERROR("%s: no reply from the daemon", __func__);
+		goto fail;
+	}
+
+	rc = 0;
+
+fail:
+	CHECK_CLOSE(sock);
+	CHECK_CLOSE(fd);
+	return rc;
+}
+
+/**
+ * Fallback for when file descriptors cannot be passed: the file is
+ * streamed over the RPC socket and reassembled by the daemon.
+ */
+static int inject_xtra_data_chunked(char *data, int length) {
+	const int max_chunk = RPC_PAYLOAD_MAX - 3 * sizeof(int);
+	int offset = 0;
+	int rc = -1;
+
+	while (offset < length) {
+		struct rpc_request_t req;
+		char *buf = req.header.buffer;
+		size_t idx = 0;
+
+		int chunk = length - offset;
+
+		req.header.code = GPS_PROXY_XTRA_INJECT_XTRA_CHUNK;
+
+		if (chunk > max_chunk) {
+			chunk = max_chunk;
+		}
+
+		if (gps_pack_xtra_inject_chunk(buf, &idx, &length, &offset,
+			&chunk))
+		{
+			goto fail;
+		}
+		GPS_MARSHAL_RAW(buf, idx, data + offset, chunk);
+
+		rc = rpc_call_result(&req, idx);
+		if (rc) {
+			RPC_ERROR("%s: chunk at %d failed %d", __func__, offset, rc);
+			break;
+		}
+		offset += chunk;
+	}
+
+fail:
+	return rc;
+}
+
 static int inject_xtra_data(char *data, int length) {
 	LOG_ENTRY;
 
 	int rc = -1;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_XTRA_INJECT_XTRA_DATA,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_XTRA_INJECT_XTRA_DATA;
 
-	if (!data || !length) {
+	if (!data || length <= 0) {
 		RPC_ERROR("%s: data is NULL", __func__);
 		goto fail;
 	}
 
+	if (length > RPC_PAYLOAD_MAX - (int)sizeof(length) - 1) {
+		if (length > GPS_XTRA_MAX_SIZE) {
+			RPC_ERROR("%s: XTRA data too large %d", __func__, length);
+			goto fail;
+		}
+
+		if (!(__atomic_load_n(&link_features, __ATOMIC_RELAXED) &
+			GPS_FEATURE_XTRA_FD) || inject_xtra_data_fd(data, length, &rc))
+		{
+			rc = inject_xtra_data_chunked(data, length);
+		}
+		goto fail;
+	}
+
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, length);
-	RPC_PACK_RAW(buf, idx, data, length);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	if (gps_pack_xtra_inject_data(buf, &idx, &length)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, data, length);
 
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = rpc_call_result(&req, idx);
 
 fail:
 	LOG_EXIT;
@@ -764,13 +2610,10 @@ static void agps_init(AGpsCallbacks *callbacks) {
 	pthread_mutex_lock(&gps_mutex);
 	aGpsCallbacks = callbacks;
 	pthread_mutex_unlock(&gps_mutex);
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_AGPS_INIT,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_AGPS_INIT;
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, 0);
 fail:
 	LOG_EXIT;
 	return;
@@ -778,11 +2621,8 @@ fail:
 
 static int agps_data_conn_open(const char *apn) {
 	LOG_ENTRY;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_AGPS_DATA_CONN_OPEN,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_AGPS_DATA_CONN_OPEN;
 
 	int rc = -1;
 	char *buf = req.header.buffer;
@@ -793,11 +2633,9 @@ static int agps_data_conn_open(const char *apn) {
 		goto fail;
 	}
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK_S(buf, idx, apn);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	GPS_MARSHAL_S(buf, idx, apn);
 
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = rpc_call_result(&req, idx);
 fail:
 	LOG_EXIT;
 	return rc;
@@ -805,54 +2643,62 @@ fail:
 
 static int agps_data_conn_closed(void) {
 	LOG_ENTRY;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_AGPS_DATA_CONN_CLOSED,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_AGPS_DATA_CONN_CLOSED;
 
-	int rc = rpc_call_result(gps_rpc, &req);
+	int rc = rpc_call_result(&req, 0);
 	LOG_EXIT;
 	return rc;
 }
 
 static int agps_data_conn_failed(void) {
 	LOG_ENTRY;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_AGPS_DATA_CONN_FAILED,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_AGPS_DATA_CONN_FAILED;
 
-	int rc = rpc_call_result(gps_rpc, &req);
+	int rc = rpc_call_result(&req, 0);
 	LOG_EXIT;
 	return rc;
 }
 
+/* sends the call without recording it, see gps_init_send */
+static int agps_set_server_send(AGpsType type, const char *hostname,
+	int port)
+{
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_AGPS_AGPS_SET_SERVER;
+
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_pack_agps_set_server(buf, &idx, &type, &port)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, hostname);
+
+	return rpc_call_result(&req, idx);
+fail:
+	return -1;
+}
+
 static int agps_set_server(AGpsType type, const char *hostname, int port) {
 	LOG_ENTRY;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_AGPS_AGPS_SET_SERVER,
-		},
-	};
-	
 	int rc = -1;
-	char *buf = req.header.buffer;
-	size_t idx = 0;
 
 	if (!hostname) {
 		RPC_ERROR("%s: hostname is NULL", __func__);
 		goto fail;
 	}
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, type);
-	RPC_PACK(buf, idx, port);
-	RPC_PACK_S(buf, idx, hostname);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	if (type < GPS_SESSION_AGPS_TYPES) {
+		pthread_mutex_lock(&gps_mutex);
+		session.server[type].set = 1;
+		session.server[type].port = port;
+		gps_session_copy(session.server[type].hostname, hostname);
+		pthread_mutex_unlock(&gps_mutex);
+	}
 
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = agps_set_server_send(type, hostname, port);
 fail:
 	LOG_EXIT;
 	return rc;
@@ -878,32 +2724,27 @@ static void ni_init(GpsNiCallbacks *callbacks) {
 	}
 
 	niCallbacks = callbacks;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_NI_INIT,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_NI_INIT;
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, 0);
 fail:
 	LOG_EXIT;
 }
 
 static void ni_respond(int notif_id, GpsUserResponseType user_response) {
 	LOG_ENTRY;
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_NI_RESPOND,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_NI_RESPOND;
 
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK(buf, idx, notif_id);
-	RPC_PACK(buf, idx, user_response);
+	if (gps_pack_ni_respond(buf, &idx, &notif_id, &user_response)) {
+		goto fail;
+	}
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, idx);
 fail:
 	LOG_EXIT;
 	return;
@@ -930,17 +2771,37 @@ static void ril_init(AGpsRilCallbacks *callbacks) {
 	rilCallbacks = callbacks;
 	pthread_mutex_unlock(&gps_mutex);
 	
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_INIT,
-		}
-	};
+	struct rpc_request_t req;
+	req.header.code = RIL_INIT;
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, 0);
 fail:
 	LOG_EXIT;
 }
 
+/* sends the call without recording it, see gps_init_send */
+static void ril_set_ref_location_send(
+	const AGpsRefLocation *agps_reflocation, size_t sz_struct)
+{
+	struct rpc_request_t req;
+	req.header.code = RIL_SET_REF_LOC;
+
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	uint32_t wire_size = sz_struct;
+
+	if (sz_struct > UINT32_MAX ||
+		gps_pack_ril_set_ref_location(buf, &idx, &wire_size))
+	{
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, agps_reflocation, sz_struct);
+
+	rpc_call_oneway(&req, idx);
+fail:
+	return;
+}
+
 static void ril_set_ref_location(const AGpsRefLocation *agps_reflocation,
 	size_t sz_struct)
 {
@@ -951,22 +2812,35 @@ static void ril_set_ref_location(const AGpsRefLocation *agps_reflocation,
 		goto fail;
 	}
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_SET_REF_LOC,
-		}
-	};
-	
+	if (sz_struct <= sizeof(session.ref_loc)) {
+		pthread_mutex_lock(&gps_mutex);
+		session.ref_loc_set = 1;
+		session.ref_loc_size = sz_struct;
+		memcpy(&session.ref_loc, agps_reflocation, sz_struct);
+		pthread_mutex_unlock(&gps_mutex);
+	}
+
+	ril_set_ref_location_send(agps_reflocation, sz_struct);
+fail:
+	LOG_EXIT;
+}
+
+/* sends the call without recording it, see gps_init_send */
+static void ril_set_set_id_send(AGpsSetIDType type, const char *setid) {
+	struct rpc_request_t req;
+	req.header.code = RIL_SET_SET_ID;
+
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, sz_struct);
-	RPC_PACK_RAW(buf, idx, agps_reflocation, sz_struct);
+	if (gps_pack_ril_set_set_id(buf, &idx, &type)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, setid);
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, idx);
 fail:
-	LOG_EXIT;
+	return;
 }
 
 static void ril_set_set_id(AGpsSetIDType type, const char *setid) {
@@ -977,21 +2851,13 @@ static void ril_set_set_id(AGpsSetIDType type, const char *setid) {
 		goto fail;
 	}
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_SET_SET_ID,
-		}
-	};
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
-
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, type);
-	RPC_PACK_S(buf, idx, setid);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	pthread_mutex_lock(&gps_mutex);
+	session.set_id_set = 1;
+	session.set_id_type = type;
+	gps_session_copy(session.set_id, setid);
+	pthread_mutex_unlock(&gps_mutex);
 
-	rpc_call(gps_rpc, &req);
+	ril_set_set_id_send(type, setid);
 fail:
 	LOG_EXIT;
 }
@@ -1004,25 +2870,45 @@ static void ril_ni_message(uint8_t *msg, size_t len) {
 		goto fail;
 	}
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_NI_MSG,
-		}
-	};
+	struct rpc_request_t req;
+	req.header.code = RIL_NI_MSG;
 	
 	char *buf = req.header.buffer;
 	size_t idx = 0;
+	uint32_t wire_len = len;
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, len);
-	RPC_PACK_RAW(buf, idx, msg, len);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	if (len > UINT32_MAX || gps_pack_ril_ni_message(buf, &idx, &wire_len)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, msg, len);
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, idx);
 fail:
 	LOG_EXIT;
 }
 
+/* sends the call without recording it, see gps_init_send */
+static void ril_update_network_state_send(int connected, int type,
+	int roaming, const char *extra_info)
+{
+	struct rpc_request_t req;
+	req.header.code = RIL_UPDATE_NET_STATE;
+
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_pack_ril_update_network_state(buf, &idx, &connected, &type,
+		&roaming))
+	{
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, extra_info);
+
+	rpc_call_oneway(&req, idx);
+fail:
+	return;
+}
+
 static void ril_update_network_state(int connected, int type, int roaming,
 	const char *extra_info)
 {
@@ -1033,25 +2919,37 @@ static void ril_update_network_state(int connected, int type, int roaming,
 		goto fail;
 	}
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_UPDATE_NET_STATE,
-		}
-	};
-	
+	pthread_mutex_lock(&gps_mutex);
+	session.net_state_set = 1;
+	session.connected = connected;
+	session.net_type = type;
+	session.roaming = roaming;
+	gps_session_copy(session.extra_info, extra_info);
+	pthread_mutex_unlock(&gps_mutex);
+
+	ril_update_network_state_send(connected, type, roaming, extra_info);
+fail:
+	LOG_EXIT;
+}
+
+/* sends the call without recording it, see gps_init_send */
+static void ril_update_network_availability_send(int available,
+	const char *apn)
+{
+	struct rpc_request_t req;
+	req.header.code = RIL_UPDATE_NET_AVAILABILITY;
+
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, connected);
-	RPC_PACK(buf, idx, type);
-	RPC_PACK(buf, idx, roaming);
-	RPC_PACK_S(buf, idx, extra_info);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	if (gps_pack_ril_update_network_availability(buf, &idx, &available)) {
+		goto fail;
+	}
+	GPS_MARSHAL_S(buf, idx, apn);
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, idx);
 fail:
-	LOG_EXIT;
+	return;
 }
 
 static void ril_update_network_availability(int available, const char *apn) {
@@ -1062,21 +2960,13 @@ static void ril_update_network_availability(int available, const char *apn) {
 		goto fail;
 	}
 
-	struct rpc_request_t req = {
-		.header = {
-			.code = RIL_UPDATE_NET_AVAILABILITY,
-		}
-	};
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
-
-	memset(req.header.buffer, 0, RPC_PAYLOAD_MAX);
-	RPC_PACK(buf, idx, available);
-	RPC_PACK_S(buf, idx, apn);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
+	pthread_mutex_lock(&gps_mutex);
+	session.net_avail_set = 1;
+	session.available = available;
+	gps_session_copy(session.apn, apn);
+	pthread_mutex_unlock(&gps_mutex);
 
-	rpc_call(gps_rpc, &req);
+	ril_update_network_availability_send(available, apn);
 fail:
 	LOG_EXIT;
 }
@@ -1094,6 +2984,27 @@ static AGpsRilInterface sRilInterface = {
 /******************************************************************************
  * GPS Interface
  *****************************************************************************/
+
+/*
+ * The calls the session replay makes are split in two: the HAL entry
+ * point records the state and the _send helper only sends the call, so
+ * that replaying a session does not record it, or restart the TTFF clock,
+ * again.
+ */
+static int gps_init_send(void) {
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_INIT;
+
+	return rpc_call_result(&req, 0);
+}
+
+static int gps_start_send(void) {
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_START;
+
+	return rpc_call_result(&req, 0);
+}
+
 static int gps_init(GpsCallbacks *callbacks) {
 	LOG_ENTRY;
 	
@@ -1106,53 +3017,48 @@ static int gps_init(GpsCallbacks *callbacks) {
 	pthread_mutex_lock(&gps_mutex);
 	gpsCallbacks = callbacks;
 	pthread_mutex_unlock(&gps_mutex);
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_INIT,
-		},
-	};
-	
-	rc = rpc_call_result(gps_rpc, &req);
+
+	rc = gps_init_send();
 	LOG_EXIT;
 fail:
 	return rc;
 }
 
 static int gps_start(void) {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_START,
-		},
-	};
-
 	LOG_ENTRY;
-	int rc = rpc_call_result(gps_rpc, &req);
+	pthread_mutex_lock(&gps_mutex);
+	session.started = 1;
+	pthread_mutex_unlock(&gps_mutex);
+
+	__atomic_store_n(&ttff_start_us, gps_boottime_us(), __ATOMIC_RELAXED);
+
+	int rc = gps_start_send();
 	LOG_EXIT;
 	return rc;
 }
 
 static int gps_stop(void) {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_STOP,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_STOP;
 
 	LOG_ENTRY;
-	int rc = rpc_call_result(gps_rpc, &req);
+	pthread_mutex_lock(&gps_mutex);
+	session.started = 0;
+	pthread_mutex_unlock(&gps_mutex);
+
+	__atomic_store_n(&ttff_start_us, 0, __ATOMIC_RELAXED);
+
+	int rc = rpc_call_result(&req, 0);
 	LOG_EXIT;
 	return rc;
 }
 
 static void gps_cleanup(void) {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_CLEANUP,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_CLEANUP;
 
 	LOG_ENTRY;
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, 0);
 	gps_proxy_cleanup();
 	LOG_EXIT;
 }
@@ -1160,22 +3066,21 @@ static void gps_cleanup(void) {
 static int gps_inject_time(GpsUtcTime time, int64_t timeReference,
 	int uncertainty)
 {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_INJECT_TIME,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_INJECT_TIME;
 	LOG_ENTRY;
 
 	int rc = -1;
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK(buf, idx, time);
-	RPC_PACK(buf, idx, timeReference);
-	RPC_PACK(buf, idx, uncertainty);
+	if (gps_pack_gps_inject_time(buf, &idx, &time, &timeReference,
+		&uncertainty))
+	{
+		goto fail;
+	}
 
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = rpc_call_async(&req, idx);
 fail:
 	LOG_EXIT;
 	return rc;
@@ -1186,72 +3091,86 @@ static int gps_inject_location(
 	double longitude,
 	float accuracy)
 {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_INJECT_LOCATION,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_INJECT_LOCATION;
 	LOG_ENTRY;
 
 	int rc = -1;
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK(buf, idx, latitude);
-	RPC_PACK(buf, idx, longitude);
-	RPC_PACK(buf, idx, accuracy);
+	if (gps_pack_gps_inject_location(buf, &idx, &latitude, &longitude,
+		&accuracy))
+	{
+		goto fail;
+	}
 
-	rc = rpc_call_result(gps_rpc, &req);
+	rc = rpc_call_async(&req, idx);
 fail:
 	LOG_EXIT;
 	return rc;
 }
 
 static void gps_delete_aiding_data(GpsAidingData flags) {
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_DELETE_AIDING_DATA,
-		},
-	};
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_DELETE_AIDING_DATA;
 	LOG_ENTRY;
 
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK(buf, idx, flags);
+	if (gps_pack_gps_delete_aiding_data(buf, &idx, &flags)) {
+		goto fail;
+	}
 
-	rpc_call(gps_rpc, &req);
+	rpc_call_oneway(&req, idx);
 fail:
 	LOG_EXIT;
 	return;
 }
 
-static int gps_set_position_mode(
+static int gps_set_position_mode_send(
 	GpsPositionMode mode,
 	GpsPositionRecurrence recurrence,
 	uint32_t min_interval,
 	uint32_t preferred_accuracy,
 	uint32_t preferred_time)
-{	
-	struct rpc_request_t req = {
-		.header = {
-			.code = GPS_PROXY_GPS_SET_POSITION_MODE,
-		},
-	};
-	LOG_ENTRY;
+{
+	struct rpc_request_t req;
+	req.header.code = GPS_PROXY_GPS_SET_POSITION_MODE;
 
-	int rc = -1;
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK(buf, idx, mode);
-	RPC_PACK(buf, idx, recurrence);
-	RPC_PACK(buf, idx, min_interval);
-	RPC_PACK(buf, idx, preferred_accuracy);
-	RPC_PACK(buf, idx, preferred_time);
+	if (gps_pack_gps_set_position_mode(buf, &idx, &mode, &recurrence,
+		&min_interval, &preferred_accuracy, &preferred_time))
+	{
+		return -1;
+	}
+
+	return rpc_call_result(&req, idx);
+}
 
-	rc = rpc_call_result(gps_rpc, &req);
-fail:
+static int gps_set_position_mode(
+	GpsPositionMode mode,
+	GpsPositionRecurrence recurrence,
+	uint32_t min_interval,
+	uint32_t preferred_accuracy,
+	uint32_t preferred_time)
+{	
+	LOG_ENTRY;
+
+	pthread_mutex_lock(&gps_mutex);
+	session.mode_set = 1;
+	session.mode = mode;
+	session.recurrence = recurrence;
+	session.min_interval = min_interval;
+	session.preferred_accuracy = preferred_accuracy;
+	session.preferred_time = preferred_time;
+	pthread_mutex_unlock(&gps_mutex);
+
+	int rc = gps_set_position_mode_send(mode, recurrence, min_interval,
+		preferred_accuracy, preferred_time);
 	LOG_EXIT;
 	return rc;
 }
@@ -1291,6 +3210,101 @@ static GpsInterface hardwareGpsInterface = {
 	.get_extension = gps_get_extension,
 };
 
+/******************************************************************************
+ * Session Replay
+ *****************************************************************************/
+
+/**
+ * Brings a freshly connected daemon to the state the framework left the
+ * previous one in. The calls go through the _send helpers, so neither the
+ * recorded session nor the TTFF clock is touched. Returns -1 if the daemon
+ * could not be initialized and the session has to be replayed again on
+ * the next connection.
+ */
+static int gps_session_replay(void) {
+	struct gps_session_state state;
+	GpsCallbacks *gps_cbs;
+	GpsXtraCallbacks *xtra_cbs;
+	AGpsCallbacks *agps_cbs;
+	GpsNiCallbacks *ni_cbs;
+	AGpsRilCallbacks *ril_cbs;
+	int type;
+	int rc = 0;
+
+	LOG_ENTRY;
+
+	pthread_mutex_lock(&gps_mutex);
+	state = session;
+	gps_cbs = gpsCallbacks;
+	xtra_cbs = xtraCallbacks;
+	agps_cbs = aGpsCallbacks;
+	ni_cbs = niCallbacks;
+	ril_cbs = rilCallbacks;
+	pthread_mutex_unlock(&gps_mutex);
+
+	if (!gps_cbs) {
+		RPC_INFO("%s: no session to replay", __func__);
+		goto done;
+	}
+
+	if (gps_init_send()) {
+		RPC_ERROR("%s: failed to init GPS, retrying", __func__);
+		rc = -1;
+		goto done;
+	}
+
+	if (xtra_cbs) {
+		gps_xtra_init(xtra_cbs);
+	}
+	if (agps_cbs) {
+		agps_init(agps_cbs);
+	}
+	if (ni_cbs) {
+		ni_init(ni_cbs);
+	}
+	if (ril_cbs) {
+		ril_init(ril_cbs);
+	}
+
+	for (type = 0; type < GPS_SESSION_AGPS_TYPES; type++) {
+		if (state.server[type].set) {
+			agps_set_server_send(type, state.server[type].hostname,
+				state.server[type].port);
+		}
+	}
+
+	if (state.set_id_set) {
+		ril_set_set_id_send(state.set_id_type, state.set_id);
+	}
+	if (state.ref_loc_set) {
+		ril_set_ref_location_send(&state.ref_loc, state.ref_loc_size);
+	}
+	if (state.net_state_set) {
+		ril_update_network_state_send(state.connected,
+			state.net_type, state.roaming, state.extra_info);
+	}
+	if (state.net_avail_set) {
+		ril_update_network_availability_send(state.available,
+			state.apn);
+	}
+
+	if (state.mode_set) {
+		gps_set_position_mode_send(state.mode, state.recurrence,
+			state.min_interval, state.preferred_accuracy,
+			state.preferred_time);
+	}
+
+	if (state.started) {
+		gps_start_send();
+	}
+
+	RPC_INFO("%s: session restored, %s", __func__,
+		state.started ? "started" : "stopped");
+done:
+	LOG_EXIT;
+	return rc;
+}
+
 /******************************************************************************
  * Library Interface
  *****************************************************************************/
@@ -20,14 +20,24 @@
 
 #include <pthread.h>
 #include <dlfcn.h>
+#include <signal.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
 
 /* ANDROID local sockets */
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <cutils/sockets.h>
+#include <cutils/ashmem.h>
 
 /* ANDROID libhardware headers */
 #include <hardware/gps.h>
@@ -37,10 +47,14 @@
 #include <stc_log.h>
 
 #include "gps-rpc.h"
+#include "gps-marshal.h"
+#include "gps-shm.h"
+#include "gps-stats.h"
+#include "gps-trace.h"
 
 #define GPS_LIBRARY_NAME "/system/vendor/lib/hw/gps.blob.so"
 
-static rpc_t *g_rpc = NULL;
+static const char *lib_path = GPS_LIBRARY_NAME;
 static void *lib_handle = NULL;
 
 static GpsInterface *origGpsInterface = NULL;
@@ -49,938 +63,3542 @@ static AGpsInterface *origAGpsInterface = NULL;
 static GpsNiInterface *origNiInterface = NULL;
 static AGpsRilInterface *origRilInterface = NULL;
 
+/*
+ * The blob expects to be called from one framework thread. Calls from the
+ * libstc-rpc threads and the event loop, and the session changes made
+ * when a client goes away, all enter it under blob_mutex.
+ */
+static pthread_mutex_t blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /******************************************************************************
  * Function prototypes
  *****************************************************************************/
 static int load_gps_library(void);
 static void free_gps_library(void);
+static void gps_sv_delta_reset(void);
+static void gps_sv_delta_lost(void);
+static void gps_session_drop(int client);
+static void gps_cleanup_pending_run(void);
+static int gps_srv_rpc_handler(rpc_request_hdr_t *hdr, rpc_reply_t *reply);
+static void gps_epoch_add(rpc_request_t *req, size_t payload_len);
+static void gps_epoch_flush(void);
+static void gps_cb_send(rpc_request_t *req, size_t payload_len);
+static void gps_location_cb(GpsLocation *location);
+static void gps_status_cb(GpsStatus *status);
+static void gps_sv_status_cb(GpsSvStatus *sv_info);
+static void gps_agps_status_cb(AGpsStatus *status);
+static void gps_ni_notify_cb(GpsNiNotification *notification);
 
 /******************************************************************************
- * Outgoing RPC Interface
+ * Clients
  *****************************************************************************/
 
-#define MAX_THREADS 10
-static pthread_t lib_threads[MAX_THREADS];
-static int num_lib_threads = 0;
+/*
+ * The daemon keeps the blob loaded and serves up to GPS_MAX_CLIENTS
+ * clients at a time. A client is an RPC connection, optionally paired with
+ * a callback channel from the same process. Callbacks are fanned out to
+ * every client: through its shared memory ring, as length-prefixed frames
+ * over its channel socket, or over its RPC socket as before. Only the
+ * used part of the payload is copied.
+ *
+ * Callbacks are sent under the tx_mutex of each client rather than
+ * cb_mutex, and never wait for a client that stops reading. Channel
+ * sockets are non-blocking. The RPC socket belongs to libstc-rpc, whose
+ * receive thread reads it blocking, so it only gets a send timeout. A
+ * client that falls behind loses fixes, and is disconnected if anything
+ * else does not fit, see gps_client_transmit_locked.
+ *
+ * The main thread multiplexes the listening sockets, RPC hangups and the
+ * calls that arrive on the channels with epoll. libstc-rpc still runs a
+ * receive thread for each RPC connection.
+ */
+#define GPS_MAX_CLIENTS 8
+#define GPS_CLIENT_SEND_TIMEOUT_MS 100
+
+/* an XTRA file being streamed in chunks, under xtra_mutex */
+struct gps_xtra_upload {
+	char *buf;
+	int total;
+	int received;
+};
 
-static pthread_t create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
-{
-	LOG_ENTRY;
-	RPC_DEBUG("%s: name %s", __func__, name);
-	int rc = -1;
-	
-	if (!start) {
-		RPC_ERROR("NULL func pointer");
-		goto fail;
-	}
+static void xtra_upload_drop(struct gps_xtra_upload *up);
+
+struct gps_client {
+	int fd;
+	pid_t pid;
+	rpc_t *rpc;
+
+	/* agreed with GPS_PROXY_OPEN, none if it never came */
+	uint32_t features;
+	int opened;
+
+	/* the libstc-rpc thread that served GPS_PROXY_OPEN */
+	pthread_t rpc_thread;
+
+	struct gps_xtra_upload xtra;
+
+	/*
+	 * Serializes sends to the client. The transport fields are written
+	 * with both cb_mutex and tx_mutex held, in that order, and read with
+	 * either of them.
+	 */
+	pthread_mutex_t tx_mutex;
+	int aborted;
+
+	/* callback channel */
+	struct gps_shm_ring *ring;
+	int event_fd;
+	int sock;
+	uint32_t oneway_done;
+
+	/* the call being read from the channel, rx_len bytes of it so far */
+	struct gps_rpc_frame rx_frame;
+	uint32_t rx_len;
+	rpc_request_hdr_t rx_call;
+
+	uint64_t cb_count;
+	uint64_t cb_bytes;
+	uint64_t cb_dropped;
+
+	/* fix decimation, set by the session arbiter */
+	int fix_known;
+	int fix_enabled;
+	uint32_t fix_interval;
+	uint64_t last_fix_ms;
+	int fix_sent;
+};
 
-	if (num_lib_threads >= MAX_THREADS) {
-		RPC_ERROR("%s: already created maximal number of threads", __func__);
-		goto fail;
-	}
-	
-	int idx = num_lib_threads;
-	num_lib_threads++;
-	pthread_create(lib_threads + idx, NULL, start, arg);
+/* how callbacks are treated by fix decimation */
+enum {
+	GPS_CB_OTHER = 0,
+	GPS_CB_FIX_DATA,
+	GPS_CB_FIX,
+};
 
-	LOG_EXIT;
-	return lib_threads[idx];
+/*
+ * epoll tags, the client index goes into the low 32 bits, or the socket
+ * for a callback connection that has not sent its request yet
+ */
+enum {
+	GPS_EV_RPC_LISTEN = 1,
+	GPS_EV_CB_LISTEN,
+	GPS_EV_CLIENT,
+	GPS_EV_CHANNEL,
+	GPS_EV_STATS_DUMP,
+	GPS_EV_CB_REQUEST,
+};
 
-fail:
-	return 0;
-}
+#define GPS_EV_TAG(type, idx) (((uint64_t)(type) << 32) | (uint32_t)(idx))
 
-/******************************************************************************
- * XTRA Interface
- *****************************************************************************/
-static void gps_xtra_download_request_cb(void) {
-	LOG_ENTRY;
+/* protects the client table against the blob threads sending callbacks */
+static pthread_mutex_t cb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gps_client clients[GPS_MAX_CLIENTS];
+static int num_clients = 0;
+static int epoll_fd = -1;
 
-	rpc_request_t req = {
-		.header = {
-			.code = XTRA_REQUEST_CB,
-		},
-	};
-	
-	rpc_call_noreply(g_rpc, &req);
-fail:
-	LOG_EXIT;
+/*
+ * Features the daemon offers, and those every client has agreed to.
+ * Callbacks are encoded once for all clients, so the SV delta and epoch
+ * encodings are only used while every client supports them.
+ */
+#ifdef GPS_PROXY_USE_SHM
+#define GPS_SRV_FEATURES GPS_FEATURES_ALL
+#else
+#define GPS_SRV_FEATURES (GPS_FEATURES_ALL & ~GPS_FEATURE_SHM)
+#endif
+
+static uint32_t srv_features = GPS_SRV_FEATURES;
+static uint32_t cb_features = GPS_SRV_FEATURES;
+
+/* whether callbacks that carry structs use the compact encoding */
+static int gps_cb_compact(void) {
+	return !!(__atomic_load_n(&cb_features, __ATOMIC_RELAXED) &
+		GPS_FEATURE_COMPACT);
 }
 
-static pthread_t xtra_create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
-{
-	LOG_ENTRY;
-	rpc_request_t req = {
-		.header = {
-			.code =	XTRA_CREATE_THREAD_CB,
-		},
-	};
+/* the event loop thread and the client whose channel call it is serving */
+static pthread_t loop_thread;
+static struct gps_client *serving_client = NULL;
 
-	rpc_call_noreply(g_rpc, &req);
+/*
+ * Time it took to load and open the blob, and when the latest client was
+ * accepted, to report the time it waited for its first call to be served.
+ */
+static uint64_t lib_load_ms = 0;
+static int lib_preloaded = 0;
+static uint64_t first_call_accept_ms = 0;
 
-	pthread_t ret = create_thread_cb(name, start, arg);
+/* interval the receiver runs at, used to decimate fixes for slower clients */
+static uint32_t arb_interval = 0;
 
-	LOG_EXIT;
-	return ret;
+static uint64_t gps_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+static void gps_clients_init(void) {
+	int i;
 
-static GpsXtraCallbacks gpsXtraCallbacks = {
-	.download_request_cb = gps_xtra_download_request_cb,
-	.create_thread_cb = xtra_create_thread_cb,
-};
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		memset(clients + i, 0, sizeof(clients[i]));
+		clients[i].fd = -1;
+		clients[i].event_fd = -1;
+		clients[i].sock = -1;
+		pthread_mutex_init(&clients[i].tx_mutex, NULL);
+	}
+}
 
-/******************************************************************************
- * NI Interface
- *****************************************************************************/
-static pthread_t ni_create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
-{
-	LOG_ENTRY;
-	rpc_request_t req = {
-		.header = {
-			.code = NI_CREATE_THREAD_CB,
+static int gps_epoll_add(int fd, uint32_t events, uint64_t tag) {
+	struct epoll_event ev = {
+		.events = events,
+		.data = {
+			.u64 = tag,
 		},
 	};
 
-	rpc_call_noreply(g_rpc, &req);
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-	pthread_t ret = create_thread_cb(name, start, arg);
+static pid_t gps_peer_pid(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
 
-	LOG_EXIT;
-	return ret;
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		return -1;
+	}
+	return cred.pid;
 }
 
-static void gps_ni_notify_cb(GpsNiNotification *notification) {
-	LOG_ENTRY;
+static void cb_channel_detach_locked(struct gps_client *c) {
+	pthread_mutex_lock(&c->tx_mutex);
+	if (c->ring) {
+		munmap(c->ring, gps_shm_map_size(c->ring->size));
+		c->ring = NULL;
+	}
 
-	rpc_request_t req = {
-		.header = {
-			.code = NI_NOTIFY_CB,
-		},
-	};
+	CHECK_CLOSE(c->event_fd);
 
-	if (!notification) {
-		RPC_ERROR("%s: notification is NULL", __func__);
-		goto fail;
+	if (c->sock >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->sock, NULL);
+		CHECK_CLOSE(c->sock);
 	}
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
-
-	RPC_PACK_RAW(buf, idx, notification, sizeof(GpsNiNotification));
-	rpc_call_noreply(g_rpc, &req);
 
-fail:
-	LOG_EXIT;
+	if (c->cb_count) {
+		RPC_INFO("client %d callbacks: %llu sent, %llu bytes, %llu bytes/cb, "
+			"%zu bytes/cb unframed, %llu dropped", (int)c->pid,
+			(unsigned long long)c->cb_count,
+			(unsigned long long)c->cb_bytes,
+			(unsigned long long)(c->cb_bytes / c->cb_count),
+			sizeof(rpc_request_hdr_t),
+			(unsigned long long)c->cb_dropped);
+	}
+	c->cb_count = 0;
+	c->cb_bytes = 0;
+	c->cb_dropped = 0;
+	c->oneway_done = 0;
+	c->rx_len = 0;
+	pthread_mutex_unlock(&c->tx_mutex);
 }
 
-static GpsNiCallbacks gpsNiCallbacks = {
-	.notify_cb = gps_ni_notify_cb,
-	.create_thread_cb = ni_create_thread_cb,
-};
-
-/******************************************************************************
- * GPS Interface
- *****************************************************************************/
-static pthread_t gps_create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
-{
-	LOG_ENTRY;
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_CREATE_THREAD_CB,
-		},
-	};
-
-	rpc_call_noreply(g_rpc, &req);
-
-	pthread_t ret = create_thread_cb(name, start, arg);
+static struct gps_shm_ring *cb_ring_alloc(int *mem_fd, int *event_fd) {
+	struct gps_shm_ring *ring = NULL;
+	size_t map_size = gps_shm_map_size(GPS_SHM_RING_SIZE);
 
-	LOG_EXIT;
-	return ret;
-}
+	*mem_fd = gps_shm_create("gps-proxy-ring", map_size, 0);
+	if (*mem_fd < 0) {
+		*mem_fd = ashmem_create_region("gps-proxy-ring", map_size);
+	}
 
-static void gps_location_cb(GpsLocation *location) {
-	LOG_ENTRY;
+	if (*mem_fd < 0) {
+		RPC_ERROR("%s: failed to allocate shared memory", __func__);
+		goto fail;
+	}
 
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_LOC_CB,
-		},
-	};
+	ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		*mem_fd, 0);
+	if (ring == MAP_FAILED) {
+		RPC_ERROR("%s: failed to map shared memory", __func__);
+		ring = NULL;
+		goto fail;
+	}
+	gps_shm_ring_init(ring, GPS_SHM_RING_SIZE);
 
-	if (!location) {
-		RPC_ERROR("%s: location is NULL", __func__);
+	*event_fd = eventfd(0, 0);
+	if (*event_fd < 0) {
+		RPC_ERROR("%s: failed to create eventfd", __func__);
 		goto fail;
 	}
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
 
-	RPC_PACK_RAW(buf, idx, location, sizeof(GpsLocation));
-	rpc_call_noreply(g_rpc, &req);
+	return ring;
 
 fail:
-	LOG_EXIT;
+	if (ring) {
+		munmap(ring, map_size);
+	}
+	CHECK_CLOSE(*mem_fd);
+	return NULL;
 }
 
-static void gps_status_cb(GpsStatus *status) {
-	LOG_ENTRY;
-
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_STATUS_CB,
-		},
-	};
+/**
+ * Pairs a callback channel with the RPC connection of the same process
+ * that does not have one yet.
+ */
+static int cb_channel_attach(int fd) {
+	struct gps_shm_ring *ring = NULL;
+	struct gps_client *c = NULL;
+	uint32_t map_size = 0;
+	uint32_t features = 0;
+	int fds[2] = {-1, -1};
+	int nfds = 0;
+	pid_t pid = gps_peer_pid(fd);
+	int i;
+
+	pthread_mutex_lock(&cb_mutex);
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].sock < 0 &&
+			clients[i].pid == pid)
+		{
+			c = clients + i;
+			features = c->features;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cb_mutex);
 
-	if (!status) {
-		RPC_ERROR("%s: status is NULL", __func__);
-		goto fail;
+	if (!c) {
+		RPC_ERROR("%s: no RPC connection from pid %d", __func__, (int)pid);
+		return -1;
 	}
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
 
-	RPC_PACK_RAW(buf, idx, status, sizeof(GpsStatus));
-	rpc_call_noreply(g_rpc, &req);
+	if (!(features & GPS_FEATURE_CB_CHANNEL)) {
+		RPC_ERROR("%s: client %d did not agree on a channel", __func__,
+			(int)pid);
+		return -1;
+	}
 
-fail:
-	LOG_EXIT;
-}
+#ifdef GPS_PROXY_USE_SHM
+	if (features & GPS_FEATURE_SHM) {
+		ring = cb_ring_alloc(&fds[0], &fds[1]);
+	}
+	if (ring) {
+		map_size = gps_shm_map_size(ring->size);
+		nfds = 2;
+	}
+#endif
 
-static void gps_sv_status_cb(GpsSvStatus *sv_info) {
-	LOG_ENTRY;
+	/* a zero map size tells the client to read frames from the socket */
+	if (gps_shm_send_fds(fd, &map_size, sizeof(map_size), fds, nfds)) {
+		RPC_ERROR("%s: failed to set up the callback channel", __func__);
+		goto fail;
+	}
+	CHECK_CLOSE(fds[0]);
 
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_SV_STATUS_CB,
-		},
-	};
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		RPC_ERROR("%s: failed to make the channel non-blocking", __func__);
+		goto fail;
+	}
 
-	if (!sv_info) {
-		RPC_ERROR("%s: sv_info is NULL", __func__);
+	if (gps_epoll_add(fd, EPOLLIN, GPS_EV_TAG(GPS_EV_CHANNEL, c - clients))) {
+		RPC_ERROR("%s: failed to watch the callback channel", __func__);
 		goto fail;
 	}
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
 
-	RPC_PACK_RAW(buf, idx, sv_info, sizeof(GpsSvStatus));
-	rpc_call_noreply(g_rpc, &req);
+	pthread_mutex_lock(&cb_mutex);
+	pthread_mutex_lock(&c->tx_mutex);
+	c->ring = ring;
+	c->event_fd = fds[1];
+	c->sock = fd;
+	c->oneway_done = 0;
+	pthread_mutex_unlock(&c->tx_mutex);
+	pthread_mutex_unlock(&cb_mutex);
+
+	/* the new client has no SV table to apply deltas to */
+	gps_sv_delta_reset();
+
+	if (ring) {
+		RPC_INFO("client %d: callbacks use a shared memory ring of %d bytes",
+			(int)pid, GPS_SHM_RING_SIZE);
+	}
+	else {
+		RPC_INFO("client %d: callbacks use framed socket messages",
+			(int)pid);
+	}
+	return 0;
 
 fail:
-	LOG_EXIT;
+	if (ring) {
+		munmap(ring, map_size);
+	}
+	CHECK_CLOSE(fds[0]);
+	CHECK_CLOSE(fds[1]);
+	return -1;
 }
 
-static void gps_nmea_cb(GpsUtcTime timestamp,
-	const char *nmea, int length)
+/**
+ * Disconnects a client that cannot be sent to any more. Both sockets are
+ * shut down, the event loop sees the hangup and removes the client, and
+ * the client reconnects and replays its session. Called with the tx_mutex
+ * of the client held.
+ */
+static void gps_client_abort_locked(struct gps_client *c, const char *why) {
+	if (c->aborted) {
+		return;
+	}
+
+	RPC_ERROR("client %d: %s, disconnecting", (int)c->pid, why);
+	c->aborted = 1;
+	shutdown(c->fd, SHUT_RDWR);
+	if (c->sock >= 0) {
+		shutdown(c->sock, SHUT_RDWR);
+	}
+}
+
+/**
+ * Sends a callback of the given @kind to one client without blocking on
+ * it. When the ring or the channel socket is full, fixes and the data
+ * that goes with them are dropped, since the next epoch supersedes them.
+ * Anything else, replies included, must not be lost, so the client is
+ * disconnected instead. Callbacks never move to another transport, which
+ * would reorder them. Called with the tx_mutex of the client held.
+ */
+static void gps_client_transmit_locked(struct gps_client *c,
+	rpc_request_t *req, size_t len, int kind)
 {
-	LOG_ENTRY;
+	uint32_t code = req->header.code;
+	int rc;
 
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_NMEA_CB,
-		},
-	};
+	if (c->aborted) {
+		return;
+	}
 
-	if (!nmea || !length) {
-		RPC_ERROR("%s: nmea is NULL", __func__);
-		goto fail;
+	if (c->ring) {
+		if (!gps_shm_ring_push(c->ring, code, req->header.buffer, len)) {
+			if (gps_shm_ring_need_wakeup(c->ring)) {
+				eventfd_write(c->event_fd, 1);
+			}
+			c->cb_count++;
+			c->cb_bytes += gps_shm_record_size(len);
+			return;
+		}
+		rc = 1;
+	}
+	else if (c->sock >= 0) {
+		rc = gps_rpc_frame_try_write(c->sock, code, req->header.buffer, len);
+		if (!rc) {
+			c->cb_count++;
+			c->cb_bytes += sizeof(struct gps_rpc_frame) + len;
+			return;
+		}
+	}
+	else {
+		/* the RPC socket sends the whole buffer, callbacks are not cleared */
+		memset(req->header.buffer + len, 0, RPC_PAYLOAD_MAX - len);
+		if (c->rpc && rpc_call_noreply(c->rpc, req)) {
+			gps_client_abort_locked(c, "callback not delivered");
+		}
+		return;
 	}
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
 
-	RPC_PACK(buf, idx, timestamp);
-	RPC_PACK(buf, idx, length);
-	RPC_PACK_RAW(buf, idx, nmea, length);
-	req.header.buffer[RPC_PAYLOAD_MAX - 1] = '\0';
-	rpc_call_noreply(g_rpc, &req);
+	if (rc > 0 && kind != GPS_CB_OTHER) {
+		c->cb_dropped++;
+		if (code == GPS_SV_DELTA_CB || code == GPS_EPOCH_CB) {
+			gps_sv_delta_lost();
+		}
+		return;
+	}
 
-fail:
-	LOG_EXIT;
+	gps_client_abort_locked(c, rc > 0 ? "callback channel full" :
+		"callback channel failed");
 }
 
-static void gps_set_capabilities_cb(uint32_t capabilities) {
-	LOG_ENTRY;
-
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_SET_CAPABILITIES_CB,
-		},
-	};
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
+/**
+ * Decides whether a client gets a callback of the given @kind. Fixes are
+ * passed at the rate the client asked for, and the SV status and NMEA
+ * that go with a fix follow the decision for the last fix. Clients whose
+ * session is not known get everything. Called with cb_mutex held.
+ */
+static int gps_client_wants_locked(struct gps_client *c, int kind,
+	uint64_t now)
+{
+	if (kind == GPS_CB_OTHER || !c->fix_known) {
+		return 1;
+	}
 
-	RPC_DEBUG("%s: caps=%x", __func__, capabilities);
+	if (!c->fix_enabled) {
+		return 0;
+	}
 
-	RPC_PACK(buf, idx, capabilities);
-	rpc_call_noreply(g_rpc, &req);
+	if (kind == GPS_CB_FIX_DATA) {
+		return c->fix_sent;
+	}
 
-fail:
-	LOG_EXIT;
+	/* fixes come every arb_interval, allow half of that as jitter */
+	c->fix_sent = !c->last_fix_ms || c->fix_interval <= arb_interval ||
+		now - c->last_fix_ms + arb_interval / 2 >= c->fix_interval;
+	if (c->fix_sent) {
+		c->last_fix_ms = now;
+	}
+	return c->fix_sent;
 }
 
-static void gps_acquire_wakelock_cb(void) {
-	LOG_ENTRY;
+/**
+ * Sends a callback to every client that wants it. The clients are picked
+ * under cb_mutex and sent to under their own tx_mutex, so that a slow
+ * client does not hold up the table.
+ */
+static void gps_cb_broadcast(rpc_request_t *req, size_t len, int kind) {
+	struct gps_client *targets[GPS_MAX_CLIENTS];
+	uint64_t now = gps_now_ms();
+	int count = 0;
+	int i;
+
+	pthread_mutex_lock(&cb_mutex);
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 &&
+			gps_client_wants_locked(clients + i, kind, now))
+		{
+			targets[count++] = clients + i;
+		}
+	}
+	pthread_mutex_unlock(&cb_mutex);
 
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_ACQUIRE_LOCK_CB,
-		},
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&targets[i]->tx_mutex);
+		if (targets[i]->fd >= 0) {
+			gps_client_transmit_locked(targets[i], req, len, kind);
+		}
+		pthread_mutex_unlock(&targets[i]->tx_mutex);
+	}
+}
+
+/**
+ * Appends a trace with the origin of a callback, if there is room for it.
+ * Returns the new length of the payload.
+ */
+static size_t gps_cb_trace_begin(rpc_request_t *req, size_t len) {
+	struct gps_cb_trace trace = {
+		.origin_us = gps_monotonic_us(),
 	};
-	
-	rpc_call_noreply(g_rpc, &req);
 
-fail:
-	LOG_EXIT;
-}
+	if (len + sizeof(trace) > RPC_PAYLOAD_MAX) {
+		return len;
+	}
 
-static void gps_release_wakelock_cb(void) {
-	LOG_ENTRY;
+	memcpy(req->header.buffer + len, &trace, sizeof(trace));
+	return len + sizeof(trace);
+}
 
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_RELEASE_LOCK_CB,
-		},
-	};
-	
-	rpc_call_noreply(g_rpc, &req);
+/* stamps the trace that ends at @len with the time it is sent */
+static void gps_cb_trace_sent(rpc_request_t *req, size_t len) {
+	uint64_t now = gps_monotonic_us();
 
-fail:
-	LOG_EXIT;
+	memcpy(req->header.buffer + len - sizeof(struct gps_cb_trace) +
+		offsetof(struct gps_cb_trace, sent_us), &now, sizeof(now));
+}
+
+static void gps_cb_transmit(rpc_request_t *req, size_t len, int traced) {
+	int kind = GPS_CB_OTHER;
+
+	if (traced) {
+		gps_cb_trace_sent(req, len);
+	}
+
+	switch (req->header.code) {
+		case GPS_LOC_CB:
+		case GPS_LOC_COMPACT_CB:
+			kind = GPS_CB_FIX;
+			break;
+		case GPS_SV_STATUS_CB:
+		case GPS_SV_DELTA_CB:
+		case GPS_NMEA_CB:
+			kind = GPS_CB_FIX_DATA;
+			break;
+	}
+
+	gps_cb_broadcast(req, len, kind);
+}
+
+/**
+ * Recomputes the features every client supports. Called with cb_mutex
+ * held whenever a client comes, goes or opens.
+ */
+static void gps_client_features_update_locked(void) {
+	uint32_t features = srv_features;
+	int i;
+
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			features &= clients[i].features;
+		}
+	}
+
+	if (features != cb_features) {
+		RPC_INFO("callback features %x -> %x", cb_features, features);
+	}
+	__atomic_store_n(&cb_features, features, __ATOMIC_RELAXED);
+}
+
+static int gps_client_count(void) {
+	int count;
+
+	pthread_mutex_lock(&cb_mutex);
+	count = num_clients;
+	pthread_mutex_unlock(&cb_mutex);
+
+	return count;
+}
+
+/**
+ * Returns the client whose call the current thread is serving: the one
+ * whose channel the event loop is reading, or the one whose RPC receive
+ * thread this is. Clients that never opened cannot be told apart on the
+ * RPC socket, and NULL is returned for them.
+ */
+static struct gps_client *gps_client_current(void) {
+	struct gps_client *c = NULL;
+	pthread_t self = pthread_self();
+	int i;
+
+	if (pthread_equal(self, loop_thread)) {
+		return serving_client;
+	}
+
+	pthread_mutex_lock(&cb_mutex);
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].opened &&
+			pthread_equal(clients[i].rpc_thread, self))
+		{
+			c = clients + i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cb_mutex);
+
+	return c;
+}
+
+/*
+ * libstc-rpc gives a handler no context, so every client slot gets its own
+ * handler and a call on an RPC socket is known to come from that slot.
+ */
+static int gps_client_rpc_handler(struct gps_client *c,
+	rpc_request_hdr_t *hdr, rpc_reply_t *reply);
+
+#define GPS_CLIENT_HANDLER(n) \
+static int gps_client_rpc_handler_##n(rpc_request_hdr_t *hdr, \
+	rpc_reply_t *reply) \
+{ \
+	return gps_client_rpc_handler(clients + n, hdr, reply); \
+}
+
+GPS_CLIENT_HANDLER(0)
+GPS_CLIENT_HANDLER(1)
+GPS_CLIENT_HANDLER(2)
+GPS_CLIENT_HANDLER(3)
+GPS_CLIENT_HANDLER(4)
+GPS_CLIENT_HANDLER(5)
+GPS_CLIENT_HANDLER(6)
+GPS_CLIENT_HANDLER(7)
+
+static const rpc_handler_t gps_client_handlers[] = {
+	gps_client_rpc_handler_0,
+	gps_client_rpc_handler_1,
+	gps_client_rpc_handler_2,
+	gps_client_rpc_handler_3,
+	gps_client_rpc_handler_4,
+	gps_client_rpc_handler_5,
+	gps_client_rpc_handler_6,
+	gps_client_rpc_handler_7,
+};
+
+/* fails to compile unless there is a handler for every slot */
+typedef char gps_client_handlers_check[
+	sizeof(gps_client_handlers) / sizeof(gps_client_handlers[0]) ==
+	GPS_MAX_CLIENTS ? 1 : -1];
+
+static int gps_client_add(int fd) {
+	struct timeval timeout = {
+		.tv_sec = 0,
+		.tv_usec = GPS_CLIENT_SEND_TIMEOUT_MS * 1000,
+	};
+	struct gps_client *c = NULL;
+	rpc_t *rpc = NULL;
+	int i;
+
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			c = clients + i;
+			break;
+		}
+	}
+
+	if (!c) {
+		RPC_ERROR("%s: too many clients", __func__);
+		goto fail;
+	}
+
+	rpc = rpc_alloc();
+	if (!rpc) {
+		RPC_ERROR("out of memory");
+		goto fail;
+	}
+
+	if (rpc_init(fd, gps_client_handlers[c - clients], rpc)) {
+		RPC_ERROR("failed to init RPC");
+		goto fail;
+	}
+
+	/* libstc-rpc reads the socket blocking, so only bound the sends */
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout))) {
+		RPC_ERROR("%s: failed to set the send timeout", __func__);
+		goto fail;
+	}
+
+	/* only hangups, libstc-rpc reads the socket itself */
+	if (gps_epoll_add(fd, EPOLLRDHUP, GPS_EV_TAG(GPS_EV_CLIENT, c - clients))) {
+		RPC_ERROR("%s: failed to watch the client", __func__);
+		goto fail;
+	}
+
+	pthread_mutex_lock(&cb_mutex);
+	pthread_mutex_lock(&c->tx_mutex);
+	c->fd = fd;
+	c->pid = gps_peer_pid(fd);
+	c->rpc = rpc;
+	c->aborted = 0;
+	pthread_mutex_unlock(&c->tx_mutex);
+	c->features = GPS_FEATURES_LEGACY;
+	c->opened = 0;
+	num_clients++;
+	gps_client_features_update_locked();
+	pthread_mutex_unlock(&cb_mutex);
+
+	if (rpc_start(rpc)) {
+		RPC_ERROR("failed to start RPC");
+		goto fail_started;
+	}
+
+	RPC_INFO("client %d connected, %d clients", (int)c->pid, num_clients);
+	return 0;
+
+fail_started:
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	pthread_mutex_lock(&cb_mutex);
+	pthread_mutex_lock(&c->tx_mutex);
+	c->fd = -1;
+	c->rpc = NULL;
+	pthread_mutex_unlock(&c->tx_mutex);
+	num_clients--;
+	gps_client_features_update_locked();
+	pthread_mutex_unlock(&cb_mutex);
+fail:
+	if (rpc) {
+		rpc_free(rpc);
+	}
+	return -1;
+}
+
+static void gps_client_remove(struct gps_client *c) {
+	rpc_t *rpc;
+	int fd;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+
+	pthread_mutex_lock(&cb_mutex);
+	cb_channel_detach_locked(c);
+	pthread_mutex_lock(&c->tx_mutex);
+	rpc = c->rpc;
+	fd = c->fd;
+	c->rpc = NULL;
+	c->fd = -1;
+	pthread_mutex_unlock(&c->tx_mutex);
+	c->fix_known = 0;
+	num_clients--;
+	gps_client_features_update_locked();
+	pthread_mutex_unlock(&cb_mutex);
+
+	RPC_INFO("client %d disconnected, %d clients", (int)c->pid, num_clients);
+
+	/* a client that went away without stopping must not keep the receiver */
+	pthread_mutex_lock(&blob_mutex);
+	gps_session_drop(c - clients);
+	gps_cleanup_pending_run();
+	pthread_mutex_unlock(&blob_mutex);
+
+	if (rpc) {
+		if (rpc_join(rpc)) {
+			RPC_ERROR("failed to wait for RPC completion");
+		}
+		rpc_free(rpc);
+	}
+	close(fd);
+
+	/* no call of the client is running any more */
+	xtra_upload_drop(&c->xtra);
+}
+
+/******************************************************************************
+ * Session arbitration
+ *****************************************************************************/
+
+/*
+ * Every client has its own positioning session. The receiver runs with
+ * the smallest interval and the strictest accuracy of all started
+ * sessions, or of all configured ones while none is started, and is only
+ * stopped when the last session stops. Each client then gets fixes
+ * decimated to its own interval.
+ *
+ * Calls on a callback channel are attributed to its client. A call on an
+ * RPC socket is attributed to the only client without a channel, or else
+ * to a shared legacy session in the last slot.
+ */
+#define GPS_SESSION_LEGACY GPS_MAX_CLIENTS
+
+struct gps_session {
+	int configured;
+	int started;
+	GpsPositionMode mode;
+	GpsPositionRecurrence recurrence;
+	uint32_t min_interval;
+	uint32_t preferred_accuracy;
+	uint32_t preferred_time;
+};
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gps_session sessions[GPS_MAX_CLIENTS + 1];
+static struct gps_session arb_applied;
+static int arb_running = 0;
+static int sv_keyframes_only = 0;
+
+static int gps_session_current(void) {
+	int found = GPS_SESSION_LEGACY;
+	int count = 0;
+	int i;
+
+	if (pthread_equal(pthread_self(), loop_thread) && serving_client) {
+		return serving_client - clients;
+	}
+
+	pthread_mutex_lock(&cb_mutex);
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].sock < 0) {
+			found = i;
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&cb_mutex);
+
+	return count == 1 ? found : GPS_SESSION_LEGACY;
+}
+
+/**
+ * Merges the sessions into the parameters the receiver should run with.
+ * Returns nonzero if no session is configured.
+ */
+static int gps_session_merge(struct gps_session *out) {
+	int any_started = 0;
+	int found = 0;
+	int i;
+
+	for (i = 0; i <= GPS_MAX_CLIENTS; i++) {
+		any_started |= sessions[i].started;
+	}
+
+	memset(out, 0, sizeof(*out));
+	for (i = 0; i <= GPS_MAX_CLIENTS; i++) {
+		struct gps_session *ss = sessions + i;
+
+		if (!ss->configured || (any_started && !ss->started)) {
+			continue;
+		}
+
+		if (!found || ss->min_interval < out->min_interval) {
+			out->mode = ss->mode;
+			out->min_interval = ss->min_interval;
+		}
+
+		if (!found || ss->preferred_accuracy < out->preferred_accuracy) {
+			out->preferred_accuracy = ss->preferred_accuracy;
+		}
+
+		if (!found || ss->preferred_time < out->preferred_time) {
+			out->preferred_time = ss->preferred_time;
+		}
+
+		if (!found || ss->recurrence == GPS_POSITION_RECURRENCE_PERIODIC) {
+			out->recurrence = ss->recurrence;
+		}
+		found = 1;
+	}
+	out->configured = found;
+
+	return !found;
+}
+
+/**
+ * Publishes the decimation parameters of every client. Called with
+ * session_mutex held.
+ */
+static void gps_session_publish_locked(void) {
+	int decimating = 0;
+	int i;
+
+	pthread_mutex_lock(&cb_mutex);
+	arb_interval = arb_applied.min_interval;
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		struct gps_client *c = clients + i;
+		struct gps_session *ss = sessions + i;
+
+		if (c->fd < 0 || (!ss->configured && !ss->started)) {
+			c->fix_known = 0;
+			continue;
+		}
+
+		c->fix_known = 1;
+		c->fix_enabled = ss->started;
+		c->fix_interval = ss->min_interval;
+		if (ss->started && ss->min_interval > arb_interval) {
+			decimating = 1;
+		}
+	}
+	pthread_mutex_unlock(&cb_mutex);
+
+	/* skipped SV deltas would leave a decimated client without a table */
+	__atomic_store_n(&sv_keyframes_only, decimating, __ATOMIC_RELAXED);
+}
+
+/**
+ * Brings the receiver in line with the merged sessions. Called with
+ * session_mutex held. Returns the result of the last blob call.
+ */
+static int gps_session_apply_locked(void) {
+	struct gps_session merged;
+	int any_started = 0;
+	int rc = 0;
+	int i;
+
+	if (!origGpsInterface) {
+		RPC_ERROR("origGpsInterface == NULL");
+		return -1;
+	}
+
+	for (i = 0; i <= GPS_MAX_CLIENTS; i++) {
+		any_started |= sessions[i].started;
+	}
+
+	if (!gps_session_merge(&merged) &&
+		(!arb_applied.configured || merged.mode != arb_applied.mode ||
+		merged.recurrence != arb_applied.recurrence ||
+		merged.min_interval != arb_applied.min_interval ||
+		merged.preferred_accuracy != arb_applied.preferred_accuracy ||
+		merged.preferred_time != arb_applied.preferred_time))
+	{
+		if (origGpsInterface->set_position_mode) {
+			rc = origGpsInterface->set_position_mode(merged.mode,
+				merged.recurrence, merged.min_interval,
+				merged.preferred_accuracy, merged.preferred_time);
+		}
+		RPC_INFO("receiver mode %d interval %u accuracy %u rc %d",
+			merged.mode, merged.min_interval,
+			merged.preferred_accuracy, rc);
+		arb_applied = merged;
+	}
+
+	if (any_started && !arb_running) {
+		rc = origGpsInterface->start ? origGpsInterface->start() : -1;
+		arb_running = !rc;
+		RPC_INFO("receiver started rc %d", rc);
+	}
+	else if (!any_started && arb_running) {
+		rc = origGpsInterface->stop ? origGpsInterface->stop() : -1;
+		arb_running = 0;
+		RPC_INFO("receiver stopped rc %d", rc);
+	}
+
+	gps_session_publish_locked();
+	return rc;
+}
+
+static int gps_session_set_mode(GpsPositionMode mode,
+	GpsPositionRecurrence recurrence, uint32_t min_interval,
+	uint32_t preferred_accuracy, uint32_t preferred_time)
+{
+	struct gps_session *ss;
+	int rc;
+
+	pthread_mutex_lock(&session_mutex);
+	ss = sessions + gps_session_current();
+	ss->configured = 1;
+	ss->mode = mode;
+	ss->recurrence = recurrence;
+	ss->min_interval = min_interval;
+	ss->preferred_accuracy = preferred_accuracy;
+	ss->preferred_time = preferred_time;
+	rc = gps_session_apply_locked();
+	pthread_mutex_unlock(&session_mutex);
+
+	return rc;
+}
+
+static int gps_session_start(int start) {
+	int rc;
+
+	pthread_mutex_lock(&session_mutex);
+	sessions[gps_session_current()].started = start;
+	rc = gps_session_apply_locked();
+	pthread_mutex_unlock(&session_mutex);
+
+	return rc;
+}
+
+static void gps_ttff_cancel(int session);
+
+static void gps_session_drop(int client) {
+	gps_ttff_cancel(client);
+
+	pthread_mutex_lock(&session_mutex);
+	memset(sessions + client, 0, sizeof(sessions[client]));
+	if (origGpsInterface) {
+		gps_session_apply_locked();
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/******************************************************************************
+ * Time to first fix
+ *****************************************************************************/
+
+/*
+ * The time to first fix of every session is split into stages, all
+ * stamped with CLOCK_BOOTTIME on either side of the socket:
+ *   call      gps_start in the library until the daemon handles it
+ *   start     until the receiver runs, including the blob start call
+ *   receiver  until the blob reports a location
+ *   delivery  until the library has handed it to location_cb
+ * The library reports its two stamps once the fix is delivered. A start
+ * is cold without a previous fix or after the ephemeris and almanac were
+ * deleted, warm if any aiding data was deleted or the last fix is older
+ * than the ephemeris stays valid, and hot otherwise. The histograms are
+ * logged on SIGUSR1, together with the call statistics.
+ */
+#define GPS_TTFF_EPHEMERIS_US (4ULL * 3600 * 1000000)
+
+enum {
+	GPS_TTFF_COLD,
+	GPS_TTFF_WARM,
+	GPS_TTFF_HOT,
+	GPS_TTFF_KINDS,
+};
+
+enum {
+	GPS_TTFF_TOTAL,
+	GPS_TTFF_CALL,
+	GPS_TTFF_START,
+	GPS_TTFF_RECEIVER,
+	GPS_TTFF_DELIVERY,
+	GPS_TTFF_STAGES,
+};
+
+static const char *ttff_kind_names[GPS_TTFF_KINDS] = {
+	"cold", "warm", "hot",
+};
+
+static const char *ttff_stage_names[GPS_TTFF_STAGES] = {
+	"total", "call", "start", "receiver", "delivery",
+};
+
+struct gps_ttff {
+	int kind;
+	uint64_t call_us;
+	uint64_t started_us;
+	uint64_t fix_us;
+};
+
+/* per session, the histograms are in milliseconds */
+static pthread_mutex_t ttff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gps_ttff ttff[GPS_MAX_CLIENTS + 1];
+static struct gps_latency_hist ttff_hist[GPS_TTFF_KINDS][GPS_TTFF_STAGES];
+static uint64_t ttff_last_fix_us = 0;
+static GpsAidingData ttff_deleted = 0;
+
+/* signalled from the SIGUSR1 handler */
+static int stats_dump_fd = -1;
+
+static int gps_ttff_classify_locked(uint64_t now) {
+	const GpsAidingData orbits = GPS_DELETE_EPHEMERIS | GPS_DELETE_ALMANAC;
+
+	if (!ttff_last_fix_us || (ttff_deleted & orbits) == orbits) {
+		return GPS_TTFF_COLD;
+	}
+
+	if (ttff_deleted || now - ttff_last_fix_us > GPS_TTFF_EPHEMERIS_US) {
+		return GPS_TTFF_WARM;
+	}
+
+	return GPS_TTFF_HOT;
+}
+
+static void gps_ttff_begin(int session) {
+	uint64_t now = gps_boottime_us();
+
+	pthread_mutex_lock(&ttff_mutex);
+	memset(ttff + session, 0, sizeof(ttff[session]));
+	ttff[session].kind = gps_ttff_classify_locked(now);
+	ttff[session].call_us = now;
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+static void gps_ttff_started(int session) {
+	uint64_t now = gps_boottime_us();
+
+	pthread_mutex_lock(&ttff_mutex);
+	if (ttff[session].call_us && !ttff[session].started_us) {
+		ttff[session].started_us = now;
+	}
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+static void gps_ttff_cancel(int session) {
+	pthread_mutex_lock(&ttff_mutex);
+	memset(ttff + session, 0, sizeof(ttff[session]));
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+static void gps_ttff_aiding_deleted(GpsAidingData flags) {
+	pthread_mutex_lock(&ttff_mutex);
+	ttff_deleted |= flags;
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+/**
+ * Called for every location the blob reports.
+ */
+static void gps_ttff_fix(void) {
+	uint64_t now = gps_boottime_us();
+	int i;
+
+	pthread_mutex_lock(&ttff_mutex);
+	ttff_last_fix_us = now;
+	ttff_deleted = 0;
+
+	for (i = 0; i <= GPS_MAX_CLIENTS; i++) {
+		struct gps_ttff *t = ttff + i;
+
+		if (!t->call_us || t->fix_us) {
+			continue;
+		}
+
+		/* the blob may report from within its start call */
+		if (!t->started_us) {
+			t->started_us = now;
+		}
+		t->fix_us = now;
+	}
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+static void gps_ttff_report(int session, const struct gps_ttff_report *r) {
+	struct gps_ttff t;
+	uint64_t stage[GPS_TTFF_STAGES];
+	int i;
+
+	pthread_mutex_lock(&ttff_mutex);
+	t = ttff[session];
+	memset(ttff + session, 0, sizeof(ttff[session]));
+
+	if (!t.fix_us || r->start_us > t.call_us || r->fix_us < t.fix_us) {
+		pthread_mutex_unlock(&ttff_mutex);
+		RPC_DEBUG("%s: no matching start", __func__);
+		return;
+	}
+
+	stage[GPS_TTFF_TOTAL] = r->fix_us - r->start_us;
+	stage[GPS_TTFF_CALL] = t.call_us - r->start_us;
+	stage[GPS_TTFF_START] = t.started_us - t.call_us;
+	stage[GPS_TTFF_RECEIVER] = t.fix_us - t.started_us;
+	stage[GPS_TTFF_DELIVERY] = r->fix_us - t.fix_us;
+
+	for (i = 0; i < GPS_TTFF_STAGES; i++) {
+		gps_latency_hist_add(&ttff_hist[t.kind][i], stage[i] / 1000);
+	}
+	pthread_mutex_unlock(&ttff_mutex);
+
+	RPC_INFO("%s ttff %llums: call %lluus, start %lluus, receiver %llums, "
+		"delivery %lluus", ttff_kind_names[t.kind],
+		(unsigned long long)(stage[GPS_TTFF_TOTAL] / 1000),
+		(unsigned long long)stage[GPS_TTFF_CALL],
+		(unsigned long long)stage[GPS_TTFF_START],
+		(unsigned long long)(stage[GPS_TTFF_RECEIVER] / 1000),
+		(unsigned long long)stage[GPS_TTFF_DELIVERY]);
+}
+
+static void gps_ttff_dump(void) {
+	struct gps_latency_hist *h;
+	int kind, i;
+
+	pthread_mutex_lock(&ttff_mutex);
+	for (kind = 0; kind < GPS_TTFF_KINDS; kind++) {
+		for (i = 0; i < GPS_TTFF_STAGES; i++) {
+			h = &ttff_hist[kind][i];
+			if (!h->count) {
+				continue;
+			}
+			RPC_INFO("ttff %s %s: %llu starts, p50 %llums, p90 %llums, "
+				"max %llums", ttff_kind_names[kind], ttff_stage_names[i],
+				(unsigned long long)h->count,
+				(unsigned long long)gps_latency_hist_percentile(h, 50),
+				(unsigned long long)gps_latency_hist_percentile(h, 90),
+				(unsigned long long)h->max);
+		}
+	}
+	pthread_mutex_unlock(&ttff_mutex);
+}
+
+/******************************************************************************
+ * Call statistics
+ *****************************************************************************/
+
+/* time spent in gps_srv_rpc_handler, mostly inside the blob, per code */
+static struct gps_stats_registry call_stats =
+	GPS_STATS_REGISTRY_INIT(GPS_RPC_MAX);
+
+static void gps_call_stats_dump(void) {
+	struct gps_call_stats st;
+	unsigned code;
+
+	for (code = 0; code < GPS_RPC_MAX; code++) {
+		gps_stats_merge(&call_stats, code, &st);
+		if (!st.calls) {
+			continue;
+		}
+
+		RPC_INFO("%s: %llu calls, %llu errors, %llu bytes, p50 %lluus, "
+			"p99 %lluus, max %lluus", gps_rpc_to_s(code),
+			(unsigned long long)st.calls,
+			(unsigned long long)st.errors,
+			(unsigned long long)st.bytes,
+			(unsigned long long)gps_latency_hist_percentile(&st.latency, 50),
+			(unsigned long long)gps_latency_hist_percentile(&st.latency, 99),
+			(unsigned long long)st.latency.max);
+	}
+}
+
+static void gps_stats_signal(int sig) {
+	if (stats_dump_fd >= 0) {
+		eventfd_write(stats_dump_fd, 1);
+	}
+}
+
+/******************************************************************************
+ * Capture and replay
+ *****************************************************************************/
+
+/*
+ * With -r the daemon appends every call it serves and every callback the
+ * blob makes to a trace file, see gps-trace.h. Callbacks are recorded as
+ * they leave the blob, in the original encoding: before they are
+ * compacted, delta encoded, bundled or traced. Calls are recorded with
+ * the time they arrived and the result they got.
+ *
+ * With -R the daemon serves a trace instead of the blob, which is not
+ * loaded at all. Every call is answered with the result recorded for the
+ * next call of the same code: each code has its own cursor into the
+ * trace, so calls of different codes can arrive in any order, from any
+ * number of clients. The first GPS_PROXY_GPS_INIT starts the replay
+ * thread, which sends the recorded callbacks down the same path the blob
+ * does, at their offsets from the recorded init divided by the -s speed
+ * factor. Speed 0 sends them as fast as they can be delivered. Callbacks
+ * the daemon encodes are handed to its blob callbacks again, so they are
+ * encoded for the clients connected at replay time.
+ */
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int capture_fd = -1;
+static uint64_t capture_start_us = 0;
+
+static struct gps_trace_map replay_map;
+static int replay_mode = 0;
+static double replay_speed = 1;
+
+/* protects the cursors and the start of the replay thread */
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t replay_call_off[GPS_RPC_MAX];
+static uint64_t replay_base_us = 0;
+static int replay_started = 0;
+static pthread_t replay_thread;
+
+static int gps_capture_open(const char *path) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	capture_fd = gps_trace_create(path,
+		(uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+	if (capture_fd < 0) {
+		RPC_ERROR("failed to create the trace %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	capture_start_us = gps_monotonic_us();
+	RPC_INFO("capturing to %s", path);
+	return 0;
+}
+
+/**
+ * Appends a record to the trace. @at_us is the CLOCK_MONOTONIC time of
+ * the event.
+ */
+static void gps_capture(uint16_t type, uint32_t code, int rc,
+	const void *data, size_t len, uint64_t at_us)
+{
+	struct gps_trace_record rec = {
+		.code = code,
+		.type = type,
+		.rc = rc,
+		.len = len,
+	};
+
+	if (__atomic_load_n(&capture_fd, __ATOMIC_RELAXED) < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&capture_mutex);
+	rec.time_us = at_us - capture_start_us;
+	if (capture_fd >= 0 && gps_trace_append(capture_fd, &rec, data)) {
+		RPC_ERROR("failed to write the trace, capture stopped");
+		close(capture_fd);
+		__atomic_store_n(&capture_fd, -1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+static int gps_capturing(void) {
+	return __atomic_load_n(&capture_fd, __ATOMIC_RELAXED) >= 0;
+}
+
+/*
+ * Captures the callback @arg in its plain encoding. For the callbacks
+ * that are encoded for the clients, before that happens.
+ */
+#define GPS_CAPTURE_PLAIN(type, code, name, arg) do { \
+	if (gps_capturing()) { \
+		char __buf[RPC_PAYLOAD_MAX]; \
+		size_t __idx = 0; \
+		if (!gps_pack_##name(__buf, &__idx, arg)) { \
+			gps_capture(type, code, 0, __buf, __idx, gps_monotonic_us()); \
+		} \
+	} \
+} while (0)
+
+/* callbacks that only exist on the wire, captured by GPS_CAPTURE_PLAIN */
+static int gps_cb_encoded(uint32_t code) {
+	switch (code) {
+		case GPS_LOC_COMPACT_CB:
+		case GPS_STATUS_COMPACT_CB:
+		case GPS_SV_DELTA_CB:
+		case AGPS_STATUS_COMPACT_CB:
+		case NI_NOTIFY_COMPACT_CB:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+static void gps_capture_close(void) {
+	pthread_mutex_lock(&capture_mutex);
+	CHECK_CLOSE(capture_fd);
+	pthread_mutex_unlock(&capture_mutex);
+}
+
+static int gps_replay_open(const char *path) {
+	if (gps_trace_map_open(path, &replay_map)) {
+		RPC_ERROR("failed to open the trace %s", path);
+		return -1;
+	}
+
+	replay_mode = 1;
+	RPC_INFO("replaying %s at speed %g", path, replay_speed);
+	return 0;
+}
+
+/**
+ * Sends a recorded callback. The ones the daemon encodes go through the
+ * blob callback, the others go out as they were recorded.
+ */
+static void gps_replay_cb(const struct gps_trace_record *rec) {
+	rpc_request_t req;
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	union {
+		GpsLocation location;
+		GpsStatus status;
+		GpsSvStatus sv_status;
+		AGpsStatus agps_status;
+		GpsNiNotification ni_notify;
+	} cb;
+
+	req.header.code = rec->code;
+	memcpy(buf, rec->data, rec->len);
+
+	switch (rec->code) {
+		case GPS_LOC_CB:
+			if (!gps_unpack_location(buf, &idx, &cb.location) &&
+				idx <= rec->len)
+			{
+				gps_location_cb(&cb.location);
+				return;
+			}
+			break;
+		case GPS_STATUS_CB:
+			if (!gps_unpack_status(buf, &idx, &cb.status) &&
+				idx <= rec->len)
+			{
+				gps_status_cb(&cb.status);
+				return;
+			}
+			break;
+		case GPS_SV_STATUS_CB:
+			if (!gps_unpack_sv_status(buf, &idx, &cb.sv_status) &&
+				idx <= rec->len)
+			{
+				gps_sv_status_cb(&cb.sv_status);
+				return;
+			}
+			break;
+		case AGPS_STATUS_CB:
+			if (!gps_unpack_agps_status(buf, &idx, &cb.agps_status) &&
+				idx <= rec->len)
+			{
+				gps_agps_status_cb(&cb.agps_status);
+				return;
+			}
+			break;
+		case NI_NOTIFY_CB:
+			if (!gps_unpack_ni_notify(buf, &idx, &cb.ni_notify) &&
+				idx <= rec->len)
+			{
+				gps_ni_notify_cb(&cb.ni_notify);
+				return;
+			}
+			break;
+	}
+
+	if (rec->type == GPS_TRACE_EPOCH_CB) {
+		gps_epoch_add(&req, rec->len);
+	}
+	else {
+		gps_cb_send(&req, rec->len);
+	}
+}
+
+static void* gps_replay_thread_func(void *unused) {
+	const struct gps_trace_record *rec;
+	uint64_t start_us = gps_monotonic_us();
+	uint64_t count = 0;
+	size_t off = 0;
+
+	while ((rec = gps_trace_next(&replay_map, &off))) {
+		if ((rec->type != GPS_TRACE_CB && rec->type != GPS_TRACE_EPOCH_CB) ||
+			rec->len > RPC_PAYLOAD_MAX)
+		{
+			continue;
+		}
+
+		if (replay_speed > 0 && rec->time_us > replay_base_us) {
+			uint64_t due_us = start_us +
+				(uint64_t)((rec->time_us - replay_base_us) / replay_speed);
+			struct timespec ts = {
+				.tv_sec = due_us / 1000000,
+				.tv_nsec = (due_us % 1000000) * 1000,
+			};
+
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&ts, NULL) == EINTR)
+			{
+			}
+		}
+
+		gps_replay_cb(rec);
+		count++;
+	}
+	gps_epoch_flush();
+
+	RPC_INFO("replay finished, %llu callbacks in %llums",
+		(unsigned long long)count,
+		(unsigned long long)(gps_monotonic_us() - start_us) / 1000);
+	return NULL;
+}
+
+/**
+ * Answers a call from the trace. Called instead of gps_srv_rpc_call.
+ */
+static int gps_replay_call(rpc_request_hdr_t *hdr, rpc_reply_t *reply,
+	size_t *len)
+{
+	const struct gps_trace_record *rec = NULL;
+	char *rbuf = reply->buffer;
+	size_t ridx = 0;
+	size_t off;
+	int rc = 0;
+
+	*len = 0;
+	pthread_mutex_lock(&replay_mutex);
+	if (hdr->code < GPS_RPC_MAX) {
+		off = replay_call_off[hdr->code];
+		while ((rec = gps_trace_next(&replay_map, &off))) {
+			if (rec->type == GPS_TRACE_CALL && rec->code == hdr->code) {
+				replay_call_off[hdr->code] = off;
+				*len = rec->len;
+				rc = rec->rc;
+				break;
+			}
+		}
+	}
+
+	if (!rec) {
+		RPC_DEBUG("%s: %s is not in the trace", __func__,
+			gps_rpc_to_s(hdr->code));
+	}
+
+	if (hdr->code == GPS_PROXY_GPS_INIT && !replay_started) {
+		replay_base_us = rec ? rec->time_us : 0;
+		if (pthread_create(&replay_thread, NULL,
+			gps_replay_thread_func, NULL))
+		{
+			RPC_ERROR("failed to start the replay thread");
+		}
+		else {
+			replay_started = 1;
+		}
+	}
+	pthread_mutex_unlock(&replay_mutex);
+
+	RPC_PACK(rbuf, ridx, rc);
+	return rc;
+
+fail:
+	return -1;
+}
+
+/******************************************************************************
+ * Fix epoch bundling
+ *****************************************************************************/
+
+/*
+ * The blob reports one fix as a location, an SV status and a burst of
+ * NMEA sentences. These are collected into a single GPS_EPOCH_CB message
+ * which the library unpacks and fires in the original order. An epoch is
+ * sent when the location arrives, when another SV status shows that a new
+ * epoch has started, when the bundle is full, when any other callback has
+ * to be sent, or at the latest GPS_EPOCH_WINDOW_MS after its first record.
+ */
+#define GPS_EPOCH_WINDOW_MS 20
+
+static pthread_mutex_t epoch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t epoch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t epoch_thread;
+static int epoch_thread_running = 0;
+static rpc_request_t epoch_req;
+static uint32_t epoch_len = 0;
+static int epoch_has_sv = 0;
+static int epoch_has_loc = 0;
+static struct timespec epoch_deadline;
+
+static void gps_epoch_flush_locked(void) {
+	struct gps_cb_trace trace = { 0, 0 };
+	size_t len = sizeof(epoch_len) + epoch_len;
+
+	if (!epoch_len) {
+		return;
+	}
+
+	/* the records carry their origins, the epoch only the send time */
+	epoch_req.header.code = GPS_EPOCH_CB;
+	memcpy(epoch_req.header.buffer, &epoch_len, sizeof(epoch_len));
+	memcpy(epoch_req.header.buffer + len, &trace, sizeof(trace));
+	len += sizeof(trace);
+	gps_cb_trace_sent(&epoch_req, len);
+
+	gps_cb_broadcast(&epoch_req, len,
+		epoch_has_loc ? GPS_CB_FIX : GPS_CB_FIX_DATA);
+
+	epoch_len = 0;
+	epoch_has_sv = 0;
+	epoch_has_loc = 0;
+}
+
+static void gps_epoch_flush(void) {
+	pthread_mutex_lock(&epoch_mutex);
+	gps_epoch_flush_locked();
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+static void* gps_epoch_thread_func(void *unused) {
+	pthread_mutex_lock(&epoch_mutex);
+	while (1) {
+		if (!epoch_len) {
+			pthread_cond_wait(&epoch_cond, &epoch_mutex);
+			continue;
+		}
+
+		if (pthread_cond_timedwait(&epoch_cond, &epoch_mutex,
+			&epoch_deadline) == ETIMEDOUT)
+		{
+			gps_epoch_flush_locked();
+		}
+	}
+	pthread_mutex_unlock(&epoch_mutex);
+	return NULL;
+}
+
+static void gps_epoch_add(rpc_request_t *req, size_t payload_len) {
+	size_t len;
+	struct gps_rpc_frame frame;
+	size_t max = RPC_PAYLOAD_MAX - sizeof(epoch_len) -
+		sizeof(struct gps_cb_trace);
+	char *bundle = epoch_req.header.buffer + sizeof(epoch_len);
+
+	if (!gps_cb_encoded(req->header.code)) {
+		gps_capture(GPS_TRACE_EPOCH_CB, req->header.code, 0,
+			req->header.buffer, payload_len, gps_monotonic_us());
+	}
+
+	len = gps_cb_trace_begin(req, payload_len);
+	frame.code = req->header.code;
+	frame.len = len;
+
+	pthread_mutex_lock(&epoch_mutex);
+
+	if ((frame.code == GPS_SV_STATUS_CB || frame.code == GPS_SV_DELTA_CB) &&
+		epoch_has_sv)
+	{
+		gps_epoch_flush_locked();
+	}
+
+	if (epoch_len + sizeof(frame) + len > max) {
+		gps_epoch_flush_locked();
+	}
+
+	if (!epoch_thread_running || sizeof(frame) + len > max ||
+		!(__atomic_load_n(&cb_features, __ATOMIC_RELAXED) &
+			GPS_FEATURE_EPOCH))
+	{
+		gps_epoch_flush_locked();
+		gps_cb_transmit(req, len, len != payload_len);
+		goto done;
+	}
+
+	if (!epoch_len) {
+		clock_gettime(CLOCK_REALTIME, &epoch_deadline);
+		epoch_deadline.tv_nsec += GPS_EPOCH_WINDOW_MS * 1000000L;
+		if (epoch_deadline.tv_nsec >= 1000000000L) {
+			epoch_deadline.tv_sec++;
+			epoch_deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_signal(&epoch_cond);
+	}
+
+	memcpy(bundle + epoch_len, &frame, sizeof(frame));
+	memcpy(bundle + epoch_len + sizeof(frame), req->header.buffer, len);
+	epoch_len += sizeof(frame) + len;
+
+	if (frame.code == GPS_SV_STATUS_CB || frame.code == GPS_SV_DELTA_CB) {
+		epoch_has_sv = 1;
+	}
+
+	if (frame.code == GPS_LOC_CB || frame.code == GPS_LOC_COMPACT_CB) {
+		epoch_has_loc = 1;
+		gps_epoch_flush_locked();
+	}
+
+done:
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+static void gps_epoch_start(void) {
+	pthread_mutex_lock(&epoch_mutex);
+	if (!epoch_thread_running &&
+		!pthread_create(&epoch_thread, NULL, gps_epoch_thread_func, NULL))
+	{
+		epoch_thread_running = 1;
+	}
+	pthread_mutex_unlock(&epoch_mutex);
+}
+
+/**
+ * Sends a callback that is not part of an epoch bundle. A pending bundle
+ * is flushed first so that the client sees callbacks in order.
+ */
+static void gps_cb_send(rpc_request_t *req, size_t payload_len) {
+	size_t len;
+
+	if (!gps_cb_encoded(req->header.code)) {
+		gps_capture(GPS_TRACE_CB, req->header.code, 0,
+			req->header.buffer, payload_len, gps_monotonic_us());
+	}
+
+	len = gps_cb_trace_begin(req, payload_len);
+
+	gps_epoch_flush();
+	gps_cb_transmit(req, len, len != payload_len);
+}
+
+/******************************************************************************
+ * Outgoing RPC Interface
+ *****************************************************************************/
+
+#define MAX_THREADS 10
+static pthread_t lib_threads[MAX_THREADS];
+static int num_lib_threads = 0;
+
+/* thread creation callbacks the blob has asked for, replayed to new clients */
+static uint8_t thread_cb_sent[GPS_RPC_MAX];
+
+static pthread_t create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	RPC_DEBUG("%s: name %s", __func__, name);
+	int rc = -1;
+	
+	if (!start) {
+		RPC_ERROR("NULL func pointer");
+		goto fail;
+	}
+
+	if (num_lib_threads >= MAX_THREADS) {
+		RPC_ERROR("%s: already created maximal number of threads", __func__);
+		goto fail;
+	}
+	
+	int idx = num_lib_threads;
+	num_lib_threads++;
+	pthread_create(lib_threads + idx, NULL, start, arg);
+
+	LOG_EXIT;
+	return lib_threads[idx];
+
+fail:
+	return 0;
+}
+
+/******************************************************************************
+ * XTRA Interface
+ *****************************************************************************/
+static void gps_xtra_download_request_cb(void) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = XTRA_REQUEST_CB;
+	
+	gps_cb_send(&req, 0);
+fail:
+	LOG_EXIT;
+}
+
+static pthread_t xtra_create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	rpc_request_t req;
+	req.header.code = XTRA_CREATE_THREAD_CB;
+
+	gps_cb_send(&req, 0);
+	thread_cb_sent[req.header.code] = 1;
+
+	pthread_t ret = create_thread_cb(name, start, arg);
+
+	LOG_EXIT;
+	return ret;
+}
+
+
+static GpsXtraCallbacks gpsXtraCallbacks = {
+	.download_request_cb = gps_xtra_download_request_cb,
+	.create_thread_cb = xtra_create_thread_cb,
+};
+
+/******************************************************************************
+ * NI Interface
+ *****************************************************************************/
+static pthread_t ni_create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	rpc_request_t req;
+	req.header.code = NI_CREATE_THREAD_CB;
+
+	gps_cb_send(&req, 0);
+	thread_cb_sent[req.header.code] = 1;
+
+	pthread_t ret = create_thread_cb(name, start, arg);
+
+	LOG_EXIT;
+	return ret;
+}
+
+static void gps_ni_notify_cb(GpsNiNotification *notification) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = NI_NOTIFY_CB;
+
+	if (!notification) {
+		RPC_ERROR("%s: notification is NULL", __func__);
+		goto fail;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_cb_compact()) {
+		GPS_CAPTURE_PLAIN(GPS_TRACE_CB, NI_NOTIFY_CB, ni_notify, notification);
+		req.header.code = NI_NOTIFY_COMPACT_CB;
+		if (gps_encode_ni_notify(buf, &idx, notification)) {
+			goto fail;
+		}
+	}
+	else if (gps_pack_ni_notify(buf, &idx, notification)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+static GpsNiCallbacks gpsNiCallbacks = {
+	.notify_cb = gps_ni_notify_cb,
+	.create_thread_cb = ni_create_thread_cb,
+};
+
+/******************************************************************************
+ * GPS Interface
+ *****************************************************************************/
+static pthread_t gps_create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	rpc_request_t req;
+	req.header.code = GPS_CREATE_THREAD_CB;
+
+	gps_cb_send(&req, 0);
+	thread_cb_sent[req.header.code] = 1;
+
+	pthread_t ret = create_thread_cb(name, start, arg);
+
+	LOG_EXIT;
+	return ret;
+}
+
+static void gps_location_cb(GpsLocation *location) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = GPS_LOC_CB;
+
+	if (!location) {
+		RPC_ERROR("%s: location is NULL", __func__);
+		goto fail;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	gps_ttff_fix();
+
+	if (gps_cb_compact()) {
+		GPS_CAPTURE_PLAIN(GPS_TRACE_EPOCH_CB, GPS_LOC_CB, location, location);
+		req.header.code = GPS_LOC_COMPACT_CB;
+		if (gps_encode_location(buf, &idx, location)) {
+			goto fail;
+		}
+	}
+	else if (gps_pack_location(buf, &idx, location)) {
+		goto fail;
+	}
+	gps_epoch_add(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+static void gps_status_cb(GpsStatus *status) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = GPS_STATUS_CB;
+
+	if (!status) {
+		RPC_ERROR("%s: status is NULL", __func__);
+		goto fail;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_cb_compact()) {
+		GPS_CAPTURE_PLAIN(GPS_TRACE_CB, GPS_STATUS_CB, status, status);
+		req.header.code = GPS_STATUS_COMPACT_CB;
+		if (gps_encode_status(buf, &idx, status)) {
+			goto fail;
+		}
+	}
+	else if (gps_pack_status(buf, &idx, status)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+/*
+ * Last SV table as seen by the client. Only slots below num_svs are
+ * updated, exactly like the client does when it applies a delta.
+ */
+static pthread_mutex_t sv_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GpsSvStatus sv_last;
+static uint32_t sv_seq = 0;
+static int sv_since_keyframe = GPS_SV_KEYFRAME_INTERVAL;
+
+/* set when a client missed a delta, the next SV status is a keyframe */
+static int sv_resync = 0;
+
+static void gps_sv_delta_reset(void) {
+	pthread_mutex_lock(&sv_mutex);
+	sv_since_keyframe = GPS_SV_KEYFRAME_INTERVAL;
+	pthread_mutex_unlock(&sv_mutex);
+}
+
+/*
+ * Called when a delta was dropped for a client that fell behind. The
+ * sender may hold sv_mutex, so only a flag is set.
+ */
+static void gps_sv_delta_lost(void) {
+	__atomic_store_n(&sv_resync, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends the whole table as GPS_SV_STATUS_CB, for when some client cannot
+ * apply deltas. The next delta is a keyframe since the table it would be
+ * encoded against has gone stale meanwhile.
+ */
+static void gps_sv_status_send_full(GpsSvStatus *sv_info) {
+	rpc_request_t req;
+	size_t idx = 0;
+
+	req.header.code = GPS_SV_STATUS_CB;
+
+	gps_sv_delta_reset();
+	if (!gps_pack_sv_status(req.header.buffer, &idx, sv_info)) {
+		gps_epoch_add(&req, idx);
+	}
+}
+
+static void gps_sv_status_cb(GpsSvStatus *sv_info) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	struct gps_sv_delta delta;
+	int num_svs;
+
+	int i;
+
+	req.header.code = GPS_SV_DELTA_CB;
+
+	if (!sv_info) {
+		RPC_ERROR("%s: sv_info is NULL", __func__);
+		goto fail;
+	}
+
+	if (!(__atomic_load_n(&cb_features, __ATOMIC_RELAXED) &
+		GPS_FEATURE_SV_DELTA))
+	{
+		gps_sv_status_send_full(sv_info);
+		LOG_EXIT;
+		return;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = sizeof(delta);
+	size_t tail;
+
+	GPS_CAPTURE_PLAIN(GPS_TRACE_EPOCH_CB, GPS_SV_STATUS_CB, sv_status,
+		sv_info);
+
+	num_svs = sv_info->num_svs;
+	if (num_svs < 0) {
+		num_svs = 0;
+	}
+	if (num_svs > GPS_MAX_SVS) {
+		num_svs = GPS_MAX_SVS;
+	}
+
+	pthread_mutex_lock(&sv_mutex);
+
+	if (__atomic_exchange_n(&sv_resync, 0, __ATOMIC_RELAXED)) {
+		sv_since_keyframe = GPS_SV_KEYFRAME_INTERVAL;
+	}
+
+	memset(&delta, 0, sizeof(delta));
+	if (__atomic_load_n(&sv_keyframes_only, __ATOMIC_RELAXED) ||
+		sv_since_keyframe >= GPS_SV_KEYFRAME_INTERVAL)
+	{
+		memset(&sv_last, 0, sizeof(sv_last));
+		delta.flags = GPS_SV_DELTA_KEYFRAME;
+		sv_since_keyframe = 0;
+	}
+	else {
+		sv_since_keyframe++;
+	}
+
+	delta.seq = ++sv_seq;
+	delta.num_svs = num_svs;
+	delta.ephemeris_mask = sv_info->ephemeris_mask;
+	delta.almanac_mask = sv_info->almanac_mask;
+	delta.used_in_fix_mask = sv_info->used_in_fix_mask;
+
+	for (i = 0; i < num_svs; i++) {
+		GpsSvInfo *sv = sv_info->sv_list + i;
+		GpsSvInfo *last = sv_last.sv_list + i;
+		uint8_t fields = 0;
+
+		if (delta.flags & GPS_SV_DELTA_KEYFRAME) {
+			fields = GPS_SV_FIELD_ALL;
+		}
+		else {
+			fields |= sv->prn != last->prn ? GPS_SV_FIELD_PRN : 0;
+			fields |= sv->snr != last->snr ? GPS_SV_FIELD_SNR : 0;
+			fields |= sv->elevation != last->elevation ?
+				GPS_SV_FIELD_ELEVATION : 0;
+			fields |= sv->azimuth != last->azimuth ?
+				GPS_SV_FIELD_AZIMUTH : 0;
+		}
+
+		if (!fields) {
+			continue;
+		}
+
+		delta.changed |= 1ULL << i;
+		RPC_PACK(buf, idx, fields);
+		if (fields & GPS_SV_FIELD_PRN) {
+			RPC_PACK(buf, idx, sv->prn);
+		}
+		if (fields & GPS_SV_FIELD_SNR) {
+			RPC_PACK(buf, idx, sv->snr);
+		}
+		if (fields & GPS_SV_FIELD_ELEVATION) {
+			RPC_PACK(buf, idx, sv->elevation);
+		}
+		if (fields & GPS_SV_FIELD_AZIMUTH) {
+			RPC_PACK(buf, idx, sv->azimuth);
+		}
+		*last = *sv;
+	}
+
+	/* the header goes in front of the records, now that they are known */
+	tail = idx;
+	idx = 0;
+	if (gps_pack_sv_delta(buf, &idx, &delta)) {
+		goto fail;
+	}
+	idx = tail;
+
+	gps_epoch_add(&req, idx);
+	pthread_mutex_unlock(&sv_mutex);
+
+	LOG_EXIT;
+	return;
+
+fail:
+	if (sv_info) {
+		/* the table is out of sync, start over with a keyframe */
+		sv_since_keyframe = GPS_SV_KEYFRAME_INTERVAL;
+		pthread_mutex_unlock(&sv_mutex);
+	}
+	LOG_EXIT;
+}
+
+static void gps_nmea_cb(GpsUtcTime timestamp,
+	const char *nmea, int length)
+{
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = GPS_NMEA_CB;
+
+	if (!nmea || !length) {
+		RPC_ERROR("%s: nmea is NULL", __func__);
+		goto fail;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_pack_nmea(buf, &idx, &timestamp, &length)) {
+		goto fail;
+	}
+	GPS_MARSHAL_RAW(buf, idx, nmea, length);
+	gps_epoch_add(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+static uint32_t gps_capabilities = 0;
+static int gps_have_capabilities = 0;
+
+static void gps_set_capabilities_cb(uint32_t capabilities) {
+	LOG_ENTRY;
+
+	gps_capabilities = capabilities;
+	gps_have_capabilities = 1;
+
+	rpc_request_t req;
+	req.header.code = GPS_SET_CAPABILITIES_CB;
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	RPC_DEBUG("%s: caps=%x", __func__, capabilities);
+
+	if (gps_pack_set_capabilities(buf, &idx, &capabilities)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+static void gps_acquire_wakelock_cb(void) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = GPS_ACQUIRE_LOCK_CB;
+	
+	gps_cb_send(&req, 0);
+
+fail:
+	LOG_EXIT;
+}
+
+static void gps_release_wakelock_cb(void) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = GPS_RELEASE_LOCK_CB;
+	
+	gps_cb_send(&req, 0);
+
+fail:
+	LOG_EXIT;
 }
 
 static void gps_request_utc_time_cb(void) {
 	LOG_ENTRY;
 	
-	rpc_request_t req = {
-		.header = {
-			.code = GPS_REQUEST_UTC_TIME_CB,
-		},
-	};
+	rpc_request_t req;
+	req.header.code = GPS_REQUEST_UTC_TIME_CB;
+	
+	gps_cb_send(&req, 0);
+
+fail:
+	LOG_EXIT;
+}
+
+static GpsCallbacks gpsCallbacks = {
+	.size = sizeof(GpsCallbacks),
+	.location_cb = gps_location_cb,
+	.status_cb = gps_status_cb,
+	.sv_status_cb = gps_sv_status_cb,
+	.nmea_cb = gps_nmea_cb,
+	.set_capabilities_cb = gps_set_capabilities_cb,
+	.acquire_wakelock_cb = gps_acquire_wakelock_cb,
+	.release_wakelock_cb = gps_release_wakelock_cb,
+	.create_thread_cb = gps_create_thread_cb,
+	.request_utc_time_cb = gps_request_utc_time_cb,
+};
+
+/******************************************************************************
+ * AGPS Interface
+ *****************************************************************************/
+static pthread_t agps_create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	rpc_request_t req;
+	req.header.code = AGPS_CREATE_THREAD_CB;
+
+	gps_cb_send(&req, 0);
+	thread_cb_sent[req.header.code] = 1;
+
+	pthread_t ret = create_thread_cb(name, start, arg);
+
+	LOG_EXIT;
+	return ret;
+}
+
+static void gps_agps_status_cb(AGpsStatus *status) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = AGPS_STATUS_CB;
+
+	if (!status) {
+		RPC_ERROR("%s: status is NULL", __func__);
+		goto fail;
+	}
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+
+	if (gps_cb_compact()) {
+		GPS_CAPTURE_PLAIN(GPS_TRACE_CB, AGPS_STATUS_CB, agps_status, status);
+		req.header.code = AGPS_STATUS_COMPACT_CB;
+		if (gps_encode_agps_status(buf, &idx, status)) {
+			goto fail;
+		}
+	}
+	else if (gps_pack_agps_status(buf, &idx, status)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+
+fail:
+	LOG_EXIT;
+}
+
+static AGpsCallbacks aGpsCallbacks = {
+	.status_cb = gps_agps_status_cb,
+	.create_thread_cb = agps_create_thread_cb,
+};
+
+/******************************************************************************
+ * RIL Interface
+ *****************************************************************************/
+static pthread_t ril_create_thread_cb(
+	const char *name,
+	void (*start)(void *),
+	void *arg
+)
+{
+	LOG_ENTRY;
+	rpc_request_t req;
+	req.header.code = RIL_CREATE_THREAD_CB;
+
+	gps_cb_send(&req, 0);
+	thread_cb_sent[req.header.code] = 1;
+
+	pthread_t ret = create_thread_cb(name, start, arg);
+
+	LOG_EXIT;
+	return ret;
+}
+
+static void ril_request_set_id(uint32_t flags) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = RIL_SET_ID_CB;
+	
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	
+	if (gps_pack_ril_request_set_id(buf, &idx, &flags)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+fail:
+	LOG_EXIT;
+}
+
+static void ril_request_ref_loc(uint32_t flags) {
+	LOG_ENTRY;
+
+	rpc_request_t req;
+	req.header.code = RIL_REF_LOC_CB;
 	
-	rpc_call_noreply(g_rpc, &req);
+	char *buf = req.header.buffer;
+	size_t idx = 0;
+	
+	if (gps_pack_ril_request_ref_loc(buf, &idx, &flags)) {
+		goto fail;
+	}
+	gps_cb_send(&req, idx);
+fail:
+	LOG_EXIT;
+}
+
+static AGpsRilCallbacks rilCallbacks = {
+	.create_thread_cb = ril_create_thread_cb,
+	.request_setid = ril_request_set_id,
+	.request_refloc = ril_request_ref_loc,
+};
+
+/******************************************************************************
+ * XTRA data injection
+ *****************************************************************************/
+
+/*
+ * XTRA files do not fit into a single request. The client either passes a
+ * sealed memfd over the callback socket, which is mapped and handed to the
+ * blob without copying, or streams the file in chunks over the RPC socket.
+ *
+ * Each client reassembles its own upload, so that clients can upload at
+ * the same time. Its chunks may come over the RPC socket and its channel
+ * both, and a client is only known on the RPC socket once it has sent
+ * GPS_PROXY_OPEN. Clients that never did share one upload.
+ */
+static pthread_mutex_t xtra_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct gps_xtra_upload xtra_legacy;
+
+static int xtra_inject(char *data, int length) {
+	if (!origGpsXtraInterface || !origGpsXtraInterface->inject_xtra_data) {
+		RPC_ERROR("origGpsXtraInterface == NULL");
+		return -1;
+	}
+
+	RPC_INFO("injecting %d bytes of XTRA data", length);
+	return origGpsXtraInterface->inject_xtra_data(data, length);
+}
+
+static int xtra_inject_fd(int fd, int length) {
+	struct stat st;
+	char *data;
+	int rc;
+
+	if (length <= 0 || fstat(fd, &st) || st.st_size < length) {
+		RPC_ERROR("%s: invalid XTRA file of %d bytes", __func__, length);
+		return -1;
+	}
+
+	if ((fcntl(fd, F_GET_SEALS) & GPS_SHM_SEALS) != GPS_SHM_SEALS) {
+		RPC_DEBUG("%s: XTRA file is not sealed", __func__);
+	}
+
+	/* private mapping: the blob gets a writable buffer without a copy */
+	data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		RPC_ERROR("%s: failed to map XTRA file", __func__);
+		return -1;
+	}
+
+	rc = xtra_inject(data, length);
+	munmap(data, length);
+
+	return rc;
+}
+
+/* the upload of the client whose call is being served */
+static struct gps_xtra_upload *xtra_upload_current(void) {
+	struct gps_client *c = gps_client_current();
+
+	if (c && __atomic_load_n(&c->opened, __ATOMIC_RELAXED)) {
+		return &c->xtra;
+	}
+	return &xtra_legacy;
+}
+
+static void xtra_upload_reset_locked(struct gps_xtra_upload *up) {
+	free(up->buf);
+	up->buf = NULL;
+	up->total = 0;
+	up->received = 0;
+}
+
+static void xtra_upload_drop(struct gps_xtra_upload *up) {
+	pthread_mutex_lock(&xtra_mutex);
+	xtra_upload_reset_locked(up);
+	pthread_mutex_unlock(&xtra_mutex);
+}
+
+static int xtra_chunk_add(struct gps_xtra_upload *up, const char *data,
+	int total, int offset, int length)
+{
+	char *complete = NULL;
+	int rc = 0;
+
+	pthread_mutex_lock(&xtra_mutex);
+	if (total <= 0 || total > GPS_XTRA_MAX_SIZE || length < 0 ||
+		length > RPC_PAYLOAD_MAX - 3 * (int)sizeof(int))
+	{
+		RPC_ERROR("%s: invalid XTRA chunk", __func__);
+		goto fail;
+	}
+
+	if (!offset) {
+		xtra_upload_reset_locked(up);
+		up->buf = malloc(total);
+		if (!up->buf) {
+			RPC_ERROR("%s: out of memory", __func__);
+			goto fail;
+		}
+		up->total = total;
+	}
+
+	if (!up->buf || total != up->total || offset != up->received ||
+		offset + length > total)
+	{
+		RPC_ERROR("%s: XTRA chunk out of sequence", __func__);
+		goto fail;
+	}
+
+	memcpy(up->buf + offset, data, length);
+	up->received += length;
+
+	/* the blob gets the file without the lock held */
+	if (up->received == up->total) {
+		complete = up->buf;
+		up->buf = NULL;
+		xtra_upload_reset_locked(up);
+	}
+	pthread_mutex_unlock(&xtra_mutex);
+
+	if (complete) {
+		rc = xtra_inject(complete, total);
+		free(complete);
+	}
+	return rc;
+
+fail:
+	xtra_upload_reset_locked(up);
+	pthread_mutex_unlock(&xtra_mutex);
+	return -1;
+}
+
+/******************************************************************************
+ * Incoming RPC Interface
+ *****************************************************************************/
+/*
+ * The blob is initialized once and shared by all clients. A client that
+ * initializes an interface later gets the callbacks the blob sent during
+ * the first initialization replayed instead. The flags are tested and set
+ * under blob_mutex, which every handler runs with.
+ */
+static int gps_inited = 0;
+static int xtra_inited = 0;
+static int agps_inited = 0;
+static int ni_inited = 0;
+static int ril_inited = 0;
+
+static void gps_init_replay(uint32_t thread_code) {
+	rpc_request_t req;
+	req.header.code = thread_code;
+
+	if (thread_cb_sent[thread_code]) {
+		gps_cb_send(&req, 0);
+	}
+
+	if (thread_code == GPS_CREATE_THREAD_CB && gps_have_capabilities) {
+		gps_set_capabilities_cb(gps_capabilities);
+	}
+}
+
+static void gps_init_reset(void) {
+	gps_inited = 0;
+	xtra_inited = 0;
+	agps_inited = 0;
+	ni_inited = 0;
+	ril_inited = 0;
+	gps_have_capabilities = 0;
+	memset(thread_cb_sent, 0, sizeof(thread_cb_sent));
+}
+
+/*
+ * One handler per call of GPS_RPC_CALLS. A handler unpacks the arguments
+ * at *@idx, leaves *@idx past the bytes it consumed and returns the
+ * result of the call.
+ */
+static int gps_srv_ril_init(char *buf, size_t *idx) {
+	if (ril_inited) {
+		gps_init_replay(RIL_CREATE_THREAD_CB);
+	}
+	else if (origRilInterface && origRilInterface->init) {
+		origRilInterface->init(&rilCallbacks);
+		ril_inited = 1;
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		return -1;
+	}
+	return 0;
+}
+
+static int gps_srv_ril_set_ref_location(char *buf, size_t *idx) {
+	AGpsRefLocation loc;
+	uint32_t wire_size;
+	size_t sz_struct;
+
+	if (gps_unpack_ril_set_ref_location(buf, idx, &wire_size)) {
+		goto fail;
+	}
+	sz_struct = wire_size;
+
+	if (sz_struct > sizeof(loc)) {
+		RPC_ERROR("%s: invalid size %zu", __func__, sz_struct);
+		goto fail;
+	}
+	RPC_UNPACK_RAW(buf, *idx, &loc, sz_struct);
+
+	if (origRilInterface && origRilInterface->set_ref_location) {
+		origRilInterface->set_ref_location(&loc, sz_struct);
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_ril_set_set_id(char *buf, size_t *idx) {
+	AGpsSetIDType type;
+	char *setid;
+
+	if (gps_unpack_ril_set_set_id(buf, idx, &type)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, *idx, setid);
+
+	if (origRilInterface && origRilInterface->set_set_id) {
+		origRilInterface->set_set_id(type, setid);
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_ril_ni_message(char *buf, size_t *idx) {
+	uint8_t *msg;
+	uint32_t wire_len;
+	size_t len;
+
+	if (gps_unpack_ril_ni_message(buf, idx, &wire_len)) {
+		goto fail;
+	}
+	len = wire_len;
+	GPS_UNMARSHAL_REF(buf, *idx, msg, len);
+
+	if (origRilInterface && origRilInterface->ni_message) {
+		origRilInterface->ni_message(msg, len);
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_ril_update_network_state(char *buf, size_t *idx) {
+	int connected, type, roaming;
+	char *extra;
+
+	if (gps_unpack_ril_update_network_state(buf, idx, &connected, &type,
+		&roaming))
+	{
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, *idx, extra);
+
+	if (origRilInterface && origRilInterface->update_network_state) {
+		origRilInterface->update_network_state(connected, type, roaming,
+			extra);
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_ril_update_network_availability(char *buf, size_t *idx) {
+	int available;
+	char *apn;
+
+	if (gps_unpack_ril_update_network_availability(buf, idx, &available)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, *idx, apn);
+
+	if (origRilInterface && origRilInterface->update_network_availability) {
+		origRilInterface->update_network_availability(available, apn);
+	}
+	else {
+		RPC_ERROR("origRilInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_xtra_init(char *buf, size_t *idx) {
+	int rc = 0;
+
+	if (xtra_inited) {
+		gps_init_replay(XTRA_CREATE_THREAD_CB);
+	}
+	else if (origGpsXtraInterface && origGpsXtraInterface->init) {
+		rc = origGpsXtraInterface->init(&gpsXtraCallbacks);
+		xtra_inited = !rc;
+	}
+	else {
+		RPC_ERROR("origGpsXtraInterface == NULL");
+		rc = -1;
+	}
+	return rc;
+}
+
+static int gps_srv_xtra_inject_data(char *buf, size_t *idx) {
+	int length;
+	char *data;
+
+	if (gps_unpack_xtra_inject_data(buf, idx, &length)) {
+		goto fail;
+	}
+
+	if (length < 0 || length > RPC_PAYLOAD_MAX - (int)*idx) {
+		RPC_ERROR("invalid XTRA length %d", length);
+		goto fail;
+	}
+	GPS_UNMARSHAL_REF(buf, *idx, data, length);
+
+	if (origGpsXtraInterface && origGpsXtraInterface->inject_xtra_data) {
+		return origGpsXtraInterface->inject_xtra_data(data, length);
+	}
+
+	RPC_ERROR("origGpsXtraInterface == NULL");
+fail:
+	return -1;
+}
+
+static int gps_srv_xtra_inject_chunk(char *buf, size_t *idx) {
+	struct gps_xtra_upload *up = xtra_upload_current();
+	int total;
+	int offset;
+	int length;
+	char *data;
+
+	if (gps_unpack_xtra_inject_chunk(buf, idx, &total, &offset, &length)) {
+		goto fail;
+	}
+
+	if (length < 0 || length > RPC_PAYLOAD_MAX - (int)*idx) {
+		RPC_ERROR("invalid XTRA chunk length %d", length);
+		goto fail;
+	}
+	GPS_UNMARSHAL_REF(buf, *idx, data, length);
+
+	return xtra_chunk_add(up, data, total, offset, length);
+
+fail:
+	xtra_upload_drop(up);
+	return -1;
+}
+
+static int gps_srv_agps_init(char *buf, size_t *idx) {
+	if (agps_inited) {
+		gps_init_replay(AGPS_CREATE_THREAD_CB);
+	}
+	else if (origAGpsInterface && origAGpsInterface->init) {
+		origAGpsInterface->init(&aGpsCallbacks);
+		agps_inited = 1;
+	}
+	else {
+		RPC_ERROR("origAGpsInterface == NULL");
+		return -1;
+	}
+	return 0;
+}
+
+static int gps_srv_agps_data_conn_open(char *buf, size_t *idx) {
+	char *str;
+
+	GPS_UNMARSHAL_S(buf, *idx, str);
+
+	if (origAGpsInterface && origAGpsInterface->data_conn_open) {
+		return origAGpsInterface->data_conn_open(str);
+	}
+
+	RPC_ERROR("origAGpsInterface == NULL");
+fail:
+	return -1;
+}
+
+static int gps_srv_agps_data_conn_closed(char *buf, size_t *idx) {
+	if (origAGpsInterface && origAGpsInterface->data_conn_closed) {
+		return origAGpsInterface->data_conn_closed();
+	}
+
+	RPC_ERROR("origAGpsInterface == NULL");
+	return -1;
+}
+
+static int gps_srv_agps_data_conn_failed(char *buf, size_t *idx) {
+	if (origAGpsInterface && origAGpsInterface->data_conn_failed) {
+		return origAGpsInterface->data_conn_failed();
+	}
+
+	RPC_ERROR("origAGpsInterface == NULL");
+	return -1;
+}
+
+static int gps_srv_agps_set_server(char *buf, size_t *idx) {
+	char *hostname;
+	AGpsType type;
+	int port;
+
+	if (gps_unpack_agps_set_server(buf, idx, &type, &port)) {
+		goto fail;
+	}
+	GPS_UNMARSHAL_S(buf, *idx, hostname);
 
+	if (origAGpsInterface && origAGpsInterface->set_server) {
+		return origAGpsInterface->set_server(type, hostname, port);
+	}
+
+	RPC_ERROR("origAGpsInterface == NULL");
 fail:
-	LOG_EXIT;
+	return -1;
 }
 
-static GpsCallbacks gpsCallbacks = {
-	.size = sizeof(GpsCallbacks),
-	.location_cb = gps_location_cb,
-	.status_cb = gps_status_cb,
-	.sv_status_cb = gps_sv_status_cb,
-	.nmea_cb = gps_nmea_cb,
-	.set_capabilities_cb = gps_set_capabilities_cb,
-	.acquire_wakelock_cb = gps_acquire_wakelock_cb,
-	.release_wakelock_cb = gps_release_wakelock_cb,
-	.create_thread_cb = gps_create_thread_cb,
-	.request_utc_time_cb = gps_request_utc_time_cb,
+static int gps_srv_ni_init(char *buf, size_t *idx) {
+	if (ni_inited) {
+		gps_init_replay(NI_CREATE_THREAD_CB);
+	}
+	else if (origNiInterface && origNiInterface->init) {
+		origNiInterface->init(&gpsNiCallbacks);
+		ni_inited = 1;
+	}
+	else {
+		RPC_ERROR("origNiInterface == NULL");
+		return -1;
+	}
+	return 0;
+}
+
+static int gps_srv_ni_respond(char *buf, size_t *idx) {
+	int notif_id;
+	GpsUserResponseType user_response;
+
+	if (gps_unpack_ni_respond(buf, idx, &notif_id, &user_response)) {
+		goto fail;
+	}
+
+	if (origNiInterface && origNiInterface->respond) {
+		origNiInterface->respond(notif_id, user_response);
+	}
+	else {
+		RPC_ERROR("origNiInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_gps_init(char *buf, size_t *idx) {
+	int rc = 0;
+
+	if (gps_inited) {
+		RPC_INFO("GPS_INIT: already initialized by another client");
+		gps_init_replay(GPS_CREATE_THREAD_CB);
+	}
+	else if (origGpsInterface && origGpsInterface->init) {
+		RPC_DEBUG("calling GPS_INIT");
+		rc = origGpsInterface->init(&gpsCallbacks);
+		RPC_INFO("GPS_INIT rc %d", rc);
+		gps_inited = !rc;
+	}
+	else {
+		RPC_ERROR("origGpsInterface == NULL");
+		rc = -1;
+	}
+	return rc;
+}
+
+static int gps_srv_gps_start(char *buf, size_t *idx) {
+	int session = gps_session_current();
+	int rc;
+
+	gps_ttff_begin(session);
+	rc = gps_session_start(1);
+	if (rc) {
+		gps_ttff_cancel(session);
+	}
+	else {
+		gps_ttff_started(session);
+	}
+	return rc;
+}
+
+static int gps_srv_gps_stop(char *buf, size_t *idx) {
+	gps_ttff_cancel(gps_session_current());
+	return gps_session_start(0);
+}
+
+static int gps_srv_ttff_report(char *buf, size_t *idx) {
+	struct gps_ttff_report report;
+
+	if (gps_unpack_ttff_report(buf, idx, &report)) {
+		return -1;
+	}
+	gps_ttff_report(gps_session_current(), &report);
+	return 0;
+}
+
+/*
+ * Cleanup asked for while other clients were connected. It runs when the
+ * last client goes away. Under blob_mutex, like the client count checks,
+ * so that a client leaving at the same time cannot miss it.
+ */
+static int cleanup_pending = 0;
+
+static void gps_cleanup_locked(void) {
+	origGpsInterface->cleanup();
+	gps_init_reset();
+	cleanup_pending = 0;
+
+	pthread_mutex_lock(&session_mutex);
+	memset(&arb_applied, 0, sizeof(arb_applied));
+	arb_running = 0;
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/* runs a deferred cleanup once no client is left, with blob_mutex held */
+static void gps_cleanup_pending_run(void) {
+	if (cleanup_pending && !gps_client_count()) {
+		RPC_INFO("GPS_CLEANUP: running the deferred cleanup");
+		gps_cleanup_locked();
+	}
+}
+
+static int gps_srv_gps_cleanup(char *buf, size_t *idx) {
+	if (!origGpsInterface || !origGpsInterface->cleanup) {
+		RPC_ERROR("origGpsInterface == NULL");
+		return -1;
+	}
+
+	if (gps_client_count() > 1) {
+		RPC_INFO("GPS_CLEANUP: deferred, other clients are connected");
+		cleanup_pending = 1;
+	}
+	else {
+		gps_cleanup_locked();
+	}
+	return 0;
+}
+
+static int gps_srv_gps_inject_time(char *buf, size_t *idx) {
+	GpsUtcTime time;
+	int64_t timeReference;
+	int uncertainty;
+
+	if (gps_unpack_gps_inject_time(buf, idx, &time, &timeReference,
+		&uncertainty))
+	{
+		goto fail;
+	}
+
+	if (origGpsInterface && origGpsInterface->inject_time) {
+		return origGpsInterface->inject_time(time, timeReference,
+			uncertainty);
+	}
+
+	RPC_ERROR("origGpsInterface == NULL");
+fail:
+	return -1;
+}
+
+static int gps_srv_gps_inject_location(char *buf, size_t *idx) {
+	double latitude;
+	double longitude;
+	float accuracy;
+
+	if (gps_unpack_gps_inject_location(buf, idx, &latitude, &longitude,
+		&accuracy))
+	{
+		goto fail;
+	}
+
+	if (origGpsInterface && origGpsInterface->inject_location) {
+		return origGpsInterface->inject_location(latitude, longitude,
+			accuracy);
+	}
+
+	RPC_ERROR("origGpsInterface == NULL");
+fail:
+	return -1;
+}
+
+static int gps_srv_gps_delete_aiding_data(char *buf, size_t *idx) {
+	GpsAidingData flags;
+
+	if (gps_unpack_gps_delete_aiding_data(buf, idx, &flags)) {
+		goto fail;
+	}
+	gps_ttff_aiding_deleted(flags);
+
+	if (origGpsInterface && origGpsInterface->delete_aiding_data) {
+		origGpsInterface->delete_aiding_data(flags);
+	}
+	else {
+		RPC_ERROR("origGpsInterface == NULL");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	return -1;
+}
+
+static int gps_srv_gps_set_position_mode(char *buf, size_t *idx) {
+	GpsPositionMode mode;
+	GpsPositionRecurrence recurrence;
+	uint32_t min_interval;
+	uint32_t preferred_accuracy;
+	uint32_t preferred_time;
+
+	if (gps_unpack_gps_set_position_mode(buf, idx, &mode, &recurrence,
+		&min_interval, &preferred_accuracy, &preferred_time))
+	{
+		return -1;
+	}
+
+	return gps_session_set_mode(mode, recurrence, min_interval,
+		preferred_accuracy, preferred_time);
+}
+
+struct gps_srv_call {
+	int (*handler)(char *buf, size_t *idx);
+	uint32_t flags;
 };
 
-/******************************************************************************
- * AGPS Interface
- *****************************************************************************/
-static pthread_t agps_create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
+static const struct gps_srv_call gps_srv_calls[GPS_RPC_MAX] = {
+	#define GPS_SRV_CALL(code, name, flags, args) \
+		[code] = { gps_srv_##name, flags },
+	GPS_RPC_CALLS(GPS_SRV_CALL)
+	#undef GPS_SRV_CALL
+};
+
+/**
+ * Executes one call. Returns its result and stores the number of argument
+ * bytes it consumed in @len. Calls that return a result get it in the
+ * reply, also when their arguments could not be decoded.
+ */
+static int gps_srv_rpc_call(rpc_request_hdr_t *hdr, rpc_reply_t *reply,
+	size_t *len)
 {
-	LOG_ENTRY;
-	rpc_request_t req = {
-		.header = {
-			.code =	AGPS_CREATE_THREAD_CB,
-		},
-	};
+	const struct gps_srv_call *call;
+	size_t idx = 0;
+	int rc;
 
-	rpc_call_noreply(g_rpc, &req);
+	if (hdr->code >= GPS_RPC_MAX || !gps_srv_calls[hdr->code].handler) {
+		RPC_ERROR("%s: unknown call %x", __func__, hdr->code);
+		*len = 0;
+		return -1;
+	}
 
-	pthread_t ret = create_thread_cb(name, start, arg);
+	call = gps_srv_calls + hdr->code;
+	pthread_mutex_lock(&blob_mutex);
+	rc = call->handler(hdr->buffer, &idx);
+	pthread_mutex_unlock(&blob_mutex);
+	if (call->flags & GPS_RPC_RESULT) {
+		memcpy(reply->buffer, &rc, sizeof(rc));
+	}
 
-	LOG_EXIT;
-	return ret;
+	*len = idx;
+	return rc;
 }
 
-static void gps_agps_status_cb(AGpsStatus *status) {
-	LOG_ENTRY;
+/**
+ * Serves GPS_PROXY_OPEN for @c, the connection the call came on. The pid
+ * in the request is only logged, the connection is known from its socket.
+ * The client gets the features both sides support, and the daemon uses
+ * them for that client from now on.
+ */
+static void gps_client_open(struct gps_client *c, rpc_request_hdr_t *hdr,
+	rpc_reply_t *reply)
+{
+	struct gps_proxy_open peer;
+	struct gps_proxy_open ours;
+	uint32_t features = 0;
+	size_t idx = 0;
+	int opened;
+	int rc = -1;
 
-	rpc_request_t req = {
-		.header = {
-			.code = AGPS_STATUS_CB,
-		},
-	};
+	if (gps_unpack_proxy_open(hdr->buffer, &idx, &peer) ||
+		peer.magic != GPS_PROTOCOL_MAGIC)
+	{
+		RPC_ERROR("%s: malformed request", __func__);
+		goto fail;
+	}
 
-	if (!status) {
-		RPC_ERROR("%s: status is NULL", __func__);
+	pthread_mutex_lock(&cb_mutex);
+	opened = c->opened;
+	if (!opened) {
+		c->features = peer.features & srv_features;
+		c->opened = 1;
+		c->rpc_thread = pthread_self();
+		features = c->features;
+		gps_client_features_update_locked();
+	}
+	pthread_mutex_unlock(&cb_mutex);
+
+	if (opened) {
+		RPC_ERROR("client %d: already opened", (int)c->pid);
 		goto fail;
 	}
-	
+
+	if (peer.pid != c->pid) {
+		RPC_INFO("client %d: handshake says pid %d", (int)c->pid,
+			(int)peer.pid);
+	}
+
+	RPC_INFO("client %d: protocol version %u, features %x, agreed %x",
+		(int)c->pid, peer.version, peer.features, features);
+	if (!gps_proxy_open_abi_match(&peer)) {
+		if (features & GPS_FEATURE_COMPACT) {
+			RPC_INFO("client %d: struct sizes differ, callbacks use the "
+				"compact encoding", (int)c->pid);
+		}
+		else {
+			RPC_ERROR("client %d: struct sizes differ, raw structs will be "
+				"garbled", (int)c->pid);
+		}
+	}
+
+	gps_proxy_open_init(&ours, features, getpid());
+	rc = 0;
+	idx = 0;
+	RPC_PACK(reply->buffer, idx, rc);
+	if (!gps_pack_proxy_open(reply->buffer, &idx, &ours)) {
+		return;
+	}
+
+fail:
+	rc = -1;
+	memcpy(reply->buffer, &rc, sizeof(rc));
+}
+
+static int gps_srv_rpc_handler(rpc_request_hdr_t *hdr, rpc_reply_t *reply) {
+	uint64_t arrival_us;
+	uint64_t start_us;
+	size_t len;
+	int rc;
+
+	if (!hdr) {
+		RPC_ERROR("hdr is NULL");
+		goto fail;
+	}
+
+	if (!reply) {
+		RPC_ERROR("reply is NULL");
+		goto fail;
+	}
+
+	RPC_DEBUG("+request code %x : %s", hdr->code, gps_rpc_to_s(hdr->code));
+	reply->code = hdr->code;
+
+	/* the handshake belongs to an RPC connection, see gps_client_rpc_handler */
+	if (hdr->code == GPS_PROXY_OPEN) {
+		RPC_ERROR("%s: handshake outside of an RPC connection", __func__);
+		goto fail;
+	}
+
+	uint64_t accept_ms = __atomic_exchange_n(&first_call_accept_ms, 0,
+		__ATOMIC_RELAXED);
+	if (accept_ms) {
+		RPC_INFO("time to first call %llums, blob load %llums%s",
+			(unsigned long long)(gps_now_ms() - accept_ms),
+			(unsigned long long)lib_load_ms,
+			lib_preloaded ? " at boot" : "");
+	}
+
+	arrival_us = gps_monotonic_us();
+	start_us = gps_boottime_us();
+	if (replay_mode) {
+		rc = gps_replay_call(hdr, reply, &len);
+	}
+	else {
+		rc = gps_srv_rpc_call(hdr, reply, &len);
+	}
+	gps_stats_record(&call_stats, hdr->code, len, rc,
+		gps_boottime_us() - start_us);
+	gps_capture(GPS_TRACE_CALL, hdr->code, rc, hdr->buffer, len, arrival_us);
+
+	RPC_DEBUG("-request code %x : %s", hdr->code, gps_rpc_to_s(hdr->code));
+
+fail:
+	return 0;
+}
+
+/*
+ * Serves a call on the RPC socket of @c. The handshake is answered here,
+ * everything else goes to gps_srv_rpc_handler.
+ */
+static int gps_client_rpc_handler(struct gps_client *c,
+	rpc_request_hdr_t *hdr, rpc_reply_t *reply)
+{
+	if (hdr && reply && hdr->code == GPS_PROXY_OPEN) {
+		reply->code = hdr->code;
+		/* the handshake is not a blob call, it is neither counted nor traced */
+		gps_client_open(c, hdr, reply);
+		return 0;
+	}
+
+	return gps_srv_rpc_handler(hdr, reply);
+}
+
+/**
+ * Serves a call that a client sent over its callback channel, once all of
+ * it has been read. Each call carries an id which is echoed in its
+ * GPS_PROXY_REPLY, so the client can keep several calls in flight.
+ * One-way calls are only counted and acknowledged in batches. Calls are
+ * executed in the order they arrive.
+ */
+static void cb_channel_call(struct gps_client *c) {
+	static rpc_reply_t call_reply;
+	rpc_request_t req;
+	struct gps_call_reply reply;
+
+	uint32_t id;
+	int rc = 0;
 	char *buf = req.header.buffer;
 	size_t idx = 0;
 
-	RPC_PACK_RAW(buf, idx, status, sizeof(AGpsStatus));
-	rpc_call_noreply(g_rpc, &req);
+	req.header.code = GPS_PROXY_REPLY;
+
+	/* the id is the last word so that the arguments stay in place */
+	memcpy(&id, c->rx_call.buffer + c->rx_frame.len - sizeof(id), sizeof(id));
+
+	c->rx_call.code = c->rx_frame.code;
+	memcpy(call_reply.buffer, &rc, sizeof(rc));
+	serving_client = c;
+	gps_srv_rpc_handler(&c->rx_call, &call_reply);
+	serving_client = NULL;
+	memcpy(&rc, call_reply.buffer, sizeof(rc));
+
+	if (id & GPS_CALL_ONEWAY) {
+		if (++c->oneway_done % GPS_ONEWAY_ACK_BATCH) {
+			return;
+		}
+		id = 0;
+	}
+
+	reply.id = id;
+	reply.rc = rc;
+	reply.oneway_done = c->oneway_done;
+
+	RPC_PACK(buf, idx, reply);
+
+	pthread_mutex_lock(&c->tx_mutex);
+	gps_client_transmit_locked(c, &req, idx, GPS_CB_OTHER);
+	pthread_mutex_unlock(&c->tx_mutex);
+
+fail:
+	return;
+}
+
+/**
+ * Reads what has arrived on a callback channel without blocking, and
+ * serves the call once its frame is complete. A client that sends part
+ * of a frame does not hold up the event loop, the rest is read when it
+ * arrives. Returns nonzero if the channel is to be closed.
+ */
+static int cb_channel_serve(struct gps_client *c) {
+	uint32_t hdr_len = sizeof(c->rx_frame);
+	char *ptr;
+	size_t want;
+	ssize_t rc;
+
+	while (1) {
+		if (c->rx_len < hdr_len) {
+			ptr = (char*)&c->rx_frame + c->rx_len;
+			want = hdr_len - c->rx_len;
+		}
+		else {
+			ptr = c->rx_call.buffer + (c->rx_len - hdr_len);
+			want = hdr_len + c->rx_frame.len - c->rx_len;
+		}
+
+		rc = recv(c->sock, ptr, want, MSG_DONTWAIT);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+
+		if (rc <= 0) {
+			return -1;
+		}
+		c->rx_len += rc;
+
+		/* the stream cannot be resynchronized after a bad length */
+		if (c->rx_len == hdr_len && (c->rx_frame.len < sizeof(uint32_t) ||
+			c->rx_frame.len > RPC_PAYLOAD_MAX))
+		{
+			RPC_ERROR("%s: malformed call %x", __func__, c->rx_frame.code);
+			return -1;
+		}
+
+		if (c->rx_len > hdr_len && c->rx_len == hdr_len + c->rx_frame.len) {
+			c->rx_len = 0;
+			cb_channel_call(c);
+			return 0;
+		}
+	}
+}
+
+/******************************************************************************
+ * RPC Transport Setup
+ *****************************************************************************/
+static int server_socket_open(void) {
+	int fd = -1;
+	int retry_count = 5;
+
+	while (retry_count--) {
+		unlink(GPS_RPC_SOCKET_NAME);
+		fd = socket_local_server(GPS_RPC_SOCKET_NAME,
+			ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+
+		if (fd >= 0) {
+			break;
+		}
+	}
 
-fail:
-	LOG_EXIT;
+	return fd;
 }
 
-static AGpsCallbacks aGpsCallbacks = {
-	.status_cb = gps_agps_status_cb,
-	.create_thread_cb = agps_create_thread_cb,
+/* an XTRA file passed over the callback socket, injected by a worker */
+struct xtra_fd_request {
+	int sock;
+	int data_fd;
+	int length;
 };
 
-/******************************************************************************
- * RIL Interface
- *****************************************************************************/
-static pthread_t ril_create_thread_cb(
-	const char *name,
-	void (*start)(void *),
-	void *arg
-)
-{
-	LOG_ENTRY;
-	rpc_request_t req = {
-		.header = {
-			.code =	RIL_CREATE_THREAD_CB,
-		},
-	};
-
-	rpc_call_noreply(g_rpc, &req);
+static void *xtra_fd_thread_func(void *arg) {
+	struct xtra_fd_request *req = arg;
+	int rc;
 
-	pthread_t ret = create_thread_cb(name, start, arg);
-
-	LOG_EXIT;
-	return ret;
-}
+	pthread_mutex_lock(&blob_mutex);
+	rc = xtra_inject_fd(req->data_fd, req->length);
+	pthread_mutex_unlock(&blob_mutex);
 
-static void ril_request_set_id(uint32_t flags) {
-	LOG_ENTRY;
+	/* the reply is a single small frame, the client is waiting for it */
+	fcntl(req->sock, F_SETFL, fcntl(req->sock, F_GETFL) & ~O_NONBLOCK);
+	gps_rpc_frame_write(req->sock, GPS_PROXY_XTRA_INJECT_XTRA_FD,
+		&rc, sizeof(rc));
 
-	rpc_request_t req = {
-		.header = {
-			.code = RIL_SET_ID_CB,
-		},
-	};
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
-	
-	RPC_PACK(buf, idx, flags);
-	rpc_call_noreply(g_rpc, &req);
-fail:
-	LOG_EXIT;
+	close(req->data_fd);
+	close(req->sock);
+	free(req);
+	return NULL;
 }
 
-static void ril_request_ref_loc(uint32_t flags) {
-	LOG_ENTRY;
-
-	rpc_request_t req = {
-		.header = {
-			.code = RIL_REF_LOC_CB,
-		},
-	};
-	
-	char *buf = req.header.buffer;
-	size_t idx = 0;
-	
-	RPC_PACK(buf, idx, flags);
-	rpc_call_noreply(g_rpc, &req);
-fail:
-	LOG_EXIT;
+/**
+ * Hands an XTRA file to a worker thread: the blob may take a while to
+ * inject it, and the event loop must not wait for that. Returns zero if
+ * the worker owns @sock and @data_fd.
+ */
+static int xtra_fd_dispatch(int sock, int data_fd, int length) {
+	struct xtra_fd_request *req;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int rc;
+
+	req = malloc(sizeof(*req));
+	if (!req) {
+		RPC_ERROR("out of memory");
+		return -1;
+	}
+	req->sock = sock;
+	req->data_fd = data_fd;
+	req->length = length;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, xtra_fd_thread_func, req);
+	pthread_attr_destroy(&attr);
+
+	if (rc) {
+		RPC_ERROR("%s: failed to start the XTRA worker", __func__);
+		free(req);
+		return -1;
+	}
+	return 0;
 }
 
-static AGpsRilCallbacks rilCallbacks = {
-	.create_thread_cb = ril_create_thread_cb,
-	.request_setid = ril_request_set_id,
-	.request_refloc = ril_request_ref_loc,
-};
+/**
+ * Accepts a connection on the callback socket. The request is read once
+ * it has arrived, so a client that connects and then stalls does not hold
+ * up the event loop.
+ */
+static void cb_server_accept(int cb_fd) {
+	int fd = accept(cb_fd, NULL, NULL);
 
-/******************************************************************************
- * Incoming RPC Interface
- *****************************************************************************/
-static int gps_srv_rpc_handler(rpc_request_hdr_t *hdr, rpc_reply_t *reply) {
-	int rc = 0;
-	if (!hdr) {
-		RPC_ERROR("hdr is NULL");
-		goto fail;
+	if (fd < 0) {
+		RPC_ERROR("failed to accept the callback channel");
+		return;
 	}
 
-	if (!reply) {
-		RPC_ERROR("reply is NULL");
-		goto fail;
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+		gps_epoll_add(fd, EPOLLIN | EPOLLRDHUP,
+			GPS_EV_TAG(GPS_EV_CB_REQUEST, fd)))
+	{
+		RPC_ERROR("%s: failed to watch the connection", __func__);
+		close(fd);
 	}
+}
 
-	RPC_DEBUG("+request code %x : %s", hdr->code, gps_rpc_to_s(hdr->code));
-	reply->code = hdr->code;
-	
-	char *buf = hdr->buffer;
-	size_t idx = 0;
+/**
+ * Handles the request on a new connection to the callback socket, which
+ * has arrived in one message. The first frame tells whether the client
+ * attaches its callback channel or passes a file. Returns nonzero if the
+ * connection is to be closed.
+ */
+static int cb_server_handle(int fd) {
+	struct gps_rpc_frame frame;
+	int data_fd = -1;
+	int length = 0;
 
-	char *rbuf = reply->buffer;
-	size_t ridx = 0;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
 
-	switch (hdr->code) {
-		case RIL_INIT:
-			if (origRilInterface && origRilInterface->init) {
-				origRilInterface->init(&rilCallbacks);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-			break;
-		case RIL_SET_REF_LOC:
-			if (origRilInterface && origRilInterface->set_ref_location) {
-				AGpsRefLocation loc;
-				size_t sz_struct;
-				RPC_UNPACK(buf, idx, sz_struct);
-				RPC_UNPACK_RAW(buf, idx, &loc, sz_struct);
-				origRilInterface->set_ref_location(&loc, sz_struct);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-			break;
-		case RIL_SET_SET_ID:
-			if (origRilInterface && origRilInterface->set_set_id) {
-				AGpsSetIDType type;
-				char setid[RPC_PAYLOAD_MAX] = {};
-				RPC_UNPACK(buf, idx, type);
-				RPC_UNPACK_S(buf, idx, setid);
-				origRilInterface->set_set_id(type, setid);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-			break;
-		case RIL_UPDATE_NET_STATE:
-			if (origRilInterface && origRilInterface->update_network_state) {
-				int connected, type, roaming;
-				char extra[RPC_PAYLOAD_MAX] = {};
-
-				RPC_UNPACK(buf, idx, connected);
-				RPC_UNPACK(buf, idx, type);
-				RPC_UNPACK(buf, idx, roaming);
-				RPC_UNPACK_S(buf, idx, extra);
-
-				origRilInterface->update_network_state(connected, type, roaming,
-					extra);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-		case RIL_NI_MSG:
-			break;
-			if (origRilInterface && origRilInterface->ni_message) {
-				uint8_t msg[RPC_PAYLOAD_MAX] = {};
-				size_t len;
-				RPC_UNPACK(buf, idx, len);
-				RPC_UNPACK_RAW(buf, idx, msg, len);
-				origRilInterface->ni_message(msg, len);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-			break;
-		case RIL_UPDATE_NET_AVAILABILITY:
-			if (origRilInterface && origRilInterface->update_network_availability) {
-				char apn[RPC_PAYLOAD_MAX] = {};
-				int available;
-				RPC_UNPACK(buf, idx, available);
-				RPC_UNPACK_S(buf, idx, apn);
-				origRilInterface->update_network_availability(available, apn);
-			}
-			else {
-				RPC_ERROR("origRilInterface == NULL");
-				rc = -1;
-			}
-			break;
+	if (gps_shm_recv_fds(fd, &frame, sizeof(frame), &data_fd, 1) < 0) {
+		RPC_ERROR("%s: failed to read the request", __func__);
+		goto done;
+	}
 
-		case GPS_PROXY_XTRA_INIT:
-			if (origGpsXtraInterface && origGpsXtraInterface->init) {
-				rc = origGpsXtraInterface->init(&gpsXtraCallbacks);
-			}
-			else {
-				RPC_ERROR("origGpsXtraInterface == NULL");
-				rc = -1;
-			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_XTRA_INJECT_XTRA_DATA:
-			{
-				int length;
-				char data[RPC_PAYLOAD_MAX - 4];
-
-				RPC_UNPACK(buf, idx, length);
-				RPC_UNPACK_RAW(buf, idx, data, length);
-				
-				if (origGpsXtraInterface && origGpsXtraInterface->inject_xtra_data) {
-					rc = origGpsXtraInterface->inject_xtra_data(data, length);
-				}
-				else {
-					RPC_ERROR("origGpsXtraInterface == NULL");
-					rc = -1;
-				}
+	switch (frame.code) {
+		case GPS_PROXY_CB_ATTACH:
+			if (!cb_channel_attach(fd)) {
+				CHECK_CLOSE(data_fd);
+				return 0;
 			}
-			RPC_PACK(rbuf, ridx, rc);
 			break;
-		case GPS_PROXY_AGPS_INIT:
-			if (origAGpsInterface && origAGpsInterface->init) {
-				origAGpsInterface->init(&aGpsCallbacks);
-			}
-			else {
-				RPC_ERROR("origAGpsInterface == NULL");
-				rc = -1;
+		case GPS_PROXY_XTRA_INJECT_XTRA_FD:
+			if (!(srv_features & GPS_FEATURE_XTRA_FD)) {
+				RPC_ERROR("%s: XTRA file passing is disabled", __func__);
+				break;
 			}
-			break;
-		case GPS_PROXY_AGPS_DATA_CONN_OPEN:
+
+			if (frame.len != sizeof(length) ||
+				gps_rpc_read_full(fd, &length, sizeof(length)) || data_fd < 0)
 			{
-				char str[RPC_PAYLOAD_MAX] = {};
-				RPC_UNPACK_S(buf, idx, str);
-				
-				if (origAGpsInterface && origAGpsInterface->data_conn_open) {
-					rc = origAGpsInterface->data_conn_open(str);
-				}
-				else {
-					RPC_ERROR("origAGpsInterface == NULL");
-					rc = -1;
-				}
-			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_AGPS_DATA_CONN_CLOSED:
-			if (origAGpsInterface && origAGpsInterface->data_conn_closed) {
-				rc = origAGpsInterface->data_conn_closed();
-			}
-			else {
-				RPC_ERROR("origAGpsInterface == NULL");
-				rc = -1;
-			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_AGPS_DATA_CONN_FAILED:
-			if (origAGpsInterface && origAGpsInterface->data_conn_failed) {
-				rc = origAGpsInterface->data_conn_failed();
-			}
-			else {
-				RPC_ERROR("origAGpsInterface == NULL");
-				rc = -1;
+				RPC_ERROR("%s: malformed XTRA request", __func__);
+				break;
 			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_AGPS_AGPS_SET_SERVER:
-			{
-				char hostname[RPC_PAYLOAD_MAX] = {};
-				AGpsType type;
-				int port;
 
-				RPC_UNPACK(buf, idx, type);
-				RPC_UNPACK(buf, idx, port);
-				RPC_UNPACK_S(buf, idx, hostname);
-	
-		
-				if (origAGpsInterface && origAGpsInterface->set_server) {
-					rc = origAGpsInterface->set_server(
-						type, hostname, port
-					);
-				}
-				else {
-					RPC_ERROR("origAGpsInterface == NULL");
-					rc = -1;
-				}
+			if (!xtra_fd_dispatch(fd, data_fd, length)) {
+				return 0;
 			}
-			RPC_PACK(rbuf, ridx, rc);
 			break;
-		case GPS_PROXY_NI_INIT:
-			if (origNiInterface && origNiInterface->init) {
-				origNiInterface->init(&gpsNiCallbacks);
-			}
-			else {
-				RPC_ERROR("origNiInterface == NULL");
-				rc = -1;
-			}
+		default:
+			RPC_ERROR("%s: unexpected code %x", __func__, frame.code);
 			break;
-		case GPS_PROXY_NI_RESPOND:
-			{
-				int notif_id;
-				GpsUserResponseType user_response;
+	}
 
-				RPC_UNPACK(buf, idx, notif_id);
-				RPC_UNPACK(buf, idx, user_response);
+done:
+	CHECK_CLOSE(data_fd);
+	return -1;
+}
 
-				if (origNiInterface && origNiInterface->respond) {
-					origNiInterface->respond(notif_id,
-						user_response);
-				}
-				else {
-					RPC_ERROR("origNiInterface == NULL");
-					rc = -1;
-				}
-			}
-			break;
-		case GPS_PROXY_GPS_INIT:
-			if (origGpsInterface && origGpsInterface->init) {
-				RPC_DEBUG("calling GPS_INIT");
-				rc = origGpsInterface->init(&gpsCallbacks);
-				RPC_INFO("GPS_INIT rc %d", rc);
-			}
-			else {
-				RPC_ERROR("origGpsInterface == NULL");
-				rc = -1;
-			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_GPS_START:
-			if (origGpsInterface && origGpsInterface->start) {
-				rc = origGpsInterface->start();
-			}
-			else {
-				RPC_ERROR("origGpsInterface == NULL");
-				rc = -1;
-			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_GPS_STOP:
-			if (origGpsInterface && origGpsInterface->stop) {
-				rc = origGpsInterface->stop();
-			}
-			else {
-				RPC_ERROR("origGpsInterface == NULL");
-				rc = -1;
+static void gps_server_event(struct epoll_event *ev, int rpc_fd, int cb_fd) {
+	uint32_t type = ev->data.u64 >> 32;
+	uint32_t idx = (uint32_t)ev->data.u64;
+	struct gps_client *c = NULL;
+	int fd;
+
+	if (type == GPS_EV_CLIENT || type == GPS_EV_CHANNEL) {
+		c = clients + idx;
+	}
+
+	switch (type) {
+		case GPS_EV_RPC_LISTEN:
+			fd = accept(rpc_fd, NULL, NULL);
+			if (fd < 0) {
+				RPC_ERROR("failed to accept the client");
+				break;
 			}
-			RPC_PACK(rbuf, ridx, rc);
-			break;
-		case GPS_PROXY_GPS_CLEANUP:
-			if (origGpsInterface && origGpsInterface->cleanup) {
-				origGpsInterface->cleanup();
+			__atomic_store_n(&first_call_accept_ms, gps_now_ms(),
+				__ATOMIC_RELAXED);
+
+			if (!replay_mode && !lib_handle && load_gps_library()) {
+				RPC_ERROR("failed to load gps library and symbols");
+				close(fd);
+				break;
 			}
-			else {
-				RPC_ERROR("origGpsInterface == NULL");
-				rc = -1;
+
+			if (gps_client_add(fd)) {
+				close(fd);
 			}
 			break;
-		case GPS_PROXY_GPS_INJECT_TIME:
-			{
-				GpsUtcTime time;
-				int64_t timeReference;
-				int uncertainty;
 
-				RPC_UNPACK(buf, idx, time);
-				RPC_UNPACK(buf, idx, timeReference);
-				RPC_UNPACK(buf, idx, uncertainty);
+		case GPS_EV_CB_LISTEN:
+			cb_server_accept(cb_fd);
+			break;
 
-				if (origGpsInterface && origGpsInterface->inject_time) {
-					rc = origGpsInterface->inject_time(time, timeReference,
-						uncertainty);
-				}
-				else {
-					RPC_ERROR("origGpsInterface == NULL");
-					rc = -1;
-				}
+		case GPS_EV_CB_REQUEST:
+			fd = idx;
+			if (cb_server_handle(fd)) {
+				close(fd);
 			}
-			RPC_PACK(rbuf, ridx, rc);
 			break;
-		case GPS_PROXY_GPS_INJECT_LOCATION:
-			{
-				double latitude;
-				double longitude;
-				float accuracy;
-
-				RPC_UNPACK(buf, idx, latitude);
-				RPC_UNPACK(buf, idx, longitude);
-				RPC_UNPACK(buf, idx, accuracy);
-				
-				if (origGpsInterface && origGpsInterface->inject_location) {
-					rc = origGpsInterface->inject_location(latitude, longitude,
-						accuracy);
-				}
-				else {
-					RPC_ERROR("origGpsInterface == NULL");
-					rc = -1;
-				}
+
+		case GPS_EV_CLIENT:
+			if (c->fd >= 0) {
+				gps_client_remove(c);
 			}
-			RPC_PACK(rbuf, ridx, rc);
 			break;
-		case GPS_PROXY_GPS_DELETE_AIDING_DATA:
-			{
-				GpsAidingData flags;
-				RPC_UNPACK(buf, idx, flags);
-				
-				if (origGpsInterface && origGpsInterface->delete_aiding_data) {
-					origGpsInterface->delete_aiding_data(flags);
-				}
-				else {
-					RPC_ERROR("origGpsInterface == NULL");
-					rc = -1;
-				}
+
+		case GPS_EV_CHANNEL:
+			if (c->sock >= 0 && cb_channel_serve(c)) {
+				pthread_mutex_lock(&cb_mutex);
+				cb_channel_detach_locked(c);
+				pthread_mutex_unlock(&cb_mutex);
 			}
 			break;
-		case GPS_PROXY_GPS_SET_POSITION_MODE:
+
+		case GPS_EV_STATS_DUMP:
 			{
-				GpsPositionMode mode;
-				GpsPositionRecurrence recurrence;
-				uint32_t min_interval;
-				uint32_t preferred_accuracy;
-				uint32_t preferred_time;
-
-				RPC_UNPACK(buf, idx, mode);
-				RPC_UNPACK(buf, idx, recurrence);
-				RPC_UNPACK(buf, idx, min_interval);
-				RPC_UNPACK(buf, idx, preferred_accuracy);
-				RPC_UNPACK(buf, idx, preferred_time);
-
-				if (origGpsInterface && origGpsInterface->set_position_mode) {
-					rc = origGpsInterface->set_position_mode(
-						mode, recurrence, min_interval,
-						preferred_accuracy, preferred_time
-					);
-				}
-				else {
-					RPC_ERROR("origGpsInterface == NULL");
-					rc = -1;
-				}
+				eventfd_t val;
+				eventfd_read(stats_dump_fd, &val);
+				gps_ttff_dump();
+				gps_call_stats_dump();
 			}
-			RPC_PACK(rbuf, idx, rc);
 			break;
 	}
-	RPC_DEBUG("-request code %x : %s", hdr->code, gps_rpc_to_s(hdr->code));
-	
-fail:
-	return 0;
 }
 
-/******************************************************************************
- * RPC Transport Setup
- *****************************************************************************/
-static int handle_rpc(int fd) {
-	struct rpc *rpc = NULL;
-	
-	rpc = rpc_alloc();
-	if (!rpc) {
-		RPC_ERROR("out of memory");
-		goto fail;
+static int gps_server(int preload) {
+	struct epoll_event events[GPS_MAX_CLIENTS + 2];
+	int fd = -1;
+	int cb_fd = -1;
+	int ret = -1;
+	int i, n;
+
+	LOG_ENTRY;
+
+	gps_clients_init();
+	loop_thread = pthread_self();
+
+	/* open the blob before any client asks, so that open_gps does not wait */
+	if (preload && !replay_mode) {
+		if (load_gps_library()) {
+			RPC_ERROR("failed to preload gps library, loading on demand");
+		}
+		else {
+			lib_preloaded = 1;
+		}
 	}
 
-	if (rpc_init(fd, gps_srv_rpc_handler, rpc)) {
-		RPC_ERROR("failed to init RPC");
+	epoll_fd = epoll_create(GPS_MAX_CLIENTS + 2);
+	if (epoll_fd < 0) {
+		RPC_ERROR("failed to create the event loop");
 		goto fail;
 	}
-	
-	g_rpc = rpc;
 
-	if (rpc_start(rpc)) {
-		RPC_ERROR("failed to start RPC");
+	fd = server_socket_open();
+	if (fd < 0) {
+		RPC_ERROR("failed to open the socket");
 		goto fail;
 	}
 
-	if (rpc_join(rpc)) {
-		RPC_ERROR("failed to wait for RPC completion");
+	if (gps_epoll_add(fd, EPOLLIN, GPS_EV_TAG(GPS_EV_RPC_LISTEN, 0))) {
+		RPC_ERROR("failed to watch the socket");
 		goto fail;
 	}
-	
-	return 0;
-fail:
-	g_rpc = NULL;
 
-	if (rpc) {
-		rpc_free(rpc);
+	cb_fd = socket_local_server(GPS_CB_SOCKET_NAME,
+		ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+	if (cb_fd < 0 ||
+		gps_epoll_add(cb_fd, EPOLLIN, GPS_EV_TAG(GPS_EV_CB_LISTEN, 0)))
+	{
+		RPC_ERROR("callbacks will be sent over the RPC socket");
+		CHECK_CLOSE(cb_fd);
 	}
-	return -1;
-}
-
-static int server_socket_open(void) {
-	int fd = -1;
-	int retry_count = 5;
-
-	while (retry_count--) {
-		unlink(GPS_RPC_SOCKET_NAME);
-		fd = socket_local_server(GPS_RPC_SOCKET_NAME,
-			ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
 
-		if (fd >= 0) {
-			break;
-		}
+	stats_dump_fd = eventfd(0, 0);
+	if (stats_dump_fd < 0 || gps_epoll_add(stats_dump_fd, EPOLLIN,
+		GPS_EV_TAG(GPS_EV_STATS_DUMP, 0)))
+	{
+		RPC_ERROR("SIGUSR1 will not dump the statistics");
+		CHECK_CLOSE(stats_dump_fd);
 	}
-
-	return fd;
-}
-
-static int gps_server(void) {
-	int fd = -1;
-	int ret = -1;
-	int client_fd = -1;
-
-	LOG_ENTRY;
-
-	fd = server_socket_open();
-	if (fd < 0) {
-		RPC_ERROR("failed to open the socket");
-		goto fail;
+	else {
+		signal(SIGUSR1, gps_stats_signal);
 	}
 
-//	while (1) {
-		struct sockaddr_un client_addr;
-		int client_addr_len;
+	gps_epoch_start();
 
-		client_fd = accept(fd, (struct sockaddr*)&client_addr,
-			&client_addr_len);
-
-		if (client_fd <= 0) {
-			RPC_ERROR("failed to accept the client");
-			goto fail;
-		}
-	
-		if (load_gps_library()) {
-			RPC_ERROR("failed to load gps library and symbols");
-			goto done;
+	while (1) {
+		n = epoll_wait(epoll_fd, events, GPS_MAX_CLIENTS + 2, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			RPC_ERROR("epoll_wait failed %s", strerror(errno));
+			break;
 		}
 
-		if (handle_rpc(client_fd)) {
-			RPC_ERROR("failed to serve the RPC client");
+		for (i = 0; i < n; i++) {
+			gps_server_event(events + i, fd, cb_fd);
 		}
+	}
 
-done:
-		if (client_fd >= 0) { 
-			close(client_fd);
+	for (i = 0; i < GPS_MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0) {
+			gps_client_remove(clients + i);
 		}
+	}
 
-		while (--num_lib_threads >= 0) {
-			pthread_kill(lib_threads[num_lib_threads], SIGKILL);
-		}
+	while (--num_lib_threads >= 0) {
+		pthread_kill(lib_threads[num_lib_threads], SIGKILL);
+	}
 
-		free_gps_library();
-//	}
+	free_gps_library();
 
 	ret = 0;
 
 fail:
-
-	if (fd >= 0) {
-		close(fd);
-	}
+	CHECK_CLOSE(stats_dump_fd);
+	CHECK_CLOSE(cb_fd);
+	CHECK_CLOSE(fd);
+	CHECK_CLOSE(epoll_fd);
 
 	LOG_EXIT;
 	return ret;
@@ -1062,19 +3680,27 @@ static int setup_gps_interface(void) {
 	return 0;
 
 fail:
+	origGpsInterface = NULL;
 	return -1;
 }
 
 static int load_gps_library(void) {
-	lib_handle = dlopen(GPS_LIBRARY_NAME, 0);
+	uint64_t start_ms = gps_now_ms();
+
+	lib_handle = dlopen(lib_path, RTLD_NOW);
 	if (!lib_handle) {
-		RPC_ERROR("failed to load gps library %s", GPS_LIBRARY_NAME);
+		RPC_ERROR("failed to load gps library %s: %s", lib_path, dlerror());
 		goto fail;
 	}
 
-	setup_gps_interface();
+	/* a library without a usable interface is as good as none */
+	if (setup_gps_interface()) {
+		goto fail;
+	}
 
-	RPC_INFO("loaded GPS library successfully");
+	lib_load_ms = gps_now_ms() - start_ms;
+	RPC_INFO("loaded GPS library successfully in %llums",
+		(unsigned long long)lib_load_ms);
 	
 	return 0;
 
@@ -1096,13 +3722,72 @@ static void free_gps_library(void) {
 	}
 }
 
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-p] [-l library] [-r trace] "
+		"[-R trace [-s speed]] [-F features]\n"
+		"  -p  load and open the GPS library at startup\n"
+		"  -l  GPS library to load instead of " GPS_LIBRARY_NAME "\n"
+		"  -r  record calls and callbacks to a trace file\n"
+		"  -R  serve a recorded trace instead of the GPS library\n"
+		"  -s  replay speed factor, 0 replays as fast as possible\n"
+		"  -F  mask of the protocol features to offer clients\n", name);
+}
+
 int main(int argc, char** argv) {
 	int rc = 0;
+	int preload = 0;
+	const char *capture_path = NULL;
+	const char *replay_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "pl:r:R:s:F:")) != -1) {
+		switch (opt) {
+			case 'p':
+				preload = 1;
+				break;
+			case 'l':
+				lib_path = optarg;
+				break;
+			case 'r':
+				capture_path = optarg;
+				break;
+			case 'R':
+				replay_path = optarg;
+				break;
+			case 's':
+				replay_speed = strtod(optarg, NULL);
+				if (replay_speed < 0) {
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+			case 'F':
+				srv_features &= strtoul(optarg, NULL, 0);
+				cb_features = srv_features;
+				break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	/* a client that goes away must not take the daemon with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (capture_path && gps_capture_open(capture_path)) {
+		return -1;
+	}
+
+	if (replay_path && gps_replay_open(replay_path)) {
+		gps_capture_close();
+		return -1;
+	}
 	
-	if ((rc = gps_server()) < 0) {
+	if ((rc = gps_server(preload)) < 0) {
 		RPC_ERROR("failed to start gps proxy server, error code %d",
 			rc);
 	}
+	gps_capture_close();
 	RPC_INFO("exiting");
 
 	return rc;
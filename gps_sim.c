@@ -0,0 +1,679 @@
+/**
+ * This file is part of gps-proxy.
+ *
+ * Copyright (C) 2012 Alexander Tarasikov <alexander.tarasikov@gmail.com>
+ *
+ * gps-proxy is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * gps-proxy is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with gps-proxy.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ANDROID libhardware headers */
+#include <hardware/gps.h>
+
+#define LOG_TAG "[GPS-SIM]"
+#include <stc_log.h>
+
+/*
+ * Synthetic receiver to stand in for the vendor blob. It implements the
+ * same HAL module the daemon loads, with all the extensions, and reports
+ * made-up fixes on a circle around a fixed point. Each fix comes as an SV
+ * status, a burst of NMEA sentences and a location, the way real blobs
+ * report them. It is tuned from the environment of the daemon:
+ *
+ *   GPS_SIM_RATE_HZ  fix rate from 1 to 100 Hz, overrides the interval
+ *                    the framework asks for in set_position_mode
+ *   GPS_SIM_SVS      satellites in every SV status, up to GPS_MAX_SVS
+ *   GPS_SIM_NMEA     sentences in every NMEA burst
+ *   GPS_SIM_LAT      latitude of the centre of the circle
+ *   GPS_SIM_LON      longitude of the centre of the circle
+ */
+#define GPS_SIM_RATE_MIN 1
+#define GPS_SIM_RATE_MAX 100
+#define GPS_SIM_DEFAULT_SVS 12
+#define GPS_SIM_RADIUS_M 100.0
+#define GPS_SIM_SPEED_MS 10.0
+#define GPS_SIM_EARTH_RADIUS_M 6371000.0
+#define GPS_SIM_NMEA_MAX 128
+
+static GpsCallbacks *gpsCallbacks = NULL;
+static GpsXtraCallbacks *xtraCallbacks = NULL;
+static AGpsCallbacks *aGpsCallbacks = NULL;
+static GpsNiCallbacks *niCallbacks = NULL;
+static AGpsRilCallbacks *rilCallbacks = NULL;
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sim_thread;
+static int sim_thread_running = 0;
+static int sim_exit = 0;
+static int sim_started = 0;
+
+/* settings, rate_hz comes from set_position_mode unless it is forced */
+static unsigned sim_rate_hz = 1;
+static int sim_rate_forced = 0;
+static int sim_num_svs = GPS_SIM_DEFAULT_SVS;
+static int sim_num_nmea = 0;
+static double sim_lat = 59.9343;
+static double sim_lon = 30.3351;
+
+static uint64_t sim_fixes = 0;
+
+static unsigned gps_sim_clamp_rate(long rate) {
+	if (rate < GPS_SIM_RATE_MIN) {
+		return GPS_SIM_RATE_MIN;
+	}
+	if (rate > GPS_SIM_RATE_MAX) {
+		return GPS_SIM_RATE_MAX;
+	}
+	return rate;
+}
+
+static void gps_sim_configure(void) {
+	const char *env;
+
+	if ((env = getenv("GPS_SIM_RATE_HZ"))) {
+		sim_rate_hz = gps_sim_clamp_rate(strtol(env, NULL, 10));
+		sim_rate_forced = 1;
+	}
+
+	if ((env = getenv("GPS_SIM_SVS"))) {
+		sim_num_svs = strtol(env, NULL, 10);
+		if (sim_num_svs < 0) {
+			sim_num_svs = 0;
+		}
+		if (sim_num_svs > GPS_MAX_SVS) {
+			RPC_INFO("%d satellites requested, the HAL only has room "
+				"for %d", sim_num_svs, GPS_MAX_SVS);
+			sim_num_svs = GPS_MAX_SVS;
+		}
+	}
+
+	/* one each of GGA, RMC and GSA, and a GSV page per four satellites */
+	sim_num_nmea = 3 + (sim_num_svs + 3) / 4;
+	if ((env = getenv("GPS_SIM_NMEA"))) {
+		sim_num_nmea = strtol(env, NULL, 10);
+		if (sim_num_nmea < 0) {
+			sim_num_nmea = 0;
+		}
+	}
+
+	if ((env = getenv("GPS_SIM_LAT"))) {
+		sim_lat = strtod(env, NULL);
+	}
+
+	if ((env = getenv("GPS_SIM_LON"))) {
+		sim_lon = strtod(env, NULL);
+	}
+
+	RPC_INFO("%u Hz%s, %d satellites, %d sentences per fix",
+		sim_rate_hz, sim_rate_forced ? " (forced)" : "",
+		sim_num_svs, sim_num_nmea);
+}
+
+static uint64_t gps_sim_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static GpsUtcTime gps_sim_utc_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (GpsUtcTime)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/******************************************************************************
+ * Synthetic data
+ *****************************************************************************/
+static void gps_sim_sv_status(GpsSvStatus *sv, uint64_t n) {
+	int i;
+
+	memset(sv, 0, sizeof(*sv));
+	sv->size = sizeof(*sv);
+	sv->num_svs = sim_num_svs;
+
+	for (i = 0; i < sim_num_svs; i++) {
+		GpsSvInfo *info = sv->sv_list + i;
+
+		info->size = sizeof(*info);
+		info->prn = i + 1;
+		/* slow drift so that consecutive tables differ a little */
+		info->snr = 20 + (float)((i * 7 + n / 4) % 25);
+		info->elevation = (float)((i * 11 + n / 64) % 90);
+		info->azimuth = (float)((i * 37 + n / 16) % 360);
+
+		sv->ephemeris_mask |= 1u << i;
+		sv->almanac_mask |= 1u << i;
+		if (i < 8) {
+			sv->used_in_fix_mask |= 1u << i;
+		}
+	}
+}
+
+static void gps_sim_location(GpsLocation *loc, uint64_t n, GpsUtcTime utc) {
+	double t = (double)n / sim_rate_hz;
+	double angle = t * GPS_SIM_SPEED_MS / GPS_SIM_RADIUS_M;
+	double north = GPS_SIM_RADIUS_M * cos(angle);
+	double east = GPS_SIM_RADIUS_M * sin(angle);
+
+	memset(loc, 0, sizeof(*loc));
+	loc->size = sizeof(*loc);
+	loc->flags = GPS_LOCATION_HAS_LAT_LONG | GPS_LOCATION_HAS_ALTITUDE |
+		GPS_LOCATION_HAS_SPEED | GPS_LOCATION_HAS_BEARING |
+		GPS_LOCATION_HAS_ACCURACY;
+	loc->latitude = sim_lat + north / GPS_SIM_EARTH_RADIUS_M * 180 / M_PI;
+	loc->longitude = sim_lon + east / (GPS_SIM_EARTH_RADIUS_M *
+		cos(sim_lat * M_PI / 180)) * 180 / M_PI;
+	loc->altitude = 20;
+	loc->speed = GPS_SIM_SPEED_MS;
+	loc->bearing = fmod(angle * 180 / M_PI + 90, 360);
+	loc->accuracy = 5;
+	loc->timestamp = utc;
+}
+
+/**
+ * Sends one NMEA sentence. The checksum and the line ending are added
+ * here.
+ */
+static void gps_sim_nmea(GpsUtcTime utc, const char *fmt, ...) {
+	char sentence[GPS_SIM_NMEA_MAX];
+	uint8_t sum = 0;
+	va_list ap;
+	int len;
+	int i;
+
+	va_start(ap, fmt);
+	len = vsnprintf(sentence, sizeof(sentence) - 6, fmt, ap);
+	va_end(ap);
+
+	if (len < 1 || len >= (int)sizeof(sentence) - 6) {
+		return;
+	}
+
+	for (i = 1; i < len; i++) {
+		sum ^= sentence[i];
+	}
+	len += snprintf(sentence + len, sizeof(sentence) - len, "*%02X\r\n", sum);
+
+	gpsCallbacks->nmea_cb(utc, sentence, len);
+}
+
+static void gps_sim_nmea_burst(const GpsLocation *loc, const GpsSvStatus *sv,
+	GpsUtcTime utc)
+{
+	time_t secs = utc / 1000;
+	struct tm tm;
+	char hms[16];
+	char lat[32], lon[32];
+	char ns, ew;
+	double alat = fabs(loc->latitude);
+	double alon = fabs(loc->longitude);
+	int gsv_count = (sv->num_svs + 3) / 4;
+	int sent;
+
+	gmtime_r(&secs, &tm);
+	snprintf(hms, sizeof(hms), "%02d%02d%02d.%02d", tm.tm_hour, tm.tm_min,
+		tm.tm_sec, (int)(utc % 1000) / 10);
+	snprintf(lat, sizeof(lat), "%02d%07.4f", (int)alat,
+		(alat - (int)alat) * 60);
+	snprintf(lon, sizeof(lon), "%03d%07.4f", (int)alon,
+		(alon - (int)alon) * 60);
+	ns = loc->latitude < 0 ? 'S' : 'N';
+	ew = loc->longitude < 0 ? 'W' : 'E';
+
+	/* cycle through GGA, RMC, GSA and the GSV pages */
+	for (sent = 0; sent < sim_num_nmea; sent++) {
+		int slot = sent % (3 + (gsv_count ? gsv_count : 1));
+
+		if (slot == 0) {
+			gps_sim_nmea(utc, "$GPGGA,%s,%s,%c,%s,%c,1,%02d,0.9,%.1f,M,,M,,",
+				hms, lat, ns, lon, ew, sv->num_svs < 8 ? sv->num_svs : 8,
+				loc->altitude);
+		}
+		else if (slot == 1) {
+			gps_sim_nmea(utc, "$GPRMC,%s,A,%s,%c,%s,%c,%.1f,%.1f,"
+				"%02d%02d%02d,,,A", hms, lat, ns, lon, ew,
+				loc->speed * 1.943844, loc->bearing,
+				tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100);
+		}
+		else if (slot == 2) {
+			gps_sim_nmea(utc, "$GPGSA,A,3,01,02,03,04,05,06,07,08,,,,,"
+				"1.5,0.9,1.2");
+		}
+		else {
+			char body[GPS_SIM_NMEA_MAX];
+			int page = slot - 3;
+			int i, n = 0;
+
+			for (i = page * 4; i < sv->num_svs && i < page * 4 + 4; i++) {
+				const GpsSvInfo *info = sv->sv_list + i;
+				n += snprintf(body + n, sizeof(body) - n, ",%02d,%02d,%03d,%02d",
+					info->prn, (int)info->elevation, (int)info->azimuth,
+					(int)info->snr);
+			}
+			body[n] = '\0';
+
+			gps_sim_nmea(utc, "$GPGSV,%d,%d,%02d%s", gsv_count ? gsv_count : 1,
+				page + 1, sv->num_svs, body);
+		}
+	}
+}
+
+static void gps_sim_report_status(GpsStatusValue value) {
+	GpsStatus status = {
+		.size = sizeof(GpsStatus),
+		.status = value,
+	};
+
+	gpsCallbacks->status_cb(&status);
+}
+
+/******************************************************************************
+ * Receiver thread
+ *****************************************************************************/
+static void gps_sim_thread_func(void *unused) {
+	GpsSvStatus sv;
+	GpsLocation loc;
+	uint64_t next_us = 0;
+	uint64_t n = 0;
+
+	RPC_INFO("receiver thread started");
+
+	pthread_mutex_lock(&sim_mutex);
+	while (!sim_exit) {
+		struct timespec ts;
+		GpsUtcTime utc;
+
+		if (!sim_started) {
+			pthread_cond_wait(&sim_cond, &sim_mutex);
+			next_us = 0;
+			continue;
+		}
+
+		if (!next_us) {
+			next_us = gps_sim_now_us();
+		}
+
+		/* sleep until the next epoch, start and stop cut the wait short */
+		ts.tv_sec = next_us / 1000000;
+		ts.tv_nsec = (next_us % 1000000) * 1000;
+		pthread_mutex_unlock(&sim_mutex);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+			EINTR)
+		{
+		}
+		pthread_mutex_lock(&sim_mutex);
+
+		if (sim_exit || !sim_started) {
+			continue;
+		}
+
+		next_us += 1000000 / sim_rate_hz;
+		n = sim_fixes++;
+		pthread_mutex_unlock(&sim_mutex);
+
+		utc = gps_sim_utc_ms();
+		gps_sim_sv_status(&sv, n);
+		gps_sim_location(&loc, n, utc);
+
+		gpsCallbacks->sv_status_cb(&sv);
+		gps_sim_nmea_burst(&loc, &sv, utc);
+		gpsCallbacks->location_cb(&loc);
+
+		pthread_mutex_lock(&sim_mutex);
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	RPC_INFO("receiver thread exiting after %llu fixes",
+		(unsigned long long)sim_fixes);
+}
+
+/******************************************************************************
+ * GPS Interface
+ *****************************************************************************/
+static int gps_sim_init(GpsCallbacks *callbacks) {
+	LOG_ENTRY;
+
+	if (!callbacks || !callbacks->create_thread_cb) {
+		RPC_ERROR("%s: callbacks are NULL", __func__);
+		goto fail;
+	}
+
+	gps_sim_configure();
+
+	pthread_mutex_lock(&sim_mutex);
+	gpsCallbacks = callbacks;
+	sim_exit = 0;
+	if (!sim_thread_running) {
+		sim_thread = callbacks->create_thread_cb("gps_sim",
+			gps_sim_thread_func, NULL);
+		sim_thread_running = !!sim_thread;
+	}
+	pthread_mutex_unlock(&sim_mutex);
+
+	if (!sim_thread_running) {
+		RPC_ERROR("%s: failed to create the receiver thread", __func__);
+		goto fail;
+	}
+
+	if (callbacks->set_capabilities_cb) {
+		callbacks->set_capabilities_cb(GPS_CAPABILITY_SCHEDULING |
+			GPS_CAPABILITY_MSB | GPS_CAPABILITY_MSA);
+	}
+
+	LOG_EXIT;
+	return 0;
+
+fail:
+	LOG_EXIT;
+	return -1;
+}
+
+static int gps_sim_start(void) {
+	LOG_ENTRY;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (sim_started) {
+		pthread_mutex_unlock(&sim_mutex);
+		goto done;
+	}
+	sim_started = 1;
+	pthread_cond_signal(&sim_cond);
+	pthread_mutex_unlock(&sim_mutex);
+
+	gps_sim_report_status(GPS_STATUS_ENGINE_ON);
+	gps_sim_report_status(GPS_STATUS_SESSION_BEGIN);
+
+done:
+	LOG_EXIT;
+	return 0;
+}
+
+static int gps_sim_stop(void) {
+	LOG_ENTRY;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (!sim_started) {
+		pthread_mutex_unlock(&sim_mutex);
+		goto done;
+	}
+	sim_started = 0;
+	pthread_mutex_unlock(&sim_mutex);
+
+	gps_sim_report_status(GPS_STATUS_SESSION_END);
+	gps_sim_report_status(GPS_STATUS_ENGINE_OFF);
+
+done:
+	LOG_EXIT;
+	return 0;
+}
+
+static void gps_sim_cleanup(void) {
+	LOG_ENTRY;
+
+	gps_sim_stop();
+
+	pthread_mutex_lock(&sim_mutex);
+	sim_exit = 1;
+	pthread_cond_signal(&sim_cond);
+	pthread_mutex_unlock(&sim_mutex);
+
+	if (sim_thread_running) {
+		pthread_join(sim_thread, NULL);
+		sim_thread_running = 0;
+	}
+
+	LOG_EXIT;
+}
+
+static int gps_sim_inject_time(GpsUtcTime time, int64_t timeReference,
+	int uncertainty)
+{
+	RPC_DEBUG("%s: %lld", __func__, (long long)time);
+	return 0;
+}
+
+static int gps_sim_inject_location(double latitude, double longitude,
+	float accuracy)
+{
+	RPC_DEBUG("%s: %f %f", __func__, latitude, longitude);
+	return 0;
+}
+
+static void gps_sim_delete_aiding_data(GpsAidingData flags) {
+	RPC_DEBUG("%s: %x", __func__, flags);
+}
+
+static int gps_sim_set_position_mode(GpsPositionMode mode,
+	GpsPositionRecurrence recurrence, uint32_t min_interval,
+	uint32_t preferred_accuracy, uint32_t preferred_time)
+{
+	LOG_ENTRY;
+
+	pthread_mutex_lock(&sim_mutex);
+	if (!sim_rate_forced) {
+		sim_rate_hz = gps_sim_clamp_rate(min_interval ?
+			1000 / min_interval : GPS_SIM_RATE_MIN);
+	}
+	RPC_INFO("%s: interval %ums, running at %u Hz", __func__,
+		min_interval, sim_rate_hz);
+	pthread_mutex_unlock(&sim_mutex);
+
+	LOG_EXIT;
+	return 0;
+}
+
+/******************************************************************************
+ * XTRA Interface
+ *****************************************************************************/
+static int gps_sim_xtra_init(GpsXtraCallbacks *callbacks) {
+	xtraCallbacks = callbacks;
+	return 0;
+}
+
+static int gps_sim_xtra_inject_data(char *data, int length) {
+	RPC_DEBUG("%s: %d bytes", __func__, length);
+	return 0;
+}
+
+static GpsXtraInterface sGpsXtraInterface = {
+	.size = sizeof(GpsXtraInterface),
+	.init = gps_sim_xtra_init,
+	.inject_xtra_data = gps_sim_xtra_inject_data,
+};
+
+/******************************************************************************
+ * AGPS Interface
+ *****************************************************************************/
+static void gps_sim_agps_init(AGpsCallbacks *callbacks) {
+	aGpsCallbacks = callbacks;
+}
+
+static int gps_sim_agps_data_conn_open(const char *apn) {
+	RPC_DEBUG("%s: %s", __func__, apn ? apn : "");
+	return 0;
+}
+
+static int gps_sim_agps_data_conn_closed(void) {
+	return 0;
+}
+
+static int gps_sim_agps_data_conn_failed(void) {
+	return 0;
+}
+
+static int gps_sim_agps_set_server(AGpsType type, const char *hostname,
+	int port)
+{
+	RPC_DEBUG("%s: %d %s:%d", __func__, type, hostname ? hostname : "", port);
+	return 0;
+}
+
+static AGpsInterface sAGpsInterface = {
+	.size = sizeof(AGpsInterface),
+	.init = gps_sim_agps_init,
+	.data_conn_open = gps_sim_agps_data_conn_open,
+	.data_conn_closed = gps_sim_agps_data_conn_closed,
+	.data_conn_failed = gps_sim_agps_data_conn_failed,
+	.set_server = gps_sim_agps_set_server,
+};
+
+/******************************************************************************
+ * NI Interface
+ *****************************************************************************/
+static void gps_sim_ni_init(GpsNiCallbacks *callbacks) {
+	niCallbacks = callbacks;
+}
+
+static void gps_sim_ni_respond(int notif_id, GpsUserResponseType user_response) {
+	RPC_DEBUG("%s: %d %d", __func__, notif_id, user_response);
+}
+
+static const GpsNiInterface sGpsNiInterface = {
+	.size = sizeof(GpsNiInterface),
+	.init = gps_sim_ni_init,
+	.respond = gps_sim_ni_respond,
+};
+
+/******************************************************************************
+ * RIL Interface
+ *****************************************************************************/
+static void gps_sim_ril_init(AGpsRilCallbacks *callbacks) {
+	rilCallbacks = callbacks;
+}
+
+static void gps_sim_ril_set_ref_location(const AGpsRefLocation *agps_reflocation,
+	size_t sz_struct)
+{
+	RPC_DEBUG("%s: %zu bytes", __func__, sz_struct);
+}
+
+static void gps_sim_ril_set_set_id(AGpsSetIDType type, const char *setid) {
+	RPC_DEBUG("%s: %d %s", __func__, type, setid ? setid : "");
+}
+
+static void gps_sim_ril_ni_message(uint8_t *msg, size_t len) {
+	RPC_DEBUG("%s: %zu bytes", __func__, len);
+}
+
+static void gps_sim_ril_update_network_state(int connected, int type,
+	int roaming, const char *extra_info)
+{
+	RPC_DEBUG("%s: %d %d %d", __func__, connected, type, roaming);
+}
+
+static void gps_sim_ril_update_network_availability(int available,
+	const char *apn)
+{
+	RPC_DEBUG("%s: %d %s", __func__, available, apn ? apn : "");
+}
+
+static const AGpsRilInterface sRilInterface = {
+	.size = sizeof(AGpsRilInterface),
+	.init = gps_sim_ril_init,
+	.set_ref_location = gps_sim_ril_set_ref_location,
+	.set_set_id = gps_sim_ril_set_set_id,
+	.ni_message = gps_sim_ril_ni_message,
+	.update_network_state = gps_sim_ril_update_network_state,
+	.update_network_availability = gps_sim_ril_update_network_availability,
+};
+
+static const void *gps_sim_get_extension(const char *name) {
+	if (!name) {
+		RPC_ERROR("%s: name is NULL", __func__);
+		return NULL;
+	}
+
+	if (!strcmp(name, GPS_XTRA_INTERFACE)) {
+		return &sGpsXtraInterface;
+	}
+	else if (!strcmp(name, AGPS_INTERFACE)) {
+		return &sAGpsInterface;
+	}
+	else if (!strcmp(name, GPS_NI_INTERFACE)) {
+		return &sGpsNiInterface;
+	}
+	else if (!strcmp(name, AGPS_RIL_INTERFACE)) {
+		return &sRilInterface;
+	}
+	return NULL;
+}
+
+static GpsInterface simGpsInterface = {
+	.size = sizeof(GpsInterface),
+	.init = gps_sim_init,
+	.start = gps_sim_start,
+	.stop = gps_sim_stop,
+	.cleanup = gps_sim_cleanup,
+	.inject_time = gps_sim_inject_time,
+	.inject_location = gps_sim_inject_location,
+	.delete_aiding_data = gps_sim_delete_aiding_data,
+	.set_position_mode = gps_sim_set_position_mode,
+	.get_extension = gps_sim_get_extension,
+};
+
+/******************************************************************************
+ * Library Interface
+ *****************************************************************************/
+static const GpsInterface *gps_sim_get_interface(struct gps_device_t *dev) {
+	return &simGpsInterface;
+}
+
+static int gps_sim_close(struct hw_device_t *device) {
+	free(device);
+	return 0;
+}
+
+static int open_gps(const struct hw_module_t *module, char const *name,
+	struct hw_device_t **device)
+{
+	struct gps_device_t *dev = calloc(1, sizeof(struct gps_device_t));
+
+	if (!dev) {
+		*device = NULL;
+		return -1;
+	}
+
+	dev->common.tag = HARDWARE_DEVICE_TAG;
+	dev->common.version = 0;
+	dev->common.module = (struct hw_module_t*)module;
+	dev->common.close = gps_sim_close;
+	dev->get_gps_interface = gps_sim_get_interface;
+
+	*device = (struct hw_device_t*)dev;
+	return 0;
+}
+
+static struct hw_module_methods_t gps_module_methods = {
+	.open = open_gps
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+	.tag = HARDWARE_MODULE_TAG,
+	.version_major = 1,
+	.version_minor = 0,
+	.id = GPS_HARDWARE_MODULE_ID,
+	.name = "Synthetic GPS Receiver",
+	.author = "Alexander Tarasikov",
+	.methods = &gps_module_methods,
+};